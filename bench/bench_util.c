@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "format.h"
+#include "log.h"
+#include "ups.h"
+
+double bench_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+uint32_t bench_next_random(uint32_t* state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+uint8_t bench_next_byte(uint32_t* state) {
+    return bench_next_random(state) >> 16;
+}
+
+size_t bench_random_below(uint32_t* state, size_t n) {
+    uint64_t r = (uint64_t)bench_next_random(state) << 24 | bench_next_random(state);
+    return r % n;
+}
+
+void bench_make_source(patch_source* source, size_t size) {
+    uint32_t state = 0x5EED;
+
+    patch_buffer_init(&source->data);
+    if (patch_buffer_resize(&source->data, size) != PATCH_OK) {
+        rombp_log_err("Failed to allocate %ld byte source image\n", (long)size);
+        exit(1);
+    }
+    uint8_t* data = source->data.data;
+
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        size_t length = size - offset < 4096 ? size - offset : 4096;
+        uint32_t kind = bench_next_random(&state) % 10;
+        if (kind < 4 || offset == 0) {
+            for (size_t i = 0; i < length; i++) {
+                data[offset + i] = bench_next_byte(&state);
+            }
+        } else if (kind < 6) {
+            memset(data + offset, kind == 4 ? 0x00 : 0xFF, length);
+        } else {
+            size_t from = bench_random_below(&state, offset / 4096) * 4096;
+            memcpy(data + offset, data + from, length);
+            data[offset + bench_next_random(&state) % length] ^= 0x5A;
+        }
+    }
+    source->crc32 = crc32_update(0, data, size);
+}
+
+void bench_random_source(patch_source* source, size_t size, uint32_t seed) {
+    patch_buffer_init(&source->data);
+    if (patch_buffer_resize(&source->data, size) != PATCH_OK) {
+        rombp_log_err("Failed to allocate %ld byte source image\n", (long)size);
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i++) {
+        source->data.data[i] = bench_next_byte(&seed);
+    }
+    source->crc32 = crc32_update(0, source->data.data, size);
+}
+
+void bench_writer_put(bench_writer* writer, const uint8_t* data, size_t len) {
+    if (writer->size + len > writer->capacity) {
+        size_t capacity = (writer->size + len) * 2;
+        uint8_t* grown = realloc(writer->data, capacity);
+        if (grown == NULL) {
+            rombp_log_err("Failed to grow patch buffer to %ld bytes\n", (long)capacity);
+            exit(1);
+        }
+        writer->data = grown;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->size, data, len);
+    writer->size += len;
+}
+
+void bench_writer_put_byte(bench_writer* writer, uint8_t value) {
+    bench_writer_put(writer, &value, 1);
+}
+
+void bench_writer_put_be(bench_writer* writer, uint32_t value, size_t size) {
+    for (size_t i = size; i > 0; i--) {
+        bench_writer_put_byte(writer, value >> ((i - 1) * 8));
+    }
+}
+
+void bench_writer_put_le32(bench_writer* writer, uint32_t value) {
+    uint8_t buf[] = { value, value >> 8, value >> 16, value >> 24 };
+    bench_writer_put(writer, buf, sizeof(buf));
+}
+
+void bench_writer_put_varint(bench_writer* writer, uint64_t data) {
+    while (1) {
+        uint8_t x = data & 0x7F;
+        data >>= 7;
+        if (data == 0) {
+            bench_writer_put_byte(writer, x | 0x80);
+            return;
+        }
+        bench_writer_put_byte(writer, x);
+        data--;
+    }
+}
+
+void bench_writer_put_relative(bench_writer* writer, uint64_t* current, uint64_t next) {
+    int64_t delta = (int64_t)next - (int64_t)*current;
+    bench_writer_put_varint(writer, ((delta < 0 ? -delta : delta) << 1) | (delta < 0));
+    *current = next;
+}
+
+size_t bench_write_ups_patch(bench_writer* patch, const uint8_t* source, size_t source_size, const uint8_t* target,
+                             size_t target_size) {
+    size_t size = source_size > target_size ? source_size : target_size;
+    size_t record_count = 0;
+    size_t pos = 0;
+
+    bench_writer_put(patch, UPS_MARKER, UPS_MARKER_SIZE);
+    bench_writer_put_varint(patch, source_size);
+    bench_writer_put_varint(patch, target_size);
+    // Both images read as zeroes past their end, so the patch also gives back
+    // the tail of the longer one when it's applied the other way
+    for (size_t i = 0; i < size; i++) {
+        uint8_t diff = (i < source_size ? source[i] : 0) ^ (i < target_size ? target[i] : 0);
+        if (diff == 0) {
+            continue;
+        }
+        bench_writer_put_varint(patch, i - pos);
+        for (; i < size; i++) {
+            diff = (i < source_size ? source[i] : 0) ^ (i < target_size ? target[i] : 0);
+            if (diff == 0) {
+                break;
+            }
+            bench_writer_put_byte(patch, diff);
+        }
+        bench_writer_put_byte(patch, 0);
+        pos = i + 1;
+        record_count++;
+    }
+    bench_writer_put_le32(patch, crc32_update(0, source, source_size));
+    bench_writer_put_le32(patch, crc32_update(0, target, target_size));
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+    return record_count;
+}
+
+FILE* bench_temp_file(const uint8_t* data, size_t size) {
+    FILE* file = tmpfile();
+    if (file == NULL) {
+        return NULL;
+    }
+    if ((size > 0 && fwrite(data, 1, size, file) != size) || fflush(file) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    rewind(file);
+    return file;
+}
+
+typedef struct bench_progress_recorder {
+    const rombp_patch_format* format;
+    void* ctx;
+    bench_progress* progress;
+} bench_progress_recorder;
+
+static void bench_record_progress(void* arg) {
+    bench_progress_recorder* recorder = (bench_progress_recorder*)arg;
+    bench_progress* progress = recorder->progress;
+    rombp_patch_status status;
+
+    patch_status_init(&status);
+    recorder->format->progress(recorder->ctx, &status);
+    progress->calls++;
+    if (status.bytes_written > 0 && status.bytes_written < status.total_bytes) {
+        progress->partial_calls++;
+    }
+    if (status.bytes_written < progress->bytes_written) {
+        progress->went_backwards = 1;
+    }
+    progress->bytes_written = status.bytes_written;
+}
+
+int bench_verify_patch(const patch_source* source, const patch_source* target, const patch_buffer* patch) {
+    rombp_apply_options options = { .mode = APPLY_MODE_MEMORY, .memory_budget = 0, .thread_count = 1 };
+    return bench_verify_patch_using(&options, source, target, patch, NULL);
+}
+
+int bench_verify_patch_using(const rombp_apply_options* options, const patch_source* source,
+                             const patch_source* target, const patch_buffer* patch, bench_progress* progress) {
+    rombp_apply_options apply_options = *options;
+    bench_progress_recorder recorder;
+    rombp_hunk_iter_status iter_status;
+    patch_source output;
+    FILE* input_file = NULL;
+    FILE* output_file = NULL;
+    void* ctx = NULL;
+    int in_memory = options->mode == APPLY_MODE_MEMORY;
+
+    patch_buffer_init(&output.data);
+    FILE* patch_file = bench_temp_file(patch->data, patch->size);
+    if (patch_file == NULL) {
+        return -1;
+    }
+    const rombp_patch_format* format = patch_format_detect(patch_file);
+    int rc = format != NULL ? PATCH_OK : PATCH_UNKNOWN_TYPE;
+    if (rc == PATCH_OK && !in_memory) {
+        input_file = bench_temp_file(source->data.data, source->data.size);
+        output_file = tmpfile();
+        rc = input_file != NULL && output_file != NULL ? PATCH_OK : PATCH_ERR_IO;
+    }
+    if (rc == PATCH_OK) {
+        ctx = calloc(1, format->context_size);
+        rc = ctx != NULL ? PATCH_OK : PATCH_ERR_IO;
+    }
+    if (rc == PATCH_OK) {
+        if (progress != NULL) {
+            memset(progress, 0, sizeof(*progress));
+            recorder.format = format;
+            recorder.ctx = ctx;
+            recorder.progress = progress;
+            apply_options.on_progress = &bench_record_progress;
+            apply_options.progress_arg = &recorder;
+        }
+        rc = format->start(ctx, &apply_options, in_memory ? source : NULL, input_file, patch_file, output_file);
+        if (rc == PATCH_OK) {
+            do {
+                iter_status = format->next(ctx, input_file, output_file);
+            } while (iter_status == HUNK_NEXT);
+            rc = iter_status == HUNK_DONE ? format->end(ctx, input_file, output_file) : PATCH_ERR_IO;
+        }
+        if (rc == PATCH_OK && in_memory) {
+            rc = format->take_output(ctx, &output);
+        }
+        format->free(ctx);
+    }
+    free(ctx);
+    if (rc == PATCH_OK && !in_memory) {
+        rewind(output_file);
+        rc = patch_buffer_read_file(&output.data, output_file);
+    }
+    if (output_file != NULL) {
+        fclose(output_file);
+    }
+    if (input_file != NULL) {
+        fclose(input_file);
+    }
+    fclose(patch_file);
+
+    if (rc == PATCH_OK) {
+        rc = output.data.size == target->data.size &&
+            (output.data.size == 0 || memcmp(output.data.data, target->data.data, output.data.size) == 0) ? 0 : -1;
+    }
+    patch_source_free(&output);
+    return rc;
+}
+
+int bench_verify_writer(const patch_source* source, const patch_source* target, const bench_writer* writer,
+                        rombp_apply_mode mode, int thread_count, bench_progress* progress) {
+    patch_buffer patch = { writer->data, writer->size, writer->capacity };
+    rombp_apply_options options = { .mode = mode, .memory_budget = 0, .thread_count = thread_count };
+    return bench_verify_patch_using(&options, source, target, &patch, progress);
+}
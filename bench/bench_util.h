@@ -0,0 +1,73 @@
+#ifndef ROMBP_BENCH_UTIL_H_
+#define ROMBP_BENCH_UTIL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "patch.h"
+
+// Helpers shared by the benchmarks and tests: timing, seeded data, patch
+// writing, and checking a patch against the target it should produce.
+
+// A growable buffer patches are written into. Exits if it can't grow.
+typedef struct bench_writer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} bench_writer;
+
+// Monotonic time, in milliseconds.
+double bench_now_ms();
+
+// A seeded LCG, so generated data is the same on every run.
+uint32_t bench_next_random(uint32_t* state);
+uint8_t bench_next_byte(uint32_t* state);
+// A random number below n, which may be larger than bench_next_random's range.
+size_t bench_random_below(uint32_t* state, size_t n);
+
+// A ROM like image: 4 KB blocks of random data, fill bytes, or repeats of an
+// earlier block. Always the same for the same size.
+void bench_make_source(patch_source* source, size_t size);
+// Random bytes from seed, with no structure to them, for tests.
+void bench_random_source(patch_source* source, size_t size, uint32_t seed);
+
+void bench_writer_put(bench_writer* writer, const uint8_t* data, size_t len);
+void bench_writer_put_byte(bench_writer* writer, uint8_t value);
+// The low size bytes of value, most significant first, like IPS offsets.
+void bench_writer_put_be(bench_writer* writer, uint32_t value, size_t size);
+void bench_writer_put_le32(bench_writer* writer, uint32_t value);
+// BPS / UPS variable length integers, and BPS relative offsets.
+void bench_writer_put_varint(bench_writer* writer, uint64_t data);
+void bench_writer_put_relative(bench_writer* writer, uint64_t* current, uint64_t next);
+
+// Append a UPS patch from source to target, with its footer, and return how
+// many records it has.
+size_t bench_write_ups_patch(bench_writer* patch, const uint8_t* source, size_t source_size, const uint8_t* target,
+                             size_t target_size);
+
+// A temporary file holding size bytes of data, or NULL.
+FILE* bench_temp_file(const uint8_t* data, size_t size);
+
+// Apply patch to source in memory, through the format registry, and compare
+// the output with target. Returns 0 when they match.
+int bench_verify_patch(const patch_source* source, const patch_source* target, const patch_buffer* patch);
+// What an engine reported through on_progress while applying a patch.
+typedef struct bench_progress {
+    int calls;
+    // Calls that reported some, but not all, of the output written
+    int partial_calls;
+    // Set if bytes written ever went down
+    int went_backwards;
+    size_t bytes_written;
+} bench_progress;
+
+// The same, applied with options. Outside of memory mode the source is read
+// from a file, and the output read back from the file the engine wrote. When
+// progress is set, the engine's progress reports are recorded in it.
+int bench_verify_patch_using(const rombp_apply_options* options, const patch_source* source,
+                             const patch_source* target, const patch_buffer* patch, bench_progress* progress);
+// The same, for a patch still in the writer it was generated into.
+int bench_verify_writer(const patch_source* source, const patch_source* target, const bench_writer* writer,
+                        rombp_apply_mode mode, int thread_count, bench_progress* progress);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "bench_util.h"
+#include "bps.h"
+#include "crc32.h"
+#include "log.h"
+
+// Compares the in-memory, streaming and mapped BPS apply paths, on one thread and
+// on every CPU (which also hashes the output on several threads), on two synthetic patches: a TargetCopy dominated one, and a larger,
+// SourceCopy dominated one like a disc image hack's. Every apply checks the output
+// CRC32. Usage: bps_bench [source file patch file ...]
+//
+// Any source / patch pairs given on the command line are benchmarked as well.
+
+static const size_t SOURCE_SIZE = 8 * 1024 * 1024;
+static const size_t TARGET_SIZE = 16 * 1024 * 1024;
+static const size_t LARGE_TARGET_SIZE = 64 * 1024 * 1024;
+static const int REPETITIONS = 5;
+
+static FILE* write_patch_file(bench_writer* patch) {
+    FILE* patch_file = bench_temp_file(patch->data, patch->size);
+    free(patch->data);
+    return patch_file;
+}
+
+// A patch made mostly of TargetCopy commands: short run length style copies
+// just behind the output offset, and longer copies from further back, with
+// a few TargetReads to seed new data.
+static FILE* make_target_copy_patch(const uint8_t* source, int* command_count) {
+    bench_writer patch = { 0 };
+    uint8_t* target = malloc(TARGET_SIZE);
+    uint64_t output_offset = 0;
+    uint64_t target_relative_offset = 0;
+    uint32_t state = 0xC0FFEE;
+
+    *command_count = 0;
+    bench_writer_put(&patch, BPS_MARKER, BPS_MARKER_SIZE);
+    bench_writer_put_varint(&patch, SOURCE_SIZE);
+    bench_writer_put_varint(&patch, TARGET_SIZE);
+    bench_writer_put_varint(&patch, 0);
+
+    while (output_offset < TARGET_SIZE) {
+        state = state * 1103515245 + 12345;
+        uint64_t length = 1 + (state >> 8) % 4096;
+        if (length > TARGET_SIZE - output_offset) {
+            length = TARGET_SIZE - output_offset;
+        }
+
+        if (output_offset < 64 || (state >> 28) == 0) {
+            // TargetRead
+            bench_writer_put_varint(&patch, ((length - 1) << 2) | 1);
+            for (uint64_t i = 0; i < length; i++) {
+                state = state * 1103515245 + 12345;
+                target[output_offset + i] = state >> 24;
+            }
+            bench_writer_put(&patch, target + output_offset, length);
+        } else {
+            // TargetCopy
+            uint64_t distance = (state >> 27) & 1 ?
+                1 + (state >> 4) % 16 :
+                1 + (state >> 4) % output_offset;
+            uint64_t src = output_offset - distance;
+            bench_writer_put_varint(&patch, ((length - 1) << 2) | 3);
+            bench_writer_put_relative(&patch, &target_relative_offset, src);
+            for (uint64_t i = 0; i < length; i++) {
+                target[output_offset + i] = target[src + i];
+            }
+            target_relative_offset += length;
+        }
+        output_offset += length;
+        (*command_count)++;
+    }
+
+    bench_writer_put_le32(&patch, crc32_update(0, source, SOURCE_SIZE));
+    bench_writer_put_le32(&patch, crc32_update(0, target, TARGET_SIZE));
+    bench_writer_put_le32(&patch, crc32_update(0, patch.data, patch.size));
+    free(target);
+
+    return write_patch_file(&patch);
+}
+
+// A patch made mostly of long SourceCopy commands from all over the source, with
+// short TargetRead edits in between, and the odd TargetCopy of an earlier stretch
+// of the target.
+static FILE* make_source_copy_patch(const uint8_t* source, int* command_count) {
+    bench_writer patch = { 0 };
+    uint8_t* target = malloc(LARGE_TARGET_SIZE);
+    uint64_t output_offset = 0;
+    uint64_t source_relative_offset = 0;
+    uint64_t target_relative_offset = 0;
+    uint32_t state = 0xBEEF;
+
+    *command_count = 0;
+    bench_writer_put(&patch, BPS_MARKER, BPS_MARKER_SIZE);
+    bench_writer_put_varint(&patch, SOURCE_SIZE);
+    bench_writer_put_varint(&patch, LARGE_TARGET_SIZE);
+    bench_writer_put_varint(&patch, 0);
+
+    while (output_offset < LARGE_TARGET_SIZE) {
+        state = state * 1103515245 + 12345;
+        uint32_t kind = (state >> 24) % 16;
+        uint64_t length = kind < 4 ? 1 + (state >> 8) % 256 : 1 + (state >> 8) % 65536;
+        if (length > LARGE_TARGET_SIZE - output_offset) {
+            length = LARGE_TARGET_SIZE - output_offset;
+        }
+
+        if (kind < 4 || (kind == 4 && output_offset == 0)) {
+            // TargetRead
+            bench_writer_put_varint(&patch, ((length - 1) << 2) | 1);
+            for (uint64_t i = 0; i < length; i++) {
+                state = state * 1103515245 + 12345;
+                target[output_offset + i] = state >> 24;
+            }
+            bench_writer_put(&patch, target + output_offset, length);
+        } else if (kind == 4) {
+            // TargetCopy
+            uint64_t src = (state >> 4) % output_offset;
+            bench_writer_put_varint(&patch, ((length - 1) << 2) | 3);
+            bench_writer_put_relative(&patch, &target_relative_offset, src);
+            for (uint64_t i = 0; i < length; i++) {
+                target[output_offset + i] = target[src + i];
+            }
+            target_relative_offset += length;
+        } else {
+            // SourceCopy
+            length = MIN(length, SOURCE_SIZE);
+            uint64_t src = (state >> 4) % (SOURCE_SIZE - length + 1);
+            bench_writer_put_varint(&patch, ((length - 1) << 2) | 2);
+            bench_writer_put_relative(&patch, &source_relative_offset, src);
+            memcpy(target + output_offset, source + src, length);
+            source_relative_offset += length;
+        }
+        output_offset += length;
+        (*command_count)++;
+    }
+
+    bench_writer_put_le32(&patch, crc32_update(0, source, SOURCE_SIZE));
+    bench_writer_put_le32(&patch, crc32_update(0, target, LARGE_TARGET_SIZE));
+    bench_writer_put_le32(&patch, crc32_update(0, patch.data, patch.size));
+    free(target);
+
+    return write_patch_file(&patch);
+}
+
+static int apply_once(const rombp_apply_options* options, FILE* source, FILE* patch, int* hunk_count) {
+    bps_file_header file_header;
+    rombp_hunk_iter_status iter_status;
+
+    FILE* output = tmpfile();
+    if (output == NULL) {
+        return -1;
+    }
+    rewind(source);
+    rewind(patch);
+
+    int rc = bps_start(patch, source, output, NULL, options, &file_header);
+    if (rc != PATCH_OK) {
+        bps_free(&file_header);
+        fclose(output);
+        return -1;
+    }
+
+    *hunk_count = 0;
+    while ((iter_status = bps_next(&file_header)) == HUNK_NEXT) {
+        (*hunk_count)++;
+    }
+    if (iter_status == HUNK_DONE) {
+        rc = bps_end(&file_header, output);
+    } else {
+        rc = -1;
+    }
+    bps_free(&file_header);
+    fclose(output);
+    return rc;
+}
+
+static int bench_patch(const char* name, FILE* source, FILE* patch) {
+    static const struct {
+        const char* name;
+        rombp_apply_mode mode;
+        // 0 for every CPU
+        int thread_count;
+    } MODES[] = {
+        { "memory", APPLY_MODE_MEMORY, 1 },
+        { "memory-mt", APPLY_MODE_MEMORY, 0 },
+        { "stream", APPLY_MODE_STREAM, 1 },
+        { "stream-mt", APPLY_MODE_STREAM, 0 },
+        { "map", APPLY_MODE_MAP, 1 },
+        { "map-mt", APPLY_MODE_MAP, 0 },
+    };
+
+    for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+        rombp_apply_options options = {
+            .mode = MODES[m].mode,
+            .memory_budget = 0,
+            .thread_count = MODES[m].thread_count > 0 ? MODES[m].thread_count : sysconf(_SC_NPROCESSORS_ONLN),
+        };
+        double best = 0;
+        double total = 0;
+        int hunk_count = 0;
+
+        for (int i = 0; i < REPETITIONS; i++) {
+            double start = bench_now_ms();
+            if (apply_once(&options, source, patch, &hunk_count) != 0) {
+                rombp_log_err("%s: failed to apply patch in %s mode\n", name, MODES[m].name);
+                return -1;
+            }
+            double elapsed = bench_now_ms() - start;
+            total += elapsed;
+            if (i == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-28s %-9s hunks: %7d  best: %8.2f ms  mean: %8.2f ms\n",
+               name, MODES[m].name, hunk_count, best, total / REPETITIONS);
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int command_count;
+    int failed = 0;
+
+    uint8_t* source_data = malloc(SOURCE_SIZE);
+    uint32_t state = 0x12345678;
+    for (size_t i = 0; i < SOURCE_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        source_data[i] = state >> 24;
+    }
+    FILE* source = tmpfile();
+    if (source == NULL) {
+        rombp_log_err("Failed to create benchmark files\n");
+        return 1;
+    }
+    fwrite(source_data, 1, SOURCE_SIZE, source);
+    fflush(source);
+
+    FILE* patch = make_target_copy_patch(source_data, &command_count);
+    if (patch == NULL) {
+        rombp_log_err("Failed to create benchmark files\n");
+        return 1;
+    }
+    failed |= bench_patch("synthetic-target-copy", source, patch) != 0;
+    fclose(patch);
+
+    patch = make_source_copy_patch(source_data, &command_count);
+    free(source_data);
+    if (patch == NULL) {
+        rombp_log_err("Failed to create benchmark files\n");
+        return 1;
+    }
+    failed |= bench_patch("synthetic-source-copy", source, patch) != 0;
+    fclose(patch);
+    fclose(source);
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        source = fopen(argv[i], "r");
+        patch = fopen(argv[i + 1], "r");
+        if (source == NULL || patch == NULL) {
+            rombp_log_err("Failed to open source: %s or patch: %s\n", argv[i], argv[i + 1]);
+            return 1;
+        }
+        const char* name = strrchr(argv[i + 1], '/');
+        failed |= bench_patch(name != NULL ? name + 1 : argv[i + 1], source, patch) != 0;
+        fclose(patch);
+        fclose(source);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "bps_diff.h"
+#include "crc32.h"
+#include "log.h"
+
+// Measures BPS patch creation on synthetic 32 and 64 MB ROM images: index
+// build time on one thread and on every CPU, encoding throughput, and the
+// size of the resulting patch. Every patch is applied again, and checked
+// against the target. Usage: bps_diff_bench [original modified ...]
+
+static const size_t IMAGE_SIZES[] = { 32 * 1024 * 1024, 64 * 1024 * 1024 };
+static const int REPETITIONS = 3;
+
+// A modified copy of the source: patched bytes, inserted and deleted runs,
+// blocks moved from elsewhere in the source, and repeats of earlier output.
+static void make_target(patch_source* target, const patch_source* source) {
+    const uint8_t* src = source->data.data;
+    size_t size = source->data.size;
+    size_t src_offset = 0;
+    uint32_t state = 0xD1FF;
+
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, size);
+    uint8_t* data = target->data.data;
+    size_t offset = 0;
+
+    while (offset < size) {
+        size_t length = 1024 + bench_next_random(&state) % (256 * 1024);
+        if (length > size - offset) {
+            length = size - offset;
+        }
+        uint32_t kind = bench_next_random(&state) % 20;
+
+        if (kind < 14) {
+            // Unchanged or lightly patched source
+            if (length > size - src_offset) {
+                length = size - src_offset;
+            }
+            memcpy(data + offset, src + src_offset, length);
+            for (int i = 0; i < 8 && kind < 4; i++) {
+                data[offset + bench_next_random(&state) % length] = bench_next_byte(&state);
+            }
+            src_offset += length;
+        } else if (kind < 16) {
+            // New data
+            length = length / 8 + 1;
+            for (size_t i = 0; i < length; i++) {
+                data[offset + i] = bench_next_byte(&state);
+            }
+        } else if (kind < 18) {
+            // Moved block
+            size_t from = bench_random_below(&state, size - length);
+            memcpy(data + offset, src + from, length);
+        } else if (offset > 0) {
+            // Repeat of earlier output
+            size_t from = bench_random_below(&state, offset);
+            for (size_t i = 0; i < length; i++) {
+                data[offset + i] = data[from + i];
+            }
+        } else {
+            continue;
+        }
+        offset += length;
+
+        // Deleted run
+        if (kind == 13) {
+            src_offset += bench_next_random(&state) % 65536;
+        }
+        if (src_offset >= size) {
+            src_offset = 0;
+        }
+    }
+    target->crc32 = crc32_update(0, data, size);
+}
+
+static double time_index(const patch_source* source, int thread_count) {
+    bps_diff_index index;
+    double best = 0;
+
+    for (int i = 0; i < REPETITIONS; i++) {
+        double start = bench_now_ms();
+        if (bps_diff_index_build(&index, source, thread_count) != PATCH_OK) {
+            return -1;
+        }
+        double elapsed = bench_now_ms() - start;
+        bps_diff_index_free(&index);
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+// Returns -1 when the patch can't be made, or doesn't apply back to the target.
+static int bench_diff(const char* name, const patch_source* source, const patch_source* target) {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bps_diff_index index;
+    patch_buffer patch;
+    double best = 0;
+    int rc = 0;
+
+    double index_one = time_index(source, 1);
+    double index_all = time_index(source, cpus);
+
+    patch_buffer_init(&patch);
+    if (bps_diff_index_build(&index, source, cpus) != PATCH_OK) {
+        rombp_log_err("%s: failed to build index\n", name);
+        return -1;
+    }
+    for (int i = 0; i < REPETITIONS; i++) {
+        double start = bench_now_ms();
+        if (bps_diff_encode(&index, source, target, &patch) != PATCH_OK) {
+            rombp_log_err("%s: failed to encode patch\n", name);
+            rc = -1;
+            break;
+        }
+        double elapsed = bench_now_ms() - start;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    bps_diff_index_free(&index);
+
+    if (rc == 0 && bench_verify_patch(source, target, &patch) != 0) {
+        rombp_log_err("%s: patch doesn't apply back to the target\n", name);
+        rc = -1;
+    }
+    double target_mb = target->data.size / (1024.0 * 1024.0);
+    printf("%-24s index: %8.2f ms (1 thread) %8.2f ms (%d threads)  encode: %8.2f ms  %7.1f MB/s  "
+           "patch: %9ld bytes (%5.2f%%)  %s\n",
+           name, index_one, index_all, cpus, best, target_mb / (best / 1000.0),
+           (long)patch.size, 100.0 * patch.size / target->data.size, rc == 0 ? "verified" : "MISMATCH");
+    patch_buffer_free(&patch);
+    return rc;
+}
+
+int main(int argc, char** argv) {
+    char name[64];
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(IMAGE_SIZES) / sizeof(IMAGE_SIZES[0]); i++) {
+        patch_source source;
+        patch_source target;
+
+        bench_make_source(&source, IMAGE_SIZES[i]);
+        make_target(&target, &source);
+        snprintf(name, sizeof(name), "synthetic-%ldMB", (long)(IMAGE_SIZES[i] / (1024 * 1024)));
+        failed |= bench_diff(name, &source, &target) != 0;
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        patch_source source;
+        patch_source target;
+
+        if (patch_source_load(&source, argv[i]) != PATCH_OK) {
+            return 1;
+        }
+        if (patch_source_load(&target, argv[i + 1]) != PATCH_OK) {
+            patch_source_free(&source);
+            return 1;
+        }
+        const char* base = strrchr(argv[i + 1], '/');
+        failed |= bench_diff(base != NULL ? base + 1 : argv[i + 1], &source, &target) != 0;
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    return failed ? 1 : 0;
+}
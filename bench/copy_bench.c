@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "log.h"
+#include "patch.h"
+
+// Measures every strategy for copying the input ROM to the output file,
+// before it's patched in place. Every copy is read back and compared with its
+// input, and the run exits non-zero on any mismatch. The copies of awkward
+// sizes are checked by make test.
+// Usage: copy_bench
+
+static const size_t BENCH_SIZE = 64 * 1024 * 1024 + 3;
+static const int REPETITIONS = 3;
+
+static const rombp_copy_strategy STRATEGIES[] = {
+    COPY_STRATEGY_REFLINK,
+    COPY_STRATEGY_COPY_FILE_RANGE,
+    COPY_STRATEGY_SENDFILE,
+    COPY_STRATEGY_READ_WRITE,
+};
+
+static FILE* make_input(patch_buffer* data, size_t size) {
+    uint32_t state = 0xC0FFEE ^ size;
+
+    patch_buffer_init(data);
+    if (patch_buffer_resize(data, size) != PATCH_OK) {
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1103515245 + 12345;
+        data->data[i] = state >> 24;
+    }
+
+    FILE* input = tmpfile();
+    if (input == NULL) {
+        return NULL;
+    }
+    if (size > 0 && patch_buffer_write_file(data, input) != PATCH_OK) {
+        fclose(input);
+        return NULL;
+    }
+    rewind(input);
+    return input;
+}
+
+// Copy input into a fresh output file with one strategy. Returns 1 when the
+// strategy isn't supported here, -1 on a bad copy, and 0 when the output is
+// byte for byte the input.
+static int copy_once(rombp_copy_strategy strategy, FILE* input, const patch_buffer* expected, double* elapsed) {
+    patch_buffer copied;
+
+    FILE* output = tmpfile();
+    if (output == NULL) {
+        return -1;
+    }
+    rewind(input);
+    double start = bench_now_ms();
+    if (patch_copy_file_using(input, output, strategy) != PATCH_OK) {
+        fclose(output);
+        return 1;
+    }
+    *elapsed = bench_now_ms() - start;
+
+    patch_buffer_init(&copied);
+    rewind(output);
+    int rc = patch_buffer_read_file(&copied, output) == PATCH_OK &&
+        copied.size == expected->size &&
+        (expected->size == 0 || memcmp(copied.data, expected->data, expected->size) == 0) ? 0 : -1;
+    patch_buffer_free(&copied);
+    fclose(output);
+    return rc;
+}
+
+static int bench_strategy(rombp_copy_strategy strategy, FILE* input, const patch_buffer* expected) {
+    const char* name = patch_copy_strategy_name(strategy);
+    double best = 0;
+
+    for (int i = 0; i < REPETITIONS; i++) {
+        double elapsed;
+        int rc = copy_once(strategy, input, expected, &elapsed);
+        if (rc > 0) {
+            printf("%-16s unsupported\n", name);
+            return 0;
+        }
+        if (rc < 0) {
+            printf("%-16s MISMATCH copying %ld bytes\n", name, (long)expected->size);
+            return -1;
+        }
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    double mb = expected->size / (1024.0 * 1024.0);
+    printf("%-16s best: %8.2f ms  %8.1f MB/s\n", name, best, mb / (best / 1000.0));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    patch_buffer expected;
+    int failed = 0;
+
+    FILE* input = make_input(&expected, BENCH_SIZE);
+    if (input == NULL) {
+        rombp_log_err("Failed to create the input file\n");
+        patch_buffer_free(&expected);
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(STRATEGIES) / sizeof(STRATEGIES[0]); i++) {
+        if (bench_strategy(STRATEGIES[i], input, &expected) != 0) {
+            failed = 1;
+        }
+    }
+    fclose(input);
+    patch_buffer_free(&expected);
+
+    return failed;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "ips_diff.h"
+#include "log.h"
+
+// Measures IPS patch creation on synthetic 16 MB ROM images: comparison and
+// encoding throughput, and the size of the resulting patch. Every patch is
+// applied again with the IPS engine, and checked against the target; the
+// run fails if any of them don't match. The edge cases are in make test.
+// Usage: ips_diff_bench [original modified ...]
+
+static const size_t IMAGE_SIZE = 16 * 1024 * 1024;
+static const int REPETITIONS = 3;
+
+// A copy of the source with edit_count edits: patched bytes, rewritten
+// blocks, and filled runs. Grows the copy by grow bytes of new data.
+static void make_target(patch_source* target, const patch_source* source, int edit_count, size_t grow) {
+    size_t size = source->data.size + grow;
+    uint32_t state = 0xD1FF;
+
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, size);
+    uint8_t* data = target->data.data;
+    memcpy(data, source->data.data, source->data.size);
+    for (size_t i = source->data.size; i < size; i++) {
+        data[i] = bench_next_byte(&state);
+    }
+
+    for (int i = 0; i < edit_count; i++) {
+        size_t offset = bench_next_random(&state) % source->data.size;
+        size_t max_length = bench_next_random(&state) % 4 == 0 ? 16384 : 16;
+        size_t length = 1 + bench_next_random(&state) % max_length;
+        if (length > source->data.size - offset) {
+            length = source->data.size - offset;
+        }
+        switch (bench_next_random(&state) % 3) {
+            case 0:
+                data[offset] ^= 0xFF;
+                break;
+            case 1:
+                for (size_t j = 0; j < length; j++) {
+                    data[offset + j] = bench_next_byte(&state);
+                }
+                break;
+            default:
+                memset(data + offset, bench_next_byte(&state), length);
+                break;
+        }
+    }
+    target->crc32 = crc32_update(0, data, size);
+}
+
+// Returns -1 when the patch can't be made, or doesn't apply back to the target.
+static int bench_diff(const char* name, const patch_source* source, const patch_source* target) {
+    patch_buffer patch;
+    double best = 0;
+    int rc = 0;
+
+    patch_buffer_init(&patch);
+    for (int i = 0; i < REPETITIONS; i++) {
+        double start = bench_now_ms();
+        if (ips_diff(source, target, &patch) != PATCH_OK) {
+            rombp_log_err("%s: failed to encode patch\n", name);
+            patch_buffer_free(&patch);
+            return -1;
+        }
+        double elapsed = bench_now_ms() - start;
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    if (bench_verify_patch(source, target, &patch) != 0) {
+        rombp_log_err("%s: patch doesn't apply back to the target\n", name);
+        rc = -1;
+    }
+    double target_mb = target->data.size / (1024.0 * 1024.0);
+    printf("%-24s encode: %8.2f ms  %8.1f MB/s  patch: %9ld bytes (%5.2f%%)  %s\n",
+           name, best, target_mb / (best / 1000.0),
+           (long)patch.size, 100.0 * patch.size / target->data.size, rc == 0 ? "verified" : "MISMATCH");
+    patch_buffer_free(&patch);
+    return rc;
+}
+
+int main(int argc, char** argv) {
+    static const struct {
+        const char* name;
+        int edit_count;
+        size_t grow;
+    } CASES[] = {
+        { "unchanged", 0, 0 },
+        { "light-edits", 200, 0 },
+        { "heavy-edits", 20000, 0 },
+        { "edits-grown", 2000, 1024 * 1024 },
+    };
+    patch_source source;
+    int failed = 0;
+
+    bench_make_source(&source, IMAGE_SIZE - 1024 * 1024);
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); i++) {
+        patch_source target;
+
+        make_target(&target, &source, CASES[i].edit_count, CASES[i].grow);
+        failed |= bench_diff(CASES[i].name, &source, &target) != 0;
+        patch_source_free(&target);
+    }
+    patch_source_free(&source);
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        patch_source target;
+
+        if (patch_source_load(&source, argv[i]) != PATCH_OK) {
+            return 1;
+        }
+        if (patch_source_load(&target, argv[i + 1]) != PATCH_OK) {
+            patch_source_free(&source);
+            return 1;
+        }
+        const char* base = strrchr(argv[i + 1], '/');
+        failed |= bench_diff(base != NULL ? base + 1 : argv[i + 1], &source, &target) != 0;
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    return failed ? 1 : 0;
+}
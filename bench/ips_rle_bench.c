@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "ips.h"
+#include "log.h"
+
+// Compares the in-memory and streaming IPS apply paths on RLE heavy
+// patches. Usage: ips_rle_bench [patch file ...]
+//
+// A synthetic patch made up of large RLE runs is always benchmarked,
+// any patch files given on the command line are benchmarked as well.
+
+static const size_t SOURCE_SIZE = 16 * 1024 * 1024;
+static const int RLE_HUNK_COUNT = 2048;
+static const int REPETITIONS = 5;
+
+static FILE* make_source_file() {
+    FILE* source = tmpfile();
+    if (source == NULL) {
+        return NULL;
+    }
+    uint32_t state = 0x12345678;
+    for (size_t i = 0; i < SOURCE_SIZE; i++) {
+        state = state * 1103515245 + 12345;
+        fputc(state >> 24, source);
+    }
+    return source;
+}
+
+// A patch that blanks out RLE_HUNK_COUNT runs of up to 64k bytes each, with
+// a short literal hunk in between every run.
+static FILE* make_rle_patch(size_t* rle_bytes) {
+    FILE* patch = tmpfile();
+    if (patch == NULL) {
+        return NULL;
+    }
+    uint32_t state = 0xCAFEBABE;
+    *rle_bytes = 0;
+
+    fwrite(IPS_MARKER, 1, IPS_MARKER_SIZE, patch);
+    for (int i = 0; i < RLE_HUNK_COUNT; i++) {
+        state = state * 1103515245 + 12345;
+        uint32_t length = 4096 + (state >> 16) % (65535 - 4096);
+        uint32_t offset = (state >> 4) % (SOURCE_SIZE - length);
+        uint8_t rle_hunk[] = {
+            offset >> 16, offset >> 8, offset, 0, 0,
+            length >> 8, length, i & 0xFF
+        };
+        fwrite(rle_hunk, 1, sizeof(rle_hunk), patch);
+        *rle_bytes += length;
+
+        uint8_t literal_hunk[] = { 0x00, 0x01, 0x00, 0x00, 0x04, 0xDE, 0xAD, 0xBE, 0xEF };
+        fwrite(literal_hunk, 1, sizeof(literal_hunk), patch);
+    }
+    fwrite("EOF", 1, 3, patch);
+    fflush(patch);
+    return patch;
+}
+
+static int apply_once(rombp_apply_mode mode, FILE* source, FILE* patch, int* hunk_count) {
+    ips_context ctx;
+    rombp_hunk_iter_status iter_status;
+
+    FILE* output = tmpfile();
+    if (output == NULL) {
+        return -1;
+    }
+    rewind(source);
+    rewind(patch);
+
+    rombp_apply_options options = {
+        .mode = mode,
+        .memory_budget = 0,
+        .thread_count = 1,
+    };
+    int rc = ips_start(&ctx, &options, NULL, source, output, patch);
+    if (rc != PATCH_OK) {
+        ips_free(&ctx);
+        fclose(output);
+        return -1;
+    }
+
+    *hunk_count = 0;
+    while ((iter_status = ips_next(&ctx)) == HUNK_NEXT) {
+        (*hunk_count)++;
+    }
+    if (iter_status == HUNK_DONE) {
+        rc = ips_end(&ctx, output);
+    } else {
+        rc = -1;
+    }
+    ips_free(&ctx);
+    fclose(output);
+    return rc;
+}
+
+static void bench_patch(const char* name, FILE* source, FILE* patch, size_t rle_bytes) {
+    static const rombp_apply_mode modes[] = { APPLY_MODE_MEMORY, APPLY_MODE_STREAM };
+    static const char* mode_names[] = { "memory", "stream" };
+
+    for (int m = 0; m < 2; m++) {
+        double best = 0;
+        double total = 0;
+        int hunk_count = 0;
+
+        for (int i = 0; i < REPETITIONS; i++) {
+            double start = bench_now_ms();
+            if (apply_once(modes[m], source, patch, &hunk_count) != 0) {
+                rombp_log_err("%s: failed to apply patch in %s mode\n", name, mode_names[m]);
+                return;
+            }
+            double elapsed = bench_now_ms() - start;
+            total += elapsed;
+            if (i == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-28s %-7s hunks: %6d  best: %8.2f ms  mean: %8.2f ms",
+               name, mode_names[m], hunk_count, best, total / REPETITIONS);
+        if (rle_bytes > 0) {
+            printf("  rle: %8.1f MB/s", (rle_bytes / (1024.0 * 1024.0)) / (best / 1000.0));
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t rle_bytes;
+
+    FILE* source = make_source_file();
+    FILE* rle_patch = make_rle_patch(&rle_bytes);
+    if (source == NULL || rle_patch == NULL) {
+        rombp_log_err("Failed to create benchmark files\n");
+        return 1;
+    }
+
+    bench_patch("synthetic-rle", source, rle_patch, rle_bytes);
+    fclose(rle_patch);
+
+    for (int i = 1; i < argc; i++) {
+        FILE* patch = fopen(argv[i], "r");
+        if (patch == NULL) {
+            rombp_log_err("Failed to open patch file: %s\n", argv[i]);
+            continue;
+        }
+        const char* name = strrchr(argv[i], '/');
+        bench_patch(name != NULL ? name + 1 : argv[i], source, patch, 0);
+        fclose(patch);
+    }
+
+    fclose(source);
+    return 0;
+}
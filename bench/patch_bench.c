@@ -0,0 +1,672 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "bps.h"
+#include "crc32.h"
+#include "format.h"
+#include "ips.h"
+#include "log.h"
+
+// Applies synthetic IPS, UPS and BPS patches of several shapes to synthetic ROM
+// images, through the format registry like rombp does, in memory and
+// streaming modes. Every workload is generated from fixed seeds, so runs on
+// different builds are comparable, and the first apply of each one is
+// checked against the target the generator built.
+//
+// Usage: patch_bench [-s MB[,MB...]] [-w warmup] [-r repetitions] [-j threads]
+//                    [-f filter] [-c baseline file] [-o baseline file] [-t tolerance %]
+//
+// -s picks the image sizes, from 1 to 512 MB. -c compares every result with a
+// baseline written by an earlier run with -o, and flags results more than
+// the tolerance slower than it.
+
+static const size_t MAX_SIZE_MB = 512;
+static const int DEFAULT_WARMUP = 1;
+static const int DEFAULT_REPETITIONS = 5;
+static const double DEFAULT_TOLERANCE = 10.0;
+// Records in plain IPS can't start at this offset, it reads as the terminator.
+static const uint32_t IPS_EOF_OFFSET = 0x454F46;
+static const size_t IPS_MAX_OFFSET = 16 * 1024 * 1024;
+
+typedef struct bench_rng {
+    uint64_t state;
+} bench_rng;
+
+// A synthetic patch for a source image. make fills in the patch, and the
+// target it turns the source into, which is as big as the source, and returns
+// how many records or commands the patch has. Engines merge some of them into
+// one hunk, so hunks/s is reported on these, not on the engine's hunks.
+typedef struct bench_workload {
+    const char* name;
+    size_t (*make)(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch, uint8_t* target);
+} bench_workload;
+
+typedef struct bench_mode {
+    const char* name;
+    rombp_apply_mode mode;
+} bench_mode;
+
+typedef struct bench_baseline {
+    char key[128];
+    double mb_per_sec;
+} bench_baseline;
+
+typedef struct bench_options {
+    size_t sizes[16];
+    int size_count;
+    int warmup;
+    int repetitions;
+    int thread_count;
+    const char* filter;
+    const char* compare_path;
+    const char* output_path;
+    double tolerance;
+} bench_options;
+
+// xorshift64*
+static uint64_t rng_next(bench_rng* rng) {
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t rng_range(bench_rng* rng, uint64_t min, uint64_t max) {
+    return min + rng_next(rng) % (max - min + 1);
+}
+
+static void rng_fill(bench_rng* rng, uint8_t* data, size_t length) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t value = rng_next(rng);
+        memcpy(data + i, &value, 8);
+    }
+    if (i < length) {
+        uint64_t value = rng_next(rng);
+        memcpy(data + i, &value, length - i);
+    }
+}
+
+// Something like a ROM: 4 KB blocks of code-like noise, blank fill, and
+// repeating tile-like patterns.
+static void make_source(bench_rng* rng, uint8_t* source, size_t size) {
+    static const size_t BLOCK_SIZE = 4096;
+
+    for (size_t offset = 0; offset < size; offset += BLOCK_SIZE) {
+        size_t length = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+        uint64_t kind = rng_next(rng) % 8;
+        if (kind < 5) {
+            rng_fill(rng, source + offset, length);
+        } else if (kind < 7) {
+            memset(source + offset, kind == 5 ? 0x00 : 0xFF, length);
+        } else {
+            uint8_t tile[32];
+            rng_fill(rng, tile, sizeof(tile));
+            for (size_t i = 0; i < length; i++) {
+                source[offset + i] = tile[i % sizeof(tile)];
+            }
+        }
+    }
+}
+
+// Images over 16 MB get IPS32 patches, since IPS can't address them.
+static size_t ips_begin(bench_writer* patch, size_t size) {
+    if (size > IPS_MAX_OFFSET) {
+        bench_writer_put(patch, IPS32_MARKER, IPS_MARKER_SIZE);
+        return 4;
+    }
+    bench_writer_put(patch, IPS_MARKER, IPS_MARKER_SIZE);
+    return 3;
+}
+
+static void ips_finish(bench_writer* patch, size_t offset_size) {
+    if (offset_size == 4) {
+        bench_writer_put(patch, (const uint8_t*)"EEOF", 4);
+    } else {
+        bench_writer_put(patch, (const uint8_t*)"EOF", 3);
+    }
+}
+
+static uint32_t ips_offset(size_t offset_size, uint32_t offset) {
+    return offset_size == 3 && offset == IPS_EOF_OFFSET ? offset + 1 : offset;
+}
+
+// A record of 1 - 8 bytes for every 256 bytes of the image, at random offsets,
+// like a translation's text and pointer fixes.
+static size_t make_ips_tiny_hunks(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                                uint8_t* target) {
+    size_t offset_size = ips_begin(patch, size);
+    size_t hunk_count = size / 256;
+
+    memcpy(target, source, size);
+    for (size_t i = 0; i < hunk_count; i++) {
+        uint32_t length = rng_range(rng, 1, 8);
+        uint32_t offset = ips_offset(offset_size, rng_range(rng, 0, size - length - 1));
+        uint8_t data[8];
+
+        rng_fill(rng, data, length);
+        bench_writer_put_be(patch, offset, offset_size);
+        bench_writer_put_be(patch, length, 2);
+        bench_writer_put(patch, data, length);
+        memcpy(target + offset, data, length);
+    }
+    ips_finish(patch, offset_size);
+    return hunk_count;
+}
+
+// RLE runs of 4 - 64 KB, back to back over the whole image, with a short
+// record after every few, like a hack that blanks out most of the original.
+static size_t make_ips_rle_runs(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                              uint8_t* target) {
+    size_t offset_size = ips_begin(patch, size);
+    size_t offset = 0;
+    size_t hunk_count = 0;
+
+    memcpy(target, source, size);
+    while (offset < size) {
+        offset = ips_offset(offset_size, offset);
+        size_t length = rng_range(rng, 4096, 65535);
+        if (length > size - offset) {
+            length = size - offset;
+        }
+        if (length == 0) {
+            break;
+        }
+        uint8_t value = rng_next(rng);
+        bench_writer_put_be(patch, offset, offset_size);
+        bench_writer_put_be(patch, 0, 2);
+        bench_writer_put_be(patch, length, 2);
+        bench_writer_put_byte(patch, value);
+        memset(target + offset, value, length);
+        offset += length;
+        hunk_count++;
+
+        if (rng_next(rng) % 4 == 0 && offset + 4 <= size) {
+            uint32_t record_offset = ips_offset(offset_size, offset - 2);
+            uint8_t data[4];
+            rng_fill(rng, data, sizeof(data));
+            bench_writer_put_be(patch, record_offset, offset_size);
+            bench_writer_put_be(patch, sizeof(data), 2);
+            bench_writer_put(patch, data, sizeof(data));
+            memcpy(target + record_offset, data, sizeof(data));
+            hunk_count++;
+        }
+    }
+    ips_finish(patch, offset_size);
+    return hunk_count;
+}
+
+static void bps_begin(bench_writer* patch, size_t size) {
+    bench_writer_put(patch, BPS_MARKER, BPS_MARKER_SIZE);
+    bench_writer_put_varint(patch, size);
+    bench_writer_put_varint(patch, size);
+    bench_writer_put_varint(patch, 0);
+}
+
+static void bps_finish(bench_writer* patch, const uint8_t* source, const uint8_t* target, size_t size) {
+    bench_writer_put_le32(patch, crc32_update(0, source, size));
+    bench_writer_put_le32(patch, crc32_update(0, target, size));
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+}
+
+static void bps_target_read(bench_rng* rng, bench_writer* patch, uint8_t* target, uint64_t offset, uint64_t length) {
+    bench_writer_put_varint(patch, ((length - 1) << 2) | 1);
+    rng_fill(rng, target + offset, length);
+    bench_writer_put(patch, target + offset, length);
+}
+
+// Mostly TargetCopy: short overlapping copies just behind the output, like
+// BPS's run length encoding, and longer ones from further back, seeded by
+// the odd TargetRead.
+static size_t make_bps_target_copy(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                                 uint8_t* target) {
+    uint64_t output_offset = 0;
+    uint64_t target_relative_offset = 0;
+    size_t command_count = 0;
+
+    bps_begin(patch, size);
+    while (output_offset < size) {
+        uint64_t length = rng_range(rng, 1, 4096);
+        if (length > size - output_offset) {
+            length = size - output_offset;
+        }
+
+        uint64_t kind = rng_next(rng) % 16;
+        if (output_offset < 64 || kind == 0) {
+            bps_target_read(rng, patch, target, output_offset, length);
+        } else {
+            uint64_t distance = kind < 8 ? rng_range(rng, 1, 16) : rng_range(rng, 1, output_offset);
+            uint64_t src = output_offset - distance;
+            bench_writer_put_varint(patch, ((length - 1) << 2) | 3);
+            bench_writer_put_relative(patch, &target_relative_offset, src);
+            // Byte by byte, since short copies overlap their own output.
+            for (uint64_t i = 0; i < length; i++) {
+                target[output_offset + i] = target[src + i];
+            }
+            target_relative_offset += length;
+        }
+        output_offset += length;
+        command_count++;
+    }
+    bps_finish(patch, source, target, size);
+    return command_count;
+}
+
+// Mostly SourceCopy of 16 bytes - 4 KB from anywhere in the source, with short
+// TargetReads in between, like a patch that rearranges the original's data.
+static size_t make_bps_source_scatter(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                                    uint8_t* target) {
+    uint64_t output_offset = 0;
+    uint64_t source_relative_offset = 0;
+    size_t command_count = 0;
+
+    bps_begin(patch, size);
+    while (output_offset < size) {
+        if (rng_next(rng) % 8 == 0) {
+            uint64_t length = rng_range(rng, 1, 64);
+            if (length > size - output_offset) {
+                length = size - output_offset;
+            }
+            bps_target_read(rng, patch, target, output_offset, length);
+            output_offset += length;
+            command_count++;
+            continue;
+        }
+
+        uint64_t length = rng_range(rng, 16, 4096);
+        if (length > size - output_offset) {
+            length = size - output_offset;
+        }
+        uint64_t src = rng_range(rng, 0, size - length);
+        bench_writer_put_varint(patch, ((length - 1) << 2) | 2);
+        bench_writer_put_relative(patch, &source_relative_offset, src);
+        memcpy(target + output_offset, source + src, length);
+        source_relative_offset += length;
+        output_offset += length;
+        command_count++;
+    }
+    bps_finish(patch, source, target, size);
+    return command_count;
+}
+
+// The same kinds of edit as the IPS workloads, as UPS patches, so the UPS
+// engine can be compared with the IPS one. The IPS patch is only used to build
+// the target.
+static size_t make_ups_tiny_hunks(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                                  uint8_t* target) {
+    bench_writer ips_patch = { 0 };
+    make_ips_tiny_hunks(rng, source, size, &ips_patch, target);
+    free(ips_patch.data);
+    return bench_write_ups_patch(patch, source, size, target, size);
+}
+
+static size_t make_ups_rle_runs(bench_rng* rng, const uint8_t* source, size_t size, bench_writer* patch,
+                                uint8_t* target) {
+    bench_writer ips_patch = { 0 };
+    make_ips_rle_runs(rng, source, size, &ips_patch, target);
+    free(ips_patch.data);
+    return bench_write_ups_patch(patch, source, size, target, size);
+}
+
+static const bench_workload WORKLOADS[] = {
+    { "ips-tiny-hunks", make_ips_tiny_hunks },
+    { "ips-rle-runs", make_ips_rle_runs },
+    { "ups-tiny-hunks", make_ups_tiny_hunks },
+    { "ups-rle-runs", make_ups_rle_runs },
+    { "bps-target-copy", make_bps_target_copy },
+    { "bps-source-scatter", make_bps_source_scatter },
+};
+
+static const bench_mode MODES[] = {
+    { "memory", APPLY_MODE_MEMORY },
+    { "stream", APPLY_MODE_STREAM },
+};
+
+// Apply the patch once, through the registry. When crc32 is set, the output
+// is hashed afterwards, outside the timing.
+static int apply_once(const rombp_apply_options* options, FILE* source, FILE* patch, double* elapsed,
+                      uint32_t* crc32, size_t size) {
+    rombp_hunk_iter_status iter_status;
+    void* ctx = NULL;
+    int rc = -1;
+
+    FILE* output = tmpfile();
+    if (output == NULL) {
+        return -1;
+    }
+    rewind(source);
+    rewind(patch);
+
+    double start = bench_now_ms();
+    const rombp_patch_format* format = patch_format_detect(patch);
+    if (format == NULL) {
+        goto done;
+    }
+    ctx = calloc(1, format->context_size);
+    if (ctx == NULL) {
+        goto done;
+    }
+    if (format->start(ctx, options, NULL, source, patch, output) != PATCH_OK) {
+        format->free(ctx);
+        goto done;
+    }
+    do {
+        iter_status = format->next(ctx, source, output);
+    } while (iter_status == HUNK_NEXT);
+    if (iter_status == HUNK_DONE && format->end(ctx, source, output) == PATCH_OK) {
+        rc = 0;
+    }
+    format->free(ctx);
+    *elapsed = bench_now_ms() - start;
+
+    if (rc == 0 && crc32 != NULL) {
+        // Streaming engines write through the descriptor, so hash what's on disk.
+        fflush(output);
+        rc = patch_crc32_file(output, size, crc32) == PATCH_OK ? 0 : -1;
+    }
+
+done:
+    free(ctx);
+    fclose(output);
+    return rc;
+}
+
+static double mean_of(const double* values, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += values[i];
+    }
+    return total / count;
+}
+
+static double stddev_of(const double* values, int count, double mean) {
+    double total = 0;
+    if (count < 2) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        total += (values[i] - mean) * (values[i] - mean);
+    }
+    return sqrt(total / (count - 1));
+}
+
+static const bench_baseline* find_baseline(const bench_baseline* baselines, int baseline_count, const char* key) {
+    for (int i = 0; i < baseline_count; i++) {
+        if (strcmp(baselines[i].key, key) == 0) {
+            return &baselines[i];
+        }
+    }
+    return NULL;
+}
+
+// Baseline files hold one "key MB/s" line per result, and # comments.
+static int read_baselines(const char* path, bench_baseline** baselines, int* baseline_count) {
+    char line[256];
+    int capacity = 0;
+
+    *baselines = NULL;
+    *baseline_count = 0;
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        rombp_log_err("Failed to open baseline file: %s, errno: %d\n", path, errno);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        bench_baseline baseline;
+        if (line[0] == '#' || sscanf(line, "%127s %lf", baseline.key, &baseline.mb_per_sec) != 2) {
+            continue;
+        }
+        if (*baseline_count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 32;
+            bench_baseline* grown = realloc(*baselines, capacity * sizeof(bench_baseline));
+            if (grown == NULL) {
+                rombp_log_err("Failed to allocate baselines\n");
+                free(*baselines);
+                *baselines = NULL;
+                *baseline_count = 0;
+                fclose(file);
+                return -1;
+            }
+            *baselines = grown;
+        }
+        (*baselines)[(*baseline_count)++] = baseline;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Returns 1 when the result is a regression against its baseline.
+static int bench_workload_mode(const bench_options* options, const char* name, size_t size, const bench_mode* mode,
+                               FILE* source, FILE* patch, size_t hunk_count, uint32_t expected_crc32,
+                               const bench_baseline* baselines, int baseline_count, FILE* baseline_output) {
+    char key[128];
+    uint32_t crc32;
+    double elapsed;
+    int regressed = 0;
+
+    rombp_apply_options apply_options = {
+        .mode = mode->mode,
+        .memory_budget = 0,
+        .thread_count = options->thread_count,
+    };
+    double* times = malloc(options->repetitions * sizeof(double));
+
+    snprintf(key, sizeof(key), "%s/%zuMB/%s/j%d", name, size / (1024 * 1024), mode->name, options->thread_count);
+    for (int i = 0; i < options->warmup + options->repetitions; i++) {
+        int check = i == 0;
+        if (apply_once(&apply_options, source, patch, &elapsed, check ? &crc32 : NULL, size) != 0) {
+            rombp_log_err("%s: failed to apply patch\n", key);
+            free(times);
+            return -1;
+        }
+        if (check && crc32 != expected_crc32) {
+            rombp_log_err("%s: output CRC32 %08x doesn't match the target's %08x\n", key, crc32, expected_crc32);
+            free(times);
+            return -1;
+        }
+        if (i >= options->warmup) {
+            times[i - options->warmup] = elapsed;
+        }
+    }
+
+    double mean = mean_of(times, options->repetitions);
+    double stddev = stddev_of(times, options->repetitions, mean);
+    double best = times[0];
+    for (int i = 1; i < options->repetitions; i++) {
+        best = times[i] < best ? times[i] : best;
+    }
+    free(times);
+    double mb_per_sec = (size / (1024.0 * 1024.0)) / (mean / 1000.0);
+
+    printf("%-40s hunks: %8zu  mean: %9.2f ms +- %5.1f%%  best: %9.2f ms  %8.1f MB/s  %11.0f hunks/s",
+           key, hunk_count, mean, mean > 0 ? stddev * 100.0 / mean : 0, best, mb_per_sec,
+           hunk_count / (mean / 1000.0));
+    const bench_baseline* baseline = find_baseline(baselines, baseline_count, key);
+    if (baseline != NULL && baseline->mb_per_sec > 0) {
+        double change = (mb_per_sec - baseline->mb_per_sec) * 100.0 / baseline->mb_per_sec;
+        regressed = change < -options->tolerance;
+        printf("  vs baseline: %+6.1f%%%s", change, regressed ? "  REGRESSION" : "");
+    }
+    printf("\n");
+    fflush(stdout);
+
+    if (baseline_output != NULL) {
+        fprintf(baseline_output, "%s %.1f\n", key, mb_per_sec);
+    }
+    return regressed;
+}
+
+static int bench_size(const bench_options* options, size_t size, const bench_baseline* baselines,
+                      int baseline_count, FILE* baseline_output, int* regression_count) {
+    bench_rng source_rng = { .state = 0x9E3779B97F4A7C15ULL ^ size };
+    int rc = 0;
+
+    uint8_t* source_data = malloc(size);
+    uint8_t* target = malloc(size);
+    if (source_data == NULL || target == NULL) {
+        rombp_log_err("Failed to allocate %zu MB images\n", size / (1024 * 1024));
+        free(source_data);
+        free(target);
+        return -1;
+    }
+    make_source(&source_rng, source_data, size);
+    FILE* source = bench_temp_file(source_data, size);
+    if (source == NULL) {
+        rombp_log_err("Failed to create benchmark files\n");
+        free(source_data);
+        free(target);
+        return -1;
+    }
+
+    for (size_t w = 0; w < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]) && rc == 0; w++) {
+        bench_writer patch_data = { 0 };
+        const bench_workload* workload = &WORKLOADS[w];
+        // Seeded apart, so filtering out workloads doesn't change the others.
+        bench_rng rng = { .state = (0xD1B54A32D192ED03ULL * (w + 1)) ^ size };
+
+        if (options->filter != NULL && strstr(workload->name, options->filter) == NULL) {
+            continue;
+        }
+        size_t hunk_count = workload->make(&rng, source_data, size, &patch_data, target);
+        uint32_t expected_crc32 = crc32_update(0, target, size);
+        FILE* patch = bench_temp_file(patch_data.data, patch_data.size);
+        free(patch_data.data);
+        if (patch == NULL) {
+            rombp_log_err("Failed to create benchmark files\n");
+            rc = -1;
+            break;
+        }
+
+        for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+            int result = bench_workload_mode(options, workload->name, size, &MODES[m], source, patch,
+                                             hunk_count, expected_crc32, baselines, baseline_count, baseline_output);
+            if (result < 0) {
+                rc = -1;
+                break;
+            }
+            *regression_count += result;
+        }
+        fclose(patch);
+    }
+
+    fclose(source);
+    free(source_data);
+    free(target);
+    return rc;
+}
+
+static int parse_sizes(bench_options* options, const char* arg) {
+    char* end;
+
+    options->size_count = 0;
+    while (*arg != '\0') {
+        unsigned long size_mb = strtoul(arg, &end, 10);
+        if (end == arg || size_mb < 1 || size_mb > MAX_SIZE_MB || options->size_count == sizeof(options->sizes) / sizeof(options->sizes[0])) {
+            return -1;
+        }
+        options->sizes[options->size_count++] = size_mb * 1024 * 1024;
+        arg = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return options->size_count > 0 ? 0 : -1;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: patch_bench [-s MB[,MB...]] [-w warmup] [-r repetitions] [-j threads]\n");
+    fprintf(stderr, "                   [-f filter] [-c baseline file] [-o baseline file] [-t tolerance %%]\n");
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    bench_baseline* baselines = NULL;
+    int baseline_count = 0;
+    FILE* baseline_output = NULL;
+    int regression_count = 0;
+    int rc = 0;
+
+    bench_options options = {
+        .sizes = { 1 * 1024 * 1024, 16 * 1024 * 1024 },
+        .size_count = 2,
+        .warmup = DEFAULT_WARMUP,
+        .repetitions = DEFAULT_REPETITIONS,
+        .thread_count = 1,
+        .tolerance = DEFAULT_TOLERANCE,
+    };
+
+    while ((opt = getopt(argc, argv, "hs:w:r:j:f:c:o:t:")) != -1) {
+        switch (opt) {
+            case 's':
+                if (parse_sizes(&options, optarg) != 0) {
+                    rombp_log_err("Sizes must be a list of 1 - %zu MB\n", MAX_SIZE_MB);
+                    return 1;
+                }
+                break;
+            case 'w':
+                options.warmup = atoi(optarg);
+                break;
+            case 'r':
+                options.repetitions = atoi(optarg);
+                break;
+            case 'j':
+                options.thread_count = atoi(optarg);
+                break;
+            case 'f':
+                options.filter = optarg;
+                break;
+            case 'c':
+                options.compare_path = optarg;
+                break;
+            case 'o':
+                options.output_path = optarg;
+                break;
+            case 't':
+                options.tolerance = atof(optarg);
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (options.warmup < 0 || options.repetitions < 1 || options.thread_count < 1) {
+        usage();
+        return 1;
+    }
+
+    if (options.compare_path != NULL && read_baselines(options.compare_path, &baselines, &baseline_count) != 0) {
+        return 1;
+    }
+    if (options.output_path != NULL) {
+        baseline_output = fopen(options.output_path, "w");
+        if (baseline_output == NULL) {
+            rombp_log_err("Failed to open baseline file: %s, errno: %d\n", options.output_path, errno);
+            free(baselines);
+            return 1;
+        }
+        fprintf(baseline_output, "# patch_bench baseline: workload/size/mode/threads MB/s\n");
+    }
+
+    for (int i = 0; i < options.size_count && rc == 0; i++) {
+        rc = bench_size(&options, options.sizes[i], baselines, baseline_count, baseline_output, &regression_count);
+    }
+
+    if (baseline_output != NULL && fclose(baseline_output) != 0) {
+        rombp_log_err("Failed to write baseline file: %s\n", options.output_path);
+        rc = -1;
+    }
+    if (options.compare_path != NULL) {
+        printf("%d result(s) over %.1f%% slower than %s\n", regression_count, options.tolerance,
+               options.compare_path);
+    }
+    free(baselines);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,392 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "batch.h"
+#include "log.h"
+
+typedef struct batch_worker {
+    batch* batch;
+    batch_job_fn run_job;
+} batch_worker;
+
+void batch_init(batch* batch) {
+    batch->jobs = NULL;
+    batch->job_count = 0;
+    batch->job_capacity = 0;
+    batch->sources = NULL;
+    batch->source_count = 0;
+    batch->source_capacity = 0;
+    batch->next_job = 0;
+    int rc = pthread_mutex_init(&batch->lock, NULL);
+    if (rc != 0) {
+        rombp_log_err("Failed to initalize mutex: %d\n", rc);
+        exit(-1);
+    }
+}
+
+void batch_free(batch* batch) {
+    for (size_t i = 0; i < batch->job_count; i++) {
+        free(batch->jobs[i].patch_path);
+        free(batch->jobs[i].output_path);
+        free(batch->jobs[i].output_key);
+    }
+    free(batch->jobs);
+
+    for (size_t i = 0; i < batch->source_count; i++) {
+        batch_source* source = batch->sources[i];
+        if (source->loaded && source->load_err == PATCH_OK && source->refs > 0) {
+            patch_source_free(&source->source);
+        }
+        pthread_mutex_destroy(&source->lock);
+        free(source->path);
+        free(source->key);
+        free(source);
+    }
+    free(batch->sources);
+    pthread_mutex_destroy(&batch->lock);
+}
+
+// The path with its directory resolved, so different spellings of one file,
+// like out/a.gba and ./out//a.gba, give the same key. The file itself doesn't
+// have to exist yet. When the directory can't be resolved, the path is its own
+// key, and opening it fails later. Returns NULL when out of memory.
+static char* batch_path_key(const char* path) {
+    char dir_path[PATH_MAX];
+    char resolved[PATH_MAX];
+
+    // a.gba is in ".", and /a.gba in "/"
+    const char* slash = strrchr(path, '/');
+    const char* name = slash != NULL ? slash + 1 : path;
+    const char* dir = slash != NULL ? path : ".";
+    size_t dir_length = slash == NULL ? 1 : slash == path ? 1 : (size_t)(slash - path);
+    if (dir_length >= sizeof(dir_path)) {
+        return strdup(path);
+    }
+    memcpy(dir_path, dir, dir_length);
+    dir_path[dir_length] = '\0';
+    if (realpath(dir_path, resolved) == NULL) {
+        return strdup(path);
+    }
+
+    size_t resolved_length = strlen(resolved);
+    const char* separator = resolved[resolved_length - 1] == '/' ? "" : "/";
+    char* key = malloc(resolved_length + strlen(separator) + strlen(name) + 1);
+    if (key != NULL) {
+        sprintf(key, "%s%s%s", resolved, separator, name);
+    }
+    return key;
+}
+
+static batch_source* batch_find_source(batch* batch, const char* path) {
+    char* key = batch_path_key(path);
+    if (key == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < batch->source_count; i++) {
+        if (strcmp(batch->sources[i]->key, key) == 0) {
+            free(key);
+            return batch->sources[i];
+        }
+    }
+
+    if (batch->source_count == batch->source_capacity) {
+        size_t capacity = batch->source_capacity == 0 ? 8 : batch->source_capacity * 2;
+        batch_source** sources = realloc(batch->sources, capacity * sizeof(batch_source*));
+        if (sources == NULL) {
+            free(key);
+            return NULL;
+        }
+        batch->sources = sources;
+        batch->source_capacity = capacity;
+    }
+
+    batch_source* source = malloc(sizeof(batch_source));
+    if (source == NULL) {
+        free(key);
+        return NULL;
+    }
+    source->path = strdup(path);
+    source->key = key;
+    if (source->path == NULL) {
+        free(source->key);
+        free(source);
+        return NULL;
+    }
+    pthread_mutex_init(&source->lock, NULL);
+    source->loaded = 0;
+    source->load_err = PATCH_OK;
+    source->refs = 0;
+    batch->sources[batch->source_count++] = source;
+    return source;
+}
+
+static int batch_add_job(batch* batch, const char* source_path, const char* patch_path, char* output_path) {
+    char* output_key = output_path != NULL ? batch_path_key(output_path) : NULL;
+    batch_source* source = output_key != NULL ? batch_find_source(batch, source_path) : NULL;
+    if (source == NULL) {
+        rombp_log_err("Failed to allocate batch job\n");
+        free(output_path);
+        free(output_key);
+        return -1;
+    }
+
+    // Two workers writing one output at once would corrupt it, with both
+    // jobs reporting success. Sources are only loaded once a job needs them,
+    // so one job's output can't be another's source either.
+    for (size_t i = 0; i < batch->job_count; i++) {
+        const batch_job* other = &batch->jobs[i];
+        if (strcmp(other->output_key, output_key) == 0) {
+            rombp_log_err("Batch patches %s and %s would both write: %s\n",
+                          other->patch_path, patch_path, output_path);
+        } else if (strcmp(other->output_key, source->key) == 0) {
+            rombp_log_err("Batch patch %s would read %s while patch %s writes it\n",
+                          patch_path, source_path, other->patch_path);
+        } else {
+            continue;
+        }
+        free(output_path);
+        free(output_key);
+        return -1;
+    }
+    for (size_t i = 0; i < batch->source_count; i++) {
+        if (strcmp(batch->sources[i]->key, output_key) == 0) {
+            rombp_log_err("Batch patch %s would overwrite source ROM: %s\n", patch_path, output_path);
+            free(output_path);
+            free(output_key);
+            return -1;
+        }
+    }
+
+    if (batch->job_count == batch->job_capacity) {
+        size_t capacity = batch->job_capacity == 0 ? 16 : batch->job_capacity * 2;
+        batch_job* jobs = realloc(batch->jobs, capacity * sizeof(batch_job));
+        if (jobs == NULL) {
+            rombp_log_err("Failed to allocate batch jobs\n");
+            free(output_path);
+            free(output_key);
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->job_capacity = capacity;
+    }
+
+    batch_job* job = &batch->jobs[batch->job_count];
+    job->source = source;
+    job->patch_path = strdup(patch_path);
+    job->output_path = output_path;
+    job->output_key = output_key;
+    if (job->patch_path == NULL) {
+        rombp_log_err("Failed to allocate batch job\n");
+        free(job->output_path);
+        free(job->output_key);
+        return -1;
+    }
+    job->memory_budget = 0;
+    job->err = PATCH_OK;
+    job->hunk_count = 0;
+    job->source->refs++;
+    batch->job_count++;
+    return 0;
+}
+
+int batch_read_manifest(batch* batch, const char* manifest_path) {
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    int line_number = 0;
+    int rc = 0;
+
+    FILE* manifest = fopen(manifest_path, "r");
+    if (manifest == NULL) {
+        rombp_log_err("Failed to open batch manifest: %s, errno: %d\n", manifest_path, errno);
+        return -1;
+    }
+
+    while ((line_length = getline(&line, &line_capacity, manifest)) != -1) {
+        line_number++;
+        while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+            line[--line_length] = '\0';
+        }
+        if (line_length == 0 || line[0] == '#') {
+            continue;
+        }
+
+        char* source_path = line;
+        char* patch_path = strchr(source_path, '\t');
+        char* output_path = patch_path != NULL ? strchr(patch_path + 1, '\t') : NULL;
+        if (output_path == NULL) {
+            rombp_log_err("%s:%d: expected source<TAB>patch<TAB>output\n", manifest_path, line_number);
+            rc = -1;
+            break;
+        }
+        *patch_path++ = '\0';
+        *output_path++ = '\0';
+
+        rc = batch_add_job(batch, source_path, patch_path, strdup(output_path));
+        if (rc != 0) {
+            break;
+        }
+    }
+
+    free(line);
+    fclose(manifest);
+    return rc;
+}
+
+static int is_patch_file(const struct dirent* entry) {
+    const char* ext = strrchr(entry->d_name, '.');
+    return ext != NULL && (strcasecmp(ext, ".ips") == 0 || strcasecmp(ext, ".bps") == 0 ||
+                           strcasecmp(ext, ".ups") == 0 || strcasecmp(ext, ".xdelta") == 0 ||
+                           strcasecmp(ext, ".vcdiff") == 0);
+}
+
+int batch_read_directory(batch* batch, const char* patch_dir, const char* source_path, const char* output_dir) {
+    struct dirent** namelist;
+    int rc = 0;
+
+    // Outputs keep the source ROM's extension, if it has one
+    const char* source_name = strrchr(source_path, '/');
+    source_name = source_name != NULL ? source_name + 1 : source_path;
+    const char* source_ext = strrchr(source_name, '.');
+    if (source_ext == NULL || source_ext == source_name) {
+        source_ext = "";
+    }
+
+    int n = scandir(patch_dir, &namelist, is_patch_file, alphasort);
+    if (n == -1) {
+        rombp_log_err("Failed to scan batch directory: %s, errno: %d\n", patch_dir, errno);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char* name = namelist[i]->d_name;
+        if (rc == 0) {
+            int stem_length = strrchr(name, '.') - name;
+            size_t patch_path_size = strlen(patch_dir) + strlen(name) + 2;
+            size_t output_path_size = strlen(output_dir) + stem_length + strlen(source_ext) + 2;
+            char* patch_path = malloc(patch_path_size);
+            char* output_path = malloc(output_path_size);
+
+            if (patch_path != NULL && output_path != NULL) {
+                snprintf(patch_path, patch_path_size, "%s/%s", patch_dir, name);
+                snprintf(output_path, output_path_size, "%s/%.*s%s", output_dir, stem_length, name, source_ext);
+                rc = batch_add_job(batch, source_path, patch_path, output_path);
+            } else {
+                rombp_log_err("Failed to allocate batch job paths\n");
+                free(output_path);
+                rc = -1;
+            }
+            free(patch_path);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    return rc;
+}
+
+// Load the job's source the first time any job asks for it. Other workers
+// that need the same source wait on its lock rather than reading it again.
+static const patch_source* batch_acquire_source(batch_source* source, rombp_patch_err* err) {
+    pthread_mutex_lock(&source->lock);
+    if (!source->loaded) {
+        rombp_log_info("Loading batch source: %s\n", source->path);
+        source->load_err = patch_source_load(&source->source, source->path);
+        source->loaded = 1;
+    }
+    *err = source->load_err;
+    pthread_mutex_unlock(&source->lock);
+
+    return *err == PATCH_OK ? &source->source : NULL;
+}
+
+// Drop a job's reference to its source, freeing it when no jobs are left.
+static void batch_release_source(batch_source* source) {
+    pthread_mutex_lock(&source->lock);
+    source->refs--;
+    if (source->refs == 0 && source->loaded && source->load_err == PATCH_OK) {
+        patch_source_free(&source->source);
+    }
+    pthread_mutex_unlock(&source->lock);
+}
+
+static batch_job* batch_next_job(batch* batch) {
+    batch_job* job = NULL;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->next_job < batch->job_count) {
+        job = &batch->jobs[batch->next_job++];
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    return job;
+}
+
+static void* batch_worker_run(void* arg) {
+    batch_worker* worker = (batch_worker*)arg;
+    batch_job* job;
+    rombp_patch_err err;
+
+    while ((job = batch_next_job(worker->batch)) != NULL) {
+        const patch_source* source = batch_acquire_source(job->source, &err);
+        if (source != NULL) {
+            worker->run_job(job, source);
+        } else {
+            job->err = err;
+        }
+        batch_release_source(job->source);
+    }
+
+    return NULL;
+}
+
+size_t batch_run(batch* batch, int worker_count, size_t memory_budget, batch_job_fn run_job) {
+    batch_worker worker = { batch, run_job };
+    size_t failed = 0;
+
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    if ((size_t)worker_count > batch->job_count) {
+        worker_count = batch->job_count;
+    }
+    size_t job_budget = worker_count > 0 ? memory_budget / worker_count : memory_budget;
+    if (memory_budget > 0 && job_budget == 0) {
+        job_budget = 1;
+    }
+    for (size_t i = 0; i < batch->job_count; i++) {
+        batch->jobs[i].memory_budget = job_budget;
+    }
+
+    pthread_t* threads = malloc(worker_count * sizeof(pthread_t));
+    int started = 0;
+    if (threads != NULL) {
+        for (; started < worker_count; started++) {
+            int rc = pthread_create(&threads[started], NULL, &batch_worker_run, &worker);
+            if (rc != 0) {
+                rombp_log_err("Failed to create batch worker thread: %d\n", rc);
+                break;
+            }
+        }
+    }
+    // Without any workers, run the jobs on the calling thread.
+    if (started == 0) {
+        batch_worker_run(&worker);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (size_t i = 0; i < batch->job_count; i++) {
+        if (batch->jobs[i].err != PATCH_OK) {
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,72 @@
+#ifndef ROMBP_BATCH_H_
+#define ROMBP_BATCH_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "patch.h"
+
+// A source ROM shared by one or more batch jobs. Loaded the first time a job
+// needs it, and freed once the last job using it is done.
+typedef struct batch_source {
+    char* path;
+    // path, with its directory resolved, to tell whether two paths are one file
+    char* key;
+    pthread_mutex_t lock;
+    int loaded;
+    rombp_patch_err load_err;
+    // Jobs still waiting to use this source
+    size_t refs;
+    patch_source source;
+} batch_source;
+
+typedef struct batch_job {
+    char* patch_path;
+    char* output_path;
+    char* output_key;
+    batch_source* source;
+    // Most memory, in bytes, the job's engine should buffer. 0 for no limit.
+    size_t memory_budget;
+    rombp_patch_err err;
+    int hunk_count;
+} batch_job;
+
+typedef struct batch {
+    batch_job* jobs;
+    size_t job_count;
+    size_t job_capacity;
+
+    batch_source** sources;
+    size_t source_count;
+    size_t source_capacity;
+
+    pthread_mutex_t lock;
+    size_t next_job;
+} batch;
+
+// Runs a single job against its (already loaded) source, and fills in
+// job->err and job->hunk_count.
+typedef void (*batch_job_fn)(batch_job* job, const patch_source* source);
+
+void batch_init(batch* batch);
+void batch_free(batch* batch);
+
+// Add every job in a manifest file. Each line is: source<TAB>patch<TAB>output.
+// Blank lines, and lines starting with '#' are skipped. Fails if two jobs
+// would write the same output, or a job would write another job's source.
+// Paths are compared with their directories resolved, so out/a.gba and
+// ./out//a.gba are the same output.
+int batch_read_manifest(batch* batch, const char* manifest_path);
+
+// Add a job for every IPS, BPS, UPS and VCDIFF (.xdelta / .vcdiff) file in
+// patch_dir, applied to source_path. Outputs are written to output_dir, named
+// after the patch file with the source file's extension. Fails if two patches
+// share a name, like hack.ips and hack.bps, since they'd write the same output.
+int batch_read_directory(batch* batch, const char* patch_dir, const char* source_path, const char* output_dir);
+
+// Run every job on a pool of worker_count threads. The workers share
+// memory_budget, so each job gets its share of it (0 for no limit). Returns
+// the number of jobs that failed.
+size_t batch_run(batch* batch, int worker_count, size_t memory_budget, batch_job_fn run_job);
+
+#endif
@@ -1,119 +1,512 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include "bps.h"
+#include "crc32.h"
 #include "log.h"
+#include "stats.h"
 
-static const uint8_t BPS_EXPECTED_MARKER[] = {
+const uint8_t BPS_MARKER[BPS_MARKER_SIZE] = {
     0x42, 0x50, 0x53, 0x31 // BPS1
 };
-static const size_t BPS_MARKER_SIZE = sizeof(BPS_EXPECTED_MARKER) / sizeof(uint8_t);
 
 static const size_t FOOTER_LENGTH = 12;
-static const size_t FOOTER_ITEMS = 12 / sizeof(uint32_t);
+static const size_t PATCH_CRC32_LENGTH = 4;
 static const size_t BUF_SIZE = 32768;
+// Memory budget for the streaming caches, when the caller doesn't set one.
+static const size_t STREAM_DEFAULT_BUDGET = 8 * 1024 * 1024;
+// Smallest output window or source cache, however tight the budget.
+static const size_t STREAM_MIN_CACHE_SIZE = 64 * 1024;
+// Patches are applied on several threads once the target is at least this big,
+// and a level of commands only once it has this many bytes to write.
+static const uint64_t PARALLEL_MIN_TARGET_SIZE = 4 * 1024 * 1024;
+static const uint64_t PARALLEL_MIN_LEVEL_SIZE = 1024 * 1024;
+// While applying in parallel, the calling thread reports progress each time it
+// has applied this many more bytes.
+static const uint64_t PARALLEL_PROGRESS_INTERVAL = 1024 * 1024;
+// How many earlier commands a TargetCopy's dependencies are looked up in, before
+// it's just ordered after all of them.
+static const size_t PARALLEL_MAX_DEPENDENCY_WALK = 64;
+#define BPS_MAX_APPLY_THREADS 64
 
-typedef enum bps_command_type {
-    BPS_SOURCE_READ = 0,
-    BPS_TARGET_READ = 1,
-    BPS_SOURCE_COPY = 2,
-    BPS_TARGET_COPY = 3,
-} bps_command_type;
+// Most bytes the CRC pipeline thread hashes before letting the writer know.
+static const size_t CRC_PIPELINE_CHUNK_SIZE = 256 * 1024;
 
-static uint32_t crc32_for_byte(uint32_t r) {
-    for(int i = 0; i < 8; ++i) {
-        r = (r & 1? 0: (uint32_t)0xEDB88320L) ^ r >> 1;
-    }
-
-    return r ^ (uint32_t)0xFF000000L;
-}
-
-static void crc32(const void *data, size_t n_bytes, uint32_t* crc) {
-    static uint32_t table[0x100];
+// How far ahead of a source read to fill the cache, when the read doesn't follow on
+// from the cached bytes. Reads that do follow on fill the whole cache.
+static const size_t STREAM_RANDOM_READ_AHEAD = 16 * 1024;
 
-    if(!*table) {
-        for(size_t i = 0; i < 0x100; ++i) {
-            table[i] = crc32_for_byte(i);
-        }
-    }
-
-    for(size_t i = 0; i < n_bytes; ++i) {
-        *crc = table[(uint8_t)*crc ^ ((uint8_t*)data)[i]] ^ *crc >> 8;
-    }
-}
+// Longest varint that still fits in 64 bits.
+static const int MAX_VARINT_LENGTH = 10;
 
-static int decode_varint(FILE* bps_file, uint64_t* out) {
+// Decode a varint straight out of the in-memory patch, at the current patch offset.
+// Varints may not run into the footer.
+static int decode_varint(bps_file_header* file_header, uint64_t* out) {
+    const uint8_t* patch = file_header->patch.data;
+    uint64_t end = file_header->patch_size - FOOTER_LENGTH;
+    uint64_t offset = file_header->patch_offset;
     uint64_t data = 0;
     uint64_t shift = 1;
 
-    for (int i = 0; i < sizeof(uint64_t); i++) {
-        uint8_t ch;
-        size_t nread = fread(&ch, 1, sizeof(uint8_t), bps_file);
-        if (nread != 1) {
-            rombp_log_err("Failed to read next byte, read: %ld, error code: %d\n", (long)nread, errno);
+    for (int i = 0; i < MAX_VARINT_LENGTH; i++) {
+        if (offset >= end) {
+            rombp_log_err("Varint runs past the end of the patch data, offset: %ld\n", (long)offset);
             return -1;
         }
+        uint8_t ch = patch[offset++];
         data += (ch & 0x7F) * shift;
         if (ch & 0x80) {
-            break;
+            file_header->patch_offset = offset;
+            *out = data;
+            return 0;
         }
         shift <<= 7;
         data += shift;
     }
 
-    *out = data;
-    return 0;
+    rombp_log_err("Varint is too long, offset: %ld\n", (long)file_header->patch_offset);
+    return -1;
 }
 
-rombp_patch_err bps_verify_marker(FILE* bps_file) {
-    return patch_verify_marker(bps_file, BPS_EXPECTED_MARKER, BPS_MARKER_SIZE);
+static inline uint32_t le_32bit_int(uint8_t* buf) {
+    return (uint32_t)buf[0] |
+        ((uint32_t)buf[1] << 8) |
+        ((uint32_t)buf[2] << 16) |
+        ((uint32_t)buf[3] << 24);
 }
 
-rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header) {
-    int rc = fseek(bps_file, 0, SEEK_END);
-    if (rc == -1) {
-        rombp_log_err("Failed to seek to the end of patch file, error: %d\n", errno);
+// Read the source, target and patch CRC32s out of the footer at the end of the patch.
+static rombp_patch_err bps_read_footer(bps_file_header* file_header) {
+    if (file_header->patch_size < BPS_MARKER_SIZE + FOOTER_LENGTH) {
+        rombp_log_err("BPS file is too small to hold a footer, size: %ld\n", (long)file_header->patch_size);
+        return PATCH_INVALID_HEADER;
+    }
+
+    uint8_t* footer = file_header->patch.data + file_header->patch_size - FOOTER_LENGTH;
+    file_header->source_crc32 = le_32bit_int(footer);
+    file_header->target_crc32 = le_32bit_int(footer + 4);
+    file_header->patch_crc32 = le_32bit_int(footer + 8);
+
+    return PATCH_OK;
+}
+
+typedef struct bps_crc32_job {
+    // Either hash length bytes of file, or length bytes of data when it's set.
+    FILE* file;
+    const uint8_t* data;
+    uint64_t length;
+    uint32_t crc32;
+    rombp_patch_err err;
+} bps_crc32_job;
+
+static void* bps_crc32_job_run(void* arg) {
+    bps_crc32_job* job = (bps_crc32_job*)arg;
+    if (job->data != NULL) {
+        job->crc32 = crc32_update(0, job->data, job->length);
+        job->err = PATCH_OK;
+    } else {
+        job->err = patch_crc32_file(job->file, job->length, &job->crc32);
+    }
+    return NULL;
+}
+
+// Check the source file and patch file against the footer CRC32s before applying
+// anything, so a patch run against the wrong ROM fails fast. The patch is hashed
+// on a separate thread while the source is hashed on this one.
+static rombp_patch_err bps_verify_checksums(bps_file_header* file_header, FILE* input_file) {
+    struct stat input_file_stat;
+    pthread_t patch_thread;
+    uint64_t input_size;
+
+    if (file_header->source != NULL) {
+        input_size = file_header->source->data.size;
+    } else {
+        int rc = fstat(fileno(input_file), &input_file_stat);
+        if (rc == -1) {
+            rombp_log_err("Failed to stat input file, errno: %d\n", errno);
+            return PATCH_ERR_IO;
+        }
+        input_size = input_file_stat.st_size;
+    }
+    if (input_size != file_header->source_size) {
+        rombp_log_err("Input file size does not match the BPS source size. Expected: %ld, got: %ld\n",
+                      (long)file_header->source_size, (long)input_size);
+        return PATCH_INVALID_INPUT_SIZE;
+    }
+
+    bps_crc32_job patch_job = {
+        .data = file_header->patch.data,
+        .length = file_header->patch_size - PATCH_CRC32_LENGTH,
+    };
+    bps_crc32_job source_job = {
+        .file = input_file,
+        .length = file_header->source_size,
+    };
+
+    // A shared source already knows its CRC32
+    if (file_header->source != NULL) {
+        source_job.crc32 = file_header->source->crc32;
+        source_job.err = PATCH_OK;
+        bps_crc32_job_run(&patch_job);
+    } else {
+        int threaded = pthread_create(&patch_thread, NULL, &bps_crc32_job_run, &patch_job) == 0;
+        if (!threaded) {
+            bps_crc32_job_run(&patch_job);
+        }
+        bps_crc32_job_run(&source_job);
+        if (threaded) {
+            pthread_join(patch_thread, NULL);
+        }
+    }
+
+    if (patch_job.err != PATCH_OK || source_job.err != PATCH_OK) {
+        rombp_log_err("Failed to compute BPS input checksums\n");
         return PATCH_ERR_IO;
     }
-    file_header->patch_size = ftell(bps_file);
-    if (file_header->patch_size == -1) {
-        rombp_log_err("Failed to get end of bps patch file length, error: %d\n", errno);
+    if (patch_job.crc32 != file_header->patch_crc32) {
+        rombp_log_err("Patch file CRC32 does not match! Expected: %u, got: %u\n",
+                      file_header->patch_crc32, patch_job.crc32);
+        return PATCH_INVALID_INPUT_CHECKSUM;
+    }
+    if (source_job.crc32 != file_header->source_crc32) {
+        rombp_log_err("Input file CRC32 does not match! Expected: %u, got: %u\n",
+                      file_header->source_crc32, source_job.crc32);
+        return PATCH_INVALID_INPUT_CHECKSUM;
+    }
+
+    rombp_log_info("Input file and patch file CRC32s are correct\n");
+    return PATCH_OK;
+}
+
+// Map the input file read-only, and the output file read-write at the target size,
+// so every command is a bounded memcpy between mappings. The output's blocks are
+// allocated up front, so running out of disk space fails here rather than with a
+// SIGBUS halfway through patching.
+static rombp_patch_err bps_map_files(bps_file_header* file_header, FILE* input_file, FILE* output_file) {
+    void* input = NULL;
+
+    if (output_file == NULL || file_header->target_size == 0 || file_header->target_size > SIZE_MAX) {
+        return PATCH_ERR_IO;
+    }
+    if (file_header->source == NULL) {
+        if (input_file == NULL || file_header->source_size > SIZE_MAX) {
+            return PATCH_ERR_IO;
+        }
+        if (file_header->source_size > 0) {
+            input = mmap(NULL, file_header->source_size, PROT_READ, MAP_PRIVATE, fileno(input_file), 0);
+            if (input == MAP_FAILED) {
+                rombp_log_debug("Can't map BPS input file, errno: %d\n", errno);
+                return PATCH_ERR_IO;
+            }
+        }
+    }
+
+    int outfd = fileno(output_file);
+    int rc = ftruncate(outfd, file_header->target_size) == 0 ? 0 : errno;
+    void* output = MAP_FAILED;
+    if (rc == 0) {
+        output = mmap(NULL, file_header->target_size, PROT_READ | PROT_WRITE, MAP_SHARED, outfd, 0);
+        rc = output == MAP_FAILED ? errno : 0;
+    }
+    if (rc != 0) {
+        rombp_log_debug("Can't map BPS output file, errno: %d\n", rc);
+        if (input != NULL) {
+            munmap(input, file_header->source_size);
+        }
         return PATCH_ERR_IO;
     }
-    // Reset back to after the marker
-    rc = fseek(bps_file, BPS_MARKER_SIZE, SEEK_SET);
+
+    if (file_header->source == NULL) {
+        file_header->mapped_source.data.data = input;
+        file_header->mapped_source.data.size = file_header->source_size;
+        file_header->source = &file_header->mapped_source;
+    }
+    file_header->target.data = output;
+    file_header->target.size = file_header->target_size;
+    file_header->in_memory = 1;
+    file_header->mapped = 1;
+
+    rombp_log_debug("Mapped BPS input and output files\n");
+    return PATCH_OK;
+}
+
+// Hashes streamed output on its own thread, following the writer through the output
+// window, so the writer never waits on the CRC unless the window is full of bytes
+// still to be hashed. produced and hashed count bytes of output, and wrap around:
+// only how far apart they are matters, and that's never more than the window size.
+typedef struct bps_crc_pipeline {
+    const uint8_t* window;
+    size_t window_size;
+    atomic_size_t produced;
+    atomic_size_t hashed;
+    atomic_int stopping;
+    // Threads sleeping on cond, until the other one moves its counter on. One can
+    // still be on its way out of the wait while the other starts waiting.
+    atomic_int waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    uint32_t crc32;
+} bps_crc_pipeline;
+
+// Sleep until counter moves on from seen, or the pipeline is stopping.
+static void bps_crc_pipeline_wait(bps_crc_pipeline* pipeline, atomic_size_t* counter, size_t seen) {
+    pthread_mutex_lock(&pipeline->lock);
+    atomic_fetch_add(&pipeline->waiting, 1);
+    while (atomic_load(counter) == seen && !atomic_load(&pipeline->stopping)) {
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    atomic_fetch_sub(&pipeline->waiting, 1);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Call after moving a counter on. Only takes the lock if a thread sleeps.
+static void bps_crc_pipeline_wake(bps_crc_pipeline* pipeline) {
+    if (atomic_load(&pipeline->waiting)) {
+        pthread_mutex_lock(&pipeline->lock);
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+}
+
+static void* bps_crc_pipeline_run(void* arg) {
+    bps_crc_pipeline* pipeline = (bps_crc_pipeline*)arg;
+    size_t hashed = 0;
+    size_t pos = 0;
+
+    while (1) {
+        size_t produced = atomic_load(&pipeline->produced);
+        if (produced == hashed) {
+            if (atomic_load(&pipeline->stopping)) {
+                return NULL;
+            }
+            bps_crc_pipeline_wait(pipeline, &pipeline->produced, hashed);
+            continue;
+        }
+
+        size_t amount_to_hash = MIN(produced - hashed, pipeline->window_size - pos);
+        amount_to_hash = MIN(amount_to_hash, CRC_PIPELINE_CHUNK_SIZE);
+        pipeline->crc32 = crc32_update(pipeline->crc32, pipeline->window + pos, amount_to_hash);
+        pos = (pos + amount_to_hash) % pipeline->window_size;
+        hashed += amount_to_hash;
+        atomic_store(&pipeline->hashed, hashed);
+        bps_crc_pipeline_wake(pipeline);
+    }
+}
+
+static bps_crc_pipeline* bps_crc_pipeline_start(const uint8_t* window, size_t window_size) {
+    bps_crc_pipeline* pipeline = malloc(sizeof(bps_crc_pipeline));
+    if (pipeline == NULL) {
+        return NULL;
+    }
+    pipeline->window = window;
+    pipeline->window_size = window_size;
+    atomic_init(&pipeline->produced, 0);
+    atomic_init(&pipeline->hashed, 0);
+    atomic_init(&pipeline->stopping, 0);
+    atomic_init(&pipeline->waiting, 0);
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    pipeline->crc32 = 0;
+
+    if (pthread_create(&pipeline->thread, NULL, &bps_crc_pipeline_run, pipeline) != 0) {
+        pthread_cond_destroy(&pipeline->cond);
+        pthread_mutex_destroy(&pipeline->lock);
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+// How many of the length bytes about to be written at the end of the output can go
+// into the window, without overwriting bytes that aren't hashed yet. Waits for at
+// least one.
+static size_t bps_crc_pipeline_reserve(bps_crc_pipeline* pipeline, size_t length) {
+    size_t produced = atomic_load(&pipeline->produced);
+    while (1) {
+        size_t hashed = atomic_load(&pipeline->hashed);
+        size_t available = pipeline->window_size - (produced - hashed);
+        if (available > 0) {
+            return MIN(length, available);
+        }
+        bps_crc_pipeline_wait(pipeline, &pipeline->hashed, hashed);
+    }
+}
+
+static void bps_crc_pipeline_publish(bps_crc_pipeline* pipeline, size_t length) {
+    atomic_fetch_add(&pipeline->produced, length);
+    bps_crc_pipeline_wake(pipeline);
+}
+
+// Hash whatever is left, stop the pipeline thread, and return the CRC32 of all of
+// the output.
+static uint32_t bps_crc_pipeline_stop(bps_crc_pipeline* pipeline) {
+    atomic_store(&pipeline->stopping, 1);
+    bps_crc_pipeline_wake(pipeline);
+    pthread_join(pipeline->thread, NULL);
+
+    uint32_t crc32 = pipeline->crc32;
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline);
+    return crc32;
+}
+
+rombp_patch_err bps_start(FILE* bps_file, FILE* input_file, FILE* output_file, const patch_source* source,
+                          const rombp_apply_options* options, bps_file_header* file_header) {
+    rombp_apply_mode mode = options->mode;
+    size_t memory_budget = options->memory_budget;
+
+    file_header->source = source;
+    patch_buffer_init(&file_header->patch);
+    patch_buffer_init(&file_header->target);
+    patch_buffer_init(&file_header->mapped_source.data);
+    file_header->in_memory = 0;
+    file_header->mapped = 0;
+    file_header->input_fd = input_file != NULL ? fileno(input_file) : -1;
+    file_header->output_fd = output_file != NULL ? fileno(output_file) : -1;
+    file_header->window = NULL;
+    file_header->window_size = 0;
+    file_header->flushed_offset = 0;
+    file_header->source_cache = NULL;
+    file_header->source_cache_size = 0;
+    file_header->source_cache_offset = 0;
+    file_header->source_cache_length = 0;
+    file_header->ops = NULL;
+    file_header->op_count = 0;
+    file_header->next_op = 0;
+    atomic_init(&file_header->applied_bytes, 0);
+    file_header->on_progress = options->on_progress;
+    file_header->progress_arg = options->progress_arg;
+    file_header->thread_count = 1;
+    file_header->crc_thread_count = MIN(MAX(options->thread_count, 1), BPS_MAX_APPLY_THREADS);
+    file_header->crc_pipeline = NULL;
+    file_header->stats = options->stats;
+
+    // Pull the whole patch into memory, commands are decoded straight out of the buffer.
+    int rc = patch_seek(bps_file, 0);
     if (rc == -1) {
-        rombp_log_err("Failed to seek bps file back to beginning before reading metadata, error: %d\n", errno);
+        rombp_log_err("Failed to seek bps file back to beginning, error: %d\n", errno);
         return PATCH_ERR_IO;
     }
-    rc = decode_varint(bps_file, &file_header->source_size);
+    rc = patch_buffer_read_file(&file_header->patch, bps_file);
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to read BPS patch into memory\n");
+        return rc;
+    }
+    file_header->patch_size = file_header->patch.size;
+    file_header->patch_offset = BPS_MARKER_SIZE;
+
+    rc = bps_read_footer(file_header);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+    rc = decode_varint(file_header, &file_header->source_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read source size\n");
-        return PATCH_ERR_IO;
+        return PATCH_INVALID_HEADER;
     }
-    rc = decode_varint(bps_file, &file_header->target_size);
+    rc = decode_varint(file_header, &file_header->target_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read target size\n");
-        return PATCH_ERR_IO;
+        return PATCH_INVALID_HEADER;
     }
-    rc = decode_varint(bps_file, &file_header->metadata_size);
+    rc = decode_varint(file_header, &file_header->metadata_size);
     if (rc == -1) {
         rombp_log_err("BPS file: Failed to read metadata size\n");
-        return PATCH_ERR_IO;
+        return PATCH_INVALID_HEADER;
+    }
+    // Skip over metadata. Don't need it!
+    if (file_header->metadata_size > file_header->patch_size - FOOTER_LENGTH - file_header->patch_offset) {
+        rombp_log_err("BPS metadata runs past the end of the patch, metadata size: %ld\n", (long)file_header->metadata_size);
+        return PATCH_INVALID_HEADER;
     }
-    if (file_header->metadata_size > 0) {
-        // Skip over metadata. Don't need it!
-        int pos = fseek(bps_file, file_header->metadata_size, SEEK_CUR);
-        if (pos == -1) {
-            rombp_log_err("Failed to skip metadata field. Err: %d\n", errno);
+    file_header->patch_offset += file_header->metadata_size;
+
+    rombp_log_debug("BPS file header, source_size: %ld, target_size: %ld, metadata_size: %ld\n",
+                    file_header->source_size,
+                    file_header->target_size,
+                    file_header->metadata_size);
+
+    uint64_t begin = rombp_stats_begin(file_header->stats);
+    rc = bps_verify_checksums(file_header, input_file);
+    rombp_stats_add_phase(file_header->stats, STATS_PHASE_CRC,
+                      file_header->patch_size + (source != NULL ? 0 : file_header->source_size), begin);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+
+    // Patch the output file through a mapping when we can, or else build the target in
+    // memory, so TargetCopy never has to read back from the output file.
+    if (mode == APPLY_MODE_AUTO || mode == APPLY_MODE_MAP) {
+        rc = bps_map_files(file_header, input_file, output_file);
+        if (rc != PATCH_OK && mode == APPLY_MODE_MAP) {
+            rombp_log_debug("Could not map BPS files, streaming to the output file\n");
+        }
+    }
+    if (!file_header->mapped && (mode == APPLY_MODE_AUTO || mode == APPLY_MODE_MEMORY)) {
+        int fits = file_header->target_size <= SIZE_MAX &&
+            (mode == APPLY_MODE_MEMORY || memory_budget == 0 || file_header->target_size <= memory_budget);
+        rc = fits ? patch_buffer_resize(&file_header->target, file_header->target_size) : PATCH_ERR_IO;
+        if (rc == PATCH_OK) {
+            file_header->in_memory = 1;
+        } else if (mode == APPLY_MODE_MEMORY) {
+            rombp_log_err("Could not allocate %ld bytes for the BPS target\n", (long)file_header->target_size);
             return PATCH_ERR_IO;
+        } else {
+            rombp_log_debug("BPS target doesn't fit in memory, streaming to the output file\n");
+            patch_buffer_free(&file_header->target);
+        }
+    }
+
+    // Split the budget between a window over the end of the output, and a read-ahead
+    // cache over the input file. Neither needs to be bigger than the file it covers.
+    size_t budget = memory_budget > 0 ? memory_budget : STREAM_DEFAULT_BUDGET;
+    int needs_window = !file_header->in_memory;
+    int needs_source_cache = file_header->source == NULL && file_header->source_size > 0;
+    if (needs_window) {
+        size_t window_size = needs_source_cache ? budget / 2 : budget;
+        window_size = MAX(window_size, STREAM_MIN_CACHE_SIZE);
+        file_header->window_size = MAX(MIN(window_size, file_header->target_size), 1);
+        file_header->window = malloc(file_header->window_size);
+        if (file_header->window == NULL) {
+            rombp_log_err("Failed to allocate %ld byte BPS output window\n", (long)file_header->window_size);
+            return PATCH_ERR_IO;
+        }
+    }
+    if (needs_source_cache) {
+        size_t cache_size = needs_window ? budget / 2 : budget;
+        cache_size = MAX(cache_size, STREAM_MIN_CACHE_SIZE);
+        file_header->source_cache_size = MIN(cache_size, file_header->source_size);
+        file_header->source_cache = malloc(file_header->source_cache_size);
+        if (file_header->source_cache == NULL) {
+            rombp_log_err("Failed to allocate %ld byte BPS source cache\n", (long)file_header->source_cache_size);
+            return PATCH_ERR_IO;
+        }
+    }
+    if (needs_window || needs_source_cache) {
+        rombp_log_debug("BPS output window: %ld bytes, source cache: %ld bytes\n",
+                        (long)file_header->window_size, (long)file_header->source_cache_size);
+    }
+    if (needs_window && file_header->crc_thread_count > 1) {
+        file_header->crc_pipeline = bps_crc_pipeline_start(file_header->window, file_header->window_size);
+        if (file_header->crc_pipeline == NULL) {
+            rombp_log_debug("Failed to start the BPS CRC32 thread, hashing output inline\n");
         }
     }
 
-    rombp_log_info("BPS file header, source_size: %ld, target_size: %ld, metadata_size: %ld\n",
-                   file_header->source_size,
-                   file_header->target_size,
-                   file_header->metadata_size);
+    // Only a whole target in memory can be written out of order
+    if (file_header->in_memory && file_header->target_size >= PARALLEL_MIN_TARGET_SIZE) {
+        file_header->thread_count = MIN(MAX(options->thread_count, 1), BPS_MAX_APPLY_THREADS);
+    }
 
     file_header->output_offset = 0;
     file_header->source_relative_offset = 0;
@@ -123,187 +516,570 @@ rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header) {
     return PATCH_OK;
 }
 
-static rombp_hunk_iter_status bps_write_output(bps_file_header* file_header, FILE* output_file, uint8_t* buf, size_t len) {
-    size_t nwritten = fwrite(buf, sizeof(uint8_t), len, output_file);
-    if (nwritten < len && ferror(output_file)) {
-        rombp_log_err("BPS output write error: %d\n", errno);
-        return HUNK_ERR_IO;
+// Check that length more bytes of output still fit inside the target.
+static int bps_output_fits(bps_file_header* file_header, uint64_t length) {
+    if (length > file_header->target_size - file_header->output_offset) {
+        rombp_log_err("BPS command writes past the end of the target, output offset: %ld, length: %ld\n",
+                      (long)file_header->output_offset, (long)length);
+        return 0;
     }
+    return 1;
+}
 
-    crc32(buf, len, &file_header->output_crc32);
-    file_header->output_offset += len;
+// Write out every byte of the output window that isn't in the output file yet.
+static int bps_flush_window(bps_file_header* file_header) {
+    uint64_t count = file_header->output_offset - file_header->flushed_offset;
+    size_t start = file_header->flushed_offset % file_header->window_size;
+    size_t first = MIN(count, file_header->window_size - start);
 
-    return HUNK_NEXT;
+    if (patch_pwrite(file_header->output_fd, file_header->window + start, first, file_header->flushed_offset) != PATCH_OK ||
+        patch_pwrite(file_header->output_fd, file_header->window, count - first, file_header->flushed_offset + first) != PATCH_OK) {
+        rombp_log_err("Failed to write BPS output window\n");
+        return -1;
+    }
+    file_header->flushed_offset = file_header->output_offset;
+    return 0;
 }
 
-static rombp_hunk_iter_status bps_source_read(bps_file_header* file_header, uint64_t length, FILE* input_file, FILE* output_file) {
-    int pos = fseek(input_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek source file. err: %d\n", errno);
+// Append to the output. When streaming, the output goes into a ring buffer holding the
+// last window_size bytes, which is only written to the output file once it fills up.
+static rombp_hunk_iter_status bps_write_output(bps_file_header* file_header, const uint8_t* buf, size_t len) {
+    if (!bps_output_fits(file_header, len)) {
         return HUNK_ERR_IO;
     }
-
-    pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+    if (file_header->in_memory) {
+        memcpy(file_header->target.data + file_header->output_offset, buf, len);
+        if (file_header->crc_thread_count == 1) {
+            file_header->output_crc32 = crc32_update(file_header->output_crc32, buf, len);
+        }
+        file_header->output_offset += len;
+        return HUNK_NEXT;
     }
 
-    uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
-
-    while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, input_file);
-        if (nread < target_read && ferror(input_file)) {
-            rombp_log_err("Error during BPS source read, error: %d\n", errno);
+    while (len > 0) {
+        size_t window_size = file_header->window_size;
+        if (file_header->output_offset - file_header->flushed_offset == window_size &&
+            bps_flush_window(file_header) == -1) {
             return HUNK_ERR_IO;
         }
+        size_t pos = file_header->output_offset % window_size;
+        size_t amount_to_write = MIN(len, window_size - pos);
+        amount_to_write = MIN(amount_to_write, window_size - (file_header->output_offset - file_header->flushed_offset));
 
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS source read, write error\n");
-            return werror;
+        if (file_header->crc_pipeline != NULL) {
+            amount_to_write = bps_crc_pipeline_reserve(file_header->crc_pipeline, amount_to_write);
+            memcpy(file_header->window + pos, buf, amount_to_write);
+            bps_crc_pipeline_publish(file_header->crc_pipeline, amount_to_write);
+        } else {
+            memcpy(file_header->window + pos, buf, amount_to_write);
+            file_header->output_crc32 = crc32_update(file_header->output_crc32, buf, amount_to_write);
         }
-
-        remaining -= nread;
+        file_header->output_offset += amount_to_write;
+        buf += amount_to_write;
+        len -= amount_to_write;
     }
 
     return HUNK_NEXT;
 }
 
-static rombp_hunk_iter_status bps_target_read(bps_file_header* file_header, uint64_t length, FILE* output_file, FILE* bps_file) {
-    int pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
+// Read exactly length bytes of fd at offset.
+static int bps_pread(int fd, uint8_t* buf, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t nread = pread(fd, buf, length, offset);
+        if (nread <= 0) {
+            rombp_log_err("Failed to read %ld bytes at offset: %ld, errno: %d\n", (long)length, (long)offset, errno);
+            return -1;
+        }
+        buf += nread;
+        length -= nread;
+        offset += nread;
+    }
+    return 0;
+}
+
+// Write length bytes of the source, from offset, to the output. Without an in-memory
+// source, the input file is read through a read-ahead cache, refilled from the
+// first byte that misses it. Sequential reads refill all of it, random ones only
+// a little past the end of the command, so scattered SourceCopy commands don't
+// read the whole cache each.
+static rombp_hunk_iter_status bps_write_from_source(bps_file_header* file_header, uint64_t offset, uint64_t length) {
+    if (offset > file_header->source_size || length > file_header->source_size - offset) {
+        rombp_log_err("BPS command reads past the end of the source, offset: %ld, length: %ld\n",
+                      (long)offset, (long)length);
         return HUNK_ERR_IO;
     }
+    if (file_header->source != NULL) {
+        return bps_write_output(file_header, file_header->source->data.data + offset, length);
+    }
 
-    uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
-        
-    while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, bps_file);
-        if (nread < target_read && ferror(bps_file)) {
-            rombp_log_err("Error during BPS target read, read patch error: %d\n", errno);
-            return HUNK_ERR_IO;
+    while (length > 0) {
+        uint64_t cache_offset = file_header->source_cache_offset;
+        if (offset < cache_offset || offset >= cache_offset + file_header->source_cache_length) {
+            size_t amount_to_read = file_header->source_cache_size;
+            if (offset != cache_offset + file_header->source_cache_length) {
+                amount_to_read = MIN(amount_to_read, MAX(length, STREAM_RANDOM_READ_AHEAD));
+            }
+            amount_to_read = MIN(amount_to_read, file_header->source_size - offset);
+            if (bps_pread(file_header->input_fd, file_header->source_cache, amount_to_read, offset) == -1) {
+                rombp_log_err("Error during BPS source read\n");
+                return HUNK_ERR_IO;
+            }
+            file_header->source_cache_offset = cache_offset = offset;
+            file_header->source_cache_length = amount_to_read;
         }
-        
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
+
+        size_t amount_to_copy = MIN(length, cache_offset + file_header->source_cache_length - offset);
+        rombp_hunk_iter_status werror = bps_write_output(file_header, file_header->source_cache + (offset - cache_offset),
+                                                         amount_to_copy);
         if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS target read, write error\n");
             return werror;
         }
+        offset += amount_to_copy;
+        length -= amount_to_copy;
+    }
+
+    return HUNK_NEXT;
+}
+
+static rombp_hunk_iter_status bps_source_read(bps_file_header* file_header, uint64_t length) {
+    return bps_write_from_source(file_header, file_header->output_offset, length);
+}
 
-        remaining -= nread;
+static rombp_hunk_iter_status bps_target_read(bps_file_header* file_header, uint64_t length) {
+    if (length > file_header->patch_size - FOOTER_LENGTH - file_header->patch_offset) {
+        rombp_log_err("BPS target read runs past the end of the patch, length: %ld\n", (long)length);
+        return HUNK_ERR_IO;
     }
 
+    // The payload is already in memory, write it straight from the patch buffer.
+    rombp_hunk_iter_status werror = bps_write_output(file_header,
+                                                     file_header->patch.data + file_header->patch_offset,
+                                                     length);
+    if (werror != HUNK_NEXT) {
+        rombp_log_err("Error during BPS target read, write error\n");
+        return werror;
+    }
+    file_header->patch_offset += length;
+
     return HUNK_NEXT;
 }
 
-static rombp_hunk_iter_status bps_source_copy(bps_file_header* file_header, uint64_t length, FILE* input_file, FILE* output_file, FILE* bps_file) {
+static rombp_hunk_iter_status bps_source_copy(bps_file_header* file_header, uint64_t length) {
     uint64_t data;
-    int rc = decode_varint(bps_file, &data);
+    int rc = decode_varint(file_header, &data);
     if (rc == -1) {
         rombp_log_err("Failed to decode source relative offset data\n");
         return HUNK_ERR_IO;
     }
     file_header->source_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
-    rombp_log_info("Source relative offset is: %ld\n", file_header->source_relative_offset);
+    rombp_log_trace("Source relative offset is: %ld\n", file_header->source_relative_offset);
 
-    int pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
-        return HUNK_ERR_IO;
+    rombp_hunk_iter_status werror = bps_write_from_source(file_header, file_header->source_relative_offset, length);
+    file_header->source_relative_offset += length;
+    if (werror != HUNK_NEXT) {
+        rombp_log_err("Error during BPS source copy\n");
+    }
+    return werror;
+}
+
+// Forward copy length bytes within the target, from src to dest, with the same
+// result as copying one byte at a time. When the ranges overlap with src behind
+// dest, the output is the (dest - src) byte pattern at src repeated, so the pattern
+// is copied once and then doubled up with non-overlapping memcpys.
+static void bps_copy_within(uint8_t* target, uint64_t dest, uint64_t src, uint64_t length) {
+    if (src >= dest || dest - src >= length) {
+        memmove(target + dest, target + src, length);
+        return;
     }
 
-    pos = fseek(input_file, file_header->source_relative_offset, SEEK_SET);
-    if (pos == -1) {
-        rombp_log_err("Failed to seek target file. err: %d\n", errno);
+    uint64_t copied = dest - src;
+    memcpy(target + dest, target + src, copied);
+    while (copied < length) {
+        uint64_t amount_to_copy = MIN(copied, length - copied);
+        memcpy(target + dest + copied, target + dest, amount_to_copy);
+        copied += amount_to_copy;
+    }
+}
+
+static rombp_hunk_iter_status bps_target_copy_in_memory(bps_file_header* file_header, uint64_t length) {
+    uint64_t src = file_header->target_relative_offset;
+    uint64_t dest = file_header->output_offset;
+
+    if (!bps_output_fits(file_header, length)) {
+        return HUNK_ERR_IO;
+    }
+    // Like the streaming path, only output already written can be copied. The rest
+    // of the target buffer hasn't been initialized.
+    if (src >= dest) {
+        rombp_log_err("BPS target copy reads output that isn't written yet, source: %ld\n", (long)src);
         return HUNK_ERR_IO;
     }
 
-    uint64_t remaining = length;
+    bps_copy_within(file_header->target.data, dest, src, length);
+    if (file_header->crc_thread_count == 1) {
+        file_header->output_crc32 = crc32_update(file_header->output_crc32, file_header->target.data + dest, length);
+    }
+    file_header->output_offset += length;
+    file_header->target_relative_offset += length;
+
+    return HUNK_NEXT;
+}
+
+// Stream a TargetCopy through a bounce buffer. Sources inside the output window are
+// copied out of it, anything older is read back from the output file, which it has
+// already been flushed to. When the copy overlaps its own output, the bytes it
+// produces repeat the last (dest - src) bytes, so that pattern is read once and
+// doubled up to fill the buffer.
+static rombp_hunk_iter_status bps_target_copy_streaming(bps_file_header* file_header, uint64_t length) {
     uint8_t buf[BUF_SIZE];
+    size_t window_size = file_header->window_size;
 
-    while (remaining > 0) {
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, input_file);
-        if (nread < target_read && ferror(input_file)) {
-            rombp_log_err("Error during BPS source read, error: %d\n", errno);
+    if (!bps_output_fits(file_header, length)) {
+        return HUNK_ERR_IO;
+    }
+    while (length > 0) {
+        uint64_t src = file_header->target_relative_offset;
+        if (src >= file_header->output_offset) {
+            rombp_log_err("BPS target copy reads output that isn't written yet, source: %ld\n", (long)src);
             return HUNK_ERR_IO;
         }
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
+        uint64_t distance = file_header->output_offset - src;
+        size_t amount_to_copy = MIN(length, BUF_SIZE);
+
+        if (distance <= window_size) {
+            size_t amount_to_read = MIN(amount_to_copy, distance);
+            size_t pos = src % window_size;
+            size_t first = MIN(amount_to_read, window_size - pos);
+            memcpy(buf, file_header->window + pos, first);
+            memcpy(buf + first, file_header->window, amount_to_read - first);
+            while (amount_to_read < amount_to_copy) {
+                size_t amount_to_repeat = MIN(amount_to_read, amount_to_copy - amount_to_read);
+                memcpy(buf + amount_to_read, buf, amount_to_repeat);
+                amount_to_read += amount_to_repeat;
+            }
+        } else {
+            // Stop short of the window, its bytes might not be in the file yet
+            amount_to_copy = MIN(amount_to_copy, distance - window_size);
+            if (bps_pread(file_header->output_fd, buf, amount_to_copy, src) == -1) {
+                rombp_log_err("Error during BPS target copy, read error\n");
+                return HUNK_ERR_IO;
+            }
+        }
+
+        rombp_hunk_iter_status werror = bps_write_output(file_header, buf, amount_to_copy);
         if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS source copy, write error\n");
+            rombp_log_err("Error during BPS target copy, write error\n");
             return werror;
         }
-        file_header->source_relative_offset += nread;
-        remaining -= nread;
+        file_header->target_relative_offset += amount_to_copy;
+        length -= amount_to_copy;
     }
 
     return HUNK_NEXT;
 }
 
-static rombp_hunk_iter_status bps_target_copy(bps_file_header* file_header, uint64_t length, FILE* output_file, FILE* bps_file) {
+static rombp_hunk_iter_status bps_target_copy(bps_file_header* file_header, uint64_t length) {
     uint64_t data;
-    int rc = decode_varint(bps_file, &data);
+    int rc = decode_varint(file_header, &data);
     if (rc == -1) {
         rombp_log_err("Failed to decode target relative offset data\n");
         return HUNK_ERR_IO;
     }
     file_header->target_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
-    rombp_log_info("Target relative offset is: %ld\n", file_header->target_relative_offset);
+    rombp_log_trace("Target relative offset is: %ld\n", file_header->target_relative_offset);
 
-    uint64_t remaining = length;
-    uint8_t buf[BUF_SIZE];
+    if (file_header->in_memory) {
+        return bps_target_copy_in_memory(file_header, length);
+    }
+    return bps_target_copy_streaming(file_header, length);
+}
 
-    while (remaining > 0) {
-        int pos = fseek(output_file, file_header->target_relative_offset, SEEK_SET);
-        if (pos == -1) {
-            rombp_log_err("Failed to seek target file. err: %d\n", errno);
-            return HUNK_ERR_IO;
+// Decode every command up front, into ops with absolute offsets. Fails on anything
+// the sequential path would reject, so it can report the error instead. Each op gets
+// a level: SourceRead, TargetRead and SourceCopy only read the source or patch, so
+// they're level 0. A TargetCopy is one level above every op it reads the output of.
+// Ops of one level don't depend on each other.
+static int bps_scan_ops(bps_file_header* file_header) {
+    uint64_t end = file_header->patch_size - FOOTER_LENGTH;
+    uint64_t patch_offset = file_header->patch_offset;
+    uint64_t output_offset = 0;
+    uint64_t source_relative_offset = 0;
+    uint64_t target_relative_offset = 0;
+    uint32_t max_level = 0;
+    size_t capacity = 1024;
+    size_t op_count = 0;
+    uint64_t data;
+    int rc = 0;
+
+    bps_op* ops = malloc(capacity * sizeof(bps_op));
+    while (rc == 0 && ops != NULL && file_header->patch_offset < end) {
+        if (op_count == capacity) {
+            capacity *= 2;
+            bps_op* grown = realloc(ops, capacity * sizeof(bps_op));
+            if (grown == NULL) {
+                free(ops);
+                ops = NULL;
+                break;
+            }
+            ops = grown;
+        }
+        rc = decode_varint(file_header, &data);
+        bps_op* op = &ops[op_count];
+        op->output_offset = output_offset;
+        op->kind = data & 3;
+        op->length = (data >> 2) + 1;
+        op->level = 0;
+        if (rc == -1 || op->length > file_header->target_size - output_offset) {
+            rc = -1;
+            break;
         }
 
-        uint64_t target_read = MIN(BUF_SIZE, remaining);
-        size_t nread = fread(buf, sizeof(uint8_t), target_read, output_file);
-        if (nread < target_read && ferror(output_file)) {
-            rombp_log_err("Error during BPS target read, error: %d\n", errno);
-            return HUNK_ERR_IO;
+        switch (op->kind) {
+            case BPS_SOURCE_READ:
+                op->src_offset = output_offset;
+                break;
+            case BPS_TARGET_READ:
+                op->src_offset = file_header->patch_offset;
+                if (op->length > end - file_header->patch_offset) {
+                    rc = -1;
+                }
+                file_header->patch_offset += op->length;
+                break;
+            case BPS_SOURCE_COPY:
+                rc = decode_varint(file_header, &data);
+                source_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
+                op->src_offset = source_relative_offset;
+                source_relative_offset += op->length;
+                break;
+            case BPS_TARGET_COPY: {
+                rc = decode_varint(file_header, &data);
+                target_relative_offset += (data & 1 ? -1 : 1) * (data >> 1);
+                op->src_offset = target_relative_offset;
+                target_relative_offset += op->length;
+                // Reading output that isn't written yet is left to the sequential path
+                if (op->src_offset >= output_offset) {
+                    rc = -1;
+                    break;
+                }
+
+                // Find the first op that wrote any of the bytes read, then every op
+                // after it up to the end of the read, or the start of this op.
+                uint64_t read_end = MIN(op->src_offset + op->length, output_offset);
+                size_t low = 0;
+                size_t high = op_count;
+                while (high - low > 1) {
+                    size_t mid = low + (high - low) / 2;
+                    if (ops[mid].output_offset <= op->src_offset) {
+                        low = mid;
+                    } else {
+                        high = mid;
+                    }
+                }
+                size_t walked = 0;
+                for (size_t i = low; i < op_count && ops[i].output_offset < read_end; i++) {
+                    if (++walked > PARALLEL_MAX_DEPENDENCY_WALK) {
+                        op->level = max_level + 1;
+                        break;
+                    }
+                    op->level = MAX(op->level, ops[i].level + 1);
+                }
+                break;
+            }
+        }
+        if ((op->kind == BPS_SOURCE_READ || op->kind == BPS_SOURCE_COPY) &&
+            (op->src_offset > file_header->source_size || op->length > file_header->source_size - op->src_offset)) {
+            rc = -1;
         }
+        max_level = MAX(max_level, op->level);
+        output_offset += op->length;
+        op_count++;
+    }
+    file_header->patch_offset = patch_offset;
 
-        pos = fseek(output_file, file_header->output_offset, SEEK_SET);
-        if (pos == -1) {
-            rombp_log_err("Failed to seek target file. err: %d\n", errno);
-            return HUNK_ERR_IO;
+    if (rc == -1 || ops == NULL) {
+        free(ops);
+        return -1;
+    }
+    file_header->ops = ops;
+    file_header->op_count = op_count;
+    return 0;
+}
+
+static int bps_apply_op(bps_file_header* file_header, const bps_op* op) {
+    uint8_t* dest = file_header->target.data + op->output_offset;
+
+    switch (op->kind) {
+        case BPS_SOURCE_READ:
+        case BPS_SOURCE_COPY:
+            if (file_header->source != NULL) {
+                memcpy(dest, file_header->source->data.data + op->src_offset, op->length);
+                return 0;
+            }
+            return bps_pread(file_header->input_fd, dest, op->length, op->src_offset);
+        case BPS_TARGET_READ:
+            memcpy(dest, file_header->patch.data + op->src_offset, op->length);
+            return 0;
+        case BPS_TARGET_COPY:
+            bps_copy_within(file_header->target.data, op->output_offset, op->src_offset, op->length);
+            return 0;
+    }
+    return -1;
+}
+
+typedef struct bps_apply_job {
+    bps_file_header* file_header;
+    const size_t* order;
+    size_t first;
+    size_t last;
+    int err;
+    // Set on the job the calling thread runs, which reports progress.
+    int reports_progress;
+    // Apply time per command type, merged into the stats once the job's joined.
+    rombp_stats_counter commands[STATS_MAX_COMMANDS];
+} bps_apply_job;
+
+static void* bps_apply_job_run(void* arg) {
+    bps_apply_job* job = (bps_apply_job*)arg;
+    bps_file_header* file_header = job->file_header;
+    uint64_t unreported = 0;
+
+    for (size_t i = job->first; i < job->last && job->err == 0; i++) {
+        const bps_op* op = &file_header->ops[job->order[i]];
+        uint64_t begin = rombp_stats_begin(file_header->stats);
+        job->err = bps_apply_op(file_header, op);
+        if (file_header->stats != NULL) {
+            rombp_stats_counter_add(&job->commands[op->kind], op->length, begin);
         }
+        atomic_fetch_add_explicit(&file_header->applied_bytes, op->length, memory_order_relaxed);
+        unreported += op->length;
+        if (job->reports_progress && file_header->on_progress != NULL && unreported >= PARALLEL_PROGRESS_INTERVAL) {
+            file_header->on_progress(file_header->progress_arg);
+            unreported = 0;
+        }
+    }
+    return NULL;
+}
 
-        rombp_hunk_iter_status werror = bps_write_output(file_header, output_file, buf, nread);
-        if (werror != HUNK_NEXT) {
-            rombp_log_err("Error during BPS target copy, write error\n");
-            return werror;
+// Apply the ops of one level, ordered[first, last), split between threads by the
+// number of bytes they write.
+static int bps_apply_level(bps_file_header* file_header, const size_t* order, size_t first, size_t last) {
+    bps_apply_job jobs[BPS_MAX_APPLY_THREADS];
+    pthread_t threads[BPS_MAX_APPLY_THREADS];
+    int started[BPS_MAX_APPLY_THREADS];
+    uint64_t level_size = 0;
+
+    for (size_t i = first; i < last; i++) {
+        level_size += file_header->ops[order[i]].length;
+    }
+    int job_count = level_size < PARALLEL_MIN_LEVEL_SIZE ? 1 : file_header->thread_count;
+    if ((size_t)job_count > last - first) {
+        job_count = last - first;
+    }
+
+    uint64_t assigned = 0;
+    size_t next = first;
+    for (int j = 0; j < job_count; j++) {
+        uint64_t share = level_size * (j + 1) / job_count;
+        jobs[j].file_header = file_header;
+        jobs[j].order = order;
+        jobs[j].first = next;
+        while (next < last && (assigned < share || j == job_count - 1)) {
+            assigned += file_header->ops[order[next++]].length;
+        }
+        jobs[j].last = next;
+        jobs[j].err = 0;
+        jobs[j].reports_progress = j == 0;
+        memset(jobs[j].commands, 0, sizeof(jobs[j].commands));
+    }
+
+    for (int j = 1; j < job_count; j++) {
+        started[j] = pthread_create(&threads[j], NULL, &bps_apply_job_run, &jobs[j]) == 0;
+        if (!started[j]) {
+            bps_apply_job_run(&jobs[j]);
+        }
+    }
+    bps_apply_job_run(&jobs[0]);
+    int err = jobs[0].err;
+    for (int j = 1; j < job_count; j++) {
+        if (started[j]) {
+            pthread_join(threads[j], NULL);
         }
+        err |= jobs[j].err;
+    }
+    for (int j = 0; j < job_count; j++) {
+        rombp_stats_merge_commands(file_header->stats, jobs[j].commands);
+    }
+    return err;
+}
+
+// Apply every op, a level at a time.
+static int bps_apply_ops(bps_file_header* file_header) {
+    uint32_t level_count = 0;
+    for (size_t i = 0; i < file_header->op_count; i++) {
+        level_count = MAX(level_count, file_header->ops[i].level + 1);
+    }
+
+    // Counting sort the ops by level, keeping them in output order within each
+    size_t* order = malloc(file_header->op_count * sizeof(size_t));
+    size_t* level_starts = calloc(level_count + 1, sizeof(size_t));
+    if ((order == NULL && file_header->op_count > 0) || level_starts == NULL) {
+        free(order);
+        free(level_starts);
+        return -1;
+    }
+    for (size_t i = 0; i < file_header->op_count; i++) {
+        level_starts[file_header->ops[i].level + 1]++;
+    }
+    for (uint32_t level = 0; level < level_count; level++) {
+        level_starts[level + 1] += level_starts[level];
+    }
+    for (size_t i = 0; i < file_header->op_count; i++) {
+        order[level_starts[file_header->ops[i].level]++] = i;
+    }
+    for (uint32_t level = level_count; level > 0; level--) {
+        level_starts[level] = level_starts[level - 1];
+    }
+    level_starts[0] = 0;
 
-        file_header->target_relative_offset += nread;
-        remaining -= nread;
+    rombp_log_debug("Applying %ld BPS commands in %d levels, on up to %d threads\n",
+                    (long)file_header->op_count, level_count, file_header->thread_count);
+    int err = 0;
+    for (uint32_t level = 0; level < level_count && err == 0; level++) {
+        err = bps_apply_level(file_header, order, level_starts[level], level_starts[level + 1]);
     }
+    free(order);
+    free(level_starts);
+    return err != 0 ? -1 : 0;
+}
 
+// Step past the next op, already applied by bps_apply_ops.
+static rombp_hunk_iter_status bps_next_op(bps_file_header* file_header) {
+    if (file_header->next_op >= file_header->op_count) {
+        return HUNK_DONE;
+    }
+    const bps_op* op = &file_header->ops[file_header->next_op++];
+    file_header->output_offset = op->output_offset + op->length;
     return HUNK_NEXT;
 }
 
-rombp_hunk_iter_status bps_next(bps_file_header* file_header, FILE* input_file, FILE* output_file, FILE* bps_file) {
-    long pos = ftell(bps_file);
-    if (pos == -1) {
-        rombp_log_err("Failed to get current file position, error: %d\n", errno);
-        return HUNK_ERR_IO;
+rombp_hunk_iter_status bps_next(bps_file_header* file_header) {
+    // The first call applies the whole patch on several threads, when it's big enough
+    if (file_header->thread_count > 1) {
+        if (bps_scan_ops(file_header) == 0 && bps_apply_ops(file_header) == -1) {
+            rombp_log_err("Failed to apply BPS commands in parallel\n");
+            return HUNK_ERR_IO;
+        }
+        file_header->thread_count = 1;
     }
-    rombp_log_info("Position is: %ld\n", pos);
-    if (pos >= file_header->patch_size - FOOTER_LENGTH) {
+    if (file_header->ops != NULL) {
+        return bps_next_op(file_header);
+    }
+
+    if (file_header->patch_offset >= file_header->patch_size - FOOTER_LENGTH) {
         return HUNK_DONE;
     }
     uint64_t data;
-    int rc = decode_varint(bps_file, &data);
+    int rc = decode_varint(file_header, &data);
     if (rc == -1) {
         rombp_log_err("Couldn't get data for command and length\n");
         return HUNK_ERR_IO;
@@ -311,55 +1087,92 @@ rombp_hunk_iter_status bps_next(bps_file_header* file_header, FILE* input_file,
     uint64_t command = data & 3;
     uint64_t length = (data >> 2) + 1;
 
-    rombp_log_info("Command is: %ld, length is: %ld\n", command, length);
+    rombp_log_trace("Command is: %ld, length is: %ld\n", command, length);
 
+    rombp_hunk_iter_status status;
+    uint64_t begin = rombp_stats_begin(file_header->stats);
     switch (command) {
         case BPS_SOURCE_READ:
-            return bps_source_read(file_header,
-                                   length,
-                                   input_file,
-                                   output_file);
+            status = bps_source_read(file_header, length);
+            break;
         case BPS_TARGET_READ:
-            return bps_target_read(file_header,
-                                   length,
-                                   output_file,
-                                   bps_file);
+            status = bps_target_read(file_header, length);
+            break;
         case BPS_SOURCE_COPY:
-            return bps_source_copy(file_header,
-                                   length,
-                                   input_file,
-                                   output_file,
-                                   bps_file);
-        case BPS_TARGET_COPY: {
-            return bps_target_copy(file_header,
-                                   length,
-                                   output_file,
-                                   bps_file);
-        }
+            status = bps_source_copy(file_header, length);
+            break;
+        case BPS_TARGET_COPY:
+            status = bps_target_copy(file_header, length);
+            break;
         default:
             rombp_log_err("Unknown BPS command: %ld, aborting!\n", (long)command);
             return HUNK_ERR_IO;
     }
+    rombp_stats_add_command(file_header->stats, command, length, begin);
 
-    return HUNK_NEXT;
+    return status;
 }
 
-rombp_patch_err bps_end(bps_file_header* file_header, FILE* bps_file) {
-    uint32_t footer[FOOTER_ITEMS];
-
-    size_t nread = fread(&footer, sizeof(uint32_t), FOOTER_ITEMS, bps_file);
-    if (nread < FOOTER_LENGTH && ferror(bps_file)) {
-        rombp_log_err("Error reading BPS footer: %d\n", errno);
+rombp_patch_err bps_end(bps_file_header* file_header, FILE* output_file) {
+    if (!file_header->in_memory && bps_flush_window(file_header) == -1) {
         return PATCH_ERR_IO;
     }
-
-    uint32_t expected_output_crc32 = footer[1];
-    if (file_header->output_crc32 != expected_output_crc32) {
-        rombp_log_err("Footer output CRC32 and expected CRC32 do not match! Expected: %d, got: %d\n",
-                      expected_output_crc32, file_header->output_crc32);
+    // Only hashing left to do here is timed, output hashed inline is part of applying it
+    uint64_t begin = rombp_stats_begin(file_header->stats);
+    if (file_header->in_memory && file_header->crc_thread_count > 1) {
+        file_header->output_crc32 = crc32_parallel(file_header->target.data, file_header->output_offset,
+                                                   file_header->crc_thread_count);
+        rombp_stats_add_phase(file_header->stats, STATS_PHASE_CRC, file_header->output_offset, begin);
+    } else if (file_header->crc_pipeline != NULL) {
+        file_header->output_crc32 = bps_crc_pipeline_stop(file_header->crc_pipeline);
+        file_header->crc_pipeline = NULL;
+        rombp_stats_add_phase(file_header->stats, STATS_PHASE_CRC, 0, begin);
+    }
+    if (file_header->output_crc32 != file_header->target_crc32) {
+        rombp_log_err("Footer output CRC32 and expected CRC32 do not match! Expected: %u, got: %u\n",
+                      file_header->target_crc32, file_header->output_crc32);
         return PATCH_INVALID_OUTPUT_CHECKSUM;
     }
-
     rombp_log_info("Output file CRC32 is correct\n");
+
+    if (file_header->in_memory && !file_header->mapped && output_file != NULL) {
+        return patch_buffer_write_file(&file_header->target, output_file);
+    }
     return PATCH_OK;
 }
+
+rombp_patch_err bps_take_output(bps_file_header* file_header, patch_source* output) {
+    if (!file_header->in_memory || file_header->mapped) {
+        rombp_log_err("BPS target is not in memory\n");
+        return PATCH_ERR_IO;
+    }
+    // bps_end already checked this against the footer
+    output->data = file_header->target;
+    output->crc32 = file_header->output_crc32;
+    patch_buffer_init(&file_header->target);
+    return PATCH_OK;
+}
+
+void bps_free(bps_file_header* file_header) {
+    if (file_header->crc_pipeline != NULL) {
+        bps_crc_pipeline_stop(file_header->crc_pipeline);
+        file_header->crc_pipeline = NULL;
+    }
+    if (file_header->mapped) {
+        munmap(file_header->target.data, file_header->target.size);
+        patch_buffer_init(&file_header->target);
+        if (file_header->mapped_source.data.data != NULL) {
+            munmap(file_header->mapped_source.data.data, file_header->mapped_source.data.size);
+            patch_buffer_init(&file_header->mapped_source.data);
+        }
+        file_header->mapped = 0;
+    }
+    patch_buffer_free(&file_header->patch);
+    patch_buffer_free(&file_header->target);
+    free(file_header->window);
+    file_header->window = NULL;
+    free(file_header->source_cache);
+    file_header->source_cache = NULL;
+    free(file_header->ops);
+    file_header->ops = NULL;
+}
@@ -1,28 +1,114 @@
 #ifndef ROMPB_BPS_H_
 #define ROMPB_BPS_H_
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 
 #include "patch.h"
 
+// Every BPS patch starts with this marker, BPS1.
+#define BPS_MARKER_SIZE 4
+extern const uint8_t BPS_MARKER[BPS_MARKER_SIZE];
+
+// The low two bits of every BPS command.
+typedef enum bps_command_type {
+    BPS_SOURCE_READ = 0,
+    BPS_TARGET_READ = 1,
+    BPS_SOURCE_COPY = 2,
+    BPS_TARGET_COPY = 3,
+} bps_command_type;
+
+// A command, decoded with absolute offsets, so commands can be applied out of order.
+// src_offset is into the source, the patch for TargetRead, or the target for TargetCopy.
+typedef struct bps_op {
+    uint64_t output_offset;
+    uint64_t src_offset;
+    uint64_t length;
+    // Ops only depend on ops of lower levels.
+    uint32_t level;
+    uint8_t kind;
+} bps_op;
+
 typedef struct bps_file_header {
     uint64_t source_size;
     uint64_t target_size;
+    // Shared in-memory copy of the input file, if the caller has one.
+    const patch_source* source;
     uint64_t metadata_size;
 
+    // The whole patch file, and the read position of the next command in it.
+    patch_buffer patch;
     uint64_t patch_size;
+    uint64_t patch_offset;
+
+    // When set, the target is built up in memory and written out by bps_end,
+    // otherwise commands write straight to the output file.
+    int in_memory;
+    patch_buffer target;
+    // When set, the target's data is a shared mapping of the output file
+    // rather than a heap buffer, so there's nothing to write out at the end.
+    // Without a shared source, source then points at mapped_source, a
+    // read-only mapping of the input file.
+    int mapped;
+    patch_source mapped_source;
+
+    // Otherwise, the last window_size bytes of output are kept in a ring
+    // buffer, to serve TargetCopy without reading back from the output file.
+    // Everything before flushed_offset has been written to the file.
+    int output_fd;
+    uint8_t* window;
+    size_t window_size;
+    uint64_t flushed_offset;
+
+    // Without an in-memory source, the input file is read through a
+    // read-ahead cache, holding source_cache_length bytes from its offset.
+    int input_fd;
+    uint8_t* source_cache;
+    size_t source_cache_size;
+    uint64_t source_cache_offset;
+    size_t source_cache_length;
+
+    // When thread_count is over 1, the first bps_next decodes every command
+    // into ops and applies them in parallel. Later calls just step through them.
+    // applied_bytes counts what every apply thread has written so far.
+    int thread_count;
+    bps_op* ops;
+    size_t op_count;
+    size_t next_op;
+    atomic_size_t applied_bytes;
+    void (*on_progress)(void* arg);
+    void* progress_arg;
 
     uint64_t output_offset;
     uint64_t source_relative_offset;
     uint64_t target_relative_offset;
 
+    // Output is hashed as it's written, when there's one thread for it. Otherwise
+    // a target in memory is hashed once, by bps_end, on crc_thread_count threads,
+    // and streamed output is hashed on a pipeline thread, crc_pipeline.
+    int crc_thread_count;
+    struct bps_crc_pipeline* crc_pipeline;
     uint32_t output_crc32;
+
+    struct rombp_stats* stats;
+
+    // Expected CRC32s, from the patch footer.
+    uint32_t source_crc32;
+    uint32_t target_crc32;
+    uint32_t patch_crc32;
 } bps_file_header;
 
-rombp_patch_err bps_verify_marker(FILE* bps_file);
-rombp_patch_err bps_start(FILE* bps_file, bps_file_header* file_header);
-rombp_hunk_iter_status bps_next(bps_file_header* file_header, FILE* input_file, FILE* output_file, FILE* bps_file);
-rombp_patch_err bps_end(bps_file_header* file_header, FILE* bps_file);
+// When source is set, it's used in place of reading input_file.
+// Buffers stay within the options' memory budget, when it's set. Output images
+// bigger than the budget aren't built in memory.
+rombp_patch_err bps_start(FILE* bps_file, FILE* input_file, FILE* output_file, const patch_source* source,
+                          const rombp_apply_options* options, bps_file_header* file_header);
+rombp_hunk_iter_status bps_next(bps_file_header* file_header);
+rombp_patch_err bps_end(bps_file_header* file_header, FILE* output_file);
+// Move the in-memory target into output, so it can be the source of another
+// patch. Only valid after a successful bps_end, for a patch started in memory.
+rombp_patch_err bps_take_output(bps_file_header* file_header, patch_source* output);
+void bps_free(bps_file_header* file_header);
 
 #endif
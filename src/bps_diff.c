@@ -0,0 +1,517 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps.h"
+#include "bps_diff.h"
+#include "crc32.h"
+#include "log.h"
+
+// Matches are found by hashing HASH_LENGTH bytes at every STRIDE'th
+// position. Any match at least HASH_LENGTH + STRIDE - 1 bytes long covers
+// an indexed position, and gets extended backwards from there.
+#define BPS_DIFF_STRIDE 4
+static const size_t HASH_LENGTH = 8;
+
+static const int MIN_BUCKET_BITS = 10;
+static const int MAX_BUCKET_BITS = 20;
+#define BPS_DIFF_MAX_THREADS 16
+// Don't bother spinning up a thread for less than this many indexed positions
+static const size_t MIN_SLOTS_PER_THREAD = 1 << 16;
+
+// Shortest runs worth breaking a TargetRead for
+static const size_t MIN_SOURCE_READ = 4;
+static const size_t MIN_COPY = 8;
+// Stop looking for a better match once one is this long
+static const size_t GOOD_MATCH = 256;
+// Most candidates to check per hash bucket or chain
+static const int MAX_CANDIDATES = 32;
+// In a long run of unmatched bytes, search at every step'th position only. Odd
+// steps still land on every position of the stride within a few steps, and any
+// skipped start of a match is recovered by extending it backwards.
+static const size_t LITERAL_SKIP_SHIFT = 6;
+static const size_t MAX_LITERAL_STEP = 15;
+
+static const uint32_t NO_POSITION = 0xFFFFFFFF;
+
+
+static inline uint32_t bps_diff_hash(const uint8_t* data, int bits) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return (uint32_t)((value * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+// Number of positions with a full hash window, at the stride.
+static size_t bps_diff_slot_count(size_t size) {
+    return size >= HASH_LENGTH ? (size - HASH_LENGTH) / BPS_DIFF_STRIDE + 1 : 0;
+}
+
+static int bps_diff_bucket_bits(size_t slot_count) {
+    int bits = MIN_BUCKET_BITS;
+    while (bits < MAX_BUCKET_BITS && ((size_t)1 << bits) < slot_count / 4) {
+        bits++;
+    }
+    return bits;
+}
+
+// Length of the common prefix of a and b, up to max bytes.
+static size_t bps_diff_match_length(const uint8_t* a, const uint8_t* b, size_t max) {
+    size_t n = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        n += 8;
+    }
+#endif
+    while (n < max && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Length of the common suffix of a and b, ending just before them, up to max bytes.
+static size_t bps_diff_match_length_back(const uint8_t* a, const uint8_t* b, size_t max) {
+    size_t n = 0;
+    while (n < max && a[-(ptrdiff_t)n - 1] == b[-(ptrdiff_t)n - 1]) {
+        n++;
+    }
+    return n;
+}
+
+// Index building. Each thread hashes a range of source slots: first to count
+// bucket sizes, and then, once the counts are turned into offsets, to scatter
+// its positions into place. Threads own consecutive slot ranges, so positions
+// end up sorted within each bucket no matter how many threads are used.
+typedef struct bps_diff_index_job {
+    bps_diff_index* index;
+    size_t first_slot;
+    size_t last_slot;
+    uint32_t* counts;
+} bps_diff_index_job;
+
+static void* bps_diff_index_count(void* arg) {
+    bps_diff_index_job* job = (bps_diff_index_job*)arg;
+    const bps_diff_index* index = job->index;
+
+    for (size_t slot = job->first_slot; slot < job->last_slot; slot++) {
+        job->counts[bps_diff_hash(index->source + slot * BPS_DIFF_STRIDE, index->bucket_bits)]++;
+    }
+    return NULL;
+}
+
+static void* bps_diff_index_scatter(void* arg) {
+    bps_diff_index_job* job = (bps_diff_index_job*)arg;
+    bps_diff_index* index = job->index;
+
+    for (size_t slot = job->first_slot; slot < job->last_slot; slot++) {
+        uint32_t bucket = bps_diff_hash(index->source + slot * BPS_DIFF_STRIDE, index->bucket_bits);
+        index->positions[job->counts[bucket]++] = slot * BPS_DIFF_STRIDE;
+    }
+    return NULL;
+}
+
+// Run fn over every job, on its own thread where possible.
+static void bps_diff_run_jobs(bps_diff_index_job* jobs, pthread_t* threads, int job_count, void* (*fn)(void*)) {
+    int started[BPS_DIFF_MAX_THREADS];
+
+    for (int i = 1; i < job_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &jobs[i]) == 0;
+        if (!started[i]) {
+            fn(&jobs[i]);
+        }
+    }
+    fn(&jobs[0]);
+    for (int i = 1; i < job_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+rombp_patch_err bps_diff_index_build(bps_diff_index* index, const patch_source* source, int thread_count) {
+    bps_diff_index_job jobs[BPS_DIFF_MAX_THREADS];
+    pthread_t threads[BPS_DIFF_MAX_THREADS];
+
+    index->source = source->data.data;
+    index->source_size = source->data.size;
+    index->bucket_starts = NULL;
+    index->positions = NULL;
+
+    if (index->source_size > NO_POSITION) {
+        rombp_log_err("Source is too large to diff: %ld bytes\n", (long)index->source_size);
+        return PATCH_INVALID_INPUT_SIZE;
+    }
+
+    size_t slot_count = bps_diff_slot_count(index->source_size);
+    index->bucket_bits = bps_diff_bucket_bits(slot_count);
+    size_t bucket_count = (size_t)1 << index->bucket_bits;
+
+    if (thread_count > BPS_DIFF_MAX_THREADS) {
+        thread_count = BPS_DIFF_MAX_THREADS;
+    }
+    if ((size_t)thread_count > slot_count / MIN_SLOTS_PER_THREAD) {
+        thread_count = slot_count / MIN_SLOTS_PER_THREAD;
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    index->bucket_starts = malloc((bucket_count + 1) * sizeof(uint32_t));
+    index->positions = malloc((slot_count > 0 ? slot_count : 1) * sizeof(uint32_t));
+    uint32_t* counts = calloc(bucket_count * thread_count, sizeof(uint32_t));
+    if (index->bucket_starts == NULL || index->positions == NULL || counts == NULL) {
+        rombp_log_err("Failed to allocate BPS diff index for %ld positions\n", (long)slot_count);
+        free(counts);
+        bps_diff_index_free(index);
+        return PATCH_ERR_IO;
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        jobs[i].index = index;
+        jobs[i].first_slot = slot_count * i / thread_count;
+        jobs[i].last_slot = slot_count * (i + 1) / thread_count;
+        jobs[i].counts = counts + bucket_count * i;
+    }
+    bps_diff_run_jobs(jobs, threads, thread_count, &bps_diff_index_count);
+
+    // Turn the per thread counts into each thread's write offset in every bucket.
+    uint32_t offset = 0;
+    for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+        index->bucket_starts[bucket] = offset;
+        for (int i = 0; i < thread_count; i++) {
+            uint32_t count = jobs[i].counts[bucket];
+            jobs[i].counts[bucket] = offset;
+            offset += count;
+        }
+    }
+    index->bucket_starts[bucket_count] = offset;
+
+    bps_diff_run_jobs(jobs, threads, thread_count, &bps_diff_index_scatter);
+    free(counts);
+
+    rombp_log_debug("Built BPS diff index: %ld positions, %ld buckets, %d threads\n",
+                    (long)slot_count, (long)bucket_count, thread_count);
+    return PATCH_OK;
+}
+
+void bps_diff_index_free(bps_diff_index* index) {
+    free(index->bucket_starts);
+    free(index->positions);
+    index->bucket_starts = NULL;
+    index->positions = NULL;
+}
+
+typedef struct bps_diff_match {
+    bps_command_type action;
+    // Where in the target the match starts, and how long it is.
+    size_t start;
+    size_t length;
+    // Where the bytes are copied from, for SourceCopy and TargetCopy.
+    size_t from;
+} bps_diff_match;
+
+typedef struct bps_diff_encoder {
+    const bps_diff_index* index;
+    const uint8_t* source;
+    size_t source_size;
+    const uint8_t* target;
+    size_t target_size;
+
+    patch_buffer* patch;
+    rombp_patch_err err;
+
+    uint64_t source_relative_offset;
+    uint64_t target_relative_offset;
+
+    // Hash chains over the already encoded target, for TargetCopy.
+    int chain_bits;
+    uint32_t* target_head;
+    uint32_t* target_prev;
+    size_t next_insert;
+} bps_diff_encoder;
+
+static void bps_diff_put(bps_diff_encoder* encoder, const void* data, size_t len) {
+    if (encoder->err != PATCH_OK) {
+        return;
+    }
+    size_t offset = encoder->patch->size;
+    encoder->err = patch_buffer_resize(encoder->patch, offset + len);
+    if (encoder->err == PATCH_OK) {
+        memcpy(encoder->patch->data + offset, data, len);
+    }
+}
+
+static void bps_diff_put_varint(bps_diff_encoder* encoder, uint64_t data) {
+    uint8_t buf[10];
+    size_t len = 0;
+
+    while (1) {
+        uint8_t x = data & 0x7F;
+        data >>= 7;
+        if (data == 0) {
+            buf[len++] = x | 0x80;
+            break;
+        }
+        buf[len++] = x;
+        data--;
+    }
+    bps_diff_put(encoder, buf, len);
+}
+
+static void bps_diff_put_le32(bps_diff_encoder* encoder, uint32_t value) {
+    uint8_t buf[] = { value, value >> 8, value >> 16, value >> 24 };
+    bps_diff_put(encoder, buf, sizeof(buf));
+}
+
+static void bps_diff_put_command(bps_diff_encoder* encoder, bps_command_type action, uint64_t length) {
+    bps_diff_put_varint(encoder, ((length - 1) << 2) | action);
+}
+
+// Signed offset from *relative to position, then move *relative past the copy.
+static void bps_diff_put_relative(bps_diff_encoder* encoder, uint64_t* relative, uint64_t position, uint64_t length) {
+    if (position >= *relative) {
+        bps_diff_put_varint(encoder, (position - *relative) << 1);
+    } else {
+        bps_diff_put_varint(encoder, ((*relative - position) << 1) | 1);
+    }
+    *relative = position + length;
+}
+
+static size_t bps_diff_varint_size(uint64_t data) {
+    size_t size = 1;
+    while (data >= 0x80) {
+        data = (data >> 7) - 1;
+        size++;
+    }
+    return size;
+}
+
+static size_t bps_diff_relative_cost(uint64_t relative, uint64_t position) {
+    uint64_t distance = position >= relative ? position - relative : relative - position;
+    return bps_diff_varint_size(distance << 1);
+}
+
+// Bytes saved by a match, over sending its bytes in a TargetRead.
+static long bps_diff_match_gain(const bps_diff_encoder* encoder, const bps_diff_match* match) {
+    long cost = 1;
+    if (match->action == BPS_SOURCE_COPY) {
+        cost += bps_diff_relative_cost(encoder->source_relative_offset, match->from);
+    } else if (match->action == BPS_TARGET_COPY) {
+        cost += bps_diff_relative_cost(encoder->target_relative_offset, match->from);
+    }
+    return (long)match->length - cost;
+}
+
+static void bps_diff_consider(const bps_diff_encoder* encoder, bps_diff_match* best, long* best_gain,
+                              bps_command_type action, size_t start, size_t from, size_t length) {
+    bps_diff_match match = { action, start, length, from };
+    long gain = bps_diff_match_gain(encoder, &match);
+    if (gain > *best_gain) {
+        *best = match;
+        *best_gain = gain;
+    }
+}
+
+// Add the target positions before end to the TargetCopy hash chains.
+static void bps_diff_insert_until(bps_diff_encoder* encoder, size_t end) {
+    while (encoder->next_insert < end && encoder->next_insert + HASH_LENGTH <= encoder->target_size) {
+        uint32_t slot = encoder->next_insert / BPS_DIFF_STRIDE;
+        uint32_t bucket = bps_diff_hash(encoder->target + encoder->next_insert, encoder->chain_bits);
+        encoder->target_prev[slot] = encoder->target_head[bucket];
+        encoder->target_head[bucket] = slot;
+        encoder->next_insert += BPS_DIFF_STRIDE;
+    }
+}
+
+static void bps_diff_find_source_copy(const bps_diff_encoder* encoder, size_t pos, size_t literal_start,
+                                      bps_diff_match* best, long* best_gain) {
+    const bps_diff_index* index = encoder->index;
+    uint32_t bucket = bps_diff_hash(encoder->target + pos, index->bucket_bits);
+    uint32_t lo = index->bucket_starts[bucket];
+    uint32_t hi = index->bucket_starts[bucket + 1];
+
+    // Positions are sorted, so start with the candidates closest to where the
+    // last copy left off. Those are the likeliest to match, and cheapest to encode.
+    uint32_t first = lo;
+    uint32_t count = hi - lo;
+    while (count > 0) {
+        uint32_t step = count / 2;
+        if (index->positions[first + step] < encoder->source_relative_offset) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+    first = first - lo > (uint32_t)MAX_CANDIDATES / 2 ? first - MAX_CANDIDATES / 2 : lo;
+    uint32_t last = hi - first > (uint32_t)MAX_CANDIDATES ? first + MAX_CANDIDATES : hi;
+
+    for (uint32_t i = first; i < last && best->length < GOOD_MATCH; i++) {
+        size_t from = index->positions[i];
+        size_t max = MIN(encoder->source_size - from, encoder->target_size - pos);
+        size_t forward = bps_diff_match_length(encoder->source + from, encoder->target + pos, max);
+        if (forward < HASH_LENGTH) {
+            continue;
+        }
+        size_t back = bps_diff_match_length_back(encoder->source + from, encoder->target + pos,
+                                                 MIN(from, pos - literal_start));
+        bps_diff_consider(encoder, best, best_gain, BPS_SOURCE_COPY, pos - back, from - back, back + forward);
+    }
+}
+
+static void bps_diff_find_target_copy(const bps_diff_encoder* encoder, size_t pos, size_t literal_start,
+                                      bps_diff_match* best, long* best_gain) {
+    uint32_t slot = encoder->target_head[bps_diff_hash(encoder->target + pos, encoder->chain_bits)];
+
+    for (int i = 0; i < MAX_CANDIDATES && slot != NO_POSITION && best->length < GOOD_MATCH; i++) {
+        size_t from = (size_t)slot * BPS_DIFF_STRIDE;
+        slot = encoder->target_prev[slot];
+
+        // Copies may overlap their own output, like an RLE run
+        size_t forward = bps_diff_match_length(encoder->target + from, encoder->target + pos,
+                                               encoder->target_size - pos);
+        if (forward < HASH_LENGTH) {
+            continue;
+        }
+        size_t back = bps_diff_match_length_back(encoder->target + from, encoder->target + pos,
+                                                 MIN(from, pos - literal_start));
+        bps_diff_consider(encoder, best, best_gain, BPS_TARGET_COPY, pos - back, from - back, back + forward);
+    }
+}
+
+static void bps_diff_flush_literals(bps_diff_encoder* encoder, size_t literal_start, size_t end) {
+    if (end > literal_start) {
+        bps_diff_put_command(encoder, BPS_TARGET_READ, end - literal_start);
+        bps_diff_put(encoder, encoder->target + literal_start, end - literal_start);
+    }
+}
+
+static void bps_diff_put_match(bps_diff_encoder* encoder, const bps_diff_match* match) {
+    bps_diff_put_command(encoder, match->action, match->length);
+    if (match->action == BPS_SOURCE_COPY) {
+        bps_diff_put_relative(encoder, &encoder->source_relative_offset, match->from, match->length);
+    } else if (match->action == BPS_TARGET_COPY) {
+        bps_diff_put_relative(encoder, &encoder->target_relative_offset, match->from, match->length);
+    }
+}
+
+// Greedy encoding: at every target position, take the best of a SourceRead at the
+// same offset, a SourceCopy from the source index or a TargetCopy from the chains
+// over the target so far. Bytes with no worthwhile match collect into a TargetRead.
+static void bps_diff_encode_commands(bps_diff_encoder* encoder) {
+    size_t pos = 0;
+    size_t literal_start = 0;
+
+    while (pos < encoder->target_size && encoder->err == PATCH_OK) {
+        bps_diff_match best = { BPS_TARGET_READ, pos, 0, 0 };
+        long best_gain = 0;
+
+        if (pos < encoder->source_size) {
+            size_t max = MIN(encoder->source_size, encoder->target_size) - pos;
+            size_t length = bps_diff_match_length(encoder->source + pos, encoder->target + pos, max);
+            if (length > 0) {
+                size_t back = bps_diff_match_length_back(encoder->source + pos, encoder->target + pos,
+                                                         pos - literal_start);
+                length += back;
+                if (length >= MIN_SOURCE_READ) {
+                    bps_diff_consider(encoder, &best, &best_gain, BPS_SOURCE_READ, pos - back, pos - back, length);
+                }
+            }
+        }
+        if (best.length < GOOD_MATCH && pos + HASH_LENGTH <= encoder->target_size) {
+            bps_diff_insert_until(encoder, pos);
+            bps_diff_find_source_copy(encoder, pos, literal_start, &best, &best_gain);
+            bps_diff_find_target_copy(encoder, pos, literal_start, &best, &best_gain);
+        }
+
+        size_t min_length = best.action == BPS_SOURCE_READ ? MIN_SOURCE_READ : MIN_COPY;
+        if (best_gain <= 0 || best.length < min_length) {
+            size_t step = 1 + ((pos - literal_start) >> LITERAL_SKIP_SHIFT);
+            pos += MIN(step | 1, MAX_LITERAL_STEP);
+            continue;
+        }
+
+        bps_diff_flush_literals(encoder, literal_start, best.start);
+        bps_diff_put_match(encoder, &best);
+        pos = best.start + best.length;
+        literal_start = pos;
+    }
+
+    bps_diff_flush_literals(encoder, literal_start, encoder->target_size);
+}
+
+rombp_patch_err bps_diff_encode(const bps_diff_index* index, const patch_source* source,
+                                const patch_source* target, patch_buffer* patch) {
+    bps_diff_encoder encoder;
+
+    encoder.index = index;
+    encoder.source = source->data.data;
+    encoder.source_size = source->data.size;
+    encoder.target = target->data.data;
+    encoder.target_size = target->data.size;
+    encoder.patch = patch;
+    encoder.err = PATCH_OK;
+    encoder.source_relative_offset = 0;
+    encoder.target_relative_offset = 0;
+    encoder.next_insert = 0;
+
+    if (encoder.target_size > NO_POSITION) {
+        rombp_log_err("Target is too large to diff: %ld bytes\n", (long)encoder.target_size);
+        return PATCH_INVALID_OUTPUT_SIZE;
+    }
+
+    size_t slot_count = bps_diff_slot_count(encoder.target_size);
+    encoder.chain_bits = bps_diff_bucket_bits(slot_count);
+    encoder.target_head = malloc(((size_t)1 << encoder.chain_bits) * sizeof(uint32_t));
+    encoder.target_prev = malloc((slot_count > 0 ? slot_count : 1) * sizeof(uint32_t));
+    if (encoder.target_head == NULL || encoder.target_prev == NULL) {
+        rombp_log_err("Failed to allocate BPS diff target chains\n");
+        free(encoder.target_head);
+        free(encoder.target_prev);
+        return PATCH_ERR_IO;
+    }
+    memset(encoder.target_head, 0xFF, ((size_t)1 << encoder.chain_bits) * sizeof(uint32_t));
+
+    patch->size = 0;
+    bps_diff_put(&encoder, BPS_MARKER, BPS_MARKER_SIZE);
+    bps_diff_put_varint(&encoder, encoder.source_size);
+    bps_diff_put_varint(&encoder, encoder.target_size);
+    bps_diff_put_varint(&encoder, 0); // No metadata
+
+    bps_diff_encode_commands(&encoder);
+
+    bps_diff_put_le32(&encoder, source->crc32);
+    bps_diff_put_le32(&encoder, target->crc32);
+    if (encoder.err == PATCH_OK) {
+        bps_diff_put_le32(&encoder, crc32_update(0, patch->data, patch->size));
+    }
+
+    free(encoder.target_head);
+    free(encoder.target_prev);
+
+    if (encoder.err != PATCH_OK) {
+        rombp_log_err("Failed to grow the BPS patch buffer\n");
+        return encoder.err;
+    }
+    rombp_log_info("Encoded %ld byte BPS patch for a %ld byte target\n", (long)patch->size, (long)encoder.target_size);
+    return PATCH_OK;
+}
+
+rombp_patch_err bps_diff(const patch_source* source, const patch_source* target, int thread_count, patch_buffer* patch) {
+    bps_diff_index index;
+
+    rombp_patch_err rc = bps_diff_index_build(&index, source, thread_count);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+    rc = bps_diff_encode(&index, source, target, patch);
+    bps_diff_index_free(&index);
+    return rc;
+}
@@ -0,0 +1,32 @@
+#ifndef ROMBP_BPS_DIFF_H_
+#define ROMBP_BPS_DIFF_H_
+
+#include <stdint.h>
+
+#include "patch.h"
+
+// Hash index over the source ROM, used to find SourceCopy matches. Every
+// BPS_DIFF_STRIDE'th source position is hashed, and positions are grouped by
+// hash bucket, in ascending order within a bucket.
+typedef struct bps_diff_index {
+    const uint8_t* source;
+    size_t source_size;
+    int bucket_bits;
+    // bucket_count + 1 offsets into positions
+    uint32_t* bucket_starts;
+    uint32_t* positions;
+} bps_diff_index;
+
+// Build the source index on thread_count threads.
+rombp_patch_err bps_diff_index_build(bps_diff_index* index, const patch_source* source, int thread_count);
+void bps_diff_index_free(bps_diff_index* index);
+
+// Encode a BPS patch that turns source into target, into patch. The source
+// must be the one index was built over.
+rombp_patch_err bps_diff_encode(const bps_diff_index* index, const patch_source* source,
+                                const patch_source* target, patch_buffer* patch);
+
+// Build the index and encode in one go.
+rombp_patch_err bps_diff(const patch_source* source, const patch_source* target, int thread_count, patch_buffer* patch);
+
+#endif
@@ -0,0 +1,347 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include "crc32.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32_X86_CLMUL
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#define CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Reflected CRC32 polynomial
+static const uint32_t CRC32_POLY = 0xEDB88320;
+// crc32_parallel hands out chunks of this many bytes, and most threads it runs on.
+static const size_t CRC32_PARALLEL_CHUNK_SIZE = 2 * 1024 * 1024;
+#define CRC32_MAX_THREADS 64
+
+typedef uint32_t (*crc32_update_fn)(uint32_t crc, const uint8_t* data, size_t len);
+
+static pthread_once_t crc32_init_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32_table[8][0x100];
+// x^(2^n) mod p(x), used to combine CRCs.
+static uint32_t crc32_x2n_table[32];
+static crc32_update_fn crc32_update_impl;
+static const char* crc32_impl_name;
+
+// All of the update functions work on the pre and post inverted CRC
+// value, crc32_update takes care of the inversion.
+static uint32_t crc32_update_bytes(uint32_t crc, const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32_table[0][(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// Slicing-by-8: consume 8 bytes per iteration with 8 independent table lookups.
+static uint32_t crc32_update_slice8(uint32_t crc, const uint8_t* data, size_t len) {
+    while (len >= 8) {
+        uint32_t one = crc ^ ((uint32_t)data[0] |
+                              (uint32_t)data[1] << 8 |
+                              (uint32_t)data[2] << 16 |
+                              (uint32_t)data[3] << 24);
+        uint32_t two = (uint32_t)data[4] |
+            (uint32_t)data[5] << 8 |
+            (uint32_t)data[6] << 16 |
+            (uint32_t)data[7] << 24;
+
+        crc = crc32_table[7][one & 0xFF] ^
+            crc32_table[6][(one >> 8) & 0xFF] ^
+            crc32_table[5][(one >> 16) & 0xFF] ^
+            crc32_table[4][one >> 24] ^
+            crc32_table[3][two & 0xFF] ^
+            crc32_table[2][(two >> 8) & 0xFF] ^
+            crc32_table[1][(two >> 16) & 0xFF] ^
+            crc32_table[0][two >> 24];
+
+        data += 8;
+        len -= 8;
+    }
+
+    return crc32_update_bytes(crc, data, len);
+}
+
+#ifdef CRC32_X86_CLMUL
+// Carry-less multiplication folding, from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction" paper. Folds 64 bytes per
+// iteration, then reduces down to 32 bits with a Barrett reduction.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_update_clmul(uint32_t crc, const uint8_t* data, size_t len) {
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    if (len < 64) {
+        return crc32_update_slice8(crc, data, len);
+    }
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    data += 64;
+    len -= 64;
+
+    // Fold 64 byte blocks in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        len -= 64;
+    }
+
+    // Fold the 4 lanes down to 128 bits
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Single 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        data += 16;
+        len -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduce to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = _mm_extract_epi32(x1, 1);
+
+    // Whatever is left over is less than 16 bytes
+    return crc32_update_bytes(crc, data, len);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32_update_armv8(uint32_t crc, const uint8_t* data, size_t len) {
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        crc = __crc32d(crc, *(const uint64_t*)data);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+// Multiply a and b modulo the CRC polynomial, both in reflected form.
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// x^(n * 2^k) mod p(x)
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned int k) {
+    uint32_t p = (uint32_t)1 << 31; // x^0 == 1
+
+    while (n) {
+        if (n & 1) {
+            p = crc32_multmodp(crc32_x2n_table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+static void crc32_init() {
+    for (uint32_t i = 0; i < 0x100; i++) {
+        uint32_t r = i;
+        for (int j = 0; j < 8; j++) {
+            r = r & 1 ? (r >> 1) ^ CRC32_POLY : r >> 1;
+        }
+        crc32_table[0][i] = r;
+    }
+    for (uint32_t i = 0; i < 0x100; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            uint32_t prev = crc32_table[slice - 1][i];
+            crc32_table[slice][i] = crc32_table[0][prev & 0xFF] ^ (prev >> 8);
+        }
+    }
+
+    uint32_t p = (uint32_t)1 << 30; // x^1
+    crc32_x2n_table[0] = p;
+    for (int n = 1; n < 32; n++) {
+        crc32_x2n_table[n] = p = crc32_multmodp(p, p);
+    }
+
+    crc32_update_impl = crc32_update_slice8;
+    crc32_impl_name = "slice8";
+
+#ifdef CRC32_X86_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc32_update_impl = crc32_update_clmul;
+        crc32_impl_name = "pclmul";
+    }
+#endif
+
+#ifdef CRC32_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_update_impl = crc32_update_armv8;
+        crc32_impl_name = "armv8";
+    }
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    pthread_once(&crc32_init_once, crc32_init);
+    return ~crc32_update_impl(~crc, (const uint8_t*)data, len);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    pthread_once(&crc32_init_once, crc32_init);
+    return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+typedef struct crc32_parallel_job {
+    const uint8_t* data;
+    size_t len;
+    size_t chunk_count;
+    // Index of the next chunk to hash, claimed by whichever thread is free.
+    atomic_size_t next_chunk;
+    uint32_t* chunk_crcs;
+} crc32_parallel_job;
+
+static void* crc32_parallel_run(void* arg) {
+    crc32_parallel_job* job = (crc32_parallel_job*)arg;
+    size_t chunk;
+    while ((chunk = atomic_fetch_add(&job->next_chunk, 1)) < job->chunk_count) {
+        size_t offset = chunk * CRC32_PARALLEL_CHUNK_SIZE;
+        size_t len = MIN(CRC32_PARALLEL_CHUNK_SIZE, job->len - offset);
+        job->chunk_crcs[chunk] = crc32_update(0, job->data + offset, len);
+    }
+    return NULL;
+}
+
+uint32_t crc32_parallel(const void* data, size_t len, int thread_count) {
+    pthread_t threads[CRC32_MAX_THREADS];
+    int started[CRC32_MAX_THREADS];
+    crc32_parallel_job job = {
+        .data = (const uint8_t*)data,
+        .len = len,
+        .chunk_count = len / CRC32_PARALLEL_CHUNK_SIZE + (len % CRC32_PARALLEL_CHUNK_SIZE != 0),
+    };
+
+    thread_count = MIN(thread_count, CRC32_MAX_THREADS);
+    if (thread_count <= 1 || job.chunk_count < 2) {
+        return crc32_update(0, data, len);
+    }
+    job.chunk_crcs = malloc(job.chunk_count * sizeof(uint32_t));
+    if (job.chunk_crcs == NULL) {
+        return crc32_update(0, data, len);
+    }
+    atomic_init(&job.next_chunk, 0);
+    thread_count = MIN((size_t)thread_count, job.chunk_count);
+
+    // This thread hashes chunks too, so any threads that fail to start only cost time
+    for (int i = 1; i < thread_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, &crc32_parallel_run, &job) == 0;
+    }
+    crc32_parallel_run(&job);
+    for (int i = 1; i < thread_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    uint32_t crc = job.chunk_crcs[0];
+    for (size_t chunk = 1; chunk < job.chunk_count; chunk++) {
+        size_t chunk_len = MIN(CRC32_PARALLEL_CHUNK_SIZE, len - chunk * CRC32_PARALLEL_CHUNK_SIZE);
+        crc = crc32_combine(crc, job.chunk_crcs[chunk], chunk_len);
+    }
+    free(job.chunk_crcs);
+    return crc;
+}
+
+const char* crc32_implementation() {
+    pthread_once(&crc32_init_once, crc32_init);
+    return crc32_impl_name;
+}
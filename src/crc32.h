@@ -0,0 +1,27 @@
+#ifndef ROMBP_CRC32_H_
+#define ROMBP_CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Standard (zlib compatible) CRC32. Start with a crc of 0, and feed data
+// through crc32_update in as many pieces as needed.
+//
+// The fastest implementation available on the running CPU is picked the
+// first time any function here is called: PCLMULQDQ folding on x86-64,
+// the CRC32 instructions on ARMv8, otherwise a portable slicing-by-8 table.
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+
+// Given crc1 of a block A, and crc2 of a block B that is len2 bytes long,
+// return the CRC32 of A followed by B. Lets chunks be hashed independently
+// (and in parallel) and then merged.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// CRC32 of len bytes of data, hashed in fixed-size chunks on up to thread_count
+// threads, and combined. Small buffers are hashed on the calling thread.
+uint32_t crc32_parallel(const void* data, size_t len, int thread_count);
+
+// Name of the implementation picked at runtime, for logging.
+const char* crc32_implementation();
+
+#endif
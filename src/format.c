@@ -0,0 +1,220 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include "bps.h"
+#include "format.h"
+#include "ips.h"
+#include "log.h"
+#include "ups.h"
+#include "vcdiff.h"
+
+// Adapters from the registry's calling convention to each engine's own.
+
+static rombp_patch_err ips_format_start(void* ctx, const rombp_apply_options* options, const patch_source* source,
+                                        FILE* input_file, FILE* patch_file, FILE* output_file) {
+    return ips_start(ctx, options, source, input_file, output_file, patch_file);
+}
+
+static rombp_hunk_iter_status ips_format_next(void* ctx, FILE* input_file, FILE* output_file) {
+    return ips_next(ctx);
+}
+
+static rombp_patch_err ips_format_end(void* ctx, FILE* input_file, FILE* output_file) {
+    return ips_end(ctx, output_file);
+}
+
+static rombp_patch_err ips_format_take_output(void* ctx, patch_source* output) {
+    return ips_take_output(ctx, output);
+}
+
+static void ips_format_free(void* ctx) {
+    ips_free(ctx);
+}
+
+static void ips_format_progress(const void* ctx, rombp_patch_status* status) {
+    const ips_context* ips = ctx;
+    status->bytes_written = ips->bytes_written;
+    status->total_bytes = ips->total_bytes;
+    status->copy_strategy = ips->copy_strategy;
+}
+
+static rombp_patch_err bps_format_start(void* ctx, const rombp_apply_options* options, const patch_source* source,
+                                        FILE* input_file, FILE* patch_file, FILE* output_file) {
+    return bps_start(patch_file, input_file, output_file, source, options, ctx);
+}
+
+static rombp_hunk_iter_status bps_format_next(void* ctx, FILE* input_file, FILE* output_file) {
+    return bps_next(ctx);
+}
+
+static rombp_patch_err bps_format_end(void* ctx, FILE* input_file, FILE* output_file) {
+    return bps_end(ctx, output_file);
+}
+
+static rombp_patch_err bps_format_take_output(void* ctx, patch_source* output) {
+    return bps_take_output(ctx, output);
+}
+
+static void bps_format_free(void* ctx) {
+    bps_free(ctx);
+}
+
+static void bps_format_progress(const void* ctx, rombp_patch_status* status) {
+    const bps_file_header* bps = ctx;
+    // A parallel apply writes the whole target before stepping through its commands
+    uint64_t applied = atomic_load_explicit(&bps->applied_bytes, memory_order_relaxed);
+    status->bytes_written = MAX(bps->output_offset, applied);
+    status->total_bytes = bps->target_size;
+}
+
+static rombp_patch_err ups_format_start(void* ctx, const rombp_apply_options* options, const patch_source* source,
+                                        FILE* input_file, FILE* patch_file, FILE* output_file) {
+    return ups_start(ctx, options, source, input_file, patch_file);
+}
+
+static rombp_hunk_iter_status ups_format_next(void* ctx, FILE* input_file, FILE* output_file) {
+    return ups_next(ctx, input_file, output_file);
+}
+
+static rombp_patch_err ups_format_end(void* ctx, FILE* input_file, FILE* output_file) {
+    return ups_end(ctx, input_file, output_file);
+}
+
+static rombp_patch_err ups_format_take_output(void* ctx, patch_source* output) {
+    return ups_take_output(ctx, output);
+}
+
+static void ups_format_free(void* ctx) {
+    ups_free(ctx);
+}
+
+static void ups_format_progress(const void* ctx, rombp_patch_status* status) {
+    const ups_context* ups = ctx;
+    status->bytes_written = ups->output_offset;
+    status->total_bytes = ups->output_size;
+}
+
+static rombp_patch_err vcdiff_format_start(void* ctx, const rombp_apply_options* options, const patch_source* source,
+                                           FILE* input_file, FILE* patch_file, FILE* output_file) {
+    return vcdiff_start(ctx, options, source, input_file, output_file, patch_file);
+}
+
+static rombp_hunk_iter_status vcdiff_format_next(void* ctx, FILE* input_file, FILE* output_file) {
+    return vcdiff_next(ctx);
+}
+
+static rombp_patch_err vcdiff_format_end(void* ctx, FILE* input_file, FILE* output_file) {
+    return vcdiff_end(ctx, output_file);
+}
+
+static rombp_patch_err vcdiff_format_take_output(void* ctx, patch_source* output) {
+    return vcdiff_take_output(ctx, output);
+}
+
+static void vcdiff_format_free(void* ctx) {
+    vcdiff_free(ctx);
+}
+
+static void vcdiff_format_progress(const void* ctx, rombp_patch_status* status) {
+    const vcdiff_context* vcdiff = ctx;
+    status->bytes_written = atomic_load_explicit(&vcdiff->output_bytes, memory_order_relaxed);
+    status->total_bytes = vcdiff->target_size;
+}
+
+// Indexed by ips_command_type, bps_command_type, ups_command_type, and VCDIFF
+// instruction type.
+static const char* const IPS_COMMAND_NAMES[] = { "record", "rle" };
+static const char* const BPS_COMMAND_NAMES[] = { "SourceRead", "TargetRead", "SourceCopy", "TargetCopy" };
+static const char* const UPS_COMMAND_NAMES[] = { "copy", "xor" };
+static const char* const VCDIFF_COMMAND_NAMES[] = { "ADD", "RUN", "COPY" };
+
+static const rombp_patch_format PATCH_FORMATS[] = {
+    {
+        .name = "IPS",
+        .marker = IPS_MARKER,
+        .marker_size = IPS_MARKER_SIZE,
+        .context_size = sizeof(ips_context),
+        .command_names = IPS_COMMAND_NAMES,
+        .command_count = sizeof(IPS_COMMAND_NAMES) / sizeof(IPS_COMMAND_NAMES[0]),
+        .start = ips_format_start,
+        .next = ips_format_next,
+        .end = ips_format_end,
+        .take_output = ips_format_take_output,
+        .free = ips_format_free,
+        .progress = ips_format_progress,
+    },
+    {
+        .name = "IPS32",
+        .marker = IPS32_MARKER,
+        .marker_size = IPS_MARKER_SIZE,
+        .context_size = sizeof(ips_context),
+        .command_names = IPS_COMMAND_NAMES,
+        .command_count = sizeof(IPS_COMMAND_NAMES) / sizeof(IPS_COMMAND_NAMES[0]),
+        .start = ips_format_start,
+        .next = ips_format_next,
+        .end = ips_format_end,
+        .take_output = ips_format_take_output,
+        .free = ips_format_free,
+        .progress = ips_format_progress,
+    },
+    {
+        .name = "BPS",
+        .marker = BPS_MARKER,
+        .marker_size = BPS_MARKER_SIZE,
+        .context_size = sizeof(bps_file_header),
+        .command_names = BPS_COMMAND_NAMES,
+        .command_count = sizeof(BPS_COMMAND_NAMES) / sizeof(BPS_COMMAND_NAMES[0]),
+        .start = bps_format_start,
+        .next = bps_format_next,
+        .end = bps_format_end,
+        .take_output = bps_format_take_output,
+        .free = bps_format_free,
+        .progress = bps_format_progress,
+    },
+    {
+        .name = "UPS",
+        .marker = UPS_MARKER,
+        .marker_size = UPS_MARKER_SIZE,
+        .context_size = sizeof(ups_context),
+        .command_names = UPS_COMMAND_NAMES,
+        .command_count = sizeof(UPS_COMMAND_NAMES) / sizeof(UPS_COMMAND_NAMES[0]),
+        .start = ups_format_start,
+        .next = ups_format_next,
+        .end = ups_format_end,
+        .take_output = ups_format_take_output,
+        .free = ups_format_free,
+        .progress = ups_format_progress,
+    },
+    {
+        .name = "VCDIFF",
+        .marker = VCDIFF_MARKER,
+        .marker_size = VCDIFF_MARKER_SIZE,
+        .context_size = sizeof(vcdiff_context),
+        .command_names = VCDIFF_COMMAND_NAMES,
+        .command_count = sizeof(VCDIFF_COMMAND_NAMES) / sizeof(VCDIFF_COMMAND_NAMES[0]),
+        .start = vcdiff_format_start,
+        .next = vcdiff_format_next,
+        .end = vcdiff_format_end,
+        .take_output = vcdiff_format_take_output,
+        .free = vcdiff_format_free,
+        .progress = vcdiff_format_progress,
+    },
+};
+
+const rombp_patch_format* patch_format_detect(FILE* patch_file) {
+    uint8_t peek[PATCH_FORMAT_PEEK_SIZE];
+
+    rombp_log_debug("Trying to detect patch type\n");
+    size_t nread = fread(peek, sizeof(uint8_t), sizeof(peek), patch_file);
+
+    for (size_t i = 0; i < sizeof(PATCH_FORMATS) / sizeof(PATCH_FORMATS[0]); i++) {
+        const rombp_patch_format* format = &PATCH_FORMATS[i];
+        if (nread >= format->marker_size && memcmp(peek, format->marker, format->marker_size) == 0) {
+            rombp_log_info("Detected patch type: %s\n", format->name);
+            return format;
+        }
+    }
+
+    rombp_log_err("Unknown patch type\n");
+    return NULL;
+}
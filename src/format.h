@@ -0,0 +1,50 @@
+#ifndef ROMBP_FORMAT_H_
+#define ROMBP_FORMAT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "patch.h"
+
+// Longest marker of any format. Detection reads this many bytes, once.
+#define PATCH_FORMAT_PEEK_SIZE 8
+
+// A patch format, and the engine that applies it. Every engine works on its
+// own context struct, of context_size bytes, allocated by the caller. Engines
+// seek the patch file to wherever they need it, so detection leaves it where
+// the peek stopped. Detection is what checks the marker; the IPS engine only
+// looks at it again to tell IPS from IPS32.
+//
+// There's no separate verify hook. Past the marker, checking a patch means
+// reading all of it: start already does that before the first hunk is applied,
+// checking the BPS and UPS patch CRC32s, and parsing every IPS record and
+// VCDIFF window header. A verify step ahead of start would read the patch twice.
+typedef struct rombp_patch_format {
+    const char* name;
+    // The engine's own marker, which its patches start with.
+    const uint8_t* marker;
+    size_t marker_size;
+    size_t context_size;
+    // Names of the engine's command types, indexed by the type it reports
+    // apply stats for.
+    const char* const* command_names;
+    int command_count;
+
+    // When source is set, it's used in place of reading input_file.
+    rombp_patch_err (*start)(void* ctx, const rombp_apply_options* options, const patch_source* source,
+                             FILE* input_file, FILE* patch_file, FILE* output_file);
+    rombp_hunk_iter_status (*next)(void* ctx, FILE* input_file, FILE* output_file);
+    rombp_patch_err (*end)(void* ctx, FILE* input_file, FILE* output_file);
+    // Move an in-memory result into output, to use as the source of the next patch.
+    rombp_patch_err (*take_output)(void* ctx, patch_source* output);
+    // Release anything start allocated. Called whether or not patching succeeded.
+    void (*free)(void* ctx);
+    // Fill in the output bytes written so far, out of the total the patch will
+    // write, and how a streaming engine copied the input to the output.
+    void (*progress)(const void* ctx, rombp_patch_status* status);
+} rombp_patch_format;
+
+// The format whose marker the patch file starts with, or NULL.
+const rombp_patch_format* patch_format_detect(FILE* patch_file);
+
+#endif
@@ -1,257 +1,624 @@
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 
+#include "crc32.h"
 #include "ips.h"
 #include "log.h"
+#include "stats.h"
 
 static const size_t BUF_SIZE = 32768;
 
-// Copy the input file to the output file, it is assumed
-// that both files will be at position 0 before this function
-// is called.
-static int copy_file(FILE* input_file, FILE* output_file) {
-    uint8_t buf[BUF_SIZE];
-    int rc;
+const uint8_t IPS_MARKER[IPS_MARKER_SIZE] = {
+    0x50, 0x41, 0x54, 0x43, 0x48 // PATCH
+};
+const uint8_t IPS32_MARKER[IPS_MARKER_SIZE] = {
+    0x49, 0x50, 0x53, 0x33, 0x32 // IPS32
+};
+
+// Plain IPS, with 24-bit record offsets, and IPS32, the same format with 32-bit
+// offsets, for images over 16 MB. A truncation size after the terminator is as
+// wide as an offset.
+typedef struct ips_variant {
+    const char* name;
+    const uint8_t* marker;
+    const uint8_t* eof_marker;
+    size_t eof_marker_size;
+    size_t offset_size;
+} ips_variant;
+
+static const ips_variant IPS_VARIANTS[] = {
+    {
+        .name = "IPS",
+        .marker = IPS_MARKER,
+        .eof_marker = (const uint8_t*)"EOF",
+        .eof_marker_size = 3,
+        .offset_size = 3,
+    },
+    {
+        .name = "IPS32",
+        .marker = IPS32_MARKER,
+        .eof_marker = (const uint8_t*)"EEOF",
+        .eof_marker_size = 4,
+        .offset_size = 4,
+    },
+};
 
-    int infd = fileno(input_file);
-    if (infd == -1) {
-        rombp_log_err("Bad input file, is the stream closed?\n");
-        return infd;
+static const ips_variant* ips_find_variant(const uint8_t* marker) {
+    for (size_t i = 0; i < sizeof(IPS_VARIANTS) / sizeof(IPS_VARIANTS[0]); i++) {
+        if (memcmp(marker, IPS_VARIANTS[i].marker, IPS_MARKER_SIZE) == 0) {
+            return &IPS_VARIANTS[i];
+        }
     }
-    struct stat input_file_stat;
-    rc = fstat(infd, &input_file_stat);
-    if (rc == -1) {
-        rombp_log_err("Failed to stat input file, errno: %d\n", errno);
-        return rc;
+    return NULL;
+}
+
+// An offset, or a truncation size: offset_size bytes, big endian.
+static inline uint32_t be_offset(const uint8_t* buf, size_t offset_size) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < offset_size; i++) {
+        value = (value << 8) | buf[i];
     }
+    return value;
+}
 
-    off_t input_file_size = input_file_stat.st_size;
-    size_t total_read = 0;
-    while (1) {
-        size_t nread = fread(&buf, 1, BUF_SIZE, input_file);
-        total_read += nread;
-        if (nread < BUF_SIZE) {
-            if (total_read < input_file_size) {
-                rombp_log_err("Failed to read the entire input file, read: %ld bytes, input file size: %ld\n", (long int)total_read, (long int)input_file_size);
+static const inline uint16_t be_16bit_int(uint8_t *buf) {
+    return ((buf[0] << 8) & 0xFF00) |
+        (buf[1] & 0x00FF);
+}
+
+static const size_t RLE_PAYLOAD_BYTE_SIZE = 3;
+// Extract the RLE length, as well as the byte value that needs to repeated (rle_length times)
+static int ips_get_rle_payload(patch_buffer* patch, size_t* pos, uint32_t* rle_length, uint8_t* rle_value) {
+    if (patch->size - *pos < RLE_PAYLOAD_BYTE_SIZE) {
+        rombp_log_err("Unexpectedly reached EOF while trying to read the RLE payload\n");
+        return -1;
+    }
+
+    uint8_t* buf = patch->data + *pos;
+    *rle_length = be_16bit_int(buf);
+    *rle_value = buf[2];
+    *pos += RLE_PAYLOAD_BYTE_SIZE;
+
+    return 0;
+}
+
+static int ips_next_hunk_header(patch_buffer* patch, const ips_variant* variant, size_t* pos, ips_hunk_header* header) {
+    assert(header != NULL);
+
+    size_t remaining = patch->size - *pos;
+    if (remaining >= variant->eof_marker_size &&
+        memcmp(patch->data + *pos, variant->eof_marker, variant->eof_marker_size) == 0) {
+        *pos += variant->eof_marker_size;
+        return HUNK_DONE;
+    }
+    if (remaining < variant->offset_size + 2) {
+        rombp_log_info("IPS file ended without an EOF marker\n");
+        *pos = patch->size;
+        return HUNK_DONE;
+    }
+
+    // Decode the hunk preamble
+    // 3 byte offset (4 for IPS32)
+    // 2 byte payload length.
+    uint8_t* buf = patch->data + *pos;
+    header->offset = be_offset(buf, variant->offset_size);
+    header->length = be_16bit_int(buf + variant->offset_size);
+    *pos += variant->offset_size + 2;
+
+    return HUNK_NEXT;
+}
+
+// Parse every record in the patch into a flat array, in file order, and the
+// truncation size after the EOF marker, if there is one.
+static int ips_parse_records(ips_context* ctx, ips_write** records_out, size_t* record_count_out) {
+    patch_buffer* patch = &ctx->patch;
+    const ips_variant* variant = ctx->variant;
+    ips_write* records = NULL;
+    size_t record_count = 0;
+    size_t record_capacity = 0;
+    size_t pos = IPS_MARKER_SIZE;
+    ips_hunk_header hunk_header;
+
+    while (ips_next_hunk_header(patch, variant, &pos, &hunk_header) == HUNK_NEXT) {
+        ips_write record;
+        record.offset = hunk_header.offset;
+        record.patch_offset = 0;
+        record.rle_value = 0;
+
+        // 0 length header means the hunk is run length encoded (RLE).
+        // We have to look into the payload to determine how big the hunk
+        // is.
+        if (hunk_header.length == 0) {
+            int rc = ips_get_rle_payload(patch, &pos, &record.length, &record.rle_value);
+            if (rc < 0) {
+                free(records);
+                return rc;
+            }
+            record.is_rle = 1;
+        } else {
+            if (patch->size - pos < hunk_header.length) {
+                rombp_log_err("Unexpected EOF while trying to read payload from IPS file, offset: %d, length: %d\n",
+                              hunk_header.offset, hunk_header.length);
+                free(records);
                 return -1;
-            } else {
-                return 0;
             }
+            record.length = hunk_header.length;
+            record.patch_offset = pos;
+            record.is_rle = 0;
+            pos += hunk_header.length;
         }
-        size_t nwritten = fwrite(&buf, 1, nread, output_file);
-        if (nwritten < nread) {
-            rombp_log_err("Tried to copy %ld bytes to the output file, but only copied: %ld\n", (long int)nread, (long int)nwritten);
+        if (record.length == 0) {
+            continue;
+        }
+        if ((uint64_t)record.offset + record.length > UINT32_MAX) {
+            rombp_log_err("IPS record runs past 4 GB, offset: %u, length: %u\n", record.offset, record.length);
+            free(records);
             return -1;
         }
+
+        if (record_count == record_capacity) {
+            record_capacity = record_capacity > 0 ? record_capacity * 2 : 256;
+            ips_write* grown = realloc(records, record_capacity * sizeof(ips_write));
+            if (grown == NULL) {
+                rombp_log_err("Failed to allocate IPS records\n");
+                free(records);
+                return -1;
+            }
+            records = grown;
+        }
+        records[record_count++] = record;
     }
 
+    // Lunar IPS extension: the size to cut the output down, or pad it out, to
+    if (patch->size - pos == variant->offset_size) {
+        ctx->has_truncate_size = 1;
+        ctx->truncate_size = be_offset(patch->data + pos, variant->offset_size);
+        rombp_log_info("IPS output size is set to: %ld\n", (long int)ctx->truncate_size);
+    } else if (pos < patch->size) {
+        rombp_log_info("Ignoring %ld bytes after the IPS EOF marker\n", (long int)(patch->size - pos));
+    }
+
+    *records_out = records;
+    *record_count_out = record_count;
     return 0;
 }
 
-rombp_patch_err ips_start(FILE* input_file, FILE* output_file) {
-    // Once the header is verified, copy the input to output
-    int rc = copy_file(input_file, output_file);
-    if (rc != 0) {
-        rombp_log_err("Failed to seek to copy input file to output file: %d\n", rc);
-        return PATCH_ERR_IO;
+// Start point of a record, for sorting records by offset.
+typedef struct ips_plan_start {
+    uint32_t offset;
+    uint32_t index;
+} ips_plan_start;
+
+static int compare_record_offsets(const void* a, const void* b) {
+    const ips_plan_start* left = a;
+    const ips_plan_start* right = b;
+    if (left->offset != right->offset) {
+        return left->offset < right->offset ? -1 : 1;
     }
-
-    return PATCH_OK;
+    return left->index < right->index ? -1 : (left->index > right->index);
 }
 
-static const uint8_t IPS_EXPECTED_MARKER[] = {
-    0x50, 0x41, 0x54, 0x43, 0x48 // PATCH
-};
-static const size_t IPS_MARKER_SIZE = sizeof(IPS_EXPECTED_MARKER) / sizeof(uint8_t);
-
-rombp_patch_err ips_verify_marker(FILE* ips_file) {
-    return patch_verify_marker(ips_file, IPS_EXPECTED_MARKER, IPS_MARKER_SIZE);
+static int compare_positions(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return left < right ? -1 : (left > right);
 }
 
-static const size_t HUNK_PREAMBLE_BYTE_SIZE = 5;
-
-static const inline uint32_t be_24bit_int(uint8_t *buf) {
-    return ((buf[0] << 16) & 0x00FF0000) |
-        ((buf[1] << 8) & 0x0000FF00) |
-        (buf[2] & 0x000000FF);
+// Max heap of record indices, the latest record in the patch is on top.
+static void heap_push(uint32_t* heap, size_t* heap_size, uint32_t index) {
+    size_t i = (*heap_size)++;
+    heap[i] = index;
+    while (i > 0 && heap[(i - 1) / 2] < heap[i]) {
+        uint32_t tmp = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = heap[i];
+        heap[i] = tmp;
+        i = (i - 1) / 2;
+    }
 }
 
-static const inline uint16_t be_16bit_int(uint8_t *buf) {
-    return ((buf[0] << 8) & 0xFF00) |
-        (buf[1] & 0x00FF);
+static void heap_pop(uint32_t* heap, size_t* heap_size) {
+    size_t i = 0;
+    heap[0] = heap[--(*heap_size)];
+    while (1) {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        if (left < *heap_size && heap[left] > heap[largest]) {
+            largest = left;
+        }
+        if (right < *heap_size && heap[right] > heap[largest]) {
+            largest = right;
+        }
+        if (largest == i) {
+            return;
+        }
+        uint32_t tmp = heap[largest];
+        heap[largest] = heap[i];
+        heap[i] = tmp;
+        i = largest;
+    }
 }
 
-static const size_t RLE_PAYLOAD_BYTE_SIZE = 3;
-// Extract the RLE length, as well as the byte value that needs to repeated (rle_length times)
-static int ips_get_rle_payload(FILE* ips_file, uint32_t* rle_length, uint8_t* rle_value) {
-    uint8_t buf[RLE_PAYLOAD_BYTE_SIZE];
-
-    size_t nread = fread(&buf, 1, RLE_PAYLOAD_BYTE_SIZE, ips_file);
-    if (nread < RLE_PAYLOAD_BYTE_SIZE) {
-        int err = ferror(ips_file);
-        if (err != 0) {
-            rombp_log_err("Error reading from IPS file for RLE payload, error: %d\n", err);
-            return -1;
+// Turn the records into the minimal set of writes that produce the same output:
+// sorted by offset, with no overlaps. Where records overlap, the one that comes
+// later in the patch wins, the same as applying them in file order would.
+//
+// This sweeps across every record start and end point, keeping the records that
+// cover the current point in a heap ordered by their position in the patch.
+static int ips_plan_writes(ips_write* records, size_t record_count, ips_write** writes_out, size_t* write_count_out) {
+    ips_plan_start* starts = malloc(record_count * sizeof(ips_plan_start));
+    uint64_t* positions = malloc(record_count * 2 * sizeof(uint64_t));
+    uint32_t* heap = malloc(record_count * sizeof(uint32_t));
+    ips_write* writes = malloc(record_count * 2 * sizeof(ips_write));
+    size_t heap_size = 0;
+    size_t position_count = 0;
+    size_t write_count = 0;
+
+    if (record_count > 0 && (starts == NULL || positions == NULL || heap == NULL || writes == NULL)) {
+        rombp_log_err("Failed to allocate IPS write plan\n");
+        free(starts);
+        free(positions);
+        free(heap);
+        free(writes);
+        return -1;
+    }
+
+    for (size_t i = 0; i < record_count; i++) {
+        starts[i].offset = records[i].offset;
+        starts[i].index = i;
+        positions[position_count++] = records[i].offset;
+        positions[position_count++] = (uint64_t)records[i].offset + records[i].length;
+    }
+    qsort(starts, record_count, sizeof(ips_plan_start), compare_record_offsets);
+    qsort(positions, position_count, sizeof(uint64_t), compare_positions);
+
+    size_t next_start = 0;
+    for (size_t p = 0; p + 1 < position_count; p++) {
+        uint64_t position = positions[p];
+        uint64_t next_position = positions[p + 1];
+        if (position == next_position) {
+            continue;
         }
-        if (feof(ips_file) != 0) {
-            rombp_log_err("Unexpectedly reached EOF while trying to read the RLE payload\n");
-            return -1;
+
+        while (next_start < record_count && starts[next_start].offset <= position) {
+            heap_push(heap, &heap_size, starts[next_start++].index);
+        }
+        while (heap_size > 0 &&
+               (uint64_t)records[heap[0]].offset + records[heap[0]].length <= position) {
+            heap_pop(heap, &heap_size);
         }
+        if (heap_size == 0) {
+            continue;
+        }
+
+        ips_write* owner = &records[heap[0]];
+        uint32_t skip = position - owner->offset;
+        ips_write* last = write_count > 0 ? &writes[write_count - 1] : NULL;
+
+        // Pieces of the same record that end up next to each other are joined back up.
+        if (last != NULL &&
+            (uint64_t)last->offset + last->length == position &&
+            last->is_rle == owner->is_rle &&
+            (owner->is_rle ?
+             last->rle_value == owner->rle_value :
+             last->patch_offset + last->length == owner->patch_offset + skip)) {
+            last->length += next_position - position;
+            continue;
+        }
+
+        ips_write* write = &writes[write_count++];
+        write->offset = position;
+        write->length = next_position - position;
+        write->is_rle = owner->is_rle;
+        write->rle_value = owner->rle_value;
+        write->patch_offset = owner->is_rle ? 0 : owner->patch_offset + skip;
     }
 
-    *rle_length = be_16bit_int(buf);
-    *rle_value = buf[2];
+    free(starts);
+    free(positions);
+    free(heap);
 
+    *writes_out = writes;
+    *write_count_out = write_count;
     return 0;
 }
 
-static int ips_next_hunk_header(FILE* ips_file, ips_hunk_header* header) {
-    uint8_t buf[HUNK_PREAMBLE_BYTE_SIZE];
-
-    assert(header != NULL);
-
-    // Read the hunk preamble
-    // 3 byte offset
-    // 2 byte payload length.
-    size_t nread = fread(&buf, 1, HUNK_PREAMBLE_BYTE_SIZE, ips_file);
-    if (nread < HUNK_PREAMBLE_BYTE_SIZE) {
-        int err = ferror(ips_file);
-        if (err != 0) {
-            rombp_log_err("Error reading from IPS file, error: %d\n", err);
-            return HUNK_ERR_IO;
+// Drop or shorten planned writes past the truncation size. Writes are sorted, so
+// only the last ones can be.
+static void ips_clip_writes(ips_context* ctx) {
+    while (ctx->write_count > 0) {
+        ips_write* last = &ctx->writes[ctx->write_count - 1];
+        if (last->offset >= ctx->truncate_size) {
+            ctx->write_count--;
+            continue;
         }
-        if (feof(ips_file) != 0) {
-            return HUNK_DONE;
+        if ((uint64_t)last->offset + last->length > ctx->truncate_size) {
+            last->length = ctx->truncate_size - last->offset;
         }
+        return;
     }
+}
 
-    // We have a 5 byte buffer of the hunk preamble, decode values:
-    header->offset = be_24bit_int(buf);
-    header->length = be_16bit_int(buf+3);
+static rombp_patch_err ips_input_size(const patch_source* source, FILE* input_file, uint64_t* size) {
+    struct stat input_stat;
 
-    return HUNK_NEXT;
+    if (source != NULL) {
+        *size = source->data.size;
+        return PATCH_OK;
+    }
+    if (fstat(fileno(input_file), &input_stat) == -1) {
+        rombp_log_err("Failed to stat input file, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    *size = input_stat.st_size;
+    return PATCH_OK;
 }
 
-// Write the rle_value to the output_file rle_hunk_length times. By the time this function is
-// called, we should assume that output_file has already been seeked to the correct position
-// in the file.
-static int ips_write_rle_hunk(FILE* output_file, uint32_t rle_hunk_length, uint8_t rle_value) {
-    // It'd be sweet if we could do this in one fwrite call. Oh well.
-    size_t nwritten;
-
-    for (int i = 0; i < rle_hunk_length; i++) {
-        nwritten = fwrite(&rle_value, sizeof(uint8_t), 1, output_file);
-        if (nwritten == 0) {
-            rombp_log_err("Failed to write RLE byte value, length: %d, value: %d, i: %d\n",
-                    rle_hunk_length, rle_value, i);
-            return -1;
-        }
+// The truncation size when the patch has one, otherwise the input grown to fit
+// the last write.
+static uint64_t ips_output_size(const ips_context* ctx, uint64_t input_size) {
+    if (ctx->has_truncate_size) {
+        return ctx->truncate_size;
     }
+    if (ctx->write_count == 0) {
+        return input_size;
+    }
+    const ips_write* last = &ctx->writes[ctx->write_count - 1];
+    return MAX(input_size, (uint64_t)last->offset + last->length);
+}
 
-    return 0;
+// Set the length of the output file, copied from the input, before it's patched.
+// Growth is allocated up front, so a full disk fails here and not halfway through.
+static rombp_patch_err ips_size_output_file(int output_fd, uint64_t input_size, uint64_t output_size) {
+    if (output_size > input_size &&
+        posix_fallocate(output_fd, input_size, output_size - input_size) == 0) {
+        return PATCH_OK;
+    }
+    if (output_size != input_size && ftruncate(output_fd, output_size) == -1) {
+        rombp_log_err("Failed to resize output file to %ld bytes, errno: %d\n", (long int)output_size, errno);
+        return PATCH_ERR_IO;
+    }
+    return PATCH_OK;
 }
- 
-// For normal hunks (non-RLE encoded), copy payload values from the IPS file to the output.
-// By the time this function is called, the ips_file should be positioned at the start of the payload
-// and the output file should already be seeked to the destination file position.
-static int ips_write_hunk(FILE* ips_file, FILE* output_file, uint32_t hunk_length) {
-    uint8_t buf[BUF_SIZE];
 
-    size_t length_remaining = hunk_length;
-    size_t nread;
-    size_t nwritten;
-    while (length_remaining > 0) {
-        size_t amount_to_copy = MIN(BUF_SIZE, length_remaining);
+rombp_patch_err ips_start(ips_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                          FILE* input_file, FILE* output_file, FILE* ips_file) {
+    rombp_apply_mode mode = options->mode;
+    ips_write* records;
+    size_t record_count;
+    int rc;
 
-        nread = fread(&buf, 1, amount_to_copy, ips_file);
-        if (nread < amount_to_copy) {
-            int err = ferror(ips_file);
-            if (err != 0) {
-                rombp_log_err("Error reading payload IPS file, error: %d\n", err);
-                return -1;
+    patch_buffer_init(&ctx->output);
+    patch_buffer_init(&ctx->patch);
+    ctx->in_memory = 0;
+    ctx->output_fd = -1;
+    ctx->copy_strategy = COPY_STRATEGY_NONE;
+    ctx->writes = NULL;
+    ctx->write_count = 0;
+    ctx->next_write = 0;
+    ctx->bytes_written = 0;
+    ctx->total_bytes = 0;
+    ctx->variant = NULL;
+    ctx->has_truncate_size = 0;
+    ctx->truncate_size = 0;
+    ctx->stats = options->stats;
+
+    // Plan every write up front, from the records after the marker.
+    rc = patch_seek(ips_file, 0);
+    if (rc == -1) {
+        rombp_log_err("Failed to seek IPS file back to beginning, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    rc = patch_buffer_read_file(&ctx->patch, ips_file);
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to read IPS patch into memory\n");
+        return rc;
+    }
+    if (ctx->patch.size >= IPS_MARKER_SIZE) {
+        ctx->variant = ips_find_variant(ctx->patch.data);
+    }
+    if (ctx->variant == NULL) {
+        rombp_log_err("Patch doesn't start with an IPS or IPS32 marker\n");
+        return PATCH_INVALID_HEADER;
+    }
+    rc = ips_parse_records(ctx, &records, &record_count);
+    if (rc != 0) {
+        return PATCH_INVALID_HEADER;
+    }
+    rc = ips_plan_writes(records, record_count, &ctx->writes, &ctx->write_count);
+    free(records);
+    if (rc != 0) {
+        return PATCH_ERR_IO;
+    }
+    if (ctx->has_truncate_size) {
+        ips_clip_writes(ctx);
+    }
+    rombp_log_debug("Planned %ld %s writes from %ld records\n",
+                    (long int)ctx->write_count, ctx->variant->name, (long int)record_count);
+    for (size_t i = 0; i < ctx->write_count; i++) {
+        ctx->total_bytes += ctx->writes[i].length;
+    }
+
+    uint64_t input_size;
+    rc = ips_input_size(source, input_file, &input_size);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+    uint64_t output_size = ips_output_size(ctx, input_size);
+
+    // Load the whole input into memory, so hunks can be applied without any seeking.
+    // The buffer is allocated once, big enough for the input and the patched output.
+    // If we can't fit it in memory, fall back to patching the output file in place.
+    if (mode != APPLY_MODE_STREAM) {
+        rc = MAX(input_size, output_size) <= SIZE_MAX ?
+            patch_buffer_reserve(&ctx->output, MAX(input_size, output_size)) : PATCH_ERR_IO;
+        if (rc == PATCH_OK && source != NULL) {
+            rc = patch_buffer_resize(&ctx->output, MIN(input_size, output_size));
+            if (rc == PATCH_OK) {
+                memcpy(ctx->output.data, source->data.data, ctx->output.size);
             }
-            if (feof(ips_file) != 0) {
-                rombp_log_err("Unexpected EOF while trying to read payload from IPS file, remaining: %ld, ips file pos: %ld, nread: %ld\n", (long int)length_remaining, ftell(ips_file), (long int)nread);
-                return -1;
+        } else if (rc == PATCH_OK) {
+            rc = patch_buffer_read_file(&ctx->output, input_file);
+        }
+        if (rc == PATCH_OK) {
+            rc = patch_buffer_resize(&ctx->output, output_size);
+        }
+        if (rc == PATCH_OK) {
+            ctx->in_memory = 1;
+            return PATCH_OK;
+        }
+        patch_buffer_free(&ctx->output);
+        if (mode == APPLY_MODE_MEMORY) {
+            rombp_log_err("Could not load input file into memory\n");
+            return PATCH_ERR_IO;
+        }
+        rombp_log_debug("Could not load input file into memory, patching output file in place\n");
+        if (source == NULL) {
+            rc = patch_seek(input_file, 0);
+            if (rc == -1) {
+                rombp_log_err("Failed to seek input file back to beginning, error: %d\n", errno);
+                return PATCH_ERR_IO;
             }
         }
-        nwritten = fwrite(&buf, 1, nread, output_file);
-        if (nwritten < nread) {
-            rombp_log_err("Failed to write all data to output file, expected to write: %ld bytes, wrote: %ld\n", (long int)nread, (long int)nwritten);
+    }
+
+    // Once the header is verified, copy the input to output, and patch that copy in place.
+    if (source != NULL) {
+        rc = patch_buffer_write_file(&source->data, output_file);
+        ctx->copy_strategy = COPY_STRATEGY_FROM_MEMORY;
+    } else {
+        rc = patch_copy_file(input_file, output_file, &ctx->copy_strategy);
+    }
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to copy input file to output file: %d\n", rc);
+        return PATCH_ERR_IO;
+    }
+    ctx->output_fd = fileno(output_file);
+
+    return ips_size_output_file(ctx->output_fd, input_size, output_size);
+}
+
+// Write the rle_value to the output file rle_hunk_length times, starting at offset. The run
+// is filled into a buffer once and written out in BUF_SIZE chunks.
+static int ips_write_rle_hunk(int output_fd, uint64_t offset, uint32_t rle_hunk_length, uint8_t rle_value) {
+    uint8_t buf[BUF_SIZE];
+
+    memset(buf, rle_value, MIN(BUF_SIZE, rle_hunk_length));
+
+    size_t length_remaining = rle_hunk_length;
+    while (length_remaining > 0) {
+        size_t amount_to_write = MIN(BUF_SIZE, length_remaining);
+        if (patch_pwrite(output_fd, buf, amount_to_write, offset) != PATCH_OK) {
+            rombp_log_err("Failed to write RLE run, length: %d, value: %d, remaining: %ld\n",
+                          rle_hunk_length, rle_value, (long int)length_remaining);
             return -1;
         }
-        length_remaining -= nwritten;
+        offset += amount_to_write;
+        length_remaining -= amount_to_write;
     }
 
     return 0;
 }
 
-static int ips_patch_hunk(ips_hunk_header* hunk_header, FILE* input_file, FILE* output_file, FILE* ips_file) {
-    // Seek the output file to the specified hunk offset
-    int rc = fseek(output_file, hunk_header->offset, SEEK_SET);
-    if (rc == -1) {
-        rombp_log_err("Error seeking output file to offset: %d, error: %d\n",
-                      hunk_header->offset, errno);
-        return rc;
+// For normal hunks (non-RLE encoded), copy the payload from the in-memory patch to its
+// offset in the output.
+static int ips_write_hunk(patch_buffer* patch, int output_fd, ips_write* write) {
+    if (patch_pwrite(output_fd, patch->data + write->patch_offset, write->length, write->offset) != PATCH_OK) {
+        rombp_log_err("Failed to write all data to output file, expected to write: %ld bytes\n",
+                      (long int)write->length);
+        return -1;
     }
 
-    rombp_log_info("Hunk RLE: %d, offset: %d, length: %d, ips_offset: %ld\n",
-                   hunk_header->length == 0,
-                   hunk_header->offset,
-                   hunk_header->length,
-                   ftell(ips_file));
+    return 0;
+}
 
-    // 0 length header means the hunk is run length encoded (RLE).
-    // We have to look into the payload to determine how big the hunk
-    // is.
-    if (hunk_header->length == 0) {
-        uint32_t rle_hunk_length;
-        uint8_t rle_value;
-        rc = ips_get_rle_payload(ips_file, &rle_hunk_length, &rle_value);
-        if (rc < 0) {
-            rombp_log_err("Failed to find RLE payload length, err: %d\n", rc);
-            return rc;
+static int ips_patch_write(ips_context* ctx, ips_write* write) {
+    if (ctx->in_memory) {
+        uint8_t* dest = ctx->output.data + write->offset;
+        if (write->is_rle) {
+            memset(dest, write->rle_value, write->length);
+        } else {
+            memcpy(dest, ctx->patch.data + write->patch_offset, write->length);
         }
-        rc = ips_write_rle_hunk(output_file, rle_hunk_length, rle_value);
+        return 0;
+    }
+
+    if (write->is_rle) {
+        int rc = ips_write_rle_hunk(ctx->output_fd, write->offset, write->length, write->rle_value);
         if (rc < 0) {
             rombp_log_err("Failed to write RLE hunk value to output, rle length: %d, rle value: %d\n",
-                          rle_hunk_length, rle_value);
-            return rc;
-        }
-    } else {
-        rc = ips_write_hunk(ips_file, output_file, hunk_header->length);
-        if (rc < 0) {
-            rombp_log_err("Failed writing non-RLE hunk value to output, length: %d\n",
-                          hunk_header->length);
-            return rc;
+                          write->length, write->rle_value);
         }
+        return rc;
     }
 
-    return 0;
+    int rc = ips_write_hunk(&ctx->patch, ctx->output_fd, write);
+    if (rc < 0) {
+        rombp_log_err("Failed writing non-RLE hunk value to output, length: %d\n", write->length);
+    }
+    return rc;
 }
 
-rombp_hunk_iter_status ips_next(FILE* input_file, FILE* output_file, FILE* ips_file) {
-    ips_hunk_header hunk_header;
-
-    int rc = ips_next_hunk_header(ips_file, &hunk_header);
-    if (rc < 0) {
-        rombp_log_err("Error getting next hunk, at hunk count: %d\n", rc);
-        return HUNK_ERR_IO;
-    } else if (rc == HUNK_DONE) {
+// Apply the next run of planned writes. Writes are sorted and don't overlap, so the output
+// is written front to back. Streaming writes go straight to their offset with pwrite.
+rombp_hunk_iter_status ips_next(ips_context* ctx) {
+    if (ctx->next_write >= ctx->write_count) {
         return HUNK_DONE;
-    } else {
-        assert(rc == HUNK_NEXT);
-        rc = ips_patch_hunk(&hunk_header, input_file, output_file, ips_file);
+    }
+
+    ips_write* write = &ctx->writes[ctx->next_write];
+    uint64_t run_offset = write->offset;
+    uint64_t run_end = run_offset;
+
+    while (ctx->next_write < ctx->write_count && write->offset == run_end) {
+        uint64_t begin = rombp_stats_begin(ctx->stats);
+        int rc = ips_patch_write(ctx, write);
         if (rc < 0) {
             rombp_log_err("Failed to patch next hunk: %d\n", rc);
             return HUNK_ERR_IO;
         }
+        rombp_stats_add_command(ctx->stats, write->is_rle ? IPS_RLE : IPS_RECORD, write->length, begin);
+        run_end += write->length;
+        write = &ctx->writes[++ctx->next_write];
+    }
+    ctx->bytes_written += run_end - run_offset;
 
-        return HUNK_NEXT;
+    rombp_log_trace("Hunk offset: %ld, length: %ld\n", (long int)run_offset, (long int)(run_end - run_offset));
+    return HUNK_NEXT;
+}
+
+rombp_patch_err ips_end(ips_context* ctx, FILE* output_file) {
+    if (!ctx->in_memory || output_file == NULL) {
+        return PATCH_OK;
     }
+
+    rombp_log_debug("Writing %ld byte patched image to output file\n", (long int)ctx->output.size);
+    return patch_buffer_write_file(&ctx->output, output_file);
+}
+
+rombp_patch_err ips_take_output(ips_context* ctx, patch_source* output) {
+    if (!ctx->in_memory) {
+        rombp_log_err("IPS output image is not in memory\n");
+        return PATCH_ERR_IO;
+    }
+    uint64_t begin = rombp_stats_begin(ctx->stats);
+    output->data = ctx->output;
+    output->crc32 = crc32_update(0, output->data.data, output->data.size);
+    rombp_stats_add_phase(ctx->stats, STATS_PHASE_CRC, output->data.size, begin);
+    patch_buffer_init(&ctx->output);
+    return PATCH_OK;
+}
+
+void ips_free(ips_context* ctx) {
+    patch_buffer_free(&ctx->output);
+    patch_buffer_free(&ctx->patch);
+    free(ctx->writes);
+    ctx->writes = NULL;
 }
- 
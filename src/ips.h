@@ -6,13 +6,75 @@
 
 #include "patch.h"
 
+// Every IPS patch starts with PATCH, and every IPS32 patch with IPS32.
+#define IPS_MARKER_SIZE 5
+extern const uint8_t IPS_MARKER[IPS_MARKER_SIZE];
+extern const uint8_t IPS32_MARKER[IPS_MARKER_SIZE];
+
 typedef struct ips_hunk_header {
     uint32_t offset;
     uint16_t length;
 } ips_hunk_header;
 
-rombp_patch_err ips_verify_marker(FILE* ips_file);
-rombp_patch_err ips_start(FILE* input_file, FILE* output_file);
-rombp_hunk_iter_status ips_next(FILE* input_file, FILE* output_file, FILE* ips_file);
+// A single write to the output: length bytes at offset, either a run of
+// rle_value, or copied from the patch buffer at patch_offset.
+typedef struct ips_write {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t patch_offset;
+    uint8_t is_rle;
+    uint8_t rle_value;
+} ips_write;
+
+// Kinds of write, as counted in the stats report.
+typedef enum ips_command_type {
+    IPS_RECORD = 0,
+    IPS_RLE = 1,
+} ips_command_type;
+
+typedef struct ips_context {
+    // When set, hunks are applied to the output buffer, and the whole
+    // image is written to the output file once by ips_end. Otherwise
+    // hunks are written straight to the output file.
+    int in_memory;
+    patch_buffer output;
+    // Otherwise, how the input was copied to the output file, and the
+    // descriptor that hunks are then written to in place.
+    rombp_copy_strategy copy_strategy;
+    int output_fd;
+
+    // The patch records, planned by ips_start into non-overlapping
+    // writes sorted by offset.
+    patch_buffer patch;
+    ips_write* writes;
+    size_t write_count;
+    size_t next_write;
+
+    // IPS or IPS32, from the patch's marker.
+    const struct ips_variant* variant;
+    // Set when the patch ends with a truncation size, after its EOF marker. The
+    // output is then exactly truncate_size bytes, cut down or padded with zeroes.
+    int has_truncate_size;
+    uint64_t truncate_size;
+
+    // Progress: bytes of planned writes applied so far, out of the total.
+    size_t bytes_written;
+    size_t total_bytes;
+
+    struct rombp_stats* stats;
+} ips_context;
+
+// When source is set, it's used in place of reading input_file.
+rombp_patch_err ips_start(ips_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                          FILE* input_file, FILE* output_file, FILE* ips_file);
+// Apply the next run of writes that touch each other, as one hunk. Records
+// that overlap or follow on from one another count as a single hunk, so
+// there can be fewer hunks than records.
+rombp_hunk_iter_status ips_next(ips_context* ctx);
+rombp_patch_err ips_end(ips_context* ctx, FILE* output_file);
+// Move the patched in-memory image into output, so it can be the source of
+// another patch. Only valid after ips_end, for a context started in memory.
+rombp_patch_err ips_take_output(ips_context* ctx, patch_source* output);
+void ips_free(ips_context* ctx);
 
 #endif
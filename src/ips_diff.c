@@ -0,0 +1,424 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "ips.h"
+#include "ips_diff.h"
+#include "log.h"
+
+// Record costs, in patch bytes: a 3 byte offset and 2 byte length, followed
+// by either the payload, or an RLE length and value.
+static const uint32_t RECORD_HEADER_SIZE = 5;
+static const uint32_t RLE_RECORD_SIZE = 8;
+static const size_t MAX_RECORD_LENGTH = 0xFFFF;
+// Offsets have to fit in 24 bits
+static const size_t MAX_TARGET_SIZE = 0x1000000;
+// A record at this offset would read as the EOF marker
+static const size_t EOF_OFFSET = 0x454F46;
+// A run of at least this many unchanged bytes always ends a record, unless
+// a single RLE record could cover it.
+static const size_t MIN_SPLIT_GAP = 8;
+
+static const uint32_t UNREACHABLE = 0x3FFFFFFF;
+
+static const uint8_t IPS_EOF[] = { 0x45, 0x4F, 0x46 }; // EOF
+
+// What to do with a byte when no record is open
+enum {
+    STEP_SKIP = 0,
+    STEP_OPEN = 1,
+    STEP_RLE = 2,
+};
+// What to do with a byte when a plain record is open. Kept in the high bit.
+static const uint8_t STEP_EXTEND = 0x80;
+
+typedef struct ips_diff_encoder {
+    const uint8_t* reference;
+    const uint8_t* target;
+    size_t target_size;
+    // The last byte has to be written even if it matches, to grow the output
+    int write_last;
+
+    // Per segment position: minimum cost with no record open, and the choices
+    uint32_t* cost;
+    uint8_t* steps;
+    size_t capacity;
+
+    patch_buffer* patch;
+    rombp_patch_err err;
+} ips_diff_encoder;
+
+// Index of the first byte where a and b differ, or n.
+static size_t ips_diff_mismatch(const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 64 <= n; i += 64) {
+        __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                     _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)),
+                                     _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)),
+                                     _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)),
+                                     _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        __m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            break;
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                                    _mm_loadu_si128((const __m128i*)(b + i))));
+        if (mask != 0xFFFF) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        if (vminvq_u8(eq) != 0xFF) {
+            break;
+        }
+    }
+#elif defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        if (x != y) {
+            return i + (__builtin_ctzll(x ^ y) >> 3);
+        }
+    }
+#endif
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Index of the first byte where a and b match, or n.
+static size_t ips_diff_match(const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+                                                    _mm_loadu_si128((const __m128i*)(b + i))));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        if (vmaxvq_u8(eq) != 0) {
+            break;
+        }
+    }
+#endif
+    while (i < n && a[i] != b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Offset of the next byte at or after pos that a record has to cover.
+static size_t ips_diff_next_change(const ips_diff_encoder* encoder, size_t pos) {
+    size_t n = encoder->target_size;
+    if (pos >= n) {
+        return n;
+    }
+    pos += ips_diff_mismatch(encoder->reference + pos, encoder->target + pos, n - pos);
+    if (pos == n && encoder->write_last) {
+        return n - 1;
+    }
+    return pos;
+}
+
+// Offset of the next byte at or after pos that doesn't need a record.
+static size_t ips_diff_next_unchanged(const ips_diff_encoder* encoder, size_t pos) {
+    size_t n = encoder->target_size;
+    if (pos >= n) {
+        return n;
+    }
+    pos += ips_diff_match(encoder->reference + pos, encoder->target + pos, n - pos);
+    if (pos == n - 1 && encoder->write_last) {
+        return n;
+    }
+    return pos;
+}
+
+static int ips_diff_must_write(const ips_diff_encoder* encoder, size_t pos) {
+    return encoder->reference[pos] != encoder->target[pos] ||
+        (encoder->write_last && pos == encoder->target_size - 1);
+}
+
+// Whether target[from, to] is a single run of one byte value.
+static int ips_diff_is_run(const uint8_t* target, size_t from, size_t to) {
+    for (size_t i = from + 1; i <= to; i++) {
+        if (target[i] != target[from]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Length of the run of equal bytes starting at pos, up to end, capped at one record.
+static size_t ips_diff_run_length(const uint8_t* target, size_t pos, size_t end) {
+    size_t limit = end - pos < MAX_RECORD_LENGTH ? end : pos + MAX_RECORD_LENGTH;
+    size_t i = pos + 1;
+    while (i < limit && target[i] == target[pos]) {
+        i++;
+    }
+    return i - pos;
+}
+
+static void ips_diff_put(ips_diff_encoder* encoder, const void* data, size_t len) {
+    if (encoder->err != PATCH_OK) {
+        return;
+    }
+    size_t offset = encoder->patch->size;
+    encoder->err = patch_buffer_resize(encoder->patch, offset + len);
+    if (encoder->err == PATCH_OK) {
+        memcpy(encoder->patch->data + offset, data, len);
+    }
+}
+
+static void ips_diff_put_header(ips_diff_encoder* encoder, size_t offset, size_t length) {
+    uint8_t buf[] = {
+        (offset >> 16) & 0xFF, (offset >> 8) & 0xFF, offset & 0xFF,
+        (length >> 8) & 0xFF, length & 0xFF,
+    };
+    ips_diff_put(encoder, buf, sizeof(buf));
+}
+
+static void ips_diff_put_rle(ips_diff_encoder* encoder, size_t offset, size_t length) {
+    uint8_t buf[] = { (length >> 8) & 0xFF, length & 0xFF, encoder->target[offset] };
+    ips_diff_put_header(encoder, offset, 0);
+    ips_diff_put(encoder, buf, sizeof(buf));
+}
+
+// Write target[start, end) as plain records, split at the record length
+// limit. A split never lands on the EOF offset.
+static void ips_diff_put_plain(ips_diff_encoder* encoder, size_t start, size_t end) {
+    while (start < end) {
+        size_t length = end - start < MAX_RECORD_LENGTH ? end - start : MAX_RECORD_LENGTH;
+        if (start + length == EOF_OFFSET && start + length < end) {
+            length--;
+        }
+        ips_diff_put_header(encoder, start, length);
+        ips_diff_put(encoder, encoder->target + start, length);
+        start += length;
+    }
+}
+
+// Find the cheapest records covering every change in target[start, end),
+// working backwards. cost[k] is the cheapest way to cover [start + k, end)
+// with no record open at start + k. With a plain record open, the next byte
+// can be added to it for one byte, or the record closed.
+static void ips_diff_plan(ips_diff_encoder* encoder, size_t start, size_t end) {
+    const uint8_t* target = encoder->target;
+    size_t m = end - start;
+    uint32_t* cost = encoder->cost;
+    uint8_t* steps = encoder->steps;
+    uint32_t open_cost = 0;
+    size_t run = 0;
+
+    cost[m] = 0;
+    for (size_t k = m; k-- > 0;) {
+        size_t pos = start + k;
+        int can_start = pos != EOF_OFFSET;
+        run = k + 1 < m && target[pos] == target[pos + 1] ? run + 1 : 1;
+        size_t rle_length = run < MAX_RECORD_LENGTH ? run : MAX_RECORD_LENGTH;
+
+        // open_cost still holds the cost from k + 1 with a record open
+        uint32_t extend = open_cost + 1;
+        uint32_t best = UNREACHABLE;
+        uint8_t step = STEP_SKIP;
+        if (!ips_diff_must_write(encoder, pos)) {
+            best = cost[k + 1];
+        }
+        if (can_start && RECORD_HEADER_SIZE + extend < best) {
+            best = RECORD_HEADER_SIZE + extend;
+            step = STEP_OPEN;
+        }
+        if (can_start && RLE_RECORD_SIZE + cost[k + rle_length] < best) {
+            best = RLE_RECORD_SIZE + cost[k + rle_length];
+            step = STEP_RLE;
+        }
+        cost[k] = best;
+
+        if (extend < best) {
+            open_cost = extend;
+            step |= STEP_EXTEND;
+        } else {
+            open_cost = best;
+        }
+        steps[k] = step;
+    }
+}
+
+// Follow the planned steps forwards, writing out the records.
+static void ips_diff_emit(ips_diff_encoder* encoder, size_t start, size_t end) {
+    const uint8_t* steps = encoder->steps;
+    size_t m = end - start;
+    size_t plain_start = 0;
+    int open = 0;
+    size_t k = 0;
+
+    while (k < m) {
+        if (open) {
+            if (steps[k] & STEP_EXTEND) {
+                k++;
+                continue;
+            }
+            ips_diff_put_plain(encoder, start + plain_start, start + k);
+            open = 0;
+        }
+        switch (steps[k] & ~STEP_EXTEND) {
+            case STEP_SKIP:
+                k++;
+                break;
+            case STEP_OPEN:
+                plain_start = k;
+                open = 1;
+                k++;
+                break;
+            case STEP_RLE: {
+                size_t length = ips_diff_run_length(encoder->target, start + k, end);
+                ips_diff_put_rle(encoder, start + k, length);
+                k += length;
+                break;
+            }
+        }
+    }
+    if (open) {
+        ips_diff_put_plain(encoder, start + plain_start, end);
+    }
+}
+
+static rombp_patch_err ips_diff_segment(ips_diff_encoder* encoder, size_t start, size_t end) {
+    size_t m = end - start;
+    if (m + 1 > encoder->capacity) {
+        size_t capacity = encoder->capacity == 0 ? 4096 : encoder->capacity;
+        while (capacity < m + 1) {
+            capacity *= 2;
+        }
+        uint32_t* cost = realloc(encoder->cost, capacity * sizeof(uint32_t));
+        if (cost != NULL) {
+            encoder->cost = cost;
+        }
+        uint8_t* steps = realloc(encoder->steps, capacity);
+        if (steps != NULL) {
+            encoder->steps = steps;
+        }
+        if (cost == NULL || steps == NULL) {
+            rombp_log_err("Failed to allocate IPS diff plan\n");
+            return PATCH_ERR_IO;
+        }
+        encoder->capacity = capacity;
+    }
+
+    ips_diff_plan(encoder, start, end);
+    ips_diff_emit(encoder, start, end);
+    return encoder->err;
+}
+
+// Split the changes into segments separated by long unchanged runs, and
+// plan each one on its own.
+static rombp_patch_err ips_diff_encode_records(ips_diff_encoder* encoder) {
+    const uint8_t* target = encoder->target;
+    size_t n = encoder->target_size;
+    size_t pos = ips_diff_next_change(encoder, 0);
+
+    while (pos < n) {
+        // Nothing can start at the EOF offset, so give the segment a byte to start from
+        size_t start = pos == EOF_OFFSET ? pos - 1 : pos;
+        size_t end = ips_diff_next_unchanged(encoder, pos + 1);
+        while (end < n) {
+            size_t next = ips_diff_next_change(encoder, end);
+            if (next >= n) {
+                break;
+            }
+            size_t gap = next - end;
+            if (gap >= MIN_SPLIT_GAP &&
+                (gap >= MAX_RECORD_LENGTH || !ips_diff_is_run(target, end - 1, next))) {
+                break;
+            }
+            end = ips_diff_next_unchanged(encoder, next + 1);
+        }
+
+        rombp_patch_err rc = ips_diff_segment(encoder, start, end);
+        if (rc != PATCH_OK) {
+            return rc;
+        }
+        pos = ips_diff_next_change(encoder, end);
+    }
+    return PATCH_OK;
+}
+
+rombp_patch_err ips_diff(const patch_source* source, const patch_source* target, patch_buffer* patch) {
+    ips_diff_encoder encoder;
+    patch_buffer padded;
+
+    if (target->data.size > MAX_TARGET_SIZE) {
+        rombp_log_err("Target is too large for IPS: %ld bytes\n", (long)target->data.size);
+        return PATCH_INVALID_OUTPUT_SIZE;
+    }
+
+    // Output past the end of the source starts out zero filled, so compare
+    // against a zero padded copy.
+    patch_buffer_init(&padded);
+    encoder.reference = source->data.data;
+    if (target->data.size > source->data.size) {
+        rombp_patch_err rc = patch_buffer_resize(&padded, target->data.size);
+        if (rc != PATCH_OK) {
+            rombp_log_err("Failed to allocate IPS diff reference\n");
+            return rc;
+        }
+        if (source->data.size > 0) {
+            memcpy(padded.data, source->data.data, source->data.size);
+        }
+        encoder.reference = padded.data;
+    }
+
+    encoder.target = target->data.data;
+    encoder.target_size = target->data.size;
+    encoder.write_last = target->data.size > source->data.size;
+    encoder.cost = NULL;
+    encoder.steps = NULL;
+    encoder.capacity = 0;
+    encoder.patch = patch;
+    encoder.err = PATCH_OK;
+
+    patch->size = 0;
+    ips_diff_put(&encoder, IPS_MARKER, IPS_MARKER_SIZE);
+    rombp_patch_err rc = ips_diff_encode_records(&encoder);
+    ips_diff_put(&encoder, IPS_EOF, sizeof(IPS_EOF));
+
+    // Lunar IPS extension: the size to truncate the output to
+    if (target->data.size < source->data.size) {
+        size_t size = target->data.size;
+        uint8_t buf[] = { (size >> 16) & 0xFF, (size >> 8) & 0xFF, size & 0xFF };
+        ips_diff_put(&encoder, buf, sizeof(buf));
+    }
+
+    free(encoder.cost);
+    free(encoder.steps);
+    patch_buffer_free(&padded);
+
+    if (rc == PATCH_OK) {
+        rc = encoder.err;
+    }
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to encode IPS patch: %d\n", rc);
+        return rc;
+    }
+    rombp_log_info("Encoded %ld byte IPS patch for a %ld byte target\n", (long)patch->size, (long)encoder.target_size);
+    return PATCH_OK;
+}
@@ -0,0 +1,12 @@
+#ifndef ROMBP_IPS_DIFF_H_
+#define ROMBP_IPS_DIFF_H_
+
+#include "patch.h"
+
+// Encode an IPS patch that turns source into target, into patch. The patch
+// is the smallest one that can be built from plain and RLE records. Targets
+// over 16 MiB can't be addressed by IPS. Targets shorter than the source get
+// a truncation size after the EOF marker.
+rombp_patch_err ips_diff(const patch_source* source, const patch_source* target, patch_buffer* patch);
+
+#endif
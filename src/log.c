@@ -0,0 +1,3 @@
+#include "log.h"
+
+int rombp_log_level = ROMBP_LOG_INFO;
@@ -1,12 +1,57 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <stdio.h>
+
+// Log levels, most severe first. Errors go to stderr, the rest to stdout.
+#define ROMBP_LOG_ERR 0
+#define ROMBP_LOG_INFO 1
+// How a patch is being applied: engine modes, buffer sizes, fallbacks.
+#define ROMBP_LOG_DEBUG 2
+// Every hunk, command or window. Slows big patches down a lot.
+#define ROMBP_LOG_TRACE 3
+
+// Most verbose level compiled in. Calls at a more verbose level compile to
+// nothing, arguments and all.
+#ifndef ROMBP_LOG_LEVEL
+#if defined(TARGET_RG350) || defined(ROMBP_DISABLE_INFO_LOG)
+// Disable info logging when on device, or when benchmarking.
+#define ROMBP_LOG_LEVEL ROMBP_LOG_ERR
+#else
+#define ROMBP_LOG_LEVEL ROMBP_LOG_TRACE
+#endif
+#endif
+
+// Most verbose level logged, of those compiled in. ROMBP_LOG_INFO unless the
+// command line changes it, before any patching starts.
+extern int rombp_log_level;
+
+// Arguments are only evaluated when the level is logged.
+#define rombp_log_at(LEVEL, STREAM, MSG, ...) \
+    do { \
+        if ((LEVEL) <= rombp_log_level) { \
+            fprintf(STREAM, MSG, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
 #define rombp_log_err(MSG, ...) fprintf(stderr, MSG, ##__VA_ARGS__)
-#ifdef TARGET_RG350
-// Disable info logging when on device.
-#define rombp_log_info(MSG, ...) {};
+
+#if ROMBP_LOG_LEVEL >= ROMBP_LOG_INFO
+#define rombp_log_info(MSG, ...) rombp_log_at(ROMBP_LOG_INFO, stdout, MSG, ##__VA_ARGS__)
+#else
+#define rombp_log_info(MSG, ...) do {} while (0)
+#endif
+
+#if ROMBP_LOG_LEVEL >= ROMBP_LOG_DEBUG
+#define rombp_log_debug(MSG, ...) rombp_log_at(ROMBP_LOG_DEBUG, stdout, MSG, ##__VA_ARGS__)
+#else
+#define rombp_log_debug(MSG, ...) do {} while (0)
+#endif
+
+#if ROMBP_LOG_LEVEL >= ROMBP_LOG_TRACE
+#define rombp_log_trace(MSG, ...) rombp_log_at(ROMBP_LOG_TRACE, stdout, MSG, ##__VA_ARGS__)
 #else
-#define rombp_log_info(MSG, ...) fprintf(stdout, MSG, ##__VA_ARGS__)
+#define rombp_log_trace(MSG, ...) do {} while (0)
 #endif
 
 #endif
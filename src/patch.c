@@ -1,55 +1,466 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
 
+#include "crc32.h"
 #include "log.h"
 #include "patch.h"
 
-rombp_patch_err patch_verify_marker(FILE* patch_file, const uint8_t* expected_header, const size_t header_size) {
-    uint8_t buf[header_size];
+void patch_status_init(rombp_patch_status* status) {
+    status->is_done = 0;
+    status->iter_status = HUNK_NONE;
+    status->err = PATCH_OK;
+    status->hunk_count = 0;
+    status->bytes_written = 0;
+    status->total_bytes = 0;
+    status->copy_strategy = COPY_STRATEGY_NONE;
+}
+
+int patch_status_percent(const rombp_patch_status* status) {
+    if (status->total_bytes == 0) {
+        return status->is_done ? 100 : 0;
+    }
+    return (int)((uint64_t)status->bytes_written * 100 / status->total_bytes);
+}
+
+void patch_shared_status_init(rombp_shared_patch_status* shared) {
+    rombp_patch_status status;
+
+    atomic_init(&shared->seq, 0);
+    patch_status_init(&status);
+    patch_shared_status_publish(shared, &status);
+}
+
+void patch_shared_status_publish(rombp_shared_patch_status* shared, const rombp_patch_status* status) {
+    unsigned int seq = atomic_load_explicit(&shared->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&shared->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&shared->is_done, status->is_done, memory_order_relaxed);
+    atomic_store_explicit(&shared->iter_status, status->iter_status, memory_order_relaxed);
+    atomic_store_explicit(&shared->err, status->err, memory_order_relaxed);
+    atomic_store_explicit(&shared->hunk_count, status->hunk_count, memory_order_relaxed);
+    atomic_store_explicit(&shared->bytes_written, status->bytes_written, memory_order_relaxed);
+    atomic_store_explicit(&shared->total_bytes, status->total_bytes, memory_order_relaxed);
+    atomic_store_explicit(&shared->copy_strategy, status->copy_strategy, memory_order_relaxed);
 
-    size_t nread = fread(&buf, 1, header_size, patch_file);
-    if (nread < header_size) {
-        rombp_log_err("Header malformed, expected to get at least %ld bytes in the patch file, read: %ld\n", (long int)header_size, (long int)nread);
-        return PATCH_INVALID_HEADER;
+    atomic_store_explicit(&shared->seq, seq + 2, memory_order_release);
+}
+
+void patch_shared_status_read(rombp_shared_patch_status* shared, rombp_patch_status* status) {
+    unsigned int begin;
+    unsigned int end;
+
+    do {
+        begin = atomic_load_explicit(&shared->seq, memory_order_acquire);
+
+        status->is_done = atomic_load_explicit(&shared->is_done, memory_order_relaxed);
+        status->iter_status = atomic_load_explicit(&shared->iter_status, memory_order_relaxed);
+        status->err = atomic_load_explicit(&shared->err, memory_order_relaxed);
+        status->hunk_count = atomic_load_explicit(&shared->hunk_count, memory_order_relaxed);
+        status->bytes_written = atomic_load_explicit(&shared->bytes_written, memory_order_relaxed);
+        status->total_bytes = atomic_load_explicit(&shared->total_bytes, memory_order_relaxed);
+        status->copy_strategy = atomic_load_explicit(&shared->copy_strategy, memory_order_relaxed);
+
+        atomic_thread_fence(memory_order_acquire);
+        end = atomic_load_explicit(&shared->seq, memory_order_relaxed);
+    } while ((begin & 1) != 0 || begin != end);
+}
+
+static const size_t CRC32_BUF_SIZE = 1024 * 1024;
+
+static atomic_size_t patch_seeks;
+
+int patch_seek(FILE* file, long offset) {
+    atomic_fetch_add_explicit(&patch_seeks, 1, memory_order_relaxed);
+    return fseek(file, offset, SEEK_SET);
+}
+
+uint64_t patch_seek_count() {
+    return atomic_load_explicit(&patch_seeks, memory_order_relaxed);
+}
+
+// CRC32 the first length bytes of the file. Reads through the file descriptor with
+// pread, so the stream position is left alone and this is safe to run alongside
+// other readers of the same file.
+rombp_patch_err patch_crc32_file(FILE* file, uint64_t length, uint32_t* crc32) {
+    int fd = fileno(file);
+    if (fd == -1) {
+        rombp_log_err("Bad file, is the stream closed?\n");
+        return PATCH_ERR_IO;
+    }
+    uint8_t* buf = malloc(CRC32_BUF_SIZE);
+    if (buf == NULL) {
+        rombp_log_err("Failed to allocate CRC32 buffer\n");
+        return PATCH_ERR_IO;
     }
 
-    for (int i = 0; i < header_size; i++) {
-        if (expected_header[i] != buf[i]) {
-            rombp_log_err("Marker at byte %d doesn't match. Value: %d\n", i, buf[i]);
-            return PATCH_INVALID_HEADER;
+    uint32_t crc = 0;
+    uint64_t offset = 0;
+    while (offset < length) {
+        size_t amount_to_read = MIN(CRC32_BUF_SIZE, length - offset);
+        ssize_t nread = pread(fd, buf, amount_to_read, offset);
+        if (nread <= 0) {
+            rombp_log_err("Failed to read file for CRC32 at offset: %ld, errno: %d\n", (long int)offset, errno);
+            free(buf);
+            return PATCH_ERR_IO;
         }
+        crc = crc32_update(crc, buf, nread);
+        offset += nread;
     }
 
+    free(buf);
+    *crc32 = crc;
     return PATCH_OK;
 }
 
-void patch_status_reset(rombp_patch_status* status) {
-    status->is_done = 0;
-    status->iter_status = HUNK_NONE;
-    status->err = PATCH_OK;
-    status->hunk_count = 0;
+// The read/write copy buffer is sized to the file, between these bounds, and
+// halved down to COPY_BUF_MIN_SIZE if it can't be allocated.
+static const size_t COPY_BUF_MIN_SIZE = 64 * 1024;
+static const size_t COPY_BUF_SMALL_SIZE = 1024 * 1024;
+static const size_t COPY_BUF_MAX_SIZE = 8 * 1024 * 1024;
+// Largest single kernel copy request, so 32-bit counts never overflow.
+static const size_t COPY_CHUNK_SIZE = 1024 * 1024 * 1024;
+
+// Each copy returns 1 on success, 0 when it isn't supported for this pair of
+// files, and -1 when it fails part way. Every copy writes the output from
+// offset 0, so after either failure the next strategy can simply start over.
+
+static int copy_reflink(int infd, int outfd) {
+#if defined(__linux__) && defined(FICLONE)
+    if (ioctl(outfd, FICLONE, infd) == 0) {
+        return 1;
+    }
+    rombp_log_debug("Can't reflink input file to output, errno: %d\n", errno);
+#endif
+    return 0;
 }
 
-void patch_status_init(rombp_patch_status* status) {
-    patch_status_reset(status);
-    int rc = pthread_mutex_init(&status->lock, NULL);
-    if (rc != 0) {
-        rombp_log_err("Failed to initalize mutex: %d\n", rc);
-        exit(-1);
+static int copy_kernel_range(int infd, int outfd, uint64_t length) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    loff_t in_offset = 0;
+    loff_t out_offset = 0;
+    while ((uint64_t)in_offset < length) {
+        size_t amount_to_copy = MIN(COPY_CHUNK_SIZE, length - in_offset);
+        ssize_t ncopied = syscall(SYS_copy_file_range, infd, &in_offset, outfd, &out_offset, amount_to_copy, 0);
+        if (ncopied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ncopied <= 0) {
+            if (in_offset == 0 && ncopied == -1) {
+                rombp_log_debug("Can't copy_file_range input file to output, errno: %d\n", errno);
+                return 0;
+            }
+            rombp_log_err("copy_file_range stopped at offset: %ld, errno: %d\n", (long int)in_offset, errno);
+            return -1;
+        }
     }
+    return 1;
+#else
+    return 0;
+#endif
 }
 
-void patch_status_copy(rombp_patch_status* dest, rombp_patch_status* src) {
-    // Copy fields manually, to avoid copying the mutex
-    dest->is_done = src->is_done;
-    dest->iter_status = src->iter_status;
-    dest->err = src->err;
-    dest->hunk_count = src->hunk_count;
+static int copy_sendfile(int infd, int outfd, uint64_t length) {
+#if defined(__linux__)
+    // sendfile writes at the output's file offset, rather than taking one.
+    atomic_fetch_add_explicit(&patch_seeks, 1, memory_order_relaxed);
+    if (lseek(outfd, 0, SEEK_SET) == -1) {
+        return 0;
+    }
+    off_t in_offset = 0;
+    while ((uint64_t)in_offset < length) {
+        size_t amount_to_copy = MIN(COPY_CHUNK_SIZE, length - in_offset);
+        ssize_t ncopied = sendfile(outfd, infd, &in_offset, amount_to_copy);
+        if (ncopied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ncopied <= 0) {
+            if (in_offset == 0 && ncopied == -1) {
+                rombp_log_debug("Can't sendfile input file to output, errno: %d\n", errno);
+                return 0;
+            }
+            rombp_log_err("sendfile stopped at offset: %ld, errno: %d\n", (long int)in_offset, errno);
+            return -1;
+        }
+    }
+    return 1;
+#else
+    return 0;
+#endif
 }
 
-void patch_status_destroy(rombp_patch_status* status) {
-    int rc = pthread_mutex_destroy(&status->lock);
-    if (rc != 0) {
-        rombp_log_err("Failed to destroy mutex: %d\n", rc);
+// Copy through a userspace buffer, with pread and pwrite so neither stream's
+// position matters. Short reads are retried until exactly length bytes have
+// been copied; hitting the end of the input any sooner is an error.
+static int copy_read_write(int infd, int outfd, uint64_t length) {
+    size_t buf_size = MAX(COPY_BUF_SMALL_SIZE, MIN(COPY_BUF_MAX_SIZE, length / 8));
+    buf_size = MIN(buf_size, MAX(length, 1));
+    uint8_t* buf = malloc(buf_size);
+    while (buf == NULL && buf_size > COPY_BUF_MIN_SIZE) {
+        buf_size /= 2;
+        buf = malloc(buf_size);
+    }
+    if (buf == NULL) {
+        rombp_log_err("Failed to allocate copy buffer\n");
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    while (offset < length) {
+        size_t amount_to_read = MIN(buf_size, length - offset);
+        ssize_t nread = pread(infd, buf, amount_to_read, offset);
+        if (nread == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            rombp_log_err("Failed to read the entire input file, read: %ld bytes, input file size: %ld, errno: %d\n",
+                          (long int)offset, (long int)length, errno);
+            free(buf);
+            return -1;
+        }
+        if (patch_pwrite(outfd, buf, nread, offset) != PATCH_OK) {
+            free(buf);
+            return -1;
+        }
+        offset += nread;
     }
+
+    free(buf);
+    return 1;
 }
 
+rombp_patch_err patch_copy_file_using(FILE* input_file, FILE* output_file, rombp_copy_strategy strategy) {
+    struct stat input_file_stat;
+
+    int infd = fileno(input_file);
+    int outfd = fileno(output_file);
+    if (infd == -1 || outfd == -1) {
+        rombp_log_err("Bad file, is the stream closed?\n");
+        return PATCH_ERR_IO;
+    }
+    if (fstat(infd, &input_file_stat) == -1) {
+        rombp_log_err("Failed to stat input file, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    uint64_t length = input_file_stat.st_size;
+    // Anything the output stream still buffers would land on top of the copy later.
+    if (fflush(output_file) != 0) {
+        rombp_log_err("Failed to flush output file, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+
+    int rc = 0;
+    switch (strategy) {
+        case COPY_STRATEGY_REFLINK:
+            rc = copy_reflink(infd, outfd);
+            break;
+        case COPY_STRATEGY_COPY_FILE_RANGE:
+            rc = copy_kernel_range(infd, outfd, length);
+            break;
+        case COPY_STRATEGY_SENDFILE:
+            rc = copy_sendfile(infd, outfd, length);
+            break;
+        case COPY_STRATEGY_READ_WRITE:
+#if defined(POSIX_FADV_SEQUENTIAL)
+            posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            rc = copy_read_write(infd, outfd, length);
+            break;
+        default:
+            break;
+    }
+    if (rc <= 0) {
+        return PATCH_ERR_IO;
+    }
+
+    rombp_log_info("Copied %ld byte input file to output, strategy: %s\n",
+                   (long int)length, patch_copy_strategy_name(strategy));
+    return PATCH_OK;
+}
+
+rombp_patch_err patch_copy_file(FILE* input_file, FILE* output_file, rombp_copy_strategy* strategy) {
+    static const rombp_copy_strategy strategies[] = {
+        COPY_STRATEGY_REFLINK,
+        COPY_STRATEGY_COPY_FILE_RANGE,
+        COPY_STRATEGY_SENDFILE,
+        COPY_STRATEGY_READ_WRITE,
+    };
+
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+        *strategy = strategies[i];
+        if (patch_copy_file_using(input_file, output_file, strategies[i]) == PATCH_OK) {
+            return PATCH_OK;
+        }
+    }
+
+    rombp_log_err("Failed to copy input file to output\n");
+    return PATCH_ERR_IO;
+}
+
+rombp_patch_err patch_pwrite(int fd, const uint8_t* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t nwritten = pwrite(fd, data, length, offset);
+        if (nwritten <= 0) {
+            rombp_log_err("Failed to write %ld bytes at offset: %ld, errno: %d\n",
+                          (long int)length, (long int)offset, errno);
+            return PATCH_ERR_IO;
+        }
+        data += nwritten;
+        length -= nwritten;
+        offset += nwritten;
+    }
+
+    return PATCH_OK;
+}
+
+const char* patch_copy_strategy_name(rombp_copy_strategy strategy) {
+    switch (strategy) {
+        case COPY_STRATEGY_NONE:
+            return "none";
+        case COPY_STRATEGY_REFLINK:
+            return "reflink";
+        case COPY_STRATEGY_COPY_FILE_RANGE:
+            return "copy_file_range";
+        case COPY_STRATEGY_SENDFILE:
+            return "sendfile";
+        case COPY_STRATEGY_READ_WRITE:
+            return "read/write";
+        case COPY_STRATEGY_FROM_MEMORY:
+            return "from memory";
+    }
+    return "unknown";
+}
+
+void patch_buffer_init(patch_buffer* buffer) {
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+// Grow or shrink the buffer to size bytes. Newly exposed bytes are zeroed, the same
+// as writing past the end of a file would leave them.
+rombp_patch_err patch_buffer_resize(patch_buffer* buffer, size_t size) {
+    if (size > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        uint8_t* data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            rombp_log_err("Failed to grow patch buffer to %ld bytes\n", (long int)capacity);
+            return PATCH_ERR_IO;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    if (size > buffer->size) {
+        memset(buffer->data + buffer->size, 0, size - buffer->size);
+    }
+    buffer->size = size;
+
+    return PATCH_OK;
+}
+
+rombp_patch_err patch_buffer_reserve(patch_buffer* buffer, size_t capacity) {
+    if (capacity <= buffer->capacity) {
+        return PATCH_OK;
+    }
+    uint8_t* data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        rombp_log_err("Failed to grow patch buffer to %ld bytes\n", (long int)capacity);
+        return PATCH_ERR_IO;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+
+    return PATCH_OK;
+}
+
+// Read the whole file into the buffer, starting from the current file position.
+rombp_patch_err patch_buffer_read_file(patch_buffer* buffer, FILE* file) {
+    struct stat file_stat;
+
+    int fd = fileno(file);
+    if (fd == -1) {
+        rombp_log_err("Bad file, is the stream closed?\n");
+        return PATCH_ERR_IO;
+    }
+    int rc = fstat(fd, &file_stat);
+    if (rc == -1) {
+        rombp_log_err("Failed to stat file, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    long pos = ftell(file);
+    if (pos == -1) {
+        rombp_log_err("Failed to get file position, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+
+    size_t file_size = file_stat.st_size > pos ? file_stat.st_size - pos : 0;
+    rc = patch_buffer_resize(buffer, file_size);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+    size_t nread = fread(buffer->data, 1, file_size, file);
+    if (nread < file_size) {
+        rombp_log_err("Failed to read the entire file, read: %ld bytes, file size: %ld\n", (long int)nread, (long int)file_size);
+        return PATCH_ERR_IO;
+    }
+
+    return PATCH_OK;
+}
+
+rombp_patch_err patch_buffer_write_file(const patch_buffer* buffer, FILE* file) {
+    size_t nwritten = fwrite(buffer->data, 1, buffer->size, file);
+    if (nwritten < buffer->size) {
+        rombp_log_err("Failed to write buffer to file, expected to write: %ld bytes, wrote: %ld, errno: %d\n",
+                      (long int)buffer->size, (long int)nwritten, errno);
+        return PATCH_ERR_IO;
+    }
+    if (fflush(file) != 0) {
+        rombp_log_err("Failed to flush output file, errno: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+
+    return PATCH_OK;
+}
+
+void patch_buffer_free(patch_buffer* buffer) {
+    free(buffer->data);
+    patch_buffer_init(buffer);
+}
+
+rombp_patch_err patch_source_load(patch_source* source, const char* path) {
+    patch_buffer_init(&source->data);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        rombp_log_err("Failed to open source file: %s, errno: %d\n", path, errno);
+        return PATCH_ERR_IO;
+    }
+    rombp_patch_err rc = patch_buffer_read_file(&source->data, file);
+    fclose(file);
+    if (rc != PATCH_OK) {
+        patch_buffer_free(&source->data);
+        return rc;
+    }
+    source->crc32 = crc32_update(0, source->data.data, source->data.size);
+
+    return PATCH_OK;
+}
+
+void patch_source_free(patch_source* source) {
+    patch_buffer_free(&source->data);
+}
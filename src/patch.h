@@ -1,15 +1,65 @@
 #ifndef ROMBP_PATCH_H_
 #define ROMBP_PATCH_H_
 
-#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 
-typedef enum rombp_patch_type {
-    PATCH_TYPE_UNKNOWN = -1,
-    PATCH_TYPE_IPS = 0,
-    PATCH_TYPE_BPS = 1,
-} rombp_patch_type;
+// How a patch engine should produce its output.
+typedef enum rombp_apply_mode {
+    // Apply in memory when the image fits, otherwise fall back to streaming.
+    APPLY_MODE_AUTO = 0,
+    // Build the whole output image in memory, and write it out once.
+    APPLY_MODE_MEMORY = 1,
+    // Patch the output file in place, with bounded memory use.
+    APPLY_MODE_STREAM = 2,
+    // Map the input and output files, and patch the output mapping in place.
+    // Falls back to streaming when the files can't be mapped. Engines that
+    // don't map files treat this like AUTO.
+    APPLY_MODE_MAP = 3,
+} rombp_apply_mode;
+
+// How a patch engine should apply a patch, and what it may use to do it.
+typedef struct rombp_apply_options {
+    rombp_apply_mode mode;
+    // Most memory, in bytes, the engine should buffer. 0 for no limit.
+    size_t memory_budget;
+    // Threads the engine may apply the patch with.
+    int thread_count;
+    // Where the engine records its command and CRC timings, or NULL.
+    struct rombp_stats* stats;
+    // Called every so often on the calling thread while a single next call
+    // does a long stretch of work, like applying a whole patch on several
+    // threads, so the caller can publish progress. May be NULL.
+    void (*on_progress)(void* arg);
+    void* progress_arg;
+} rombp_apply_options;
+
+// Memory budget, in bytes, used when none is given: engines don't buffer
+// whole images bigger than this, and size their streaming caches to fit.
+// 0 means no limit.
+#ifdef TARGET_RG350
+#define PATCH_DEFAULT_MEMORY_BUDGET (32 * 1024 * 1024)
+#else
+#define PATCH_DEFAULT_MEMORY_BUDGET 0
+#endif
+
+// How a streaming engine got an unpatched copy of the input into the output
+// file, before patching it in place. Cheapest first.
+typedef enum rombp_copy_strategy {
+    // Nothing was copied, the output was built in memory.
+    COPY_STRATEGY_NONE = 0,
+    // The output shares the input's extents, copy-on-write (FICLONE).
+    COPY_STRATEGY_REFLINK = 1,
+    // Copied in the kernel, with copy_file_range.
+    COPY_STRATEGY_COPY_FILE_RANGE = 2,
+    // Copied in the kernel, with sendfile.
+    COPY_STRATEGY_SENDFILE = 3,
+    // Copied through a userspace buffer.
+    COPY_STRATEGY_READ_WRITE = 4,
+    // Written out of an input already in memory.
+    COPY_STRATEGY_FROM_MEMORY = 5,
+} rombp_copy_strategy;
 
 // Status code used outside of hunk iteration.
 typedef enum rombp_patch_err {
@@ -32,19 +82,84 @@ typedef enum rombp_hunk_iter_status {
     HUNK_NEXT = 2,
 } rombp_hunk_iter_status;
 
-// Status that can be shared betwen threads during multi-threaded patching
+// A snapshot of patching progress, owned by one thread.
 typedef struct rombp_patch_status {
-    pthread_mutex_t lock;
     int is_done;
     rombp_hunk_iter_status iter_status;
     rombp_patch_err err;
     int hunk_count;
+    // Output bytes written so far, out of the total the patch will write.
+    size_t bytes_written;
+    size_t total_bytes;
+    rombp_copy_strategy copy_strategy;
 } rombp_patch_status;
 
-rombp_patch_err patch_verify_marker(FILE* patch_file, const uint8_t* expected_header, const size_t header_size);
+// Status published by the patching thread, and read by the UI thread, without
+// locking. It's a sequence lock: the (single) writer makes seq odd while it's
+// updating the fields, and readers retry until they see the same even seq
+// before and after reading them. Byte counts are size_t so they stay lock-free
+// on 32-bit targets.
+typedef struct rombp_shared_patch_status {
+    atomic_uint seq;
+    atomic_int is_done;
+    atomic_int iter_status;
+    atomic_int err;
+    atomic_int hunk_count;
+    atomic_size_t bytes_written;
+    atomic_size_t total_bytes;
+    atomic_int copy_strategy;
+} rombp_shared_patch_status;
+
+// A contiguous, growable in-memory image of a file. Used by the
+// in-memory apply engines so the output is written out in one go.
+typedef struct patch_buffer {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} patch_buffer;
+
+// A source ROM loaded into memory once, and shared read-only between patch
+// jobs that apply different patches to it.
+typedef struct patch_source {
+    patch_buffer data;
+    uint32_t crc32;
+} patch_source;
+
 void patch_status_init(rombp_patch_status* status);
-void patch_status_copy(rombp_patch_status* dest, rombp_patch_status* src);
-void patch_status_reset(rombp_patch_status* status);
-void patch_status_destroy(rombp_patch_status* status);
+// Percentage of the output written, 0 - 100.
+int patch_status_percent(const rombp_patch_status* status);
+
+void patch_shared_status_init(rombp_shared_patch_status* shared);
+void patch_shared_status_publish(rombp_shared_patch_status* shared, const rombp_patch_status* status);
+void patch_shared_status_read(rombp_shared_patch_status* shared, rombp_patch_status* status);
+
+rombp_patch_err patch_crc32_file(FILE* file, uint64_t length, uint32_t* crc32);
+// fseek to offset from the start of the file, counted for the stats report.
+int patch_seek(FILE* file, long offset);
+// Seeks made so far, by every thread.
+uint64_t patch_seek_count();
+
+// Copy the whole input file over the output file, with the cheapest strategy
+// that works, and report which one. Afterwards the output is patched through
+// its file descriptor, not its stream.
+rombp_patch_err patch_copy_file(FILE* input_file, FILE* output_file, rombp_copy_strategy* strategy);
+// Copy the whole input file over the output file with one strategy only.
+// Fails if the strategy isn't supported for these files.
+rombp_patch_err patch_copy_file_using(FILE* input_file, FILE* output_file, rombp_copy_strategy strategy);
+// Write all of data to fd at offset.
+rombp_patch_err patch_pwrite(int fd, const uint8_t* data, size_t length, uint64_t offset);
+const char* patch_copy_strategy_name(rombp_copy_strategy strategy);
+
+void patch_buffer_init(patch_buffer* buffer);
+rombp_patch_err patch_buffer_resize(patch_buffer* buffer, size_t size);
+// Grow the buffer to hold at least capacity bytes, without changing its size, so
+// it can later be resized up to that without moving.
+rombp_patch_err patch_buffer_reserve(patch_buffer* buffer, size_t capacity);
+rombp_patch_err patch_buffer_read_file(patch_buffer* buffer, FILE* file);
+rombp_patch_err patch_buffer_write_file(const patch_buffer* buffer, FILE* file);
+void patch_buffer_free(patch_buffer* buffer);
+
+rombp_patch_err patch_source_load(patch_source* source, const char* path);
+void patch_source_free(patch_source* source);
 
 #endif
@@ -1,16 +1,29 @@
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
-
-#include "bps.h"
-#include "ips.h"
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "bps_diff.h"
+#include "crc32.h"
+#include "format.h"
+#include "ips_diff.h"
 #include "log.h"
+#include "stats.h"
 #include "ui.h"
 
-static const char* PATCH_NEXT_MESSAGE = "Patching. Wrote %d hunks";
+static const char* PATCH_NEXT_MESSAGE = "Patching. %d%%, wrote %d hunks";
 static const char* PATCH_SUCCESS_MESSAGE = "Success! Wrote %d hunks";
 static const char* PATCH_FAIL_INVALID_OUTPUT_SIZE_MESSAGE = "ERR: Invalid output size!";
 static const char* PATCH_FAIL_INVALID_OUTPUT_CHECKSUM_MESSAGE = "ERR: Invalid output checksum!";
+static const char* PATCH_FAIL_INVALID_INPUT_SIZE_MESSAGE = "ERR: Wrong input ROM size!";
+static const char* PATCH_FAIL_INVALID_INPUT_CHECKSUM_MESSAGE = "ERR: Wrong input ROM or bad patch!";
 static const char* PATCH_FAIL_ERR_IO = "ERR: Failed to open file!";
 static const char* PATCH_FAIL_START = "ERR: Failed to start!";
 static const char* PATCH_FAIL_UNKNOWN_TYPE = "ERR: Unknown patch type!";
@@ -30,100 +43,56 @@ static void close_files(FILE* input_file, FILE* output_file, FILE* ips_file) {
     }
 }
 
-static rombp_patch_type detect_patch_type(FILE* patch_file) {
-    rombp_log_info("Trying to detect patch type\n");
-    int rc = ips_verify_marker(patch_file);
-
-    if (rc == 0) {
-        rombp_log_info("Detected patch type: IPS\n");
-        return PATCH_TYPE_IPS;
-    }
-
-    rc = fseek(patch_file, 0, SEEK_SET);
-    if (rc == -1) {
-        rombp_log_err("Error seeking patch file to beginning\n");
-        return PATCH_TYPE_UNKNOWN;
-    }
-
-    rombp_log_info("Trying to detect BPS patch type\n");
-    rc = bps_verify_marker(patch_file);
-    if (rc == 0) {
-        rombp_log_info("Detected patch type: BPS\n");
-        return PATCH_TYPE_BPS;
-    }
-
-    return PATCH_TYPE_UNKNOWN;
-}
-
-// Used for any patch type specific data types that
-// need to be passed into our start function.
-typedef union {
-    bps_file_header bps_file_header;
-} rombp_patch_context;
-
-static int start_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, FILE* input_file, FILE* patch_file, FILE* output_file) {
-    int rc;
-
+// Allocate a context for the format's engine, and start it. On failure, the
+// context is still handed back for free_patch.
+static rombp_patch_err start_patch(const rombp_patch_format* format, void** ctx, const rombp_apply_options* options,
+                                   const patch_source* source, FILE* input_file, FILE* patch_file, FILE* output_file) {
     rombp_log_info("Start patching\n");
 
-    switch (patch_type) {
-        case PATCH_TYPE_IPS:
-            rombp_log_info("Patch type started with IPS!\n");
-            rc = ips_start(input_file, output_file);
-            if (rc != PATCH_OK) {
-                rombp_log_err("Failed to start patching IPS file: %d\n", rc);
-                return -1;
-            }
-            return 0;
-        case PATCH_TYPE_BPS:
-            rc = bps_start(patch_file, &ctx->bps_file_header);
-            if (rc != PATCH_OK) {
-                rombp_log_err("Failed to start patching BPS file: %d\n", rc);
-                return -1;
-            }
-            return 0;
-        default:
-            rombp_log_err("Cannot start unknown patch type\n");
-            return -1;
+    *ctx = malloc(format->context_size);
+    if (*ctx == NULL) {
+        rombp_log_err("Failed to allocate %s patch context\n", format->name);
+        return PATCH_ERR_IO;
     }
-}
-
-static rombp_patch_err end_patch(rombp_patch_type patch_type, rombp_patch_context* ctx, FILE* patch_file) {
-    rombp_log_info("End patching\n");
-    switch (patch_type) {
-        case PATCH_TYPE_BPS: return bps_end(&ctx->bps_file_header, patch_file);
-        case PATCH_TYPE_IPS:
-        default:
-            return PATCH_OK; // No cleanup work for IPS patches, by default nothing left to do.
+    rombp_patch_err rc = format->start(*ctx, options, source, input_file, patch_file, output_file);
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to start patching %s file: %d\n", format->name, rc);
     }
+    return rc;
 }
 
-static rombp_hunk_iter_status next_hunk(rombp_patch_type patch_type, rombp_patch_context* patch_ctx, FILE* input_file, FILE* output_file, FILE* patch_file) {
-    switch (patch_type) {
-        case PATCH_TYPE_IPS: return ips_next(input_file, output_file, patch_file);
-        case PATCH_TYPE_BPS: return bps_next(&patch_ctx->bps_file_header, input_file, output_file, patch_file);
-        default: return HUNK_NONE;
+// Release anything the format's engine allocated, and the context itself.
+static void free_patch(const rombp_patch_format* format, void* ctx) {
+    if (ctx != NULL) {
+        format->free(ctx);
+        free(ctx);
     }
 }
 
-static rombp_patch_err open_patch_files(FILE** input_file, FILE** output_file, FILE** ips_file, rombp_patch_command* command) {
-    *input_file = fopen(command->input_file, "r");
-    if (*input_file == NULL) {
-        rombp_log_err("Failed to open input file: %s, errno: %d\n", command->input_file, errno);
-        return PATCH_ERR_IO;
+// When the input ROM is already loaded as a shared source, the input file isn't opened.
+// On failure, any files that did open are left for the caller to close.
+static rombp_patch_err open_patch_files(FILE** input_file, FILE** output_file, FILE** ips_file,
+                                        rombp_patch_command* command, const patch_source* source) {
+    *input_file = NULL;
+    *output_file = NULL;
+    *ips_file = NULL;
+    if (source == NULL) {
+        *input_file = fopen(command->input_file, "r");
+        if (*input_file == NULL) {
+            rombp_log_err("Failed to open input file: %s, errno: %d\n", command->input_file, errno);
+            return PATCH_ERR_IO;
+        }
     }
 
     *output_file = fopen(command->output_file, "w+");
     if (*output_file == NULL) {
         rombp_log_err("Failed to open output file: %d\n", errno);
-        close_files(*input_file, NULL, NULL);
         return PATCH_ERR_IO;
     }
 
     *ips_file = fopen(command->ips_file, "r");
     if (*ips_file == NULL) {
         rombp_log_err("Failed to open IPS file: %d\n", errno);
-        close_files(*input_file, *output_file, NULL);
         return PATCH_ERR_IO;
     }
 
@@ -131,30 +100,99 @@ static rombp_patch_err open_patch_files(FILE** input_file, FILE** output_file, F
 }
 
 static void display_help() {
-    fprintf(stderr, "rombp: IPS and BPS patcher\n\n");
+    fprintf(stderr, "rombp: IPS, BPS, UPS and VCDIFF patcher\n\n");
     fprintf(stderr, "Usage:\n");
     fprintf(stderr, "rombp [options]\n\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "\t-i [FILE], Input ROM file\n");
-    fprintf(stderr, "\t-p [FILE], IPS or BPS patch file\n");
-    fprintf(stderr, "\t-o [FILE], Patched output file\n\n");
+    fprintf(stderr, "\t-p [FILE], IPS, BPS, UPS or VCDIFF (xdelta) patch file. Repeat to apply several patches in order\n");
+    fprintf(stderr, "\t-o [FILE], Patched output file\n");
+    fprintf(stderr, "\t-b [FILE|DIR], Batch mode: a manifest of source<TAB>patch<TAB>output lines,\n");
+    fprintf(stderr, "\t               or a directory of patches to apply to -i, written to the -o directory\n");
+    fprintf(stderr, "\t-j [N], Number of threads to apply a patch with, or of batch workers (default: number of CPUs)\n");
+    fprintf(stderr, "\t-M [MB], Memory budget. Larger BPS and VCDIFF targets are patched in the output file,\n");
+    if (PATCH_DEFAULT_MEMORY_BUDGET > 0) {
+        fprintf(stderr, "\t         through caches within the budget (default: %d)\n", PATCH_DEFAULT_MEMORY_BUDGET / (1024 * 1024));
+    } else {
+        fprintf(stderr, "\t         through caches within the budget (default: no limit)\n");
+    }
+    fprintf(stderr, "\t         Batch workers split the budget between them\n");
+    fprintf(stderr, "\t--stats [FILE], Write a JSON report of each patch's phase and command timings, I/O\n");
+    fprintf(stderr, "\t                syscalls and peak memory use to FILE\n");
+    fprintf(stderr, "\t-v, Log how patches are applied. Repeat to log every hunk, which is much slower\n");
+    fprintf(stderr, "\t-q, Only log errors\n\n");
+    fprintf(stderr, "rombp diff [options]\n\n");
+    fprintf(stderr, "Creates a BPS or IPS patch from an original and a modified ROM. Options:\n");
+    fprintf(stderr, "\t-i [FILE], Original ROM file\n");
+    fprintf(stderr, "\t-m [FILE], Modified ROM file\n");
+    fprintf(stderr, "\t-o [FILE], Patch output file. An .ips extension writes an IPS patch, anything else BPS\n");
+    fprintf(stderr, "\t-j [N], Number of threads used to index the original ROM (default: number of CPUs)\n");
+    fprintf(stderr, "\t-v, -q, More or less logging, as above\n\n");
     fprintf(stderr, "Running rombp with no option arguments launches the SDL UI\n");
 }
 
-static int parse_command_line(int argc, char** argv, rombp_patch_command* command) {
+// -v logs one level more, up to what's compiled in, and -q only errors.
+static void adjust_log_level(int option) {
+    if (option == 'q') {
+        rombp_log_level = ROMBP_LOG_ERR;
+    } else if (rombp_log_level < ROMBP_LOG_LEVEL) {
+        rombp_log_level++;
+    }
+}
+
+typedef struct rombp_cli_options {
+    // Every -p argument, in order. More than one patch stacks them.
+    char** patch_files;
+    int patch_count;
+    char* batch_path;
+    int worker_count;
+    // Where to write the --stats report, or NULL for none.
+    char* stats_path;
+} rombp_cli_options;
+
+static int parse_command_line(int argc, char** argv, rombp_patch_command* command, rombp_cli_options* options) {
+    static const struct option LONG_OPTIONS[] = {
+        { "stats", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 },
+    };
     int c;
 
-    while ((c = getopt(argc, argv, "i:p:o:")) != -1) {
+    while ((c = getopt_long(argc, argv, "i:p:o:b:j:M:vq", LONG_OPTIONS, NULL)) != -1) {
         switch (c) {
             case 'i':
                 command->input_file = optarg;
                 break;
             case 'p':
                 command->ips_file = optarg;
+                options->patch_files[options->patch_count++] = optarg;
                 break;
             case 'o':
                 command->output_file = optarg;
                 break;
+            case 'b':
+                options->batch_path = optarg;
+                break;
+            case 'j':
+                options->worker_count = atoi(optarg);
+                if (options->worker_count < 1) {
+                    display_help();
+                    return -1;
+                }
+                break;
+            case 'M':
+                if (atoi(optarg) < 1) {
+                    display_help();
+                    return -1;
+                }
+                command->memory_budget = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'S':
+                options->stats_path = optarg;
+                break;
+            case 'v':
+            case 'q':
+                adjust_log_level(c);
+                break;
             case '?':
                 display_help();
                 return -1;
@@ -164,49 +202,76 @@ static int parse_command_line(int argc, char** argv, rombp_patch_command* comman
         }
     }
 
-    rombp_log_info("rombp arguments. input: %s, patch: %s, output: %s\n",
-                   command->input_file, command->ips_file, command->output_file);
+    rombp_log_debug("rombp arguments. input: %s, patch: %s, output: %s\n",
+                    command->input_file, command->ips_file, command->output_file);
 
     return 0;
 }
 
-static void rombp_update_patch_status(rombp_patch_status* shared, rombp_patch_status* local) {
+static void rombp_update_patch_status(rombp_shared_patch_status* shared, rombp_patch_status* local) {
     if (shared != NULL && local != NULL) {
-        int rc = pthread_mutex_lock(&shared->lock);
-        if (rc != 0) {
-            rombp_log_err("Failed to lock status mutex: %d\n", rc);
-            exit(-1);
-        }
-        patch_status_copy(shared, local);
-        rc = pthread_mutex_unlock(&shared->lock);
-        if (rc != 0) {
-            rombp_log_err("Failed to unlock mutex: %d\n", rc);
-            exit(-1);
-        }
+        patch_shared_status_publish(shared, local);
     }
 }
 
-static void rombp_read_patch_status(rombp_patch_status* shared, rombp_patch_status* local) {
+static void rombp_read_patch_status(rombp_shared_patch_status* shared, rombp_patch_status* local) {
     if (shared != NULL && local != NULL) {
-        int rc = pthread_mutex_lock(&shared->lock);
-        if (rc != 0) {
-            rombp_log_err("Failed to lock status mutex: %d\n", rc);
-            exit(-1);
-        }
-        patch_status_copy(local, shared);
-        rc = pthread_mutex_unlock(&shared->lock);
-        if (rc != 0) {
-            rombp_log_err("Failed to unlock mutex: %d\n", rc);
-            exit(-1);
-        }
+        patch_shared_status_read(shared, local);
     }
 }
 
-static int execute_patch(rombp_patch_command* command, rombp_patch_status* status) {
+// Fill in how much of the output a patch has written so far.
+static void patch_progress(const rombp_patch_format* format, void* ctx, rombp_patch_status* status) {
+    format->progress(ctx, status);
+}
+
+// Lets an engine publish progress from inside a long next call, like a BPS
+// patch applied on several threads. It's called on the patching thread, so the
+// shared status still has a single writer.
+typedef struct patch_progress_publisher {
+    const rombp_patch_format* format;
+    void** ctx;
+    rombp_patch_status* status;
+    rombp_shared_patch_status* shared;
+} patch_progress_publisher;
+
+static void publish_patch_progress(void* arg) {
+    patch_progress_publisher* publisher = (patch_progress_publisher*)arg;
+    patch_progress(publisher->format, *publisher->ctx, publisher->status);
+    rombp_update_patch_status(publisher->shared, publisher->status);
+}
+
+static void log_patch_done(const rombp_patch_status* status) {
+    rombp_log_info("Done patching file, hunk count: %d\n", status->hunk_count);
+    if (status->copy_strategy != COPY_STRATEGY_NONE) {
+        rombp_log_info("Input copied to output with: %s\n", patch_copy_strategy_name(status->copy_strategy));
+    }
+}
+
+// Detect the patch's format, and record it in stats, when there are any.
+static const rombp_patch_format* detect_patch_format(FILE* patch_file, rombp_stats* stats) {
+    rombp_stats_io phase_io;
+    uint64_t phase_begin;
+
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+    const rombp_patch_format* format = patch_format_detect(patch_file);
+    rombp_stats_phase_end(stats, STATS_PHASE_DETECT, 0, &phase_io, phase_begin);
+    if (stats != NULL && format != NULL) {
+        stats->format = format->name;
+        stats->command_names = format->command_names;
+        stats->command_count = format->command_count;
+    }
+    return format;
+}
+
+static int execute_patch(rombp_patch_command* command, const patch_source* source, rombp_shared_patch_status* status,
+                         rombp_stats* stats) {
     int rc;
-    rombp_patch_type patch_type = PATCH_TYPE_UNKNOWN;
-    rombp_patch_context patch_ctx;
+    const rombp_patch_format* format = NULL;
+    void* patch_ctx = NULL;
     rombp_patch_status local_status;
+    rombp_stats_io phase_io;
+    uint64_t phase_begin;
 
     FILE* input_file;
     FILE* output_file;
@@ -214,42 +279,64 @@ static int execute_patch(rombp_patch_command* command, rombp_patch_status* statu
 
     patch_status_init(&local_status);
 
-    local_status.err = open_patch_files(&input_file, &output_file, &patch_file, command);
+    local_status.err = open_patch_files(&input_file, &output_file, &patch_file, command, source);
     if (local_status.err == PATCH_ERR_IO) {
         local_status.iter_status = HUNK_DONE;
         goto done;
     }
-    patch_type = detect_patch_type(patch_file);
-    if (patch_type == PATCH_TYPE_UNKNOWN) {
+    format = detect_patch_format(patch_file, stats);
+    if (format == NULL) {
         local_status.iter_status = HUNK_DONE;
         local_status.err = PATCH_UNKNOWN_TYPE;
         goto done;
     }
-    rc = start_patch(patch_type, &patch_ctx, input_file, patch_file, output_file);
-    if (rc < 0) {
+    patch_progress_publisher publisher = { format, &patch_ctx, &local_status, status };
+    rombp_apply_options options = {
+        .mode = APPLY_MODE_AUTO,
+        .memory_budget = command->memory_budget,
+        .thread_count = command->thread_count,
+        .stats = stats,
+        .on_progress = status != NULL ? &publish_patch_progress : NULL,
+        .progress_arg = &publisher,
+    };
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+    rc = start_patch(format, &patch_ctx, &options, source, input_file, patch_file, output_file);
+    rombp_stats_phase_end(stats, STATS_PHASE_START, 0, &phase_io, phase_begin);
+    if (rc != PATCH_OK) {
         local_status.iter_status = HUNK_DONE;
-        local_status.err = PATCH_FAILED_TO_START;
+        // Input verification failures are reported as-is, so the user knows they picked the wrong ROM.
+        if (rc == PATCH_INVALID_INPUT_SIZE || rc == PATCH_INVALID_INPUT_CHECKSUM) {
+            local_status.err = rc;
+        } else {
+            local_status.err = PATCH_FAILED_TO_START;
+        }
         goto done;
     }
     local_status.iter_status = HUNK_NEXT;
 
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
     while (1) {
         switch (local_status.iter_status) {
             case HUNK_NEXT: {
-                local_status.iter_status = next_hunk(patch_type, &patch_ctx, input_file, output_file, patch_file);
+                local_status.iter_status = format->next(patch_ctx, input_file, output_file);
                 if (local_status.iter_status == HUNK_NEXT) {
                     local_status.hunk_count++;
-                    rombp_log_info("Got next hunk, hunk count: %d\n", local_status.hunk_count);
+                    rombp_log_trace("Got next hunk, hunk count: %d\n", local_status.hunk_count);
                 }
-                
+                patch_progress(format, patch_ctx, &local_status);
                 rombp_update_patch_status(status, &local_status);
                 break;
             }
             case HUNK_DONE: {
-                local_status.err = end_patch(patch_type, &patch_ctx, patch_file);
+                rombp_stats_phase_end(stats, STATS_PHASE_APPLY, local_status.bytes_written, &phase_io, phase_begin);
+                rombp_log_debug("End patching\n");
+                rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+                local_status.err = format->end(patch_ctx, input_file, output_file);
+                rombp_stats_phase_end(stats, STATS_PHASE_END, 0, &phase_io, phase_begin);
                 goto done;
             }
             case HUNK_ERR_IO:
+                rombp_stats_phase_end(stats, STATS_PHASE_APPLY, local_status.bytes_written, &phase_io, phase_begin);
                 local_status.err = PATCH_ERR_IO;
                 rombp_log_err("I/O error during hunk iteration\n");
                 goto done;
@@ -259,23 +346,157 @@ static int execute_patch(rombp_patch_command* command, rombp_patch_status* statu
     }
 
 done:
+    if (stats != NULL) {
+        stats->hunk_count = local_status.hunk_count;
+        stats->err = local_status.err;
+    }
     local_status.is_done = 1;
+    if (format != NULL) {
+        free_patch(format, patch_ctx);
+    }
     close_files(input_file, output_file, patch_file);
     rombp_update_patch_status(status, &local_status);
-    rombp_patch_err err = local_status.err;
-    patch_status_destroy(&local_status);
+    return local_status.err;
+}
+
+// Apply one patch of a stack entirely in memory, from source into output.
+static rombp_patch_err execute_patch_stage(const char* patch_path, int thread_count, const patch_source* source,
+                                           patch_source* output, rombp_shared_patch_status* status,
+                                           rombp_stats* stats) {
+    const rombp_patch_format* format;
+    void* patch_ctx = NULL;
+    rombp_patch_status local_status;
+    rombp_patch_err err;
+    rombp_stats_io phase_io;
+    uint64_t phase_begin;
+
+    FILE* patch_file = fopen(patch_path, "r");
+    if (patch_file == NULL) {
+        rombp_log_err("Failed to open patch file: %s, errno: %d\n", patch_path, errno);
+        return PATCH_ERR_IO;
+    }
+    format = detect_patch_format(patch_file, stats);
+    if (format == NULL) {
+        fclose(patch_file);
+        return PATCH_UNKNOWN_TYPE;
+    }
+
+    patch_status_init(&local_status);
+    patch_progress_publisher publisher = { format, &patch_ctx, &local_status, status };
+    rombp_apply_options options = {
+        .mode = APPLY_MODE_MEMORY,
+        .memory_budget = 0,
+        .thread_count = thread_count,
+        .stats = stats,
+        .on_progress = status != NULL ? &publish_patch_progress : NULL,
+        .progress_arg = &publisher,
+    };
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+    err = start_patch(format, &patch_ctx, &options, source, NULL, patch_file, NULL);
+    rombp_stats_phase_end(stats, STATS_PHASE_START, 0, &phase_io, phase_begin);
+    if (err != PATCH_OK) {
+        if (err != PATCH_INVALID_INPUT_SIZE && err != PATCH_INVALID_INPUT_CHECKSUM) {
+            err = PATCH_FAILED_TO_START;
+        }
+        goto done;
+    }
+
+    local_status.iter_status = HUNK_NEXT;
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+    while ((local_status.iter_status = format->next(patch_ctx, NULL, NULL)) == HUNK_NEXT) {
+        local_status.hunk_count++;
+        patch_progress(format, patch_ctx, &local_status);
+        rombp_update_patch_status(status, &local_status);
+    }
+    rombp_stats_phase_end(stats, STATS_PHASE_APPLY, local_status.bytes_written, &phase_io, phase_begin);
+    if (local_status.iter_status != HUNK_DONE) {
+        rombp_log_err("I/O error during hunk iteration\n");
+        err = PATCH_ERR_IO;
+        goto done;
+    }
+    // Handing the output on to the next patch is part of ending this one
+    rombp_stats_phase_begin(stats, &phase_io, &phase_begin);
+    err = format->end(patch_ctx, NULL, NULL);
+    if (err == PATCH_OK) {
+        err = format->take_output(patch_ctx, output);
+    }
+    rombp_stats_phase_end(stats, STATS_PHASE_END, 0, &phase_io, phase_begin);
+    rombp_log_info("Applied stacked patch: %s, hunk count: %d\n", patch_path, local_status.hunk_count);
+
+done:
+    if (stats != NULL) {
+        stats->hunk_count = local_status.hunk_count;
+        stats->err = err;
+    }
+    free_patch(format, patch_ctx);
+    fclose(patch_file);
+    return err;
+}
+
+// Apply a stack of patches without writing any intermediate ROMs. The input is
+// loaded once, each patch's output image becomes the source of the next, and the
+// last patch writes the output file. BPS patches still verify their source
+// CRC32 against the previous patch's output. stats, when set, has room for
+// every patch.
+static int execute_patch_stack(rombp_patch_command* command, char** patch_files, int patch_count,
+                               rombp_shared_patch_status* status, rombp_stats* stats) {
+    patch_source stage_source;
+    patch_source stage_output;
+    rombp_patch_err err;
+
+    err = patch_source_load(&stage_source, command->input_file);
+    for (int i = 0; err == PATCH_OK && i < patch_count - 1; i++) {
+        rombp_log_info("Applying stacked patch %d of %d: %s\n", i + 1, patch_count, patch_files[i]);
+        err = execute_patch_stage(patch_files[i], command->thread_count, &stage_source, &stage_output, status,
+                                  stats != NULL ? &stats[i] : NULL);
+        if (err != PATCH_OK) {
+            rombp_log_err("Stacked patch %d failed: %s\n", i + 1, patch_files[i]);
+            if (stats != NULL) {
+                stats[i].err = err;
+            }
+            break;
+        }
+        patch_source_free(&stage_source);
+        stage_source = stage_output;
+    }
+    if (err != PATCH_OK) {
+        rombp_patch_status local_status;
+
+        patch_source_free(&stage_source);
+        patch_status_init(&local_status);
+        local_status.iter_status = HUNK_DONE;
+        local_status.err = err;
+        local_status.is_done = 1;
+        rombp_update_patch_status(status, &local_status);
+        return err;
+    }
+
+    command->ips_file = patch_files[patch_count - 1];
+    err = execute_patch(command, &stage_source, status, stats != NULL ? &stats[patch_count - 1] : NULL);
+    patch_source_free(&stage_source);
     return err;
 }
 
 typedef struct rombp_patch_thread_args {
     rombp_patch_command* command;
-    rombp_patch_status status;
+    // Set when more than one patch should be stacked onto the input
+    char** patch_files;
+    int patch_count;
+    // Stats for each patch, or NULL
+    rombp_stats* stats;
+    rombp_shared_patch_status status;
     int rc;
 } rombp_patch_thread_args;
 
 static void* execute_patch_threaded(void* args) {
     rombp_patch_thread_args* patch_args = (rombp_patch_thread_args *)args;
-    int rc = execute_patch(patch_args->command, &patch_args->status);
+    int rc;
+    if (patch_args->patch_count > 1) {
+        rc = execute_patch_stack(patch_args->command, patch_args->patch_files, patch_args->patch_count,
+                                 &patch_args->status, patch_args->stats);
+    } else {
+        rc = execute_patch(patch_args->command, NULL, &patch_args->status, patch_args->stats);
+    }
     if (rc != 0) {
         rombp_log_err("Threaded patch failed: %d\n", rc);
     }
@@ -311,9 +532,12 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
 
     rombp_patch_thread_args thread_args;
     thread_args.command = command;
+    thread_args.patch_files = NULL;
+    thread_args.patch_count = 0;
+    thread_args.stats = NULL;
     thread_args.rc = 0;
 
-    patch_status_init(&thread_args.status);
+    patch_shared_status_init(&thread_args.status);
     patch_status_init(&local_status);
 
     int rc = ui_start(&ui);
@@ -331,7 +555,7 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                 rc = 0;
                 goto out;
             case EV_PATCH_COMMAND:
-                patch_status_reset(&thread_args.status);
+                patch_shared_status_init(&thread_args.status);
                 rc = rombp_start_patch_thread(patch_thread, &thread_args);
                 if (rc != 0) {
                     rombp_log_err("FATAL: Failed to start patch thread: %d\n", rc);
@@ -348,7 +572,7 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
             rombp_read_patch_status(&thread_args.status, &local_status);
             switch (local_status.iter_status) {
                 case HUNK_NEXT:
-                    sprintf(tmp_buf, PATCH_NEXT_MESSAGE, local_status.hunk_count);
+                    sprintf(tmp_buf, PATCH_NEXT_MESSAGE, patch_status_percent(&local_status), local_status.hunk_count);
                     ui_status_bar_reset_text(&ui, &ui.bottom_bar, tmp_buf);
                     break;
                 case HUNK_DONE:
@@ -357,7 +581,7 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                             case PATCH_OK:
                                 sprintf(tmp_buf, PATCH_SUCCESS_MESSAGE, local_status.hunk_count);
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, tmp_buf);
-                                rombp_log_info("Done patching file, hunk count: %d\n", thread_args.status.hunk_count);
+                                log_patch_done(&local_status);
                                 break;
                             case PATCH_INVALID_OUTPUT_SIZE:
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_OUTPUT_SIZE_MESSAGE);
@@ -367,9 +591,17 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_OUTPUT_CHECKSUM_MESSAGE);
                                 rombp_log_err("Invalid output checksum\n");
                                 break;
+                            case PATCH_INVALID_INPUT_SIZE:
+                                ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_INPUT_SIZE_MESSAGE);
+                                rombp_log_err("Invalid input size\n");
+                                break;
+                            case PATCH_INVALID_INPUT_CHECKSUM:
+                                ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_INVALID_INPUT_CHECKSUM_MESSAGE);
+                                rombp_log_err("Invalid input checksum\n");
+                                break;
                             case PATCH_ERR_IO:
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_ERR_IO);
-                                rombp_log_err("Failed to open files for patching: %d\n", thread_args.status.err);
+                                rombp_log_err("Failed to open files for patching: %d\n", local_status.err);
                                 break;
                             case PATCH_UNKNOWN_TYPE:
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_FAIL_UNKNOWN_TYPE);
@@ -381,7 +613,7 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
                                 break;
                             default:
                                 ui_status_bar_reset_text(&ui, &ui.bottom_bar, PATCH_UNKNOWN_ERROR_MESSAGE);
-                                rombp_log_err("Unknown end error: %d\n", thread_args.status.err);
+                                rombp_log_err("Unknown end error: %d\n", local_status.err);
                                 break;
                         }
                         rc = rombp_wait_patch_thread(patch_thread);
@@ -416,36 +648,183 @@ static int ui_loop(pthread_t* patch_thread, rombp_patch_command* command) {
 
 out:
     ui_stop(&ui);
-    patch_status_destroy(&thread_args.status);
-    patch_status_destroy(&local_status);
+    return rc;
+}
+
+static const char* patch_err_message(rombp_patch_err err) {
+    switch (err) {
+        case PATCH_OK: return "OK";
+        case PATCH_INVALID_OUTPUT_SIZE: return PATCH_FAIL_INVALID_OUTPUT_SIZE_MESSAGE;
+        case PATCH_INVALID_OUTPUT_CHECKSUM: return PATCH_FAIL_INVALID_OUTPUT_CHECKSUM_MESSAGE;
+        case PATCH_INVALID_INPUT_SIZE: return PATCH_FAIL_INVALID_INPUT_SIZE_MESSAGE;
+        case PATCH_INVALID_INPUT_CHECKSUM: return PATCH_FAIL_INVALID_INPUT_CHECKSUM_MESSAGE;
+        case PATCH_ERR_IO: return PATCH_FAIL_ERR_IO;
+        case PATCH_UNKNOWN_TYPE: return PATCH_FAIL_UNKNOWN_TYPE;
+        case PATCH_FAILED_TO_START: return PATCH_FAIL_START;
+        default: return PATCH_UNKNOWN_ERROR_MESSAGE;
+    }
+}
+
+static void execute_batch_job(batch_job* job, const patch_source* source) {
+    rombp_shared_patch_status shared_status;
+    rombp_patch_status status;
+    rombp_patch_command command;
+
+    command.input_file = job->source->path;
+    command.ips_file = job->patch_path;
+    command.output_file = job->output_path;
+    command.memory_budget = job->memory_budget;
+    // Jobs already run in parallel, one per worker
+    command.thread_count = 1;
+
+    patch_shared_status_init(&shared_status);
+    job->err = execute_patch(&command, source, &shared_status, NULL);
+    patch_shared_status_read(&shared_status, &status);
+    job->hunk_count = status.hunk_count;
+}
+
+static int execute_batch(rombp_patch_command* command, rombp_cli_options* batch_options) {
+    batch batch;
+    struct stat batch_stat;
+    int rc;
+
+    if (stat(batch_options->batch_path, &batch_stat) == -1) {
+        rombp_log_err("Failed to stat batch path: %s, errno: %d\n", batch_options->batch_path, errno);
+        return -1;
+    }
+
+    batch_init(&batch);
+    if (S_ISDIR(batch_stat.st_mode)) {
+        if (command->input_file == NULL || command->output_file == NULL) {
+            rombp_log_err("Batch directory mode needs an input ROM (-i) and an output directory (-o)\n");
+            batch_free(&batch);
+            return -1;
+        }
+        rc = batch_read_directory(&batch, batch_options->batch_path, command->input_file, command->output_file);
+    } else {
+        rc = batch_read_manifest(&batch, batch_options->batch_path);
+    }
+    if (rc != 0) {
+        batch_free(&batch);
+        return rc;
+    }
+
+    size_t failed = batch_run(&batch, batch_options->worker_count, command->memory_budget, &execute_batch_job);
+    for (size_t i = 0; i < batch.job_count; i++) {
+        batch_job* job = &batch.jobs[i];
+        if (job->err == PATCH_OK) {
+            printf("%s: Success! Wrote %d hunks\n", job->output_path, job->hunk_count);
+        } else {
+            printf("%s: %s (%d)\n", job->output_path, patch_err_message(job->err), job->err);
+        }
+    }
+    printf("%zu of %zu jobs patched successfully\n", batch.job_count - failed, batch.job_count);
+
+    batch_free(&batch);
+    return failed == 0 ? 0 : 1;
+}
+
+// Write the --stats report to path. Not to stdout, which info logging shares.
+static int write_stats(const char* path, const rombp_stats* stats, int stats_count,
+                       const rombp_stats_io* io_begin, uint64_t begin) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        rombp_log_err("Failed to open stats file: %s, errno: %d\n", path, errno);
+        return -1;
+    }
+    int rc = rombp_stats_write_json(file, stats, stats_count, io_begin, begin);
+    if (fclose(file) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        rombp_log_err("Failed to write stats to: %s\n", path);
+    }
     return rc;
 }
 
 static int execute_command_line(int argc, char** argv, pthread_t* patch_thread, rombp_patch_command* command) {
     int rc;
+    rombp_cli_options options;
+    rombp_patch_status status;
 
-    rc = parse_command_line(argc, argv, command);
+    options.patch_files = malloc(argc * sizeof(char*));
+    if (options.patch_files == NULL) {
+        rombp_log_err("Failed to allocate patch file list\n");
+        return -1;
+    }
+    options.patch_count = 0;
+    options.batch_path = NULL;
+    options.worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    options.stats_path = NULL;
+
+    rc = parse_command_line(argc, argv, command, &options);
     if (rc != 0) {
+        free(options.patch_files);
+        return rc;
+    }
+    command->thread_count = options.worker_count;
+    rombp_log_debug("CRC32 implementation: %s\n", crc32_implementation());
+    if (options.batch_path != NULL) {
+        if (options.stats_path != NULL) {
+            rombp_log_err("--stats reports on -p patches, it can't be used with batch mode\n");
+            free(options.patch_files);
+            return -1;
+        }
+        rc = execute_batch(command, &options);
+        free(options.patch_files);
         return rc;
     }
 
     rombp_patch_thread_args thread_args;
     thread_args.command = command;
+    thread_args.patch_files = options.patch_files;
+    thread_args.patch_count = options.patch_count;
+    thread_args.stats = NULL;
     thread_args.rc = 0;
-    patch_status_init(&thread_args.status);
+    patch_shared_status_init(&thread_args.status);
+
+    // One set of stats per patch, even when there's no patch to apply
+    int stats_count = MAX(options.patch_count, 1);
+    rombp_stats_io stats_io;
+    uint64_t stats_begin = 0;
+    if (options.stats_path != NULL) {
+        thread_args.stats = malloc(stats_count * sizeof(rombp_stats));
+        if (thread_args.stats == NULL) {
+            rombp_log_err("Failed to allocate stats\n");
+            free(options.patch_files);
+            return -1;
+        }
+        for (int i = 0; i < stats_count; i++) {
+            rombp_stats_init(&thread_args.stats[i], i < options.patch_count ? options.patch_files[i] : NULL);
+        }
+        rombp_stats_read_io(&stats_io);
+        stats_begin = rombp_stats_clock();
+    }
 
     rc = rombp_start_patch_thread(patch_thread, &thread_args);
     if (rc != 0) {
         rombp_log_err("Could not start patch thread: %d\n", rc);
+        free(thread_args.stats);
+        free(options.patch_files);
         return rc;
     }
     rc = rombp_wait_patch_thread(patch_thread);
+    free(options.patch_files);
     if (rc != 0) {
         rombp_log_err("Could not wait for patch thread to stop: %d\n", rc);
+        free(thread_args.stats);
         return rc;
     }
+    if (thread_args.stats != NULL) {
+        rc = write_stats(options.stats_path, thread_args.stats, stats_count, &stats_io, stats_begin);
+        free(thread_args.stats);
+        if (rc != 0) {
+            return rc;
+        }
+    }
 
-    if (!thread_args.status.is_done) {
+    rombp_read_patch_status(&thread_args.status, &status);
+    if (!status.is_done) {
         rombp_log_err("Illegal state: The patching thread terminated, but did not register itself as done\n");
         return -1;
     }
@@ -455,9 +834,9 @@ static int execute_command_line(int argc, char** argv, pthread_t* patch_thread,
         return thread_args.rc;
     }
 
-    switch (thread_args.status.err) {
+    switch (status.err) {
         case PATCH_OK:
-            rombp_log_info("Done patching file, hunk count: %d\n", thread_args.status.hunk_count);
+            log_patch_done(&status);
             break;
         case PATCH_INVALID_OUTPUT_SIZE:
             rombp_log_err("Invalid output size\n");
@@ -465,8 +844,14 @@ static int execute_command_line(int argc, char** argv, pthread_t* patch_thread,
         case PATCH_INVALID_OUTPUT_CHECKSUM:
             rombp_log_err("Invalid output checksum\n");
             break;
+        case PATCH_INVALID_INPUT_SIZE:
+            rombp_log_err("Invalid input size\n");
+            break;
+        case PATCH_INVALID_INPUT_CHECKSUM:
+            rombp_log_err("Invalid input checksum\n");
+            break;
         case PATCH_ERR_IO:
-            rombp_log_err("Failed to open files for patching: %d\n", thread_args.status.err);
+            rombp_log_err("Failed to open files for patching: %d\n", status.err);
             break;
         case PATCH_UNKNOWN_TYPE:
             rombp_log_err("Bad patch file type\n");
@@ -475,15 +860,93 @@ static int execute_command_line(int argc, char** argv, pthread_t* patch_thread,
             rombp_log_err("Failed to start patching\n");
             break;
         default:
-            rombp_log_err("Unknown end error: %d\n", thread_args.status.err);
+            rombp_log_err("Unknown end error: %d\n", status.err);
             break;
     }
 
-    patch_status_destroy(&thread_args.status);
-
     return 0;
 }
 
+static int execute_diff(int argc, char** argv) {
+    char* source_path = NULL;
+    char* target_path = NULL;
+    char* patch_path = NULL;
+    int thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    patch_source source;
+    patch_source target;
+    patch_buffer patch;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:m:o:j:vq")) != -1) {
+        switch (c) {
+            case 'i':
+                source_path = optarg;
+                break;
+            case 'm':
+                target_path = optarg;
+                break;
+            case 'o':
+                patch_path = optarg;
+                break;
+            case 'j':
+                thread_count = atoi(optarg);
+                break;
+            case 'v':
+            case 'q':
+                adjust_log_level(c);
+                break;
+            default:
+                display_help();
+                return -1;
+        }
+    }
+    if (source_path == NULL || target_path == NULL || patch_path == NULL || thread_count < 1) {
+        display_help();
+        return -1;
+    }
+
+    rombp_patch_err err = patch_source_load(&source, source_path);
+    if (err != PATCH_OK) {
+        return err;
+    }
+    err = patch_source_load(&target, target_path);
+    if (err != PATCH_OK) {
+        patch_source_free(&source);
+        return err;
+    }
+
+    const char* ext = strrchr(patch_path, '.');
+    int is_ips = ext != NULL && strcasecmp(ext, ".ips") == 0;
+    const char* format = is_ips ? "IPS" : "BPS";
+
+    patch_buffer_init(&patch);
+    if (is_ips) {
+        err = ips_diff(&source, &target, &patch);
+    } else {
+        err = bps_diff(&source, &target, thread_count, &patch);
+    }
+    if (err == PATCH_OK) {
+        FILE* patch_file = fopen(patch_path, "w");
+        if (patch_file == NULL) {
+            rombp_log_err("Failed to open patch output file: %s, errno: %d\n", patch_path, errno);
+            err = PATCH_ERR_IO;
+        } else {
+            err = patch_buffer_write_file(&patch, patch_file);
+            fclose(patch_file);
+        }
+    }
+    if (err == PATCH_OK) {
+        rombp_log_info("Wrote %ld byte %s patch to: %s\n", (long)patch.size, format, patch_path);
+    } else {
+        rombp_log_err("Failed to create %s patch: %d\n", format, err);
+    }
+
+    patch_buffer_free(&patch);
+    patch_source_free(&target);
+    patch_source_free(&source);
+    return err;
+}
+
 int main(int argc, char** argv) {
     rombp_patch_command command;
     pthread_t patch_thread;
@@ -491,8 +954,12 @@ int main(int argc, char** argv) {
     command.input_file = NULL;
     command.ips_file = NULL;
     command.output_file = NULL;
+    command.memory_budget = PATCH_DEFAULT_MEMORY_BUDGET;
+    command.thread_count = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (argc > 1) {
+    if (argc > 1 && strcmp(argv[1], "diff") == 0) {
+        return execute_diff(argc - 1, argv + 1);
+    } else if (argc > 1) {
         // If the user passed command line arguments, assume they don't want to launch
         // the SDL UI.
         return execute_command_line(argc, argv, &patch_thread, &command);
@@ -0,0 +1,224 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "crc32.h"
+#include "patch.h"
+#include "stats.h"
+
+static const char* STATS_PHASE_NAMES[STATS_PHASE_COUNT] = {
+    "detect",
+    "start",
+    "apply",
+    "crc",
+    "end",
+};
+
+// Bumped when the report's layout changes, so old and new reports can be told apart.
+static const int STATS_REPORT_VERSION = 1;
+
+void rombp_stats_init(rombp_stats* stats, const char* path) {
+    memset(stats, 0, sizeof(rombp_stats));
+    stats->path = path;
+}
+
+uint64_t rombp_stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void rombp_stats_counter_add(rombp_stats_counter* counter, uint64_t bytes, uint64_t begin) {
+    counter->count++;
+    counter->bytes += bytes;
+    counter->nanos += rombp_stats_clock() - begin;
+}
+
+void rombp_stats_add_command(rombp_stats* stats, int command, uint64_t bytes, uint64_t begin) {
+    if (stats != NULL && command >= 0 && command < STATS_MAX_COMMANDS) {
+        rombp_stats_counter_add(&stats->commands[command], bytes, begin);
+    }
+}
+
+void rombp_stats_add_phase(rombp_stats* stats, rombp_stats_phase phase, uint64_t bytes, uint64_t begin) {
+    if (stats != NULL) {
+        rombp_stats_counter_add(&stats->phases[phase], bytes, begin);
+    }
+}
+
+void rombp_stats_merge_commands(rombp_stats* stats, const rombp_stats_counter* commands) {
+    if (stats == NULL) {
+        return;
+    }
+    for (int i = 0; i < STATS_MAX_COMMANDS; i++) {
+        stats->commands[i].count += commands[i].count;
+        stats->commands[i].bytes += commands[i].bytes;
+        stats->commands[i].nanos += commands[i].nanos;
+    }
+}
+
+// Snapshot /proc/self/io with a single read, which it then counts too. When
+// own_read is set, that read is added to the snapshot, so it isn't counted
+// against whatever's measured from it.
+static void stats_read_io(rombp_stats_io* io, int own_read) {
+    char buf[512];
+    char* line;
+
+    memset(io, 0, sizeof(rombp_stats_io));
+    io->seeks = patch_seek_count();
+
+    // Linux only. Elsewhere, only seeks are counted.
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    ssize_t nread = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nread <= 0) {
+        return;
+    }
+    buf[nread] = '\0';
+
+    for (line = buf; line != NULL; line = strchr(line, '\n')) {
+        unsigned long long value;
+        if (*line == '\n') {
+            line++;
+        }
+        char* colon = strchr(line, ':');
+        if (colon == NULL) {
+            break;
+        }
+        value = strtoull(colon + 1, NULL, 10);
+        if (strncmp(line, "syscr:", 6) == 0) {
+            io->reads = value;
+        } else if (strncmp(line, "syscw:", 6) == 0) {
+            io->writes = value;
+        } else if (strncmp(line, "rchar:", 6) == 0) {
+            io->read_bytes = value;
+        } else if (strncmp(line, "wchar:", 6) == 0) {
+            io->write_bytes = value;
+        }
+    }
+    if (own_read) {
+        io->reads++;
+        io->read_bytes += nread;
+    }
+}
+
+void rombp_stats_read_io(rombp_stats_io* io) {
+    stats_read_io(io, 1);
+}
+
+void rombp_stats_add_io(rombp_stats_io* io, const rombp_stats_io* begin) {
+    rombp_stats_io now;
+
+    stats_read_io(&now, 0);
+    io->reads += now.reads - begin->reads;
+    io->writes += now.writes - begin->writes;
+    io->seeks += now.seeks - begin->seeks;
+    io->read_bytes += now.read_bytes - begin->read_bytes;
+    io->write_bytes += now.write_bytes - begin->write_bytes;
+}
+
+void rombp_stats_phase_begin(const rombp_stats* stats, rombp_stats_io* io, uint64_t* begin) {
+    if (stats != NULL) {
+        rombp_stats_read_io(io);
+        *begin = rombp_stats_clock();
+    }
+}
+
+void rombp_stats_phase_end(rombp_stats* stats, rombp_stats_phase phase, uint64_t bytes,
+                           const rombp_stats_io* io, uint64_t begin) {
+    if (stats != NULL) {
+        rombp_stats_add_phase(stats, phase, bytes, begin);
+        rombp_stats_add_io(&stats->phase_io[phase], io);
+    }
+}
+
+static double stats_ms(uint64_t nanos) {
+    return nanos / 1000000.0;
+}
+
+static void stats_write_string(FILE* file, const char* str) {
+    fputc('"', file);
+    for (const unsigned char* p = (const unsigned char*)str; p != NULL && *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(file, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void stats_write_io(FILE* file, const rombp_stats_io* io) {
+    fprintf(file, "\"reads\": %llu, \"writes\": %llu, \"seeks\": %llu, \"read_bytes\": %llu, \"write_bytes\": %llu",
+            (unsigned long long)io->reads, (unsigned long long)io->writes, (unsigned long long)io->seeks,
+            (unsigned long long)io->read_bytes, (unsigned long long)io->write_bytes);
+}
+
+static void stats_write_counter(FILE* file, const rombp_stats_counter* counter) {
+    fprintf(file, "\"count\": %llu, \"bytes\": %llu, \"ms\": %.3f",
+            (unsigned long long)counter->count, (unsigned long long)counter->bytes, stats_ms(counter->nanos));
+}
+
+static void stats_write_patch(FILE* file, const rombp_stats* stats) {
+    fprintf(file, "    {\n      \"path\": ");
+    stats_write_string(file, stats->path);
+    fprintf(file, ",\n      \"format\": ");
+    if (stats->format != NULL) {
+        stats_write_string(file, stats->format);
+    } else {
+        fprintf(file, "null");
+    }
+    fprintf(file, ",\n      \"err\": %d,\n      \"hunks\": %d,\n      \"phases\": {\n", stats->err, stats->hunk_count);
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(file, "        \"%s\": { ", STATS_PHASE_NAMES[i]);
+        stats_write_counter(file, &stats->phases[i]);
+        if (i != STATS_PHASE_CRC) {
+            fprintf(file, ", ");
+            stats_write_io(file, &stats->phase_io[i]);
+        }
+        fprintf(file, " }%s\n", i + 1 < STATS_PHASE_COUNT ? "," : "");
+    }
+    fprintf(file, "      },\n      \"commands\": {");
+    for (int i = 0; i < stats->command_count; i++) {
+        fprintf(file, "%s\n        ", i > 0 ? "," : "");
+        stats_write_string(file, stats->command_names[i]);
+        fprintf(file, ": { ");
+        stats_write_counter(file, &stats->commands[i]);
+        fprintf(file, " }");
+    }
+    fprintf(file, "%s}\n    }", stats->command_count > 0 ? "\n      " : "");
+}
+
+int rombp_stats_write_json(FILE* file, const rombp_stats* patches, int patch_count,
+                           const rombp_stats_io* io_begin, uint64_t begin) {
+    rombp_stats_io io;
+    struct rusage usage;
+
+    uint64_t total_nanos = rombp_stats_clock() - begin;
+    memset(&io, 0, sizeof(io));
+    rombp_stats_add_io(&io, io_begin);
+    // ru_maxrss is in kilobytes on Linux
+    long peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+
+    fprintf(file, "{\n  \"version\": %d,\n  \"total_ms\": %.3f,\n  \"peak_rss_kb\": %ld,\n  \"crc32\": ",
+            STATS_REPORT_VERSION, stats_ms(total_nanos), peak_rss_kb);
+    stats_write_string(file, crc32_implementation());
+    fprintf(file, ",\n  \"io\": { ");
+    stats_write_io(file, &io);
+    fprintf(file, " },\n  \"patches\": [");
+    for (int i = 0; i < patch_count; i++) {
+        fprintf(file, "%s\n", i > 0 ? "," : "");
+        stats_write_patch(file, &patches[i]);
+    }
+    fprintf(file, "%s]\n}\n", patch_count > 0 ? "\n  " : "");
+
+    return ferror(file) ? -1 : 0;
+}
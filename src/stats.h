@@ -0,0 +1,93 @@
+#ifndef ROMBP_STATS_H_
+#define ROMBP_STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Most command types an engine reports apply stats for.
+#define STATS_MAX_COMMANDS 4
+
+typedef enum rombp_stats_phase {
+    STATS_PHASE_DETECT = 0,
+    // Starting the engine: checking the input, loading or copying it.
+    STATS_PHASE_START = 1,
+    // Every hunk, from the first call to next until it's done.
+    STATS_PHASE_APPLY = 2,
+    // Hashing the input, patch or output, timed by the engines. Nested in the
+    // other phases, rather than added to them.
+    STATS_PHASE_CRC = 3,
+    STATS_PHASE_END = 4,
+    STATS_PHASE_COUNT = 5,
+} rombp_stats_phase;
+
+// I/O syscalls made by the whole process. Reads and writes come from
+// /proc/self/io, which counts every read and write syscall, however it's
+// made. Seeks are counted by patch_seek.
+typedef struct rombp_stats_io {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t seeks;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+} rombp_stats_io;
+
+// How many times something was done, on how many bytes, and how long it took.
+typedef struct rombp_stats_counter {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t nanos;
+} rombp_stats_counter;
+
+// Instrumentation for applying one patch. Engines find it in their apply
+// options, and record nothing when it's NULL.
+typedef struct rombp_stats {
+    const char* path;
+    // The patch's format, and the names of the engine's command types, once
+    // it's detected.
+    const char* format;
+    const char* const* command_names;
+    int command_count;
+
+    rombp_stats_counter phases[STATS_PHASE_COUNT];
+    // I/O done in each phase but CRC, which happens inside the others.
+    rombp_stats_io phase_io[STATS_PHASE_COUNT];
+    // Apply time per command type. Commands applied on several threads add up
+    // the time of each thread.
+    rombp_stats_counter commands[STATS_MAX_COMMANDS];
+
+    int hunk_count;
+    int err;
+} rombp_stats;
+
+void rombp_stats_init(rombp_stats* stats, const char* path);
+// Monotonic time, in nanoseconds.
+uint64_t rombp_stats_clock();
+// When to time something from, or 0 without stats.
+static inline uint64_t rombp_stats_begin(const rombp_stats* stats) {
+    return stats != NULL ? rombp_stats_clock() : 0;
+}
+// Count one more of something, on bytes, that started at begin.
+void rombp_stats_counter_add(rombp_stats_counter* counter, uint64_t bytes, uint64_t begin);
+// Count a command of the engine's type command, or a run of a phase. Does
+// nothing without stats.
+void rombp_stats_add_command(rombp_stats* stats, int command, uint64_t bytes, uint64_t begin);
+void rombp_stats_add_phase(rombp_stats* stats, rombp_stats_phase phase, uint64_t bytes, uint64_t begin);
+// Add up command counters kept apart, by a thread, into stats.
+void rombp_stats_merge_commands(rombp_stats* stats, const rombp_stats_counter* commands);
+
+// Snapshot the process's I/O so far. Counts /proc/self/io doesn't have are left 0.
+void rombp_stats_read_io(rombp_stats_io* io);
+// Add the I/O done since begin to io.
+void rombp_stats_add_io(rombp_stats_io* io, const rombp_stats_io* begin);
+// Time a phase run by the caller, and the I/O done during it. Both do nothing
+// without stats.
+void rombp_stats_phase_begin(const rombp_stats* stats, rombp_stats_io* io, uint64_t* begin);
+void rombp_stats_phase_end(rombp_stats* stats, rombp_stats_phase phase, uint64_t bytes,
+                           const rombp_stats_io* io, uint64_t begin);
+
+// Write a JSON report on every patch applied, and the process as a whole since
+// begin: its I/O, peak resident set size, and the CRC32 implementation in use.
+int rombp_stats_write_json(FILE* file, const rombp_stats* patches, int patch_count,
+                           const rombp_stats_io* io_begin, uint64_t begin);
+
+#endif
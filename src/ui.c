@@ -412,7 +412,7 @@ static int ui_handle_select(rombp_ui* ui, rombp_patch_command* command) {
     int rc;
 
     if (selected_item->d_type == DT_DIR) {
-        rombp_log_info("Got directory selection\n");
+        rombp_log_debug("Got directory selection\n");
         rc = ui_change_directory(ui, selected_item->d_name);
         if (rc != 0) {
             rombp_log_err("Failed to change directory: %s, rc: %d\n",selected_item->d_name, rc);
@@ -420,7 +420,7 @@ static int ui_handle_select(rombp_ui* ui, rombp_patch_command* command) {
         }
         return ui_scan_directory(ui);
     } else if (selected_item->d_type == DT_REG) {
-        rombp_log_info("Got file selection\n");
+        rombp_log_debug("Got file selection\n");
         if (command->input_file == NULL) {
             ui_status_bar_free(&ui->bottom_bar);
             command->input_file = concat_path(ui->current_directory, selected_item->d_name);
@@ -554,7 +554,7 @@ rombp_ui_event ui_handle_event(rombp_ui* ui, rombp_patch_command* command) {
                         int w = event.window.data1;
                         int h = event.window.data2;
                         ui_resize_window(ui, w, h);
-                        rombp_log_info("Window size is: %dx%d\n", w, h);
+                        rombp_log_debug("Window size is: %dx%d\n", w, h);
                         break;
                     }
                     default:
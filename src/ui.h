@@ -56,6 +56,10 @@ typedef struct rombp_patch_command {
     char* input_file;
     char* output_file;
     char* ips_file;
+    // Most memory, in bytes, a patch engine should buffer. 0 for no limit.
+    size_t memory_budget;
+    // Threads a patch engine may apply the patch with.
+    int thread_count;
 } rombp_patch_command;
 
 int ui_start(rombp_ui* ui);
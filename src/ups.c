@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "crc32.h"
+#include "log.h"
+#include "stats.h"
+#include "ups.h"
+
+const uint8_t UPS_MARKER[UPS_MARKER_SIZE] = {
+    0x55, 0x50, 0x53, 0x31 // UPS1
+};
+
+static const size_t FOOTER_LENGTH = 12;
+static const size_t PATCH_CRC32_LENGTH = 4;
+static const size_t BUF_SIZE = 32768;
+
+// Longest varint that still fits in 64 bits.
+static const int MAX_VARINT_LENGTH = 10;
+
+// Decode a varint straight out of the in-memory patch, at the current patch offset.
+// UPS varints are encoded the same way as BPS ones, and may not run into the footer.
+static int decode_varint(ups_context* ctx, uint64_t* out) {
+    const uint8_t* patch = ctx->patch.data;
+    uint64_t end = ctx->patch_size - FOOTER_LENGTH;
+    uint64_t offset = ctx->patch_offset;
+    uint64_t data = 0;
+    uint64_t shift = 1;
+
+    for (int i = 0; i < MAX_VARINT_LENGTH; i++) {
+        if (offset >= end) {
+            rombp_log_err("Varint runs past the end of the patch data, offset: %ld\n", (long)offset);
+            return -1;
+        }
+        uint8_t ch = patch[offset++];
+        data += (ch & 0x7F) * shift;
+        if (ch & 0x80) {
+            ctx->patch_offset = offset;
+            *out = data;
+            return 0;
+        }
+        shift <<= 7;
+        data += shift;
+    }
+
+    rombp_log_err("Varint is too long, offset: %ld\n", (long)ctx->patch_offset);
+    return -1;
+}
+
+static inline uint32_t le_32bit_int(const uint8_t* buf) {
+    return (uint32_t)buf[0] |
+        ((uint32_t)buf[1] << 8) |
+        ((uint32_t)buf[2] << 16) |
+        ((uint32_t)buf[3] << 24);
+}
+
+// XOR length bytes of src into dest.
+static void ups_xor(uint8_t* dest, const uint8_t* src, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 32 <= length; i += 32) {
+        __m128i a0 = _mm_loadu_si128((const __m128i*)(dest + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i*)(dest + i + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_xor_si128(a0, b0));
+        _mm_storeu_si128((__m128i*)(dest + i + 16), _mm_xor_si128(a1, b1));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= length; i += 16) {
+        vst1q_u8(dest + i, veorq_u8(vld1q_u8(dest + i), vld1q_u8(src + i)));
+    }
+#endif
+    for (; i + 8 <= length; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dest + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dest + i, &a, sizeof(a));
+    }
+    for (; i < length; i++) {
+        dest[i] ^= src[i];
+    }
+}
+
+// Work out which way round the patch applies from the input's size and CRC32,
+// and check the patch's own CRC32.
+static rombp_patch_err ups_verify_checksums(ups_context* ctx, FILE* input_file,
+                                            uint64_t source_size, uint64_t target_size,
+                                            uint32_t source_crc32, uint32_t target_crc32) {
+    struct stat input_file_stat;
+    uint32_t input_crc32;
+
+    uint32_t patch_crc32 = crc32_update(0, ctx->patch.data, ctx->patch_size - PATCH_CRC32_LENGTH);
+    if (patch_crc32 != ctx->patch_crc32) {
+        rombp_log_err("Patch file CRC32 does not match! Expected: %u, got: %u\n", ctx->patch_crc32, patch_crc32);
+        return PATCH_INVALID_INPUT_CHECKSUM;
+    }
+
+    if (ctx->source != NULL) {
+        ctx->input_size = ctx->source->data.size;
+    } else {
+        int rc = fstat(fileno(input_file), &input_file_stat);
+        if (rc == -1) {
+            rombp_log_err("Failed to stat input file, errno: %d\n", errno);
+            return PATCH_ERR_IO;
+        }
+        ctx->input_size = input_file_stat.st_size;
+    }
+    if (ctx->input_size != source_size && ctx->input_size != target_size) {
+        rombp_log_err("Input file size does not match the UPS source or target size. Expected: %ld or %ld, got: %ld\n",
+                      (long)source_size, (long)target_size, (long)ctx->input_size);
+        return PATCH_INVALID_INPUT_SIZE;
+    }
+
+    if (ctx->source != NULL) {
+        input_crc32 = ctx->source->crc32;
+    } else if (patch_crc32_file(input_file, ctx->input_size, &input_crc32) != PATCH_OK) {
+        rombp_log_err("Failed to compute UPS input checksum\n");
+        return PATCH_ERR_IO;
+    }
+
+    if (ctx->input_size == source_size && input_crc32 == source_crc32) {
+        ctx->output_size = target_size;
+        ctx->input_crc32 = source_crc32;
+        ctx->expected_output_crc32 = target_crc32;
+    } else if (ctx->input_size == target_size && input_crc32 == target_crc32) {
+        rombp_log_info("Input file is the UPS target, reverting the patch\n");
+        ctx->output_size = source_size;
+        ctx->input_crc32 = target_crc32;
+        ctx->expected_output_crc32 = source_crc32;
+    } else {
+        rombp_log_err("Input file CRC32 does not match! Expected: %u or %u, got: %u\n",
+                      source_crc32, target_crc32, input_crc32);
+        return PATCH_INVALID_INPUT_CHECKSUM;
+    }
+
+    rombp_log_info("Input file and patch file CRC32s are correct\n");
+    return PATCH_OK;
+}
+
+// Set up the output image in memory: a copy of the input, cut or zero padded
+// to the output size.
+static rombp_patch_err ups_load_output(ups_context* ctx, FILE* input_file) {
+    rombp_patch_err rc;
+
+    if (ctx->output_size > SIZE_MAX) {
+        return PATCH_ERR_IO;
+    }
+    if (ctx->source != NULL) {
+        rc = patch_buffer_resize(&ctx->output, ctx->source->data.size);
+        if (rc == PATCH_OK && ctx->source->data.size > 0) {
+            memcpy(ctx->output.data, ctx->source->data.data, ctx->source->data.size);
+        }
+    } else {
+        rc = patch_buffer_read_file(&ctx->output, input_file);
+    }
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+    if (ctx->output.size != ctx->input_size) {
+        rombp_log_err("Read %ld bytes of the UPS input, expected %ld\n", (long)ctx->output.size, (long)ctx->input_size);
+        return PATCH_ERR_IO;
+    }
+    return patch_buffer_resize(&ctx->output, ctx->output_size);
+}
+
+rombp_patch_err ups_start(ups_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                          FILE* input_file, FILE* ups_file) {
+    rombp_apply_mode mode = options->mode;
+    uint64_t source_size;
+    uint64_t target_size;
+
+    ctx->source = source;
+    patch_buffer_init(&ctx->patch);
+    patch_buffer_init(&ctx->output);
+    ctx->in_memory = 0;
+    ctx->output_offset = 0;
+    ctx->output_crc32 = 0;
+    ctx->stats = options->stats;
+
+    // Pull the whole patch into memory, records are decoded straight out of the buffer.
+    int rc = patch_seek(ups_file, 0);
+    if (rc == -1) {
+        rombp_log_err("Failed to seek UPS file back to beginning, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    rc = patch_buffer_read_file(&ctx->patch, ups_file);
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to read UPS patch into memory\n");
+        return rc;
+    }
+    ctx->patch_size = ctx->patch.size;
+    ctx->patch_offset = UPS_MARKER_SIZE;
+
+    if (ctx->patch_size < UPS_MARKER_SIZE + FOOTER_LENGTH) {
+        rombp_log_err("UPS file is too small to hold a footer, size: %ld\n", (long)ctx->patch_size);
+        return PATCH_INVALID_HEADER;
+    }
+    const uint8_t* footer = ctx->patch.data + ctx->patch_size - FOOTER_LENGTH;
+    uint32_t source_crc32 = le_32bit_int(footer);
+    uint32_t target_crc32 = le_32bit_int(footer + 4);
+    ctx->patch_crc32 = le_32bit_int(footer + 8);
+
+    if (decode_varint(ctx, &source_size) == -1) {
+        rombp_log_err("UPS file: Failed to read source size\n");
+        return PATCH_INVALID_HEADER;
+    }
+    if (decode_varint(ctx, &target_size) == -1) {
+        rombp_log_err("UPS file: Failed to read target size\n");
+        return PATCH_INVALID_HEADER;
+    }
+    rombp_log_debug("UPS file header, source_size: %ld, target_size: %ld\n", (long)source_size, (long)target_size);
+
+    uint64_t begin = rombp_stats_begin(ctx->stats);
+    rc = ups_verify_checksums(ctx, input_file, source_size, target_size, source_crc32, target_crc32);
+    rombp_stats_add_phase(ctx->stats, STATS_PHASE_CRC, ctx->patch_size + (source != NULL ? 0 : ctx->input_size), begin);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+
+    if (input_file != NULL && patch_seek(input_file, 0) == -1) {
+        rombp_log_err("Failed to seek input file back to beginning, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+
+    // With the input already in memory, records are XORed into it in place,
+    // and unchanged stretches cost nothing but their CRC32.
+    if (mode != APPLY_MODE_STREAM) {
+        rc = ups_load_output(ctx, input_file);
+        if (rc == PATCH_OK) {
+            ctx->in_memory = 1;
+        } else if (mode == APPLY_MODE_MEMORY) {
+            rombp_log_err("Could not load the UPS output into memory: %d\n", rc);
+            return PATCH_ERR_IO;
+        } else {
+            rombp_log_debug("Could not load UPS output in memory, streaming to the output file\n");
+            patch_buffer_free(&ctx->output);
+            if (input_file != NULL && patch_seek(input_file, 0) == -1) {
+                rombp_log_err("Failed to seek input file back to beginning, error: %d\n", errno);
+                return PATCH_ERR_IO;
+            }
+        }
+    }
+
+    return PATCH_OK;
+}
+
+// Read length bytes of the input at the output offset into buf. The input is
+// read in order, and reads as zeros past its end.
+static int ups_read_input(ups_context* ctx, FILE* input_file, uint8_t* buf, size_t length) {
+    uint64_t offset = ctx->output_offset;
+    size_t available = offset < ctx->input_size ? MIN(length, ctx->input_size - offset) : 0;
+
+    if (available == 0) {
+        // Past the end of the input
+    } else if (ctx->source != NULL) {
+        memcpy(buf, ctx->source->data.data + offset, available);
+    } else {
+        size_t nread = fread(buf, sizeof(uint8_t), available, input_file);
+        if (nread < available) {
+            rombp_log_err("Error during UPS input read, read: %ld of %ld bytes, error: %d\n",
+                          (long)nread, (long)available, errno);
+            return -1;
+        }
+    }
+    memset(buf + available, 0, length - available);
+    return 0;
+}
+
+// Produce the next length bytes of output: the input, XORed with xor_bytes when
+// it's set. Output past the output size is dropped.
+static rombp_hunk_iter_status ups_apply(ups_context* ctx, FILE* input_file, FILE* output_file,
+                                        const uint8_t* xor_bytes, uint64_t length) {
+    length = MIN(length, ctx->output_size - ctx->output_offset);
+
+    if (ctx->in_memory) {
+        uint8_t* dest = ctx->output.data + ctx->output_offset;
+        if (xor_bytes != NULL) {
+            ups_xor(dest, xor_bytes, length);
+        }
+        ctx->output_crc32 = crc32_update(ctx->output_crc32, dest, length);
+        ctx->output_offset += length;
+        return HUNK_NEXT;
+    }
+
+    uint8_t buf[BUF_SIZE];
+    while (length > 0) {
+        size_t chunk = MIN(BUF_SIZE, length);
+        if (ups_read_input(ctx, input_file, buf, chunk) == -1) {
+            return HUNK_ERR_IO;
+        }
+        if (xor_bytes != NULL) {
+            ups_xor(buf, xor_bytes, chunk);
+            xor_bytes += chunk;
+        }
+        size_t nwritten = fwrite(buf, sizeof(uint8_t), chunk, output_file);
+        if (nwritten < chunk) {
+            rombp_log_err("UPS output write error: %d\n", errno);
+            return HUNK_ERR_IO;
+        }
+        ctx->output_crc32 = crc32_update(ctx->output_crc32, buf, chunk);
+        ctx->output_offset += chunk;
+        length -= chunk;
+    }
+    return HUNK_NEXT;
+}
+
+// Each record skips over unchanged bytes, then XORs a run of bytes into the
+// input, up to a zero terminator. The terminator stands for one more unchanged
+// byte.
+rombp_hunk_iter_status ups_next(ups_context* ctx, FILE* input_file, FILE* output_file) {
+    uint64_t end = ctx->patch_size - FOOTER_LENGTH;
+    if (ctx->patch_offset >= end) {
+        return HUNK_DONE;
+    }
+
+    uint64_t skip;
+    if (decode_varint(ctx, &skip) == -1) {
+        rombp_log_err("Couldn't get UPS record offset\n");
+        return HUNK_ERR_IO;
+    }
+
+    const uint8_t* xor_bytes = ctx->patch.data + ctx->patch_offset;
+    const uint8_t* terminator = memchr(xor_bytes, 0, end - ctx->patch_offset);
+    if (terminator == NULL) {
+        rombp_log_err("UPS record runs past the end of the patch data, offset: %ld\n", (long)ctx->patch_offset);
+        return HUNK_ERR_IO;
+    }
+    uint64_t length = terminator - xor_bytes;
+    rombp_log_trace("UPS record, skip: %ld, length: %ld\n", (long)skip, (long)length);
+
+    uint64_t begin = rombp_stats_begin(ctx->stats);
+    rombp_hunk_iter_status status = ups_apply(ctx, input_file, output_file, NULL, skip);
+    rombp_stats_add_command(ctx->stats, UPS_COPY, skip, begin);
+    if (status == HUNK_NEXT) {
+        begin = rombp_stats_begin(ctx->stats);
+        status = ups_apply(ctx, input_file, output_file, xor_bytes, length);
+        rombp_stats_add_command(ctx->stats, UPS_XOR, length, begin);
+    }
+    if (status == HUNK_NEXT) {
+        status = ups_apply(ctx, input_file, output_file, NULL, 1);
+    }
+    ctx->patch_offset += length + 1;
+
+    return status;
+}
+
+rombp_patch_err ups_end(ups_context* ctx, FILE* input_file, FILE* output_file) {
+    // Everything after the last record is unchanged
+    uint64_t begin = rombp_stats_begin(ctx->stats);
+    uint64_t remaining = ctx->output_size - ctx->output_offset;
+    if (ups_apply(ctx, input_file, output_file, NULL, remaining) != HUNK_NEXT) {
+        return PATCH_ERR_IO;
+    }
+    rombp_stats_add_command(ctx->stats, UPS_COPY, remaining, begin);
+
+    if (ctx->output_crc32 != ctx->expected_output_crc32) {
+        rombp_log_err("Footer output CRC32 and expected CRC32 do not match! Expected: %u, got: %u\n",
+                      ctx->expected_output_crc32, ctx->output_crc32);
+        return PATCH_INVALID_OUTPUT_CHECKSUM;
+    }
+    rombp_log_info("Output file CRC32 is correct\n");
+
+    if (ctx->in_memory && output_file != NULL) {
+        return patch_buffer_write_file(&ctx->output, output_file);
+    }
+    return PATCH_OK;
+}
+
+rombp_patch_err ups_take_output(ups_context* ctx, patch_source* output) {
+    if (!ctx->in_memory) {
+        rombp_log_err("UPS output is not in memory\n");
+        return PATCH_ERR_IO;
+    }
+    // ups_end already checked this against the footer
+    output->data = ctx->output;
+    output->crc32 = ctx->output_crc32;
+    patch_buffer_init(&ctx->output);
+    return PATCH_OK;
+}
+
+void ups_free(ups_context* ctx) {
+    patch_buffer_free(&ctx->patch);
+    patch_buffer_free(&ctx->output);
+}
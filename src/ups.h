@@ -0,0 +1,62 @@
+#ifndef ROMBP_UPS_H_
+#define ROMBP_UPS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "patch.h"
+
+// Every UPS patch starts with this marker, UPS1.
+#define UPS_MARKER_SIZE 4
+extern const uint8_t UPS_MARKER[UPS_MARKER_SIZE];
+
+// Kinds of output run, as counted in the stats report: unchanged input
+// copied through, or input XORed with the patch.
+typedef enum ups_command_type {
+    UPS_COPY = 0,
+    UPS_XOR = 1,
+} ups_command_type;
+
+typedef struct ups_context {
+    // Sizes of the input and output images. UPS patches apply both ways, so
+    // these are the patch's source and target sizes, or the other way round
+    // when the input is the patch's target.
+    uint64_t input_size;
+    uint64_t output_size;
+    // Shared in-memory copy of the input file, if the caller has one.
+    const patch_source* source;
+
+    // The whole patch file, and the read position of the next record in it.
+    patch_buffer patch;
+    uint64_t patch_size;
+    uint64_t patch_offset;
+
+    // When set, the output starts as a copy of the input in memory, records
+    // are XORed into it in place, and it's written out by ups_end. Otherwise
+    // the input is streamed through to the output file.
+    int in_memory;
+    patch_buffer output;
+
+    // Output bytes produced so far, and their CRC32.
+    uint64_t output_offset;
+    uint32_t output_crc32;
+
+    // Expected CRC32s, from the patch footer, in the direction being applied.
+    uint32_t input_crc32;
+    uint32_t expected_output_crc32;
+    uint32_t patch_crc32;
+
+    struct rombp_stats* stats;
+} ups_context;
+
+// When source is set, it's used in place of reading input_file.
+rombp_patch_err ups_start(ups_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                          FILE* input_file, FILE* ups_file);
+rombp_hunk_iter_status ups_next(ups_context* ctx, FILE* input_file, FILE* output_file);
+rombp_patch_err ups_end(ups_context* ctx, FILE* input_file, FILE* output_file);
+// Move the in-memory output into output, so it can be the source of another
+// patch. Only valid after a successful ups_end, for a patch started in memory.
+rombp_patch_err ups_take_output(ups_context* ctx, patch_source* output);
+void ups_free(ups_context* ctx);
+
+#endif
@@ -0,0 +1,777 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "log.h"
+#include "stats.h"
+#include "vcdiff.h"
+
+const uint8_t VCDIFF_MARKER[VCDIFF_MARKER_SIZE] = {
+    0xD6, 0xC3, 0xC4, 0x00
+};
+
+// Header indicator bits
+static const uint8_t VCD_DECOMPRESS = 0x01;
+static const uint8_t VCD_CODETABLE = 0x02;
+// xdelta3 extension: an application header, holding file names.
+static const uint8_t VCD_APPHEADER = 0x04;
+
+// Window indicator bits
+static const uint8_t VCD_SOURCE = 0x01;
+static const uint8_t VCD_TARGET = 0x02;
+// xdelta3 extension: an Adler-32 of the window's output, before its sections.
+static const uint8_t VCD_ADLER32 = 0x04;
+
+// Longest integer that still fits in 64 bits.
+static const int MAX_VARINT_LENGTH = 10;
+
+// Windows are decoded ahead on several threads once the target is at least this big.
+static const uint64_t PARALLEL_MIN_TARGET_SIZE = 4 * 1024 * 1024;
+#define VCDIFF_MAX_DECODE_THREADS 64
+
+// Instruction types. Counted in the stats report as type - VCD_ADD.
+typedef enum vcdiff_inst_type {
+    VCD_NOOP = 0,
+    VCD_ADD = 1,
+    VCD_RUN = 2,
+    VCD_COPY = 3,
+} vcdiff_inst_type;
+
+// An entry of the instruction code table: one or two instructions, each with
+// a size (0 when it follows in the instruction section) and a COPY mode.
+typedef struct vcdiff_code {
+    uint8_t type[2];
+    uint8_t size[2];
+    uint8_t mode[2];
+} vcdiff_code;
+
+static pthread_once_t vcdiff_code_table_once = PTHREAD_ONCE_INIT;
+static vcdiff_code vcdiff_code_table[256];
+
+// The default code table, from section 5.6 of the RFC.
+static void vcdiff_build_code_table() {
+    vcdiff_code* code = vcdiff_code_table;
+
+    // RUN, sized by the instruction section
+    code->type[0] = VCD_RUN;
+    code++;
+    // ADD, sized by the instruction section, then sizes 1 - 17
+    for (int size = 0; size <= 17; size++, code++) {
+        code->type[0] = VCD_ADD;
+        code->size[0] = size;
+    }
+    // COPY in every mode, sized by the instruction section, then sizes 4 - 18
+    for (int mode = 0; mode <= 8; mode++) {
+        for (int size = 0; size <= 18; size++) {
+            if (size >= 1 && size <= 3) {
+                continue;
+            }
+            code->type[0] = VCD_COPY;
+            code->size[0] = size;
+            code->mode[0] = mode;
+            code++;
+        }
+    }
+    // ADD of 1 - 4, then COPY of 4 - 6 in the HERE, SELF and near modes,
+    // or of 4 in the same modes
+    for (int mode = 0; mode <= 8; mode++) {
+        int max_copy_size = mode <= 5 ? 6 : 4;
+        for (int add_size = 1; add_size <= 4; add_size++) {
+            for (int copy_size = 4; copy_size <= max_copy_size; copy_size++, code++) {
+                code->type[0] = VCD_ADD;
+                code->size[0] = add_size;
+                code->type[1] = VCD_COPY;
+                code->size[1] = copy_size;
+                code->mode[1] = mode;
+            }
+        }
+    }
+    // COPY of 4, then ADD of 1
+    for (int mode = 0; mode <= 8; mode++, code++) {
+        code->type[0] = VCD_COPY;
+        code->size[0] = 4;
+        code->mode[0] = mode;
+        code->type[1] = VCD_ADD;
+        code->size[1] = 1;
+    }
+}
+
+#define VCDIFF_NEAR_SIZE 4
+#define VCDIFF_SAME_SIZE 3
+
+// Recently used COPY addresses, so they can be encoded relative to each other.
+// Reset at the start of every window.
+typedef struct vcdiff_address_cache {
+    uint64_t near[VCDIFF_NEAR_SIZE];
+    uint64_t same[VCDIFF_SAME_SIZE * 256];
+    int next_slot;
+} vcdiff_address_cache;
+
+// Read a VCDIFF integer: big endian, 7 bits a byte, the high bit set on every
+// byte but the last.
+static int vcdiff_read_int(const uint8_t** pos, const uint8_t* end, uint64_t* out) {
+    const uint8_t* p = *pos;
+    uint64_t value = 0;
+
+    for (int i = 0; i < MAX_VARINT_LENGTH && p < end; i++) {
+        if (value > (UINT64_MAX >> 7)) {
+            break;
+        }
+        uint8_t ch = *p++;
+        value = (value << 7) | (ch & 0x7F);
+        if ((ch & 0x80) == 0) {
+            *pos = p;
+            *out = value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int vcdiff_read_byte(const uint8_t** pos, const uint8_t* end, uint8_t* out) {
+    if (*pos >= end) {
+        return -1;
+    }
+    *out = *(*pos)++;
+    return 0;
+}
+
+static uint32_t vcdiff_adler32(const uint8_t* data, uint64_t length) {
+    // Largest run of bytes that can be summed before the sums could overflow
+    static const size_t ADLER32_MAX_RUN = 5552;
+    static const uint32_t ADLER32_MOD = 65521;
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    while (length > 0) {
+        size_t run = MIN(length, ADLER32_MAX_RUN);
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER32_MOD;
+        b %= ADLER32_MOD;
+        data += run;
+        length -= run;
+    }
+
+    return (b << 16) | a;
+}
+
+// Decode a COPY address, here being the address of the byte about to be written,
+// and remember it in the cache.
+static int vcdiff_decode_address(vcdiff_address_cache* cache, uint8_t mode, uint64_t here,
+                                 const uint8_t** addr, const uint8_t* addr_end, uint64_t* out) {
+    uint64_t address;
+    uint64_t value;
+    uint8_t index;
+
+    if (mode == 0) {
+        // SELF
+        if (vcdiff_read_int(addr, addr_end, &address) == -1) {
+            return -1;
+        }
+    } else if (mode == 1) {
+        // HERE
+        if (vcdiff_read_int(addr, addr_end, &value) == -1 || value > here) {
+            return -1;
+        }
+        address = here - value;
+    } else if (mode < 2 + VCDIFF_NEAR_SIZE) {
+        if (vcdiff_read_int(addr, addr_end, &value) == -1) {
+            return -1;
+        }
+        address = cache->near[mode - 2] + value;
+    } else if (mode < 2 + VCDIFF_NEAR_SIZE + VCDIFF_SAME_SIZE) {
+        if (vcdiff_read_byte(addr, addr_end, &index) == -1) {
+            return -1;
+        }
+        address = cache->same[(mode - 2 - VCDIFF_NEAR_SIZE) * 256 + index];
+    } else {
+        return -1;
+    }
+    if (address >= here) {
+        return -1;
+    }
+
+    cache->near[cache->next_slot] = address;
+    cache->next_slot = (cache->next_slot + 1) % VCDIFF_NEAR_SIZE;
+    cache->same[address % (VCDIFF_SAME_SIZE * 256)] = address;
+    *out = address;
+    return 0;
+}
+
+// Copy length bytes to out at pos, from address in the segment followed by the
+// window's own output. Copies that overlap what they write repeat the bytes
+// between, which is copied once and then doubled up.
+static void vcdiff_copy(uint8_t* out, uint64_t pos, const uint8_t* segment, uint64_t segment_size,
+                        uint64_t address, uint64_t length) {
+    if (address < segment_size) {
+        uint64_t from_segment = MIN(length, segment_size - address);
+        memcpy(out + pos, segment + address, from_segment);
+        pos += from_segment;
+        length -= from_segment;
+        address = segment_size;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    uint64_t src = address - segment_size;
+    uint64_t distance = pos - src;
+    if (distance >= length) {
+        memcpy(out + pos, out + src, length);
+        return;
+    }
+    memcpy(out + pos, out + src, distance);
+    uint64_t copied = distance;
+    while (copied < length) {
+        uint64_t amount_to_copy = MIN(copied, length - copied);
+        memcpy(out + pos + copied, out + pos, amount_to_copy);
+        copied += amount_to_copy;
+    }
+}
+
+// Decode a window into out, its target_size bytes, reading COPYs from segment.
+// Touches nothing else, so windows can be decoded on different threads. When
+// commands is set, the time spent on each instruction type is added to it.
+static int vcdiff_decode_window(const uint8_t* patch, const vcdiff_window* window,
+                                const uint8_t* segment, uint8_t* out, rombp_stats_counter* commands) {
+    const uint8_t* data = patch + window->data_offset;
+    const uint8_t* data_end = data + window->data_size;
+    const uint8_t* inst = patch + window->inst_offset;
+    const uint8_t* inst_end = inst + window->inst_size;
+    const uint8_t* addr = patch + window->addr_offset;
+    const uint8_t* addr_end = addr + window->addr_size;
+    uint64_t target_size = window->target_size;
+    uint64_t pos = 0;
+    vcdiff_address_cache cache;
+
+    memset(&cache, 0, sizeof(cache));
+    while (inst < inst_end) {
+        const vcdiff_code* code = &vcdiff_code_table[*inst++];
+
+        for (int i = 0; i < 2; i++) {
+            uint8_t type = code->type[i];
+            uint64_t size = code->size[i];
+            uint64_t address;
+
+            if (type == VCD_NOOP) {
+                continue;
+            }
+            if (size == 0 && vcdiff_read_int(&inst, inst_end, &size) == -1) {
+                rombp_log_err("VCDIFF instruction size runs past the instruction section\n");
+                return -1;
+            }
+            if (size > target_size - pos) {
+                rombp_log_err("VCDIFF instruction writes past the end of its window, window offset: %ld, size: %ld\n",
+                              (long)pos, (long)size);
+                return -1;
+            }
+            uint64_t begin = commands != NULL ? rombp_stats_clock() : 0;
+
+            switch (type) {
+                case VCD_ADD:
+                    if (size > (uint64_t)(data_end - data)) {
+                        rombp_log_err("VCDIFF ADD runs past the data section, size: %ld\n", (long)size);
+                        return -1;
+                    }
+                    memcpy(out + pos, data, size);
+                    data += size;
+                    break;
+                case VCD_RUN:
+                    if (data >= data_end) {
+                        rombp_log_err("VCDIFF RUN runs past the data section\n");
+                        return -1;
+                    }
+                    memset(out + pos, *data++, size);
+                    break;
+                case VCD_COPY:
+                    if (vcdiff_decode_address(&cache, code->mode[i], window->segment_size + pos,
+                                              &addr, addr_end, &address) == -1) {
+                        rombp_log_err("Bad VCDIFF COPY address, window offset: %ld, mode: %d\n",
+                                      (long)pos, code->mode[i]);
+                        return -1;
+                    }
+                    vcdiff_copy(out, pos, segment, window->segment_size, address, size);
+                    break;
+            }
+            if (commands != NULL) {
+                rombp_stats_counter_add(&commands[type - VCD_ADD], size, begin);
+            }
+            pos += size;
+        }
+    }
+
+    if (pos != target_size) {
+        rombp_log_err("VCDIFF window decoded to %ld bytes, expected %ld\n", (long)pos, (long)target_size);
+        return -1;
+    }
+    if (window->has_adler32 && vcdiff_adler32(out, target_size) != window->adler32) {
+        rombp_log_err("VCDIFF window Adler-32 does not match, target offset: %ld\n", (long)window->target_offset);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the header, and every window's header, so the target size and every
+// window's place in it are known before decoding anything.
+static rombp_patch_err vcdiff_read_windows(vcdiff_context* ctx) {
+    const uint8_t* pos = ctx->patch.data + VCDIFF_MARKER_SIZE;
+    const uint8_t* end = ctx->patch.data + ctx->patch.size;
+    size_t capacity = 0;
+    uint64_t length;
+    uint8_t indicator;
+
+    if (vcdiff_read_byte(&pos, end, &indicator) == -1) {
+        rombp_log_err("VCDIFF file ends before its header indicator\n");
+        return PATCH_INVALID_HEADER;
+    }
+    if (indicator & VCD_CODETABLE) {
+        rombp_log_err("VCDIFF patches with their own code table aren't supported\n");
+        return PATCH_INVALID_HEADER;
+    }
+    if (indicator & VCD_DECOMPRESS) {
+        // Only windows that don't use it can be decoded
+        uint8_t compressor;
+        if (vcdiff_read_byte(&pos, end, &compressor) == -1) {
+            return PATCH_INVALID_HEADER;
+        }
+        rombp_log_info("VCDIFF header names secondary compressor: %d\n", compressor);
+    }
+    if (indicator & VCD_APPHEADER) {
+        if (vcdiff_read_int(&pos, end, &length) == -1 || length > (uint64_t)(end - pos)) {
+            rombp_log_err("VCDIFF application header runs past the end of the patch\n");
+            return PATCH_INVALID_HEADER;
+        }
+        pos += length;
+    }
+
+    while (pos < end) {
+        vcdiff_window window;
+        uint8_t delta_indicator;
+        uint64_t delta_length;
+
+        memset(&window, 0, sizeof(window));
+        if (vcdiff_read_byte(&pos, end, &indicator) == -1 ||
+            (indicator & ~(VCD_SOURCE | VCD_TARGET | VCD_ADLER32)) != 0 ||
+            (indicator & (VCD_SOURCE | VCD_TARGET)) == (VCD_SOURCE | VCD_TARGET)) {
+            rombp_log_err("Bad VCDIFF window indicator: %d\n", indicator);
+            return PATCH_INVALID_HEADER;
+        }
+        if (indicator & (VCD_SOURCE | VCD_TARGET)) {
+            window.from_target = (indicator & VCD_TARGET) != 0;
+            if (vcdiff_read_int(&pos, end, &window.segment_size) == -1 ||
+                vcdiff_read_int(&pos, end, &window.segment_offset) == -1) {
+                return PATCH_INVALID_HEADER;
+            }
+            uint64_t available = window.from_target ? ctx->target_size : ctx->input_size;
+            if (window.segment_offset > available || window.segment_size > available - window.segment_offset) {
+                rombp_log_err("VCDIFF window segment is out of range, offset: %ld, size: %ld\n",
+                              (long)window.segment_offset, (long)window.segment_size);
+                return PATCH_INVALID_HEADER;
+            }
+        }
+
+        if (vcdiff_read_int(&pos, end, &delta_length) == -1 || delta_length > (uint64_t)(end - pos)) {
+            rombp_log_err("VCDIFF window runs past the end of the patch\n");
+            return PATCH_INVALID_HEADER;
+        }
+        const uint8_t* delta_end = pos + delta_length;
+        if (vcdiff_read_int(&pos, delta_end, &window.target_size) == -1 ||
+            vcdiff_read_byte(&pos, delta_end, &delta_indicator) == -1 ||
+            vcdiff_read_int(&pos, delta_end, &window.data_size) == -1 ||
+            vcdiff_read_int(&pos, delta_end, &window.inst_size) == -1 ||
+            vcdiff_read_int(&pos, delta_end, &window.addr_size) == -1) {
+            rombp_log_err("Bad VCDIFF window header\n");
+            return PATCH_INVALID_HEADER;
+        }
+        if (delta_indicator != 0) {
+            rombp_log_err("VCDIFF window sections are compressed, which isn't supported\n");
+            return PATCH_INVALID_HEADER;
+        }
+        if (indicator & VCD_ADLER32) {
+            if (delta_end - pos < 4) {
+                return PATCH_INVALID_HEADER;
+            }
+            window.has_adler32 = 1;
+            window.adler32 = ((uint32_t)pos[0] << 24) | ((uint32_t)pos[1] << 16) | ((uint32_t)pos[2] << 8) | pos[3];
+            pos += 4;
+        }
+        uint64_t sections_left = delta_end - pos;
+        if (window.data_size > sections_left ||
+            window.inst_size > sections_left - window.data_size ||
+            window.addr_size != sections_left - window.data_size - window.inst_size) {
+            rombp_log_err("VCDIFF window section sizes don't add up\n");
+            return PATCH_INVALID_HEADER;
+        }
+        if (window.target_size > UINT64_MAX - ctx->target_size) {
+            return PATCH_INVALID_HEADER;
+        }
+
+        window.data_offset = pos - ctx->patch.data;
+        window.inst_offset = window.data_offset + window.data_size;
+        window.addr_offset = window.inst_offset + window.inst_size;
+        window.target_offset = ctx->target_size;
+        ctx->target_size += window.target_size;
+        pos = delta_end;
+
+        if (ctx->window_count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            vcdiff_window* grown = realloc(ctx->windows, capacity * sizeof(vcdiff_window));
+            if (grown == NULL) {
+                rombp_log_err("Failed to allocate VCDIFF windows\n");
+                return PATCH_ERR_IO;
+            }
+            ctx->windows = grown;
+        }
+        ctx->windows[ctx->window_count++] = window;
+    }
+
+    rombp_log_debug("VCDIFF file has %ld windows, target size: %ld\n", (long)ctx->window_count, (long)ctx->target_size);
+    return PATCH_OK;
+}
+
+// Load what decoding in memory needs: the input, unless it's shared, and the
+// whole target.
+static rombp_patch_err vcdiff_load(vcdiff_context* ctx, FILE* input_file) {
+    if (ctx->target_size > SIZE_MAX) {
+        return PATCH_ERR_IO;
+    }
+    if (ctx->source == NULL) {
+        rombp_patch_err rc = patch_buffer_read_file(&ctx->input, input_file);
+        if (rc != PATCH_OK) {
+            return rc;
+        }
+        if (ctx->input.size != ctx->input_size) {
+            rombp_log_err("Read %ld bytes of the VCDIFF input, expected %ld\n", (long)ctx->input.size, (long)ctx->input_size);
+            return PATCH_ERR_IO;
+        }
+    }
+    return patch_buffer_resize(&ctx->output, ctx->target_size);
+}
+
+// Size the buffers streaming needs: the largest window, and the largest segment
+// that has to be read from a file.
+static rombp_patch_err vcdiff_prepare_stream(vcdiff_context* ctx, FILE* output_file) {
+    uint64_t window_size = 0;
+    uint64_t segment_size = 0;
+
+    for (size_t i = 0; i < ctx->window_count; i++) {
+        const vcdiff_window* window = &ctx->windows[i];
+        window_size = MAX(window_size, window->target_size);
+        if (window->from_target || ctx->source == NULL) {
+            segment_size = MAX(segment_size, window->segment_size);
+        }
+    }
+    if (window_size > SIZE_MAX || segment_size > SIZE_MAX || output_file == NULL) {
+        return PATCH_ERR_IO;
+    }
+    ctx->output_fd = fileno(output_file);
+
+    rombp_patch_err rc = patch_buffer_resize(&ctx->window, window_size);
+    if (rc == PATCH_OK) {
+        rc = patch_buffer_resize(&ctx->segment, segment_size);
+    }
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to allocate VCDIFF buffers, window: %ld bytes, segment: %ld bytes\n",
+                      (long)window_size, (long)segment_size);
+        return rc;
+    }
+    rombp_log_debug("VCDIFF window buffer: %ld bytes, segment buffer: %ld bytes\n",
+                    (long)window_size, (long)segment_size);
+    return PATCH_OK;
+}
+
+rombp_patch_err vcdiff_start(vcdiff_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                             FILE* input_file, FILE* output_file, FILE* vcdiff_file) {
+    struct stat input_file_stat;
+    rombp_apply_mode mode = options->mode;
+
+    ctx->source = source;
+    ctx->input_size = 0;
+    ctx->input_fd = input_file != NULL ? fileno(input_file) : -1;
+    ctx->output_fd = -1;
+    patch_buffer_init(&ctx->patch);
+    patch_buffer_init(&ctx->input);
+    patch_buffer_init(&ctx->output);
+    patch_buffer_init(&ctx->window);
+    patch_buffer_init(&ctx->segment);
+    ctx->windows = NULL;
+    ctx->window_count = 0;
+    ctx->next_window = 0;
+    ctx->target_size = 0;
+    ctx->in_memory = 0;
+    ctx->thread_count = 1;
+    ctx->decoded_ahead = 0;
+    ctx->on_progress = options->on_progress;
+    ctx->progress_arg = options->progress_arg;
+    atomic_init(&ctx->output_bytes, 0);
+    ctx->stats = options->stats;
+
+    pthread_once(&vcdiff_code_table_once, vcdiff_build_code_table);
+
+    if (source != NULL) {
+        ctx->input_size = source->data.size;
+    } else {
+        if (fstat(ctx->input_fd, &input_file_stat) == -1) {
+            rombp_log_err("Failed to stat input file, errno: %d\n", errno);
+            return PATCH_ERR_IO;
+        }
+        ctx->input_size = input_file_stat.st_size;
+        if (patch_seek(input_file, 0) == -1) {
+            rombp_log_err("Failed to seek input file back to beginning, error: %d\n", errno);
+            return PATCH_ERR_IO;
+        }
+    }
+
+    // Pull the whole patch into memory, windows are decoded straight out of the buffer.
+    int rc = patch_seek(vcdiff_file, 0);
+    if (rc == -1) {
+        rombp_log_err("Failed to seek VCDIFF file back to beginning, error: %d\n", errno);
+        return PATCH_ERR_IO;
+    }
+    rc = patch_buffer_read_file(&ctx->patch, vcdiff_file);
+    if (rc != PATCH_OK) {
+        rombp_log_err("Failed to read VCDIFF patch into memory\n");
+        return rc;
+    }
+    rc = vcdiff_read_windows(ctx);
+    if (rc != PATCH_OK) {
+        return rc;
+    }
+
+    // Decode the whole target in memory when it fits the budget, so segments of the
+    // input and target are read in place, and nothing is read back from a file.
+    if (mode != APPLY_MODE_STREAM) {
+        uint64_t needed = ctx->target_size + (source != NULL ? 0 : ctx->input_size);
+        int fits = mode == APPLY_MODE_MEMORY || options->memory_budget == 0 || needed <= options->memory_budget;
+        rc = fits ? vcdiff_load(ctx, input_file) : PATCH_ERR_IO;
+        if (rc == PATCH_OK) {
+            ctx->in_memory = 1;
+        } else if (mode == APPLY_MODE_MEMORY) {
+            rombp_log_err("Could not load the VCDIFF input and target into memory\n");
+            return PATCH_ERR_IO;
+        } else {
+            rombp_log_debug("VCDIFF target doesn't fit in memory, streaming to the output file\n");
+            patch_buffer_free(&ctx->input);
+            patch_buffer_free(&ctx->output);
+        }
+    }
+    if (!ctx->in_memory) {
+        return vcdiff_prepare_stream(ctx, output_file);
+    }
+
+    if (ctx->target_size >= PARALLEL_MIN_TARGET_SIZE) {
+        ctx->thread_count = MIN(MAX(options->thread_count, 1), VCDIFF_MAX_DECODE_THREADS);
+    }
+    return PATCH_OK;
+}
+
+static const uint8_t* vcdiff_input_data(const vcdiff_context* ctx) {
+    return ctx->source != NULL ? ctx->source->data.data : ctx->input.data;
+}
+
+// Read exactly length bytes of fd at offset.
+static int vcdiff_pread(int fd, uint8_t* buf, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t nread = pread(fd, buf, length, offset);
+        if (nread <= 0) {
+            rombp_log_err("Failed to read %ld bytes at offset: %ld, errno: %d\n", (long)length, (long)offset, errno);
+            return -1;
+        }
+        buf += nread;
+        length -= nread;
+        offset += nread;
+    }
+    return 0;
+}
+
+// Decode one window into the target in memory, or through the window buffer into
+// the output file.
+static int vcdiff_apply_window(vcdiff_context* ctx, const vcdiff_window* window, rombp_stats_counter* commands) {
+    const uint8_t* segment;
+
+    if (ctx->in_memory) {
+        segment = window->from_target ? ctx->output.data : vcdiff_input_data(ctx);
+        return vcdiff_decode_window(ctx->patch.data, window, segment + window->segment_offset,
+                                    ctx->output.data + window->target_offset, commands);
+    }
+
+    if (!window->from_target && ctx->source != NULL) {
+        segment = ctx->source->data.data + window->segment_offset;
+    } else {
+        int fd = window->from_target ? ctx->output_fd : ctx->input_fd;
+        if (vcdiff_pread(fd, ctx->segment.data, window->segment_size, window->segment_offset) == -1) {
+            rombp_log_err("Failed to read VCDIFF window segment\n");
+            return -1;
+        }
+        segment = ctx->segment.data;
+    }
+    if (vcdiff_decode_window(ctx->patch.data, window, segment, ctx->window.data, commands) == -1) {
+        return -1;
+    }
+    if (patch_pwrite(ctx->output_fd, ctx->window.data, window->target_size, window->target_offset) != PATCH_OK) {
+        rombp_log_err("Failed to write VCDIFF window, target offset: %ld\n", (long)window->target_offset);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct vcdiff_decode_job {
+    vcdiff_context* ctx;
+    const size_t* windows;
+    size_t first;
+    size_t last;
+    int err;
+    // Set on the job the calling thread runs, which reports progress.
+    int reports_progress;
+    // Decode time per instruction type, merged into the stats once the job's joined.
+    rombp_stats_counter commands[STATS_MAX_COMMANDS];
+} vcdiff_decode_job;
+
+static void* vcdiff_decode_job_run(void* arg) {
+    vcdiff_decode_job* job = (vcdiff_decode_job*)arg;
+    vcdiff_context* ctx = job->ctx;
+    rombp_stats_counter* commands = ctx->stats != NULL ? job->commands : NULL;
+    for (size_t i = job->first; i < job->last && job->err == 0; i++) {
+        const vcdiff_window* window = &ctx->windows[job->windows[i]];
+        job->err = vcdiff_apply_window(ctx, window, commands);
+        atomic_fetch_add_explicit(&ctx->output_bytes, window->target_size, memory_order_relaxed);
+        if (job->reports_progress && ctx->on_progress != NULL) {
+            ctx->on_progress(ctx->progress_arg);
+        }
+    }
+    return NULL;
+}
+
+// Decode every window that doesn't copy from the target, split between threads by
+// the number of bytes they write. Their output doesn't overlap, and they only read
+// the input and the patch.
+static int vcdiff_decode_ahead(vcdiff_context* ctx, int thread_count) {
+    vcdiff_decode_job jobs[VCDIFF_MAX_DECODE_THREADS];
+    pthread_t threads[VCDIFF_MAX_DECODE_THREADS];
+    int started[VCDIFF_MAX_DECODE_THREADS];
+    uint64_t total_size = 0;
+    size_t count = 0;
+
+    size_t* windows = malloc(ctx->window_count * sizeof(size_t));
+    if (windows == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < ctx->window_count; i++) {
+        if (!ctx->windows[i].from_target) {
+            windows[count++] = i;
+            total_size += ctx->windows[i].target_size;
+        }
+    }
+    int job_count = MIN((size_t)thread_count, count);
+    rombp_log_debug("Decoding %ld of %ld VCDIFF windows ahead, on %d threads\n",
+                    (long)count, (long)ctx->window_count, job_count);
+
+    uint64_t assigned = 0;
+    size_t next = 0;
+    for (int j = 0; j < job_count; j++) {
+        uint64_t share = total_size * (j + 1) / job_count;
+        jobs[j].ctx = ctx;
+        jobs[j].windows = windows;
+        jobs[j].first = next;
+        while (next < count && (assigned < share || j == job_count - 1)) {
+            assigned += ctx->windows[windows[next++]].target_size;
+        }
+        jobs[j].last = next;
+        jobs[j].err = 0;
+        jobs[j].reports_progress = j == 0;
+        memset(jobs[j].commands, 0, sizeof(jobs[j].commands));
+    }
+
+    for (int j = 1; j < job_count; j++) {
+        started[j] = pthread_create(&threads[j], NULL, &vcdiff_decode_job_run, &jobs[j]) == 0;
+        if (!started[j]) {
+            vcdiff_decode_job_run(&jobs[j]);
+        }
+    }
+    int err = 0;
+    if (job_count > 0) {
+        vcdiff_decode_job_run(&jobs[0]);
+        err = jobs[0].err;
+    }
+    for (int j = 1; j < job_count; j++) {
+        if (started[j]) {
+            pthread_join(threads[j], NULL);
+        }
+        err |= jobs[j].err;
+    }
+    for (int j = 0; j < job_count; j++) {
+        rombp_stats_merge_commands(ctx->stats, jobs[j].commands);
+    }
+    free(windows);
+    return err != 0 ? -1 : 0;
+}
+
+// Each window is a hunk.
+rombp_hunk_iter_status vcdiff_next(vcdiff_context* ctx) {
+    if (ctx->thread_count > 1) {
+        int thread_count = ctx->thread_count;
+        ctx->thread_count = 1;
+        if (vcdiff_decode_ahead(ctx, thread_count) == -1) {
+            rombp_log_err("Failed to decode VCDIFF windows in parallel\n");
+            return HUNK_ERR_IO;
+        }
+        ctx->decoded_ahead = 1;
+    }
+    if (ctx->next_window >= ctx->window_count) {
+        return HUNK_DONE;
+    }
+
+    const vcdiff_window* window = &ctx->windows[ctx->next_window];
+    rombp_log_trace("VCDIFF window, target offset: %ld, size: %ld, segment offset: %ld, size: %ld%s\n",
+                    (long)window->target_offset, (long)window->target_size,
+                    (long)window->segment_offset, (long)window->segment_size,
+                    window->from_target ? " (target)" : "");
+    rombp_stats_counter* commands = ctx->stats != NULL ? ctx->stats->commands : NULL;
+    if (!(ctx->decoded_ahead && !window->from_target)) {
+        if (vcdiff_apply_window(ctx, window, commands) == -1) {
+            return HUNK_ERR_IO;
+        }
+        atomic_fetch_add_explicit(&ctx->output_bytes, window->target_size, memory_order_relaxed);
+    }
+    ctx->next_window++;
+    return HUNK_NEXT;
+}
+
+rombp_patch_err vcdiff_end(vcdiff_context* ctx, FILE* output_file) {
+    if (ctx->in_memory && output_file != NULL) {
+        return patch_buffer_write_file(&ctx->output, output_file);
+    }
+    return PATCH_OK;
+}
+
+rombp_patch_err vcdiff_take_output(vcdiff_context* ctx, patch_source* output) {
+    if (!ctx->in_memory) {
+        rombp_log_err("VCDIFF target is not in memory\n");
+        return PATCH_ERR_IO;
+    }
+    uint64_t begin = rombp_stats_begin(ctx->stats);
+    output->data = ctx->output;
+    output->crc32 = crc32_update(0, output->data.data, output->data.size);
+    rombp_stats_add_phase(ctx->stats, STATS_PHASE_CRC, output->data.size, begin);
+    patch_buffer_init(&ctx->output);
+    return PATCH_OK;
+}
+
+void vcdiff_free(vcdiff_context* ctx) {
+    patch_buffer_free(&ctx->patch);
+    patch_buffer_free(&ctx->input);
+    patch_buffer_free(&ctx->output);
+    patch_buffer_free(&ctx->window);
+    patch_buffer_free(&ctx->segment);
+    free(ctx->windows);
+    ctx->windows = NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef ROMBP_VCDIFF_H_
+#define ROMBP_VCDIFF_H_
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "patch.h"
+
+// Every VCDIFF patch starts with 'V' 'C' 'D' with their high bits set, and
+// version 0.
+#define VCDIFF_MARKER_SIZE 4
+extern const uint8_t VCDIFF_MARKER[VCDIFF_MARKER_SIZE];
+
+// One window of a VCDIFF (RFC 3284) patch: a stretch of the target, built by
+// copying from a segment of the input or of the target before it, and from
+// the window's own data section.
+typedef struct vcdiff_window {
+    // The segment COPY instructions read from, ahead of the window's own
+    // output. It's part of the input, or of the target when from_target is set.
+    int from_target;
+    uint64_t segment_offset;
+    uint64_t segment_size;
+
+    // Where the window's output goes in the target, and how long it is.
+    uint64_t target_offset;
+    uint64_t target_size;
+
+    // Offsets of the window's sections in the patch.
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t inst_offset;
+    uint64_t inst_size;
+    uint64_t addr_offset;
+    uint64_t addr_size;
+
+    // xdelta3's checksum of the window's output, when it has one.
+    int has_adler32;
+    uint32_t adler32;
+} vcdiff_window;
+
+typedef struct vcdiff_context {
+    // Shared in-memory copy of the input file, if the caller has one.
+    const patch_source* source;
+    uint64_t input_size;
+    int input_fd;
+    int output_fd;
+
+    // The whole patch file, and every window in it, found by vcdiff_start.
+    // Each call to vcdiff_next decodes the next window.
+    patch_buffer patch;
+    vcdiff_window* windows;
+    size_t window_count;
+    size_t next_window;
+    uint64_t target_size;
+
+    // When set, the whole target is decoded into output, and written out by
+    // vcdiff_end. Without a shared source, the input is loaded into input.
+    int in_memory;
+    patch_buffer input;
+    patch_buffer output;
+    // Otherwise each window is decoded into window, and written to the output
+    // file. Segments are read from the input or output file into segment.
+    patch_buffer window;
+    patch_buffer segment;
+
+    // When thread_count is over 1, the first vcdiff_next decodes every window
+    // that doesn't read the target, on that many threads, and sets
+    // decoded_ahead. Later calls only decode the rest, in order.
+    int thread_count;
+    int decoded_ahead;
+    void (*on_progress)(void* arg);
+    void* progress_arg;
+
+    // Target bytes decoded so far, counted by whichever thread decoded them.
+    atomic_size_t output_bytes;
+
+    struct rombp_stats* stats;
+} vcdiff_context;
+
+// When source is set, it's used in place of reading input_file. VCDIFF has no
+// checksum of the input, only xdelta3's optional checksum of each window.
+rombp_patch_err vcdiff_start(vcdiff_context* ctx, const rombp_apply_options* options, const patch_source* source,
+                             FILE* input_file, FILE* output_file, FILE* vcdiff_file);
+rombp_hunk_iter_status vcdiff_next(vcdiff_context* ctx);
+rombp_patch_err vcdiff_end(vcdiff_context* ctx, FILE* output_file);
+// Move the in-memory target into output, so it can be the source of another
+// patch. Only valid after a successful vcdiff_end, for a patch started in memory.
+rombp_patch_err vcdiff_take_output(vcdiff_context* ctx, patch_source* output);
+void vcdiff_free(vcdiff_context* ctx);
+
+#endif
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "bps.h"
+#include "crc32.h"
+#include "test.h"
+
+// Round trips the BPS engine: generates random targets as SourceRead,
+// TargetRead, SourceCopy and TargetCopy commands, and checks the engine
+// gives the target back. Targets big enough are applied on several
+// threads, with TargetCopy chains that stack many levels of commands on
+// each other, and have to come out the same as on one thread. They have to
+// report progress while they go, too. The output CRC32 is
+// checked on one thread, on several, and on the streaming pipeline thread,
+// and a wrong one has to be rejected by each.
+// Usage: bps_test
+
+enum {
+    SOURCE_READ = 0,
+    TARGET_READ = 1,
+    SOURCE_COPY = 2,
+    TARGET_COPY = 3,
+};
+
+// A random patch from source to a target of target_size bytes, with commands
+// of up to max_length bytes, or max_copy_length for TargetCopy. TargetCopy
+// mostly copies from just behind the output, overlapping itself like a run,
+// and otherwise from anywhere before it.
+static void make_patch(uint32_t seed, const patch_source* source, size_t target_size, size_t max_length,
+                       size_t max_copy_length, patch_source* target, bench_writer* patch) {
+    uint32_t state = seed;
+    uint64_t source_relative_offset = 0;
+    uint64_t target_relative_offset = 0;
+    size_t source_size = source->data.size;
+    uint8_t* out;
+
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, target_size);
+    out = target->data.data;
+
+    patch->size = 0;
+    bench_writer_put(patch, BPS_MARKER, BPS_MARKER_SIZE);
+    bench_writer_put_varint(patch, source_size);
+    bench_writer_put_varint(patch, target_size);
+    bench_writer_put_varint(patch, 0);
+
+    size_t pos = 0;
+    while (pos < target_size) {
+        int kind = bench_next_random(&state) % 4;
+        size_t length = 1 + bench_random_below(&state, kind == TARGET_COPY ? max_copy_length : max_length);
+        length = length < target_size - pos ? length : target_size - pos;
+
+        if (kind == SOURCE_READ && pos + length > source_size) {
+            kind = TARGET_READ;
+        }
+        if (kind == SOURCE_COPY && source_size == 0) {
+            kind = TARGET_READ;
+        }
+        if (kind == TARGET_COPY && pos == 0) {
+            kind = TARGET_READ;
+        }
+        if (kind == SOURCE_COPY) {
+            length = length < source_size ? length : source_size;
+        }
+
+        bench_writer_put_varint(patch, ((uint64_t)(length - 1) << 2) | kind);
+        if (kind == SOURCE_READ) {
+            memcpy(out + pos, source->data.data + pos, length);
+        } else if (kind == TARGET_READ) {
+            for (size_t i = 0; i < length; i++) {
+                out[pos + i] = bench_next_byte(&state);
+            }
+            bench_writer_put(patch, out + pos, length);
+        } else if (kind == SOURCE_COPY) {
+            uint64_t from = bench_random_below(&state, source_size - length + 1);
+            bench_writer_put_relative(patch, &source_relative_offset, from);
+            memcpy(out + pos, source->data.data + from, length);
+            source_relative_offset += length;
+        } else {
+            uint64_t distance = bench_next_random(&state) % 2 == 0
+                ? 1 + bench_random_below(&state, pos < 16 ? pos : 16)
+                : 1 + bench_random_below(&state, pos);
+            uint64_t from = pos - distance;
+            bench_writer_put_relative(patch, &target_relative_offset, from);
+            // Byte by byte, since short copies overlap their own output
+            for (size_t i = 0; i < length; i++) {
+                out[pos + i] = out[from + i];
+            }
+            target_relative_offset += length;
+        }
+        pos += length;
+    }
+
+    target->crc32 = crc32_update(0, out, target_size);
+    bench_writer_put_le32(patch, source->crc32);
+    bench_writer_put_le32(patch, target->crc32);
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+}
+
+// Add a TargetRead past the end of the target, and fix up the patch's CRC32.
+static void overrun_target(bench_writer* patch) {
+    uint8_t footer[8];
+
+    patch->size -= 12;
+    memcpy(footer, patch->data + patch->size, sizeof(footer));
+    bench_writer_put_varint(patch, ((uint64_t)0 << 2) | TARGET_READ);
+    bench_writer_put_byte(patch, 0x42);
+    bench_writer_put(patch, footer, sizeof(footer));
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+}
+
+// A TargetCopy that reads output 100 bytes ahead of what's written, in a
+// target that's otherwise random TargetRead. target is what an engine reading
+// the unwritten bytes as zeroes would give.
+static void make_forward_copy_patch(const patch_source* source, size_t target_size, patch_source* target,
+                                    bench_writer* patch) {
+    static const size_t COPY_LENGTH = 1000;
+    uint32_t state = 0xF0;
+    uint64_t target_relative_offset = 0;
+
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, target_size);
+    memset(target->data.data, 0, COPY_LENGTH + 1);
+    target->data.data[0] = 0x11;
+    for (size_t i = COPY_LENGTH + 1; i < target_size; i++) {
+        target->data.data[i] = bench_next_byte(&state);
+    }
+    target->crc32 = crc32_update(0, target->data.data, target_size);
+
+    patch->size = 0;
+    bench_writer_put(patch, BPS_MARKER, BPS_MARKER_SIZE);
+    bench_writer_put_varint(patch, source->data.size);
+    bench_writer_put_varint(patch, target_size);
+    bench_writer_put_varint(patch, 0);
+    bench_writer_put_varint(patch, ((uint64_t)0 << 2) | TARGET_READ);
+    bench_writer_put_byte(patch, target->data.data[0]);
+    bench_writer_put_varint(patch, ((uint64_t)(COPY_LENGTH - 1) << 2) | TARGET_COPY);
+    bench_writer_put_relative(patch, &target_relative_offset, 100);
+    bench_writer_put_varint(patch, ((uint64_t)(target_size - COPY_LENGTH - 2) << 2) | TARGET_READ);
+    bench_writer_put(patch, target->data.data + COPY_LENGTH + 1, target_size - COPY_LENGTH - 1);
+    bench_writer_put_le32(patch, source->crc32);
+    bench_writer_put_le32(patch, target->crc32);
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+}
+
+// Flip a bit of the target CRC32 in the footer, and fix up the patch's own.
+static void corrupt_target_crc(bench_writer* patch) {
+    patch->data[patch->size - 8] ^= 0x01;
+    patch->size -= 4;
+    bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+}
+
+// Apply the patch in every mode on 1 and 4 threads, and when streaming, through
+// an output window small enough for the CRC pipeline to wrap around it. Returns
+// how many of the applies gave the target back.
+static int verify_everywhere(const char* name, const patch_source* source, const patch_source* target,
+                             const bench_writer* writer) {
+    static const rombp_apply_mode MODES[] = { APPLY_MODE_MEMORY, APPLY_MODE_MAP, APPLY_MODE_STREAM };
+    static const int THREAD_COUNTS[] = { 1, 4 };
+    static const size_t MEMORY_BUDGETS[] = { 0, 256 * 1024 };
+    patch_buffer patch = { writer->data, writer->size, writer->capacity };
+    int matched = 0;
+
+    for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+        for (size_t t = 0; t < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); t++) {
+            for (size_t b = 0; b < sizeof(MEMORY_BUDGETS) / sizeof(MEMORY_BUDGETS[0]); b++) {
+                if (MEMORY_BUDGETS[b] != 0 && MODES[m] != APPLY_MODE_STREAM) {
+                    continue;
+                }
+                rombp_apply_options options = {
+                    .mode = MODES[m],
+                    .memory_budget = MEMORY_BUDGETS[b],
+                    .thread_count = THREAD_COUNTS[t],
+                };
+                int rc = bench_verify_patch_using(&options, source, target, &patch, NULL);
+                if (rc == 0) {
+                    matched++;
+                } else {
+                    rombp_log_info("%s: mode %d, %d threads, budget %ld: %d\n", name, MODES[m],
+                                   THREAD_COUNTS[t], (long)MEMORY_BUDGETS[b], rc);
+                }
+            }
+        }
+    }
+    return matched;
+}
+
+// Apply the patch in memory and through a mapping, on one thread and on
+// several. Returns how many of the applies gave the target back.
+static int verify_threads(const char* name, const patch_source* source, const patch_source* target,
+                          const bench_writer* writer) {
+    static const rombp_apply_mode MODES[] = { APPLY_MODE_MEMORY, APPLY_MODE_MAP };
+    static const int THREAD_COUNTS[] = { 1, 2, 4, 16 };
+    int matched = 0;
+
+    for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+        for (size_t t = 0; t < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); t++) {
+            int rc = bench_verify_writer(source, target, writer, MODES[m], THREAD_COUNTS[t], NULL);
+            if (rc == 0) {
+                matched++;
+            } else {
+                rombp_log_info("%s: mode %d, %d threads: %d\n", name, MODES[m], THREAD_COUNTS[t], rc);
+            }
+        }
+    }
+    return matched;
+}
+
+int main() {
+    bench_writer patch = { NULL, 0, 0 };
+    bench_progress progress;
+    patch_source source;
+    patch_source target;
+    char name[64];
+
+    // Targets over the 4 MB it takes to apply on several threads. Short
+    // commands give long chains of TargetCopy reading each other, and long
+    // TargetCopies read more commands than the dependency walk looks at.
+    // Every apply, 1 to 16 threads, has to give the same target.
+    for (uint32_t seed = 1; seed <= 6; seed++) {
+        uint32_t state = seed * 0x9E3779B9;
+        size_t source_size = seed % 3 == 0 ? 0 : bench_random_below(&state, 8 * 1024 * 1024);
+        size_t target_size = 4 * 1024 * 1024 + bench_random_below(&state, 4 * 1024 * 1024);
+        size_t max_length = seed % 2 == 0 ? 256 : 32 * 1024;
+
+        snprintf(name, sizeof(name), "parallel-%u", seed);
+        bench_random_source(&source, source_size, seed);
+        make_patch(seed, &source, target_size, max_length, 64 * 1024, &target, &patch);
+        TEST_CHECK(name, verify_threads(name, &source, &target, &patch) == 8);
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    // A bad command makes the parallel apply fall back to the sequential one,
+    // which has to reject it
+    bench_random_source(&source, 1024 * 1024, 0x0E);
+    make_patch(0x0E, &source, 5 * 1024 * 1024, 4096, 4096, &target, &patch);
+    overrun_target(&patch);
+    TEST_CHECK("parallel-overrun", verify_threads("parallel-overrun", &source, &target, &patch) == 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    // Copying output that isn't written yet has to be rejected every way, not
+    // only when streaming
+    bench_random_source(&source, 0, 0);
+    make_forward_copy_patch(&source, 5 * 1024 * 1024, &target, &patch);
+    TEST_CHECK("forward-target-copy", verify_everywhere("forward-target-copy", &source, &target, &patch) == 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    // 8 applies: memory, map and stream on 1 and 4 threads, and a small stream
+    // window on 1 and 4. The CRC32 is hashed inline, in parallel chunks of the
+    // finished target, or on the pipeline thread behind the streaming writer.
+    bench_random_source(&source, 3 * 1024 * 1024, 0xC7C);
+    make_patch(0xC7C, &source, 6 * 1024 * 1024 + 5, 64 * 1024, 64 * 1024, &target, &patch);
+    TEST_CHECK("checksums", verify_everywhere("checksums", &source, &target, &patch) == 8);
+    corrupt_target_crc(&patch);
+    TEST_CHECK("wrong-target-crc", verify_everywhere("wrong-target-crc", &source, &target, &patch) == 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    // Big enough to apply on several threads, which has to report progress
+    // as it goes, rather than only once the whole target is written
+    bench_random_source(&source, 4 * 1024 * 1024, 0xB95);
+    make_patch(0xB95, &source, 12 * 1024 * 1024, 64 * 1024, 64 * 1024, &target, &patch);
+    TEST_CHECK("parallel-progress",
+               bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 4, &progress) == 0);
+    TEST_CHECK("parallel-progress", progress.partial_calls > 0);
+    TEST_CHECK("parallel-progress", !progress.went_backwards);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    free(patch.data);
+    return test_report("bps_test");
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "patch.h"
+#include "test.h"
+
+// Checks every strategy for copying the input ROM to the output file, before
+// it's patched in place, with files of awkward sizes around the read/write
+// buffer sizes. Every copy is read back and compared with its input.
+// Strategies the system doesn't support are skipped.
+// Usage: copy_test
+
+static const size_t CHECK_SIZES[] = {
+    0,
+    1,
+    4095,
+    32767,
+    32768,
+    32769,
+    1024 * 1024 - 1,
+    1024 * 1024 + 1,
+    8 * 1024 * 1024 + 7,
+    24 * 1024 * 1024 + 13,
+};
+
+static const rombp_copy_strategy STRATEGIES[] = {
+    COPY_STRATEGY_REFLINK,
+    COPY_STRATEGY_COPY_FILE_RANGE,
+    COPY_STRATEGY_SENDFILE,
+    COPY_STRATEGY_READ_WRITE,
+};
+
+static FILE* make_input(patch_buffer* data, size_t size) {
+    uint32_t state = 0xC0FFEE ^ size;
+
+    patch_buffer_init(data);
+    if (patch_buffer_resize(data, size) != PATCH_OK) {
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        state = state * 1103515245 + 12345;
+        data->data[i] = state >> 24;
+    }
+
+    FILE* input = tmpfile();
+    if (input == NULL) {
+        return NULL;
+    }
+    if (size > 0 && patch_buffer_write_file(data, input) != PATCH_OK) {
+        fclose(input);
+        return NULL;
+    }
+    rewind(input);
+    return input;
+}
+
+static int output_matches(FILE* output, const patch_buffer* expected) {
+    patch_buffer copied;
+
+    patch_buffer_init(&copied);
+    rewind(output);
+    int matches = patch_buffer_read_file(&copied, output) == PATCH_OK &&
+        copied.size == expected->size &&
+        (expected->size == 0 || memcmp(copied.data, expected->data, expected->size) == 0);
+    patch_buffer_free(&copied);
+    return matches;
+}
+
+// Returns 0 if the strategy isn't supported here, and the number of sizes
+// copied otherwise. A strategy that copied a non-empty file has to copy all
+// of them.
+static int check_strategy(rombp_copy_strategy strategy) {
+    const char* name = patch_copy_strategy_name(strategy);
+    int copied = 0;
+    int copied_data = 0;
+
+    for (size_t i = 0; i < sizeof(CHECK_SIZES) / sizeof(CHECK_SIZES[0]); i++) {
+        patch_buffer expected;
+        int rc = PATCH_ERR_IO;
+
+        FILE* input = make_input(&expected, CHECK_SIZES[i]);
+        FILE* output = tmpfile();
+        TEST_CHECK(name, input != NULL && output != NULL);
+        if (input != NULL && output != NULL) {
+            rc = patch_copy_file_using(input, output, strategy);
+            if (rc == PATCH_OK) {
+                TEST_CHECK(name, output_matches(output, &expected));
+            }
+        }
+        if (output != NULL) {
+            fclose(output);
+        }
+        if (input != NULL) {
+            fclose(input);
+        }
+        patch_buffer_free(&expected);
+
+        if (rc != PATCH_OK) {
+            TEST_CHECK(name, !copied_data);
+            return 0;
+        }
+        copied++;
+        copied_data |= CHECK_SIZES[i] > 0;
+    }
+    return copied;
+}
+
+// The default copy tries each strategy in turn, and has to report the one it used.
+static void check_default_copy() {
+    for (size_t i = 0; i < sizeof(CHECK_SIZES) / sizeof(CHECK_SIZES[0]); i++) {
+        rombp_copy_strategy strategy = COPY_STRATEGY_NONE;
+        patch_buffer expected;
+
+        FILE* input = make_input(&expected, CHECK_SIZES[i]);
+        FILE* output = tmpfile();
+        TEST_CHECK("default", input != NULL && output != NULL);
+        if (input != NULL && output != NULL) {
+            TEST_CHECK("default", patch_copy_file(input, output, &strategy) == PATCH_OK);
+            TEST_CHECK("default", strategy != COPY_STRATEGY_NONE && strategy != COPY_STRATEGY_FROM_MEMORY);
+            TEST_CHECK("default", output_matches(output, &expected));
+        }
+        if (output != NULL) {
+            fclose(output);
+        }
+        if (input != NULL) {
+            fclose(input);
+        }
+        patch_buffer_free(&expected);
+    }
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(STRATEGIES) / sizeof(STRATEGIES[0]); i++) {
+        int copied = check_strategy(STRATEGIES[i]);
+        // The fallback every system has
+        if (STRATEGIES[i] == COPY_STRATEGY_READ_WRITE) {
+            TEST_CHECK("read/write", copied > 0);
+        }
+        if (copied > 0) {
+            printf("%-16s %2d sizes copied\n", patch_copy_strategy_name(STRATEGIES[i]), copied);
+        } else {
+            printf("%-16s unsupported\n", patch_copy_strategy_name(STRATEGIES[i]));
+        }
+    }
+    check_default_copy();
+
+    return test_report("copy_test");
+}
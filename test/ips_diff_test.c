@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "ips_diff.h"
+#include "test.h"
+
+// Round trips IPS patch creation: every patch is applied again with the IPS
+// engine, and must give back the target. The targets are edits that land on
+// the encoder's edge cases: a record at the offset that reads as the EOF
+// marker, records longer than an IPS length can hold, and grown and
+// truncated outputs.
+// Usage: ips_diff_test
+
+// Large enough to hold the EOF offset
+static const size_t SOURCE_SIZE = 5 * 1024 * 1024;
+static const size_t MAX_RECORD_LENGTH = 0xFFFF;
+static const size_t EOF_OFFSET = 0x454F46;
+static const size_t MAX_TARGET_SIZE = 0x1000000;
+static const size_t PATCH_HEADER_SIZE = 5;
+static const size_t TRUNCATION_SIZE = 3;
+
+// A copy of the first size bytes of source, zero filled past its end.
+static void copy_source(patch_source* target, const patch_source* source, size_t size) {
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, size);
+    memcpy(target->data.data, source->data.data, size < source->data.size ? size : source->data.size);
+}
+
+static void fill_random(patch_source* target, size_t offset, size_t length, uint32_t seed) {
+    for (size_t i = 0; i < length; i++) {
+        target->data.data[offset + i] = bench_next_byte(&seed);
+    }
+}
+
+// Walk the records up to the EOF marker, and return the number of bytes
+// after it. A record that starts at the EOF offset ends the walk early.
+static size_t bytes_after_eof(const patch_buffer* patch) {
+    size_t pos = PATCH_HEADER_SIZE;
+
+    while (pos + 3 <= patch->size && memcmp(patch->data + pos, "EOF", 3) != 0) {
+        size_t length = (patch->data[pos + 3] << 8) | patch->data[pos + 4];
+        pos += 5;
+        if (length == 0) {
+            length = 3;
+        }
+        pos += length;
+    }
+    return pos + 3 <= patch->size ? patch->size - pos - 3 : 0;
+}
+
+static void check_round_trip(const char* name, const patch_source* source, patch_source* target) {
+    patch_buffer patch;
+
+    target->crc32 = crc32_update(0, target->data.data, target->data.size);
+    patch_buffer_init(&patch);
+    TEST_CHECK(name, ips_diff(source, target, &patch) == PATCH_OK);
+    TEST_CHECK(name, bench_verify_patch(source, target, &patch) == 0);
+    size_t expected = target->data.size < source->data.size ? TRUNCATION_SIZE : 0;
+    TEST_CHECK(name, bytes_after_eof(&patch) == expected);
+    patch_buffer_free(&patch);
+    patch_source_free(target);
+}
+
+int main() {
+    patch_source source;
+    patch_source target;
+    patch_buffer patch;
+
+    bench_make_source(&source, SOURCE_SIZE);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    patch_buffer_init(&patch);
+    TEST_CHECK("unchanged", ips_diff(&source, &target, &patch) == PATCH_OK);
+    TEST_CHECK("unchanged", patch.size == PATCH_HEADER_SIZE + 3);
+    patch_buffer_free(&patch);
+    check_round_trip("unchanged", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    target.data.data[0] ^= 0xFF;
+    target.data.data[SOURCE_SIZE - 1] ^= 0xFF;
+    check_round_trip("first-and-last-byte", &source, &target);
+
+    // Only the byte at the EOF offset changes, so its record has to start
+    // one byte early
+    copy_source(&target, &source, SOURCE_SIZE);
+    target.data.data[EOF_OFFSET] ^= 0xFF;
+    check_round_trip("eof-offset", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    memset(target.data.data + EOF_OFFSET, target.data.data[EOF_OFFSET] ^ 0xFF, 1000);
+    check_round_trip("eof-offset-rle", &source, &target);
+
+    // A plain run whose first full length record would end at the EOF offset
+    copy_source(&target, &source, SOURCE_SIZE);
+    fill_random(&target, EOF_OFFSET - MAX_RECORD_LENGTH, MAX_RECORD_LENGTH + 256, 0xE0F);
+    check_round_trip("eof-offset-split", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    fill_random(&target, 0x1000, 3 * MAX_RECORD_LENGTH + 17, 0x5917);
+    check_round_trip("long-plain-run", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    memset(target.data.data + 0x200001, 0xA5, 4 * MAX_RECORD_LENGTH + 3);
+    check_round_trip("long-rle-run", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE);
+    fill_random(&target, EOF_OFFSET - 3 * MAX_RECORD_LENGTH, MAX_RECORD_LENGTH, 0x7A);
+    memset(target.data.data + EOF_OFFSET - 2 * MAX_RECORD_LENGTH, 0x3C, 2 * MAX_RECORD_LENGTH + 5);
+    fill_random(&target, EOF_OFFSET + 5, MAX_RECORD_LENGTH, 0x7B);
+    check_round_trip("mixed-across-eof-offset", &source, &target);
+
+    // Output past the source starts zero filled, but the last byte still
+    // has to be written to grow it
+    copy_source(&target, &source, SOURCE_SIZE + 2 * MAX_RECORD_LENGTH);
+    check_round_trip("grown-zeros", &source, &target);
+
+    copy_source(&target, &source, SOURCE_SIZE + 100000);
+    fill_random(&target, SOURCE_SIZE, 100000, 0x6209);
+    check_round_trip("grown-random", &source, &target);
+
+    copy_source(&target, &source, MAX_TARGET_SIZE);
+    target.data.data[MAX_TARGET_SIZE - 1] = 1;
+    check_round_trip("largest-target", &source, &target);
+
+    copy_source(&target, &source, 3 * 1024 * 1024);
+    check_round_trip("truncated", &source, &target);
+
+    copy_source(&target, &source, EOF_OFFSET + 1);
+    target.data.data[EOF_OFFSET] ^= 0xFF;
+    check_round_trip("truncated-at-eof-offset", &source, &target);
+
+    copy_source(&target, &source, MAX_TARGET_SIZE + 1);
+    patch_buffer_init(&patch);
+    TEST_CHECK("too-large", ips_diff(&source, &target, &patch) == PATCH_INVALID_OUTPUT_SIZE);
+    patch_buffer_free(&patch);
+    patch_source_free(&target);
+
+    patch_source_free(&source);
+    return test_report("ips_diff_test");
+}
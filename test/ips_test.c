@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "ips.h"
+#include "test.h"
+
+// Checks the IPS engine against a simple model of IPS: start from the source,
+// write each record in turn, growing the image with zeroes as needed, and then
+// cut or pad it to the truncation size, if the patch has one. Random IPS and
+// IPS32 patches have plain and RLE records that overlap and run past the end
+// of the source, past 16 MB for IPS32, and no, shrinking or growing
+// truncation sizes. Each is applied in memory and streaming.
+// Usage: ips_test
+
+static const uint32_t IPS_EOF_OFFSET = 0x454F46;
+
+typedef struct ips_variant {
+    const char* name;
+    const uint8_t* marker;
+    const char* terminator;
+    size_t offset_size;
+} ips_variant;
+
+static const ips_variant IPS = { "ips", IPS_MARKER, "EOF", 3 };
+static const ips_variant IPS32 = { "ips32", IPS32_MARKER, "EEOF", 4 };
+
+enum {
+    NO_TRUNCATION = 0,
+    SHRINK = 1,
+    SAME_SIZE = 2,
+    GROW = 3,
+};
+
+// Resize target to size, zero filling anything new.
+static void resize_zeroed(patch_source* target, size_t size) {
+    size_t old_size = target->data.size;
+    patch_buffer_resize(&target->data, size);
+    if (size > old_size) {
+        memset(target->data.data + old_size, 0, size - old_size);
+    }
+}
+
+// A random patch of record_count records at offsets below max_offset, and the
+// target the model gives for it.
+static void make_patch(const ips_variant* variant, uint32_t seed, const patch_source* source, size_t record_count,
+                       size_t max_offset, int truncation, patch_source* target, bench_writer* patch) {
+    uint32_t state = seed;
+    uint32_t offset = 0;
+    size_t length = 0;
+
+    patch_buffer_init(&target->data);
+    resize_zeroed(target, source->data.size);
+    memcpy(target->data.data, source->data.data, source->data.size);
+
+    patch->size = 0;
+    bench_writer_put(patch, variant->marker, IPS_MARKER_SIZE);
+    for (size_t i = 0; i < record_count; i++) {
+        offset = bench_random_below(&state, max_offset);
+        // Half the records land in the same 4 KB, on top of or next to each other
+        if (i > 0 && bench_next_random(&state) % 2 == 0) {
+            offset = offset % 4096 + (max_offset > 8192 ? max_offset / 2 : 0);
+        }
+        if (variant == &IPS && offset == IPS_EOF_OFFSET) {
+            offset--;
+        }
+        length = 1 + bench_random_below(&state, bench_next_random(&state) % 4 == 0 ? 0xFFFF : 300);
+        if (target->data.size < offset + length) {
+            resize_zeroed(target, offset + length);
+        }
+
+        bench_writer_put_be(patch, offset, variant->offset_size);
+        if (bench_next_random(&state) % 3 == 0) {
+            uint8_t value = bench_next_byte(&state);
+            bench_writer_put_be(patch, 0, 2);
+            bench_writer_put_be(patch, length, 2);
+            bench_writer_put_byte(patch, value);
+            memset(target->data.data + offset, value, length);
+        } else {
+            bench_writer_put_be(patch, length, 2);
+            for (size_t j = 0; j < length; j++) {
+                target->data.data[offset + j] = bench_next_byte(&state);
+            }
+            bench_writer_put(patch, target->data.data + offset, length);
+        }
+    }
+    bench_writer_put(patch, (const uint8_t*)variant->terminator, strlen(variant->terminator));
+
+    if (truncation != NO_TRUNCATION) {
+        size_t size = target->data.size;
+        // Shrinking cuts through the last record, so planned writes have to be
+        // clipped, and any past it dropped
+        if (truncation == SHRINK) {
+            size = offset + bench_random_below(&state, length);
+        } else if (truncation == GROW) {
+            size += 1 + bench_random_below(&state, 100000);
+        }
+        // As large as the variant's offsets can say
+        if (variant->offset_size == 3 && size > 0xFFFFFF) {
+            size = 0xFFFFFF;
+        }
+        bench_writer_put_be(patch, size, variant->offset_size);
+        resize_zeroed(target, size);
+    }
+    target->crc32 = crc32_update(0, target->data.data, target->data.size);
+}
+
+static void check_variant(const ips_variant* variant, size_t source_size, size_t max_offset) {
+    static const rombp_apply_mode MODES[] = { APPLY_MODE_MEMORY, APPLY_MODE_STREAM };
+    bench_writer patch = { NULL, 0, 0 };
+    patch_source source;
+    patch_source target;
+    char name[64];
+
+    bench_random_source(&source, source_size, source_size);
+    for (uint32_t seed = 1; seed <= 24; seed++) {
+        int truncation = seed % 4;
+
+        snprintf(name, sizeof(name), "%s-%u", variant->name, seed);
+        make_patch(variant, seed, &source, 1 + seed * 3, max_offset, truncation, &target, &patch);
+        for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+            TEST_CHECK(name, bench_verify_writer(&source, &target, &patch, MODES[m], 1, NULL) == 0);
+        }
+        patch_source_free(&target);
+    }
+    patch_source_free(&source);
+    free(patch.data);
+}
+
+int main() {
+    bench_writer patch = { NULL, 0, 0 };
+    patch_source source;
+    patch_source target;
+
+    // Records anywhere an IPS offset reaches, from a smaller source
+    check_variant(&IPS, 1024 * 1024, 0x1000000);
+    // Records past 16 MB, which only IPS32 reaches
+    check_variant(&IPS32, 1024 * 1024, 20 * 1024 * 1024);
+
+    // A record running past 4 GB has to be rejected, not wrapped around
+    bench_random_source(&source, 16, 0x4C);
+    bench_random_source(&target, 16, 0x4C);
+    bench_writer_put(&patch, IPS32_MARKER, IPS_MARKER_SIZE);
+    bench_writer_put_be(&patch, 0xFFFFFFF0, 4);
+    bench_writer_put_be(&patch, 0x20, 2);
+    bench_writer_put(&patch, target.data.data, 16);
+    bench_writer_put(&patch, target.data.data, 16);
+    bench_writer_put(&patch, (const uint8_t*)"EEOF", 4);
+    TEST_CHECK("past-4gb", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 1, NULL) != 0);
+    TEST_CHECK("past-4gb", bench_verify_writer(&source, &target, &patch, APPLY_MODE_STREAM, 1, NULL) != 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    free(patch.data);
+    return test_report("ips_test");
+}
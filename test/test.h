@@ -0,0 +1,32 @@
+#ifndef ROMBP_TEST_H_
+#define ROMBP_TEST_H_
+
+#include <stdio.h>
+
+#include "log.h"
+
+// Checks for the make test programs. A failed check is logged with where it
+// is, and the program carries on, so one run reports every failure.
+
+static int test_check_count = 0;
+static int test_failure_count = 0;
+
+#define TEST_CHECK(name, cond) do { \
+    test_check_count++; \
+    if (!(cond)) { \
+        test_failure_count++; \
+        rombp_log_err("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, (name), #cond); \
+    } \
+} while (0)
+
+// Print a summary line, and return the exit status for main.
+static int test_report(const char* program) {
+    if (test_failure_count > 0) {
+        printf("%s: %d of %d checks failed\n", program, test_failure_count, test_check_count);
+        return 1;
+    }
+    printf("%s: %d checks passed\n", program, test_check_count);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "test.h"
+
+// Round trips the UPS engine: generates random targets that keep, grow or
+// shrink their source, with stretches of changes between unchanged ones, and
+// checks the patch gives the target back from the source, and the source back
+// from the target. Patches with a wrong input, output or patch CRC32 have to
+// be rejected. Everything is applied in memory and streaming.
+// Usage: ups_test
+
+static const size_t FOOTER_SIZE = 12;
+
+static const rombp_apply_mode MODES[] = { APPLY_MODE_MEMORY, APPLY_MODE_STREAM };
+
+// The source, cut or zero padded to target_size, with random stretches changed.
+static void make_target(const patch_source* source, size_t target_size, uint32_t seed, patch_source* target) {
+    uint32_t state = seed;
+    size_t copied = source->data.size < target_size ? source->data.size : target_size;
+
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, target_size);
+    if (copied > 0) {
+        memcpy(target->data.data, source->data.data, copied);
+    }
+    if (target_size > copied) {
+        memset(target->data.data + copied, 0, target_size - copied);
+    }
+
+    for (size_t pos = 0; pos < target_size;) {
+        pos += bench_random_below(&state, 4096);
+        size_t length = 1 + bench_random_below(&state, bench_next_random(&state) % 8 == 0 ? 65536 : 64);
+        for (size_t i = pos; i < pos + length && i < target_size; i++) {
+            target->data.data[i] = bench_next_byte(&state);
+        }
+        pos += length;
+    }
+    target->crc32 = crc32_update(0, target->data.data, target_size);
+}
+
+static void make_patch(const patch_source* source, const patch_source* target, bench_writer* patch) {
+    patch->size = 0;
+    bench_write_ups_patch(patch, source->data.data, source->data.size, target->data.data, target->data.size);
+}
+
+// Flip a bit of the footer word at offset, counted from the end of the patch,
+// and fix up the patch's own CRC32 unless that's the one flipped.
+static void corrupt_footer(bench_writer* patch, size_t offset) {
+    patch->data[patch->size - offset] ^= 0x01;
+    if (offset > 4) {
+        patch->size -= 4;
+        bench_writer_put_le32(patch, crc32_update(0, patch->data, patch->size));
+    }
+}
+
+// Returns how many modes gave output from input.
+static int verify_modes(const patch_source* input, const patch_source* output, const bench_writer* patch) {
+    int matched = 0;
+    for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+        matched += bench_verify_writer(input, output, patch, MODES[m], 1, NULL) == 0;
+    }
+    return matched;
+}
+
+int main() {
+    bench_writer patch = { NULL, 0, 0 };
+    patch_source source;
+    patch_source target;
+    patch_source wrong_input;
+    char name[64];
+
+    // Forward and in reverse, with targets the same size as the source,
+    // bigger and smaller, down to empty
+    for (uint32_t seed = 1; seed <= 30; seed++) {
+        uint32_t state = seed * 0x9E3779B9;
+        size_t source_size = seed % 10 == 0 ? 0 : bench_random_below(&state, 2 * 1024 * 1024);
+        size_t target_size = source_size;
+        if (seed % 3 == 1) {
+            target_size += bench_random_below(&state, 1024 * 1024);
+        } else if (seed % 3 == 2) {
+            target_size = bench_random_below(&state, source_size + 1);
+        }
+
+        snprintf(name, sizeof(name), "random-%u", seed);
+        bench_random_source(&source, source_size, seed);
+        make_target(&source, target_size, seed, &target);
+        make_patch(&source, &target, &patch);
+        TEST_CHECK(name, verify_modes(&source, &target, &patch) == 2);
+        TEST_CHECK(name, verify_modes(&target, &source, &patch) == 2);
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    // A change in the last byte, so the record's terminator stands for a byte
+    // past the end
+    bench_random_source(&source, 100000, 0x1A57);
+    make_target(&source, 100000, 0x1A57, &target);
+    target.data.data[99999] ^= 0xFF;
+    target.crc32 = crc32_update(0, target.data.data, target.data.size);
+    make_patch(&source, &target, &patch);
+    TEST_CHECK("last-byte", verify_modes(&source, &target, &patch) == 2);
+    TEST_CHECK("last-byte", verify_modes(&target, &source, &patch) == 2);
+    patch_source_free(&target);
+
+    // An input that's neither the source nor the target, though it's the same size
+    make_target(&source, 150000, 0xBAD, &target);
+    make_patch(&source, &target, &patch);
+    make_target(&source, source.data.size, 0x1BAD, &wrong_input);
+    TEST_CHECK("wrong-input", verify_modes(&wrong_input, &target, &patch) == 0);
+    patch_source_free(&wrong_input);
+
+    // The output has to match the footer's target CRC32
+    corrupt_footer(&patch, FOOTER_SIZE - 4);
+    TEST_CHECK("wrong-output-crc", verify_modes(&source, &target, &patch) == 0);
+
+    make_patch(&source, &target, &patch);
+    TEST_CHECK("wrong-patch-crc", verify_modes(&source, &target, &patch) == 2);
+    corrupt_footer(&patch, 4);
+    TEST_CHECK("wrong-patch-crc", verify_modes(&source, &target, &patch) == 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    free(patch.data);
+    return test_report("ups_test");
+}
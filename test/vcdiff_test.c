@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "crc32.h"
+#include "test.h"
+#include "vcdiff.h"
+
+// Round trips the VCDIFF decoder: generates random targets as windows of
+// ADD, RUN and COPY instructions, encodes them with the default code table
+// and the near / same address cache from RFC 3284, and checks the decoder
+// gives the target back. Windows copy from the source, from the target
+// before them, or only from themselves, and some carry an Adler-32. The
+// code table is built here independently of the decoder's.
+// Usage: vcdiff_test
+
+// Window and header indicator bits
+static const uint8_t VCD_SOURCE = 0x01;
+static const uint8_t VCD_TARGET = 0x02;
+static const uint8_t VCD_ADLER32 = 0x04;
+static const uint8_t VCD_APPHEADER = 0x04;
+
+enum {
+    VCD_NOOP = 0,
+    VCD_ADD = 1,
+    VCD_RUN = 2,
+    VCD_COPY = 3,
+};
+
+// COPY address modes: SELF, HERE, then the near and same caches
+#define NEAR_SIZE 4
+#define SAME_SIZE 3
+static const int MODE_SELF = 0;
+static const int MODE_HERE = 1;
+static const int MODE_NEAR = 2;
+static const int MODE_SAME = 2 + NEAR_SIZE;
+
+typedef struct code_entry {
+    uint8_t type[2];
+    uint8_t size[2];
+    uint8_t mode[2];
+} code_entry;
+
+static code_entry code_table[256];
+
+static void add_entry(int* index, int type0, int size0, int mode0, int type1, int size1, int mode1) {
+    code_entry* entry = &code_table[(*index)++];
+    entry->type[0] = type0;
+    entry->size[0] = size0;
+    entry->mode[0] = mode0;
+    entry->type[1] = type1;
+    entry->size[1] = size1;
+    entry->mode[1] = mode1;
+}
+
+// The default code table, in the order RFC 3284 section 5.6 lists it.
+static int build_code_table() {
+    int index = 0;
+
+    add_entry(&index, VCD_RUN, 0, 0, VCD_NOOP, 0, 0);
+    for (int size = 0; size <= 17; size++) {
+        add_entry(&index, VCD_ADD, size, 0, VCD_NOOP, 0, 0);
+    }
+    for (int mode = 0; mode <= 8; mode++) {
+        add_entry(&index, VCD_COPY, 0, mode, VCD_NOOP, 0, 0);
+        for (int size = 4; size <= 18; size++) {
+            add_entry(&index, VCD_COPY, size, mode, VCD_NOOP, 0, 0);
+        }
+    }
+    for (int mode = 0; mode <= 5; mode++) {
+        for (int add_size = 1; add_size <= 4; add_size++) {
+            for (int copy_size = 4; copy_size <= 6; copy_size++) {
+                add_entry(&index, VCD_ADD, add_size, 0, VCD_COPY, copy_size, mode);
+            }
+        }
+    }
+    for (int mode = 6; mode <= 8; mode++) {
+        for (int add_size = 1; add_size <= 4; add_size++) {
+            add_entry(&index, VCD_ADD, add_size, 0, VCD_COPY, 4, mode);
+        }
+    }
+    for (int mode = 0; mode <= 8; mode++) {
+        add_entry(&index, VCD_COPY, 4, mode, VCD_ADD, 1, 0);
+    }
+    return index;
+}
+
+// Index of the entry for one instruction, or for a pair, or -1.
+static int find_code(int type0, int size0, int mode0, int type1, int size1, int mode1) {
+    for (int i = 0; i < 256; i++) {
+        const code_entry* entry = &code_table[i];
+        if (entry->type[0] == type0 && entry->size[0] == size0 && entry->mode[0] == mode0 &&
+            entry->type[1] == type1 && entry->size[1] == size1 && entry->mode[1] == mode1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A VCDIFF integer: big endian, 7 bits a byte, the high bit set on every
+// byte but the last.
+static void put_int(bench_writer* writer, uint64_t value) {
+    uint8_t buf[10];
+    int n = 0;
+
+    buf[n++] = value & 0x7F;
+    while ((value >>= 7) != 0) {
+        buf[n++] = 0x80 | (value & 0x7F);
+    }
+    while (n > 0) {
+        bench_writer_put_byte(writer, buf[--n]);
+    }
+}
+
+static uint32_t adler32(const uint8_t* data, size_t size) {
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+typedef struct address_cache {
+    uint64_t near[NEAR_SIZE];
+    uint64_t same[SAME_SIZE * 256];
+    int next_slot;
+} address_cache;
+
+// Encode addr in any mode that can hold it, picked at random, into the
+// address section, and return the mode.
+static int cache_encode(address_cache* cache, uint64_t addr, uint64_t here, uint32_t* state, bench_writer* addrs) {
+    int modes[2 + NEAR_SIZE + 1];
+    int count = 0;
+
+    modes[count++] = MODE_SELF;
+    modes[count++] = MODE_HERE;
+    for (int i = 0; i < NEAR_SIZE; i++) {
+        if (addr >= cache->near[i]) {
+            modes[count++] = MODE_NEAR + i;
+        }
+    }
+    if (cache->same[addr % (SAME_SIZE * 256)] == addr) {
+        modes[count++] = MODE_SAME + (addr % (SAME_SIZE * 256)) / 256;
+    }
+    int mode = modes[bench_random_below(state, count)];
+
+    if (mode == MODE_SELF) {
+        put_int(addrs, addr);
+    } else if (mode == MODE_HERE) {
+        put_int(addrs, here - addr);
+    } else if (mode < MODE_SAME) {
+        put_int(addrs, addr - cache->near[mode - MODE_NEAR]);
+    } else {
+        bench_writer_put_byte(addrs, addr % 256);
+    }
+
+    cache->near[cache->next_slot] = addr;
+    cache->next_slot = (cache->next_slot + 1) % NEAR_SIZE;
+    cache->same[addr % (SAME_SIZE * 256)] = addr;
+    return mode;
+}
+
+typedef struct instruction {
+    int type;
+    uint64_t size;
+    // Where a COPY reads from, in the segment followed by the window
+    uint64_t addr;
+    // Where an ADD's bytes, or a RUN's byte, are in the window's output
+    uint64_t offset;
+} instruction;
+
+typedef struct window_builder {
+    instruction* insts;
+    size_t count;
+    size_t capacity;
+    bench_writer data;
+    bench_writer inst;
+    bench_writer addr;
+} window_builder;
+
+static void add_instruction(window_builder* builder, int type, uint64_t size, uint64_t addr, uint64_t offset) {
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity == 0 ? 256 : builder->capacity * 2;
+        builder->insts = realloc(builder->insts, builder->capacity * sizeof(instruction));
+        if (builder->insts == NULL) {
+            rombp_log_err("Failed to allocate test instructions\n");
+            exit(1);
+        }
+    }
+    instruction* inst = &builder->insts[builder->count++];
+    inst->type = type;
+    inst->size = size;
+    inst->addr = addr;
+    inst->offset = offset;
+}
+
+static size_t random_size(uint32_t* state, size_t left) {
+    static const size_t SIZES[] = { 1, 2, 3, 4, 5, 6, 40, 3000 };
+    size_t size = SIZES[bench_random_below(state, sizeof(SIZES) / sizeof(SIZES[0]))];
+    if (size > 6) {
+        size = 1 + bench_random_below(state, size);
+    }
+    return size < left ? size : left;
+}
+
+// Random instructions that build size bytes of output from segment, and
+// the output as it's built.
+static void make_window(window_builder* builder, uint32_t* state, const uint8_t* segment,
+                        uint64_t segment_size, uint8_t* out, uint64_t size) {
+    uint64_t pos = 0;
+
+    builder->count = 0;
+    while (pos < size) {
+        uint64_t length = random_size(state, size - pos);
+        uint64_t here = segment_size + pos;
+        int kind = bench_random_below(state, 10);
+
+        if (kind < 3 || here == 0) {
+            for (uint64_t i = 0; i < length; i++) {
+                out[pos + i] = bench_next_byte(state);
+            }
+            add_instruction(builder, VCD_ADD, length, 0, pos);
+        } else if (kind < 4) {
+            memset(out + pos, bench_next_byte(state), length);
+            add_instruction(builder, VCD_RUN, length, 0, pos);
+        } else {
+            uint64_t addr;
+            int where = bench_random_below(state, 10);
+            if (where < 3 && pos > 0) {
+                // Overlaps its own output, repeating the bytes before it
+                addr = here - 1 - bench_random_below(state, pos < 20 ? pos : 20);
+            } else if (where < 5 && segment_size > 0) {
+                // Runs from the end of the segment into the window
+                addr = segment_size - 1 - bench_random_below(state, segment_size < 50 ? segment_size : 50);
+            } else {
+                addr = bench_random_below(state, here);
+            }
+            for (uint64_t i = 0; i < length; i++) {
+                uint64_t from = addr + i;
+                out[pos + i] = from < segment_size ? segment[from] : out[from - segment_size];
+            }
+            add_instruction(builder, VCD_COPY, length, addr, 0);
+        }
+        pos += length;
+    }
+}
+
+// One instruction with no table size, or sometimes the table's own size.
+static void put_single(window_builder* builder, uint32_t* state, int type, uint64_t size, int mode) {
+    int code = type != VCD_RUN && size <= 18 && bench_random_below(state, 5) != 0 ?
+        find_code(type, size, mode, VCD_NOOP, 0, 0) : -1;
+    if (code >= 0) {
+        bench_writer_put_byte(&builder->inst, code);
+        return;
+    }
+    bench_writer_put_byte(&builder->inst, find_code(type, 0, mode, VCD_NOOP, 0, 0));
+    put_int(&builder->inst, size);
+}
+
+// Encode the instructions into the three sections, pairing them through the
+// table's double entries where they fit.
+static void encode_window(window_builder* builder, uint32_t* state, uint64_t segment_size, const uint8_t* out) {
+    address_cache cache;
+    uint64_t pos = 0;
+
+    memset(&cache, 0, sizeof(cache));
+    builder->data.size = 0;
+    builder->inst.size = 0;
+    builder->addr.size = 0;
+    for (size_t i = 0; i < builder->count; i++) {
+        const instruction* inst = &builder->insts[i];
+        const instruction* next = i + 1 < builder->count ? &builder->insts[i + 1] : NULL;
+
+        if (inst->type == VCD_ADD) {
+            if (next != NULL && next->type == VCD_COPY && inst->size <= 4 && next->size <= 6) {
+                address_cache saved = cache;
+                size_t addr_size = builder->addr.size;
+                int mode = cache_encode(&cache, next->addr, segment_size + pos + inst->size, state, &builder->addr);
+                int code = find_code(VCD_ADD, inst->size, 0, VCD_COPY, next->size, mode);
+                if (code >= 0) {
+                    bench_writer_put_byte(&builder->inst, code);
+                    bench_writer_put(&builder->data, out + inst->offset, inst->size);
+                    pos += inst->size + next->size;
+                    i++;
+                    continue;
+                }
+                cache = saved;
+                builder->addr.size = addr_size;
+            }
+            put_single(builder, state, VCD_ADD, inst->size, 0);
+            bench_writer_put(&builder->data, out + inst->offset, inst->size);
+        } else if (inst->type == VCD_RUN) {
+            put_single(builder, state, VCD_RUN, inst->size, 0);
+            bench_writer_put_byte(&builder->data, out[inst->offset]);
+        } else {
+            int mode = cache_encode(&cache, inst->addr, segment_size + pos, state, &builder->addr);
+            if (inst->size == 4 && next != NULL && next->type == VCD_ADD && next->size == 1) {
+                bench_writer_put_byte(&builder->inst, find_code(VCD_COPY, 4, mode, VCD_ADD, 1, 0));
+                bench_writer_put(&builder->data, out + next->offset, 1);
+                pos += 5;
+                i++;
+                continue;
+            }
+            put_single(builder, state, VCD_COPY, inst->size, mode);
+        }
+        pos += inst->size;
+    }
+}
+
+// A random patch from source to a target of target_size bytes, in windows of
+// up to max_window bytes, with segments of up to max_segment bytes.
+static void make_patch(uint32_t seed, const patch_source* source, size_t target_size, size_t max_window,
+                       size_t max_segment, patch_source* target, bench_writer* patch) {
+    window_builder builder;
+    uint32_t state = seed;
+    size_t source_size = source->data.size;
+
+    memset(&builder, 0, sizeof(builder));
+    patch_buffer_init(&target->data);
+    patch_buffer_resize(&target->data, target_size);
+    uint8_t* out = target->data.data;
+
+    patch->size = 0;
+    bench_writer_put(patch, VCDIFF_MARKER, VCDIFF_MARKER_SIZE);
+    if (bench_random_below(&state, 2) == 0) {
+        static const char APP_HEADER[] = "rom.sfc//hack.sfc/";
+        bench_writer_put_byte(patch, VCD_APPHEADER);
+        put_int(patch, sizeof(APP_HEADER) - 1);
+        bench_writer_put(patch, (const uint8_t*)APP_HEADER, sizeof(APP_HEADER) - 1);
+    } else {
+        bench_writer_put_byte(patch, 0);
+    }
+
+    size_t pos = 0;
+    while (pos < target_size) {
+        size_t left = target_size - pos;
+        size_t window_size = 1 + bench_random_below(&state, max_window);
+        window_size = window_size < left ? window_size : left;
+
+        uint8_t indicator = 0;
+        const uint8_t* segment = NULL;
+        size_t segment_size = 0;
+        size_t segment_offset = 0;
+        int kind = bench_random_below(&state, 10);
+        if (kind < 6 && source_size > 0) {
+            indicator = VCD_SOURCE;
+            segment_size = bench_random_below(&state, (source_size < max_segment ? source_size : max_segment) + 1);
+            segment_offset = bench_random_below(&state, source_size - segment_size + 1);
+            segment = source->data.data + segment_offset;
+        } else if (kind < 8 && pos > 0) {
+            indicator = VCD_TARGET;
+            segment_size = bench_random_below(&state, (pos < max_segment ? pos : max_segment) + 1);
+            segment_offset = bench_random_below(&state, pos - segment_size + 1);
+            segment = out + segment_offset;
+        }
+        int has_adler = bench_random_below(&state, 10) < 7;
+        if (has_adler) {
+            indicator |= VCD_ADLER32;
+        }
+
+        make_window(&builder, &state, segment, segment_size, out + pos, window_size);
+        encode_window(&builder, &state, segment_size, out + pos);
+
+        bench_writer delta = { NULL, 0, 0 };
+        put_int(&delta, window_size);
+        bench_writer_put_byte(&delta, 0);
+        put_int(&delta, builder.data.size);
+        put_int(&delta, builder.inst.size);
+        put_int(&delta, builder.addr.size);
+        if (has_adler) {
+            bench_writer_put_be(&delta, adler32(out + pos, window_size), 4);
+        }
+        bench_writer_put(&delta, builder.data.data, builder.data.size);
+        bench_writer_put(&delta, builder.inst.data, builder.inst.size);
+        bench_writer_put(&delta, builder.addr.data, builder.addr.size);
+
+        bench_writer_put_byte(patch, indicator);
+        if (indicator & (VCD_SOURCE | VCD_TARGET)) {
+            put_int(patch, segment_size);
+            put_int(patch, segment_offset);
+        }
+        put_int(patch, delta.size);
+        bench_writer_put(patch, delta.data, delta.size);
+        free(delta.data);
+        pos += window_size;
+    }
+    target->crc32 = crc32_update(0, out, target_size);
+
+    free(builder.insts);
+    free(builder.data.data);
+    free(builder.inst.data);
+    free(builder.addr.data);
+}
+
+// One window that ADDs target, with its Adler-32, or with a corrupt one.
+static void make_adler_patch(const patch_source* target, int corrupt, bench_writer* patch) {
+    bench_writer delta = { NULL, 0, 0 };
+    uint32_t checksum = adler32(target->data.data, target->data.size);
+
+    put_int(&delta, target->data.size);
+    bench_writer_put_byte(&delta, 0);
+    put_int(&delta, target->data.size);
+    put_int(&delta, 1);
+    put_int(&delta, 0);
+    bench_writer_put_be(&delta, corrupt ? checksum ^ 1 : checksum, 4);
+    bench_writer_put(&delta, target->data.data, target->data.size);
+    bench_writer_put_byte(&delta, find_code(VCD_ADD, target->data.size, 0, VCD_NOOP, 0, 0));
+
+    patch->size = 0;
+    bench_writer_put(patch, VCDIFF_MARKER, VCDIFF_MARKER_SIZE);
+    bench_writer_put_byte(patch, 0);
+    bench_writer_put_byte(patch, VCD_ADLER32);
+    put_int(patch, delta.size);
+    bench_writer_put(patch, delta.data, delta.size);
+    free(delta.data);
+}
+
+int main() {
+    static const rombp_apply_mode MODES[] = { APPLY_MODE_MEMORY, APPLY_MODE_STREAM };
+    bench_writer patch = { NULL, 0, 0 };
+    bench_progress progress;
+    patch_source source;
+    patch_source target;
+    char name[64];
+
+    TEST_CHECK("code-table", build_code_table() == 256);
+    TEST_CHECK("code-table", find_code(VCD_COPY, 0, 0, VCD_NOOP, 0, 0) == 19);
+    TEST_CHECK("code-table", find_code(VCD_COPY, 0, 1, VCD_NOOP, 0, 0) == 35);
+    TEST_CHECK("code-table", find_code(VCD_ADD, 1, 0, VCD_COPY, 4, 0) == 163);
+    TEST_CHECK("code-table", find_code(VCD_ADD, 1, 0, VCD_COPY, 4, 6) == 235);
+    TEST_CHECK("code-table", find_code(VCD_COPY, 4, 0, VCD_ADD, 1, 0) == 247);
+
+    // Small patches, with short windows, so every instruction and address
+    // mode turns up, and sources of every size down to none
+    for (uint32_t seed = 1; seed <= 40; seed++) {
+        uint32_t state = seed * 0x9E3779B9;
+        size_t source_size = seed % 8 == 0 ? 0 : bench_random_below(&state, 200000);
+        size_t target_size = bench_random_below(&state, 300000);
+
+        snprintf(name, sizeof(name), "random-%u", seed);
+        bench_random_source(&source, source_size, seed);
+        make_patch(seed, &source, target_size, 30000, 1 << 20, &target, &patch);
+        for (size_t m = 0; m < sizeof(MODES) / sizeof(MODES[0]); m++) {
+            TEST_CHECK(name, bench_verify_writer(&source, &target, &patch, MODES[m], 1, NULL) == 0);
+        }
+        patch_source_free(&target);
+        patch_source_free(&source);
+    }
+
+    // Big enough for windows to be decoded ahead on several threads
+    bench_random_source(&source, 2 * 1024 * 1024, 0xB16);
+    make_patch(0xB16, &source, 6 * 1024 * 1024, 1 << 20, 1 << 20, &target, &patch);
+    TEST_CHECK("decode-ahead", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 1, NULL) == 0);
+    TEST_CHECK("decode-ahead", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 4, NULL) == 0);
+    TEST_CHECK("decode-ahead", bench_verify_writer(&source, &target, &patch, APPLY_MODE_STREAM, 4, NULL) == 0);
+    // Progress has to move as windows are decoded ahead, not only once they all are
+    TEST_CHECK("decode-ahead", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 4, &progress) == 0);
+    TEST_CHECK("decode-ahead", progress.partial_calls > 0);
+    TEST_CHECK("decode-ahead", !progress.went_backwards);
+
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    // A window whose output doesn't match its Adler-32 has to be rejected
+    bench_random_source(&source, 0, 0);
+    bench_random_source(&target, 4, 0xAD1E);
+    make_adler_patch(&target, 0, &patch);
+    TEST_CHECK("adler32", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 1, NULL) == 0);
+    make_adler_patch(&target, 1, &patch);
+    TEST_CHECK("adler32", bench_verify_writer(&source, &target, &patch, APPLY_MODE_MEMORY, 1, NULL) != 0);
+    patch_source_free(&target);
+    patch_source_free(&source);
+
+    free(patch.data);
+    return test_report("vcdiff_test");
+}